@@ -33,6 +33,18 @@ typedef void (*bmi_packet_handler_t)(int port_num, const char *buffer, int len,
 
 int bmi_port_create_mgr(bmi_port_mgr_t **port_mgr);
 
+/* Same as bmi_port_create_mgr, but the ports are split into nb_rx_threads
+   groups (port_num % nb_rx_threads), with a dedicated receive thread for each
+   group. When there is more than one thread, the packet handler can be called
+   concurrently for ports which belong to different groups. */
+int bmi_port_create_mgr_with_rx_threads(bmi_port_mgr_t **port_mgr,
+                                        int nb_rx_threads);
+
+/* Pins the receive thread of a port group (see
+   bmi_port_create_mgr_with_rx_threads) to the given CPU. Has to be called
+   before bmi_start_mgr; returns -1 if the group or the CPU is invalid. */
+int bmi_port_set_rx_thread_cpu(bmi_port_mgr_t *port_mgr, int group, int cpu);
+
 /* Start running the port manager on its own thread */
 int bmi_start_mgr(bmi_port_mgr_t* port_mgr);
 
@@ -43,6 +55,18 @@ int bmi_set_packet_handler(bmi_port_mgr_t *port_mgr,
 int bmi_port_send(bmi_port_mgr_t *port_mgr,
 		  int port_num, const char *buffer, int len);
 
+struct iovec;
+
+/* Sends n packets out of the same port, with as few syscalls as possible;
+   packet i is made of iovcnts[i] segments starting at iovs[i] and is not
+   linearized. Waits for room in the socket when it is full. A packet which
+   cannot be sent (e.g. too large) is dropped, without affecting the other
+   ones. Returns the number of packets dropped, or -1 on error (e.g. invalid
+   port). */
+int bmi_port_send_batch(bmi_port_mgr_t *port_mgr, int port_num,
+                        const struct iovec *const *iovs, const int *iovcnts,
+                        int n);
+
 int bmi_port_interface_add(bmi_port_mgr_t *port_mgr,
 			   const char *ifname, int port_num,
 			   const char *pcap_input_dump,
@@ -18,9 +18,15 @@
  *
  */
 
+#define _GNU_SOURCE  /* for sendmmsg */
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <pcap/pcap.h>
 #include "bmi_interface.h"
@@ -79,6 +85,15 @@ int bmi_interface_create(bmi_interface_t **bmi, const char *device) {
     return -1;
   }
 
+  /* the port manager waits for the fd to be ready, and then drains all the
+     packets which are available; this also makes sends non-blocking, which
+     is why the send functions wait for the fd to be writable themselves */
+  if(pcap_setnonblock(bmi_->pcap, 1, errbuf) != 0) {
+    pcap_close(bmi_->pcap);
+    free(bmi_);
+    return -1;
+  }
+
   bmi_->fd = pcap_get_selectable_fd(bmi_->pcap);
   if(bmi_->fd < 0) {
     pcap_close(bmi_->pcap);
@@ -116,6 +131,19 @@ int bmi_interface_add_dumper(bmi_interface_t *bmi, const char *filename, bmi_dum
   return 0;
 }
 
+/* returns once fd is writable, or -1 on error */
+static int wait_writable(int fd) {
+  struct pollfd pfd;
+  int rv;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  do {
+    rv = poll(&pfd, 1, -1);
+  } while(rv < 0 && errno == EINTR);
+  return (rv < 0) ? -1 : 0;
+}
+
 int bmi_interface_send(bmi_interface_t *bmi, const char *data, int len) {
   if(bmi->pcap_output_dumper) {
     struct pcap_pkthdr pkt_header;
@@ -127,7 +155,99 @@ int bmi_interface_send(bmi_interface_t *bmi, const char *data, int len) {
 	      (unsigned char *) data);
     pcap_dump_flush(bmi->pcap_output_dumper);
   }
-  return pcap_sendpacket(bmi->pcap, (unsigned char *) data, len);
+  while(pcap_sendpacket(bmi->pcap, (unsigned char *) data, len) != 0) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if(wait_writable(bmi->fd) != 0) return -1;
+  }
+  return 0;
+}
+
+#define SEND_BATCH_MAX 64
+
+static void dump_output_iov(bmi_interface_t *bmi, const struct iovec *iov,
+                            int iovcnt) {
+  static __thread char buffer[65536];
+  struct pcap_pkthdr pkt_header;
+  size_t len = 0;
+  int i;
+  for(i = 0; i < iovcnt; i++) {
+    if(len + iov[i].iov_len > sizeof(buffer)) return;
+    memcpy(buffer + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  memset(&pkt_header, 0, sizeof(pkt_header));
+  gettimeofday(&pkt_header.ts, NULL);
+  pkt_header.caplen = len;
+  pkt_header.len = len;
+  pcap_dump((unsigned char *) bmi->pcap_output_dumper, &pkt_header,
+            (unsigned char *) buffer);
+}
+
+int bmi_fd_send_batch(int fd, const struct iovec *const *iovs,
+                      const int *iovcnts, int n) {
+  struct mmsghdr msgs[SEND_BATCH_MAX];
+  int sent = 0;
+  int dropped = 0;
+  int batch;
+  int rv;
+  int i;
+
+  while(sent < n) {
+    batch = (n - sent < SEND_BATCH_MAX) ? (n - sent) : SEND_BATCH_MAX;
+    memset(msgs, 0, batch * sizeof(*msgs));
+    for(i = 0; i < batch; i++) {
+      msgs[i].msg_hdr.msg_iov = (struct iovec *) iovs[sent + i];
+      msgs[i].msg_hdr.msg_iovlen = iovcnts[sent + i];
+    }
+    rv = sendmmsg(fd, msgs, batch, 0);
+    if(rv >= 0) {
+      sent += rv;
+      continue;
+    }
+    switch(errno) {
+      case EINTR:
+        break;
+      case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+      case ENOBUFS:
+        /* the socket (or the device queue) is full, the message will be sent
+           once there is room */
+        if(wait_writable(fd) != 0) return dropped + (n - sent);
+        break;
+      case EMSGSIZE:
+      case EINVAL:
+        /* sendmmsg stops at the first message which cannot be sent, because
+           of something wrong with the message itself (e.g. too large for the
+           interface): we drop it and go on with the next ones */
+        sent++;
+        dropped++;
+        break;
+      default:
+        /* the other messages would fail the same way (e.g. the interface is
+           down) */
+        return dropped + (n - sent);
+    }
+  }
+
+  return dropped;
+}
+
+int bmi_interface_send_batch(bmi_interface_t *bmi,
+                             const struct iovec *const *iovs,
+                             const int *iovcnts, int n) {
+  int i;
+
+  if(bmi->pcap_output_dumper) {
+    for(i = 0; i < n; i++) dump_output_iov(bmi, iovs[i], iovcnts[i]);
+    pcap_dump_flush(bmi->pcap_output_dumper);
+  }
+
+  /* on Linux, the pcap fd is the packet socket bound to the interface, which
+     we can use directly to send all the packets (and their segments) with
+     one syscall */
+  return bmi_fd_send_batch(bmi->fd, iovs, iovcnts, n);
 }
 
 /* Does not make a copy! */
@@ -178,6 +298,49 @@ int bmi_interface_recv_with_copy(bmi_interface_t *bmi, char *data, int max_len)
   return rv;
 }
 
+typedef struct {
+  bmi_interface_t *bmi;
+  bmi_interface_recv_cb_t cb;
+  void *cookie;
+} recv_burst_ctx_t;
+
+static void recv_burst_one(u_char *user, const struct pcap_pkthdr *pkt_header,
+                           const u_char *pkt_data) {
+  recv_burst_ctx_t *ctx = (recv_burst_ctx_t *) user;
+
+  if(pkt_header->caplen != pkt_header->len) return;
+
+  if(ctx->bmi->pcap_input_dumper) {
+    pcap_dump((unsigned char *) ctx->bmi->pcap_input_dumper, pkt_header,
+              pkt_data);
+  }
+
+  ctx->cb((const char *) pkt_data, pkt_header->len, ctx->cookie);
+}
+
+int bmi_interface_recv_burst(bmi_interface_t *bmi, int max_pkts,
+                             bmi_interface_recv_cb_t cb, void *cookie) {
+  recv_burst_ctx_t ctx = {bmi, cb, cookie};
+  int total = 0;
+  int rv;
+
+  /* each call to pcap_dispatch processes at most one buffer worth of packets
+     (or one ring block), without making a syscall for each packet */
+  while(total < max_pkts) {
+    rv = pcap_dispatch(bmi->pcap, max_pkts - total, recv_burst_one,
+                       (u_char *) &ctx);
+    if(rv < 0) return (total > 0) ? total : -1;
+    if(rv == 0) break;
+    total += rv;
+  }
+
+  /* flush once per burst instead of once per packet */
+  if(total > 0 && bmi->pcap_input_dumper)
+    pcap_dump_flush(bmi->pcap_input_dumper);
+
+  return total;
+}
+
 int bmi_interface_get_fd(bmi_interface_t *bmi) {
   return bmi->fd;
 }
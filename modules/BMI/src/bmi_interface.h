@@ -37,10 +37,36 @@ int bmi_interface_destroy(bmi_interface_t *bmi);
 
 int bmi_interface_send(bmi_interface_t *bmi, const char *data, int len);
 
+struct iovec;
+
+/* Sends n packets on socket fd with as few sendmmsg calls as possible,
+   packet i is made of iovcnts[i] segments starting at iovs[i]. When the socket
+   is full, waits for it to be writable. A packet which cannot be sent (e.g.
+   too large) is dropped, and the following ones are still sent; any other
+   error drops all the remaining packets. Returns the number of packets
+   dropped. */
+int bmi_fd_send_batch(int fd, const struct iovec *const *iovs,
+                      const int *iovcnts, int n);
+
+/* Same as bmi_fd_send_batch, on the interface's packet socket. Returns the
+   number of packets dropped. */
+int bmi_interface_send_batch(bmi_interface_t *bmi,
+                             const struct iovec *const *iovs,
+                             const int *iovcnts, int n);
+
 int bmi_interface_recv(bmi_interface_t *bmi, const char **data);
 
 int bmi_interface_recv_with_copy(bmi_interface_t *bmi, char *data, int max_len);
 
+typedef void (*bmi_interface_recv_cb_t)(const char *data, int len, void *cookie);
+
+/* Reads up to max_pkts packets, among the ones which are already available
+   (the interface is in non-blocking mode), and calls cb for each one of
+   them. Does not make a copy! Returns the number of packets read, or -1 on
+   error. */
+int bmi_interface_recv_burst(bmi_interface_t *bmi, int max_pkts,
+                             bmi_interface_recv_cb_t cb, void *cookie);
+
 int bmi_interface_get_fd(bmi_interface_t *bmi);
 
 #endif
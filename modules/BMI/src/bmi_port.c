@@ -18,12 +18,16 @@
  *
  */
 
+#define _GNU_SOURCE  /* for pthread_attr_setaffinity_np */
+
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include "bmi_interface.h"
@@ -31,6 +35,8 @@
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 typedef struct bmi_port_s {
   bmi_interface_t *bmi;
@@ -39,18 +45,47 @@ typedef struct bmi_port_s {
   int fd;
 } bmi_port_t;
 
-#define PORT_COUNT_MAX 512
+#define PORT_COUNT_MAX 1024
+
+#define RX_THREADS_MAX 16
+
+/* max number of packets read from a port for each readiness event, so that a
+   busy port cannot starve the other ports in its group */
+#define RX_BURST_MAX 64
+
+#define EPOLL_EVENTS_MAX 64
+
+/* epoll event data for the stop eventfd, port events use the port number */
+#define STOP_EVENT ((uint32_t) PORT_COUNT_MAX)
+
+struct bmi_port_mgr_s;
+
+typedef struct bmi_rx_thread_s {
+  struct bmi_port_mgr_s *port_mgr;
+  int epoll_fd;
+  /* CPU the thread is pinned to, -1 if none */
+  int cpu;
+  int started;
+  pthread_t thread;
+  /* held while receiving, to prevent ports in the group from being removed */
+  pthread_mutex_t lock;
+} bmi_rx_thread_t;
 
 typedef struct bmi_port_mgr_s {
   bmi_port_t ports_info[PORT_COUNT_MAX];
-  fd_set fds;
-  int max_fd;
+  bmi_rx_thread_t rx_threads[RX_THREADS_MAX];
+  int nb_rx_threads;
+  /* written to when the manager is destroyed, to wake up all RX threads */
+  int stop_fd;
   void *cookie;
   bmi_packet_handler_t packet_handler;
-  pthread_t select_thread;
-  pthread_mutex_t lock;
 } bmi_port_mgr_t;
 
+typedef struct {
+  bmi_port_mgr_t *port_mgr;
+  int port_num;
+} rx_ctx_t;
+
 static inline int port_in_use(bmi_port_t *port) {
   return (port->bmi != NULL);
 }
@@ -63,50 +98,61 @@ static inline bmi_port_t *get_port(bmi_port_mgr_t *port_mgr, int port_num) {
   return &port_mgr->ports_info[port_num];
 }
 
-static void *run_select(void *data) {
-  bmi_port_mgr_t *port_mgr = (bmi_port_mgr_t *) data;
+static inline bmi_rx_thread_t *get_rx_thread(bmi_port_mgr_t *port_mgr,
+                                             int port_num) {
+  return &port_mgr->rx_threads[port_num % port_mgr->nb_rx_threads];
+}
+
+static void rx_packet(const char *data, int len, void *cookie) {
+  rx_ctx_t *ctx = (rx_ctx_t *) cookie;
+  bmi_port_mgr_t *port_mgr = ctx->port_mgr;
+  /* printf("Received pkt of len %d on port %d\n", len, ctx->port_num); */
+  if(port_mgr->packet_handler) {
+    port_mgr->packet_handler(ctx->port_num, data, len, port_mgr->cookie);
+  }
+}
+
+static void *run_rx(void *data) {
+  bmi_rx_thread_t *rx_thread = (bmi_rx_thread_t *) data;
+  bmi_port_mgr_t *port_mgr = rx_thread->port_mgr;
+  struct epoll_event events[EPOLL_EVENTS_MAX];
+  rx_ctx_t ctx;
   int n;
   int i;
   bmi_port_t *port_info;
-  const char *pkt_data;
-  int pkt_len;
-  fd_set fds;
 
-  struct timeval timeout;
+  ctx.port_mgr = port_mgr;
   while(1) {
-    /* timeout is needed to update set */
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100000;
-
-    fds = port_mgr->fds;
-    n = select(port_mgr->max_fd + 1, &fds, NULL, NULL, &timeout);
+    /* unlike select, there is no need to wake up periodically to update the
+       set of fds, ports are added to / removed from the epoll instance
+       directly */
+    n = epoll_wait(rx_thread->epoll_fd, events, EPOLL_EVENTS_MAX, -1);
     /* TODO: investigate this further */
     assert(n >= 0 || errno == EINTR);
 
-    /* the thread terminates */
-    if(port_mgr->max_fd == -1) return NULL;
-
-    if(n <= 0) { // timeout or EINTR
+    if(n <= 0) {  // EINTR
       continue;
     }
 
-    pthread_mutex_lock(&port_mgr->lock);
-
-    /* use Judy instead ? */
-    for(i = 0; n && i < PORT_COUNT_MAX; i++) {
-      port_info = get_port(port_mgr, i);
-      if(FD_ISSET(port_info->fd, &fds) && port_info->bmi) {
-        --n;
-        pkt_len = bmi_interface_recv(port_info->bmi, &pkt_data);
-        if(pkt_len < 0) continue;
-        /* printf("Received pkt of len %d on port %d\n", pkt_len, i); */
-        if(port_mgr->packet_handler) {
-          port_mgr->packet_handler(i, pkt_data, pkt_len, port_mgr->cookie);
-        }
+    pthread_mutex_lock(&rx_thread->lock);
+
+    for(i = 0; i < n; i++) {
+      /* the thread terminates */
+      if(events[i].data.u32 == STOP_EVENT) {
+        pthread_mutex_unlock(&rx_thread->lock);
+        return NULL;
       }
+      ctx.port_num = (int) events[i].data.u32;
+      port_info = get_port(port_mgr, ctx.port_num);
+      /* the port may have been removed since epoll_wait returned */
+      if(!port_in_use(port_info)) continue;
+      /* drain the packets which are already available, instead of reading a
+         single one per wake-up; fds are level-triggered so whatever is left
+         will be reported again */
+      bmi_interface_recv_burst(port_info->bmi, RX_BURST_MAX, rx_packet, &ctx);
     }
 
-    pthread_mutex_unlock(&port_mgr->lock);
+    pthread_mutex_unlock(&rx_thread->lock);
   }
 
   return NULL;
@@ -114,26 +160,111 @@ static void *run_select(void *data) {
 
 int bmi_start_mgr(bmi_port_mgr_t* port_mgr)
 {
-  return pthread_create(&port_mgr->select_thread, NULL, run_select, port_mgr);
+  int i;
+  int exitCode;
+  pthread_attr_t attr;
+  cpu_set_t cpus;
+  for(i = 0; i < port_mgr->nb_rx_threads; i++) {
+    bmi_rx_thread_t *rx_thread = &port_mgr->rx_threads[i];
+    exitCode = pthread_attr_init(&attr);
+    if(exitCode != 0) return exitCode;
+    if(rx_thread->cpu >= 0) {
+      CPU_ZERO(&cpus);
+      CPU_SET(rx_thread->cpu, &cpus);
+      exitCode = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+      if(exitCode != 0) {
+        pthread_attr_destroy(&attr);
+        return exitCode;
+      }
+    }
+    exitCode = pthread_create(&rx_thread->thread, &attr, run_rx, rx_thread);
+    pthread_attr_destroy(&attr);
+    if(exitCode != 0) return exitCode;
+    rx_thread->started = 1;
+  }
+  return 0;
 }
 
-int bmi_port_create_mgr(bmi_port_mgr_t **port_mgr) {
-  bmi_port_mgr_t *port_mgr_ = malloc(sizeof(bmi_port_mgr_t));
+int bmi_port_set_rx_thread_cpu(bmi_port_mgr_t *port_mgr, int group, int cpu) {
+  if(group < 0 || group >= port_mgr->nb_rx_threads) return -1;
+  if(cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+  bmi_rx_thread_t *rx_thread = &port_mgr->rx_threads[group];
+  if(rx_thread->started) return -1;
+  rx_thread->cpu = cpu;
+  return 0;
+}
+
+/* releases the resources of the first nb_rx_threads RX threads, which have
+   not been started */
+static void destroy_rx_threads(bmi_port_mgr_t *port_mgr, int nb_rx_threads) {
+  int i;
+  for(i = 0; i < nb_rx_threads; i++) {
+    bmi_rx_thread_t *rx_thread = &port_mgr->rx_threads[i];
+    close(rx_thread->epoll_fd);
+    pthread_mutex_destroy(&rx_thread->lock);
+  }
+}
+
+int bmi_port_create_mgr_with_rx_threads(bmi_port_mgr_t **port_mgr,
+                                        int nb_rx_threads) {
+  int i;
   int exitCode;
-  if(!port_mgr) return -1;
+  struct epoll_event ev;
+
+  if(nb_rx_threads < 1 || nb_rx_threads > RX_THREADS_MAX) return -1;
+
+  bmi_port_mgr_t *port_mgr_ = malloc(sizeof(bmi_port_mgr_t));
+  if(!port_mgr_) return -1;
 
   memset(port_mgr_, 0, sizeof(bmi_port_mgr_t));
 
-  FD_ZERO(&port_mgr_->fds);
+  port_mgr_->nb_rx_threads = nb_rx_threads;
+
+  port_mgr_->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if(port_mgr_->stop_fd < 0) {
+    free(port_mgr_);
+    return -1;
+  }
+
+  for(i = 0; i < nb_rx_threads; i++) {
+    bmi_rx_thread_t *rx_thread = &port_mgr_->rx_threads[i];
+    rx_thread->port_mgr = port_mgr_;
+    rx_thread->cpu = -1;
+
+    rx_thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(rx_thread->epoll_fd < 0) break;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = STOP_EVENT;
+    if(epoll_ctl(rx_thread->epoll_fd, EPOLL_CTL_ADD,
+                 port_mgr_->stop_fd, &ev) != 0) {
+      close(rx_thread->epoll_fd);
+      break;
+    }
 
-  exitCode = pthread_mutex_init(&port_mgr_->lock, NULL);
-  if (exitCode != 0)
-      return exitCode;
+    exitCode = pthread_mutex_init(&rx_thread->lock, NULL);
+    if(exitCode != 0) {
+      close(rx_thread->epoll_fd);
+      break;
+    }
+  }
+
+  if(i < nb_rx_threads) {
+    destroy_rx_threads(port_mgr_, i);
+    close(port_mgr_->stop_fd);
+    free(port_mgr_);
+    return -1;
+  }
 
   *port_mgr = port_mgr_;
   return 0;
 }
 
+int bmi_port_create_mgr(bmi_port_mgr_t **port_mgr) {
+  return bmi_port_create_mgr_with_rx_threads(port_mgr, 1);
+}
+
 int bmi_set_packet_handler(bmi_port_mgr_t *port_mgr,
                            bmi_packet_handler_t packet_handler,
                            void *cookie) {
@@ -153,6 +284,16 @@ int bmi_port_send(bmi_port_mgr_t *port_mgr,
   return 0;
 }
 
+int bmi_port_send_batch(bmi_port_mgr_t *port_mgr, int port_num,
+                        const struct iovec *const *iovs, const int *iovcnts,
+                        int n) {
+  if(!port_num_valid(port_num)) return -1;
+  bmi_port_t *port = get_port(port_mgr, port_num);
+  if(!port_in_use(port)) return -1;
+
+  return bmi_interface_send_batch(port->bmi, iovs, iovcnts, n);
+}
+
 int bmi_port_interface_add(bmi_port_mgr_t *port_mgr,
 			   const char *ifname, int port_num,
 			   const char *pcap_input_dump,
@@ -163,26 +304,34 @@ int bmi_port_interface_add(bmi_port_mgr_t *port_mgr,
   bmi_port_t *port = get_port(port_mgr, port_num);
   if(port_in_use(port)) return -1;
 
-  port->ifname = strdup(ifname);
-
   bmi_interface_t *bmi;
   if(bmi_interface_create(&bmi, ifname) != 0) return -1;
 
   if(pcap_input_dump) bmi_interface_add_dumper(bmi, pcap_input_dump, 1);
   if(pcap_output_dump) bmi_interface_add_dumper(bmi, pcap_output_dump, 0);
 
-  pthread_mutex_lock(&port_mgr->lock);
+  bmi_rx_thread_t *rx_thread = get_rx_thread(port_mgr, port_num);
+  int fd = bmi_interface_get_fd(bmi);
 
-  port->bmi = bmi;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = (uint32_t) port_num;
 
-  int fd = bmi_interface_get_fd(port->bmi);
-  port->fd = fd;
+  pthread_mutex_lock(&rx_thread->lock);
 
-  if(fd > port_mgr->max_fd) port_mgr->max_fd = fd;
+  if(epoll_ctl(rx_thread->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    pthread_mutex_unlock(&rx_thread->lock);
+    bmi_interface_destroy(bmi);
+    return -1;
+  }
 
-  FD_SET(fd, &port_mgr->fds);
+  port->ifname = strdup(ifname);
+  port->bmi = bmi;
+  port->port_num = port_num;
+  port->fd = fd;
 
-  pthread_mutex_unlock(&port_mgr->lock);
+  pthread_mutex_unlock(&rx_thread->lock);
 
   return 0;
 }
@@ -193,32 +342,48 @@ int bmi_port_interface_remove(bmi_port_mgr_t *port_mgr, int port_num) {
   bmi_port_t *port = get_port(port_mgr, port_num);
   if(!port_in_use(port)) return -1;
 
-  free(port->ifname);
+  bmi_rx_thread_t *rx_thread = get_rx_thread(port_mgr, port_num);
+
+  pthread_mutex_lock(&rx_thread->lock);
 
-  pthread_mutex_lock(&port_mgr->lock);
-  if(bmi_interface_destroy(port->bmi) != 0) return -1;
+  epoll_ctl(rx_thread->epoll_fd, EPOLL_CTL_DEL, port->fd, NULL);
 
-  FD_CLR(port->fd, &port_mgr->fds);
+  if(bmi_interface_destroy(port->bmi) != 0) {
+    pthread_mutex_unlock(&rx_thread->lock);
+    return -1;
+  }
+
+  free(port->ifname);
 
   memset(port, 0, sizeof(bmi_port_t));
 
-  pthread_mutex_unlock(&port_mgr->lock);
+  pthread_mutex_unlock(&rx_thread->lock);
 
   return 0;
 }
 
 int bmi_port_destroy_mgr(bmi_port_mgr_t *port_mgr) {
   int i;
+  uint64_t one = 1;
   for(i = 0; i < PORT_COUNT_MAX; i++) {
     bmi_port_t *port = get_port(port_mgr, i);
     if(port_in_use(port)) bmi_port_interface_remove(port_mgr, i);
   }
 
-  port_mgr->max_fd = -1;  // used to signal the thread it needs to terminate
+  /* signals the threads they need to terminate; the eventfd stays readable so
+     every thread sees it */
+  if(write(port_mgr->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    perror("write");
+  }
 
-  pthread_join(port_mgr->select_thread, NULL);
+  for(i = 0; i < port_mgr->nb_rx_threads; i++) {
+    bmi_rx_thread_t *rx_thread = &port_mgr->rx_threads[i];
+    if(rx_thread->started) pthread_join(rx_thread->thread, NULL);
+    close(rx_thread->epoll_fd);
+    pthread_mutex_destroy(&rx_thread->lock);
+  }
 
-  pthread_mutex_destroy(&port_mgr->lock);
+  close(port_mgr->stop_fd);
   free(port_mgr);
 
   return 0;
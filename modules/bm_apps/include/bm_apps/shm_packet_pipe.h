@@ -0,0 +1,77 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#ifndef BM_APPS_INCLUDE_BM_APPS_SHM_PACKET_PIPE_H_
+#define BM_APPS_INCLUDE_BM_APPS_SHM_PACKET_PIPE_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace bm_apps {
+
+class ShmPacketInjectImp;
+
+// Same as PacketInject, but for a switch started with --packet-in-shm: packets
+// are exchanged through shared memory rings instead of a nanomsg socket. Only
+// one client can be connected to a given switch at a time.
+class ShmPacketInject {
+ public:
+  /* the library owns the memory, make a copy if you need before returning */
+  typedef std::function<void(int port_num, const char *buffer, int len,
+                             void *cookie)> PacketReceiveCb;
+
+  // path is the Unix socket path given to the switch; throws
+  // std::runtime_error if the switch cannot be reached or if another client is
+  // already attached to it. The switch accepts a new client once this object
+  // is destroyed.
+  explicit ShmPacketInject(const std::string &path);
+
+  ~ShmPacketInject();
+
+  void start();
+
+  void set_packet_receiver(const PacketReceiveCb &cb, void *cookie);
+
+  // returns false if the packet was dropped because the ring is full
+  bool send(int port_num, const char *buffer, int len);
+
+  // sends n packets, but wakes up the switch at most once; returns the number
+  // of packets sent, the remaining ones were dropped because the ring is full
+  size_t send_batch(const int *port_nums, const char * const *buffers,
+                    const int *lens, size_t n);
+
+  // these 4 port_* functions are optional, depending on receiver configuration
+  void port_add(int port_num);
+
+  void port_remove(int port_num);
+
+  void port_bring_up(int port_num);
+
+  void port_bring_down(int port_num);
+
+ private:
+  // cannot use {nullptr} with pimpl
+  std::unique_ptr<ShmPacketInjectImp> pimp;
+};
+
+}  // namespace bm_apps
+
+#endif  // BM_APPS_INCLUDE_BM_APPS_SHM_PACKET_PIPE_H_
@@ -0,0 +1,275 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "bm_sim/shm_ring.h"
+
+#include "bm_apps/shm_packet_pipe.h"
+
+namespace bm_apps {
+
+namespace shm = bm::shm;
+
+class ShmPacketInjectImp final {
+  typedef ShmPacketInject::PacketReceiveCb PacketReceiveCb;
+
+ public:
+  explicit ShmPacketInjectImp(const std::string &path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      throw std::runtime_error("shm: socket path is too long");
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) throw std::runtime_error("shm: cannot create socket");
+    // the switch closes the connection without sending the file descriptors
+    // if another client is attached
+    if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr)) != 0 || !shm::recv_fds(sock, fds)) {
+      close(sock);
+      throw std::runtime_error("shm: cannot connect to " + path);
+    }
+
+    region = mmap(nullptr, shm::Region::size(), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fds[shm::FD_REGION], 0);
+    if (region == MAP_FAILED) {
+      close_fds();
+      close(sock);
+      throw std::runtime_error("shm: cannot map shared memory region");
+    }
+    auto *hdr = static_cast<const shm::Region::Header *>(region);
+    if (hdr->magic != shm::Region::magic ||
+        hdr->ring_capacity != shm::Region::ring_capacity) {
+      munmap(region, shm::Region::size());
+      close_fds();
+      close(sock);
+      throw std::runtime_error("shm: incompatible shared memory region");
+    }
+    to_switch = shm::Region::to_switch(region);
+    from_switch = shm::Region::from_switch(region);
+    to_switch.attach();
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    assert(stop_fd >= 0);
+  }
+
+  ~ShmPacketInjectImp() {
+    if (receive_thread.joinable()) {
+      uint64_t one = 1;
+      if (write(stop_fd, &one, sizeof(one)) != sizeof(one))
+        assert(0 && "cannot stop receive thread");
+      receive_thread.join();
+    }
+    close(stop_fd);
+    munmap(region, shm::Region::size());
+    close_fds();
+    // detaches from the switch, another client can connect after this
+    close(sock);
+  }
+
+  void start() {
+    if (receive_thread.joinable()) return;
+    receive_thread = std::thread(&ShmPacketInjectImp::receive_loop, this);
+  }
+
+  void set_packet_receiver(const PacketReceiveCb &cb, void *cookie) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cb_fn = cb;
+    cb_cookie = cookie;
+  }
+
+  size_t send_batch(const int *port_nums, const char * const *buffers,
+                    const int *lens, size_t n) {
+    std::unique_lock<std::mutex> lock(tx_mutex);
+    size_t sent = 0;
+    for (; sent < n; sent++) {
+      struct iovec iov = {const_cast<char *>(buffers[sent]),
+                          static_cast<size_t>(lens[sent])};
+      if (!to_switch.push(shm::MSG_TYPE_PACKET_IN, port_nums[sent],
+                          lens[sent], &iov, 1))
+        break;
+    }
+    if (sent > 0) flush();
+    return sent;
+  }
+
+  // these 4 port_* functions are optional, depending on receiver configuration
+  void port_add(int port_num) {
+    send_port_msg(shm::MSG_TYPE_PORT_ADD, port_num, 0);
+  }
+
+  void port_remove(int port_num) {
+    send_port_msg(shm::MSG_TYPE_PORT_REMOVE, port_num, 0);
+  }
+
+  void port_bring_up(int port_num) {
+    send_port_msg(shm::MSG_TYPE_PORT_SET_STATUS, port_num,
+                  shm::MSG_PORT_STATUS_UP);
+  }
+
+  void port_bring_down(int port_num) {
+    send_port_msg(shm::MSG_TYPE_PORT_SET_STATUS, port_num,
+                  shm::MSG_PORT_STATUS_DOWN);
+  }
+
+ private:
+  void receive_loop();
+
+  // port messages cannot be dropped, so we wait for the switch to make room
+  void send_port_msg(shm::MsgType type, int port_num, int more) {
+    std::unique_lock<std::mutex> lock(tx_mutex);
+    while (!to_switch.push(type, port_num, more, nullptr, 0)) {
+      flush();
+      std::this_thread::yield();
+    }
+    flush();
+  }
+
+  void flush() {
+    if (!to_switch.flush()) return;
+    uint64_t one = 1;
+    if (write(fds[shm::FD_TO_SWITCH_DOORBELL], &one, sizeof(one)) < 0)
+      assert(errno == EAGAIN);
+  }
+
+  void close_fds() {
+    for (int fd : fds)
+      if (fd >= 0) close(fd);
+  }
+
+ private:
+  // max number of packets received between 2 polls
+  static constexpr size_t rx_burst = 64;
+
+  // kept open for as long as we are attached to the switch
+  int sock{-1};
+  int fds[shm::FD_COUNT] = {-1, -1, -1};
+  void *region{MAP_FAILED};
+  int stop_fd{-1};
+  shm::Ring to_switch{};
+  shm::Ring from_switch{};
+
+  PacketReceiveCb cb_fn{};
+  void *cb_cookie{nullptr};
+  std::thread receive_thread{};
+  mutable std::mutex mutex{};
+  std::mutex tx_mutex{};
+};
+
+constexpr size_t ShmPacketInjectImp::rx_burst;
+
+void
+ShmPacketInjectImp::receive_loop() {
+  struct pollfd pfds[2];
+  pfds[0] = {stop_fd, POLLIN, 0};
+  pfds[1] = {fds[shm::FD_FROM_SWITCH_DOORBELL], POLLIN, 0};
+  while (true) {
+    // I choose to make copies instead of holding the lock for the callback,
+    // but only once for each burst
+    PacketReceiveCb cb_fn_;
+    void *cb_cookie_;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cb_fn_ = cb_fn;
+      cb_cookie_ = cb_cookie;
+    }
+    const size_t count = from_switch.consume(
+        [&cb_fn_, cb_cookie_](const shm::MsgHdr &hdr, const char *data) {
+          // others are ignored
+          if (cb_fn_ && hdr.type == shm::MSG_TYPE_PACKET_OUT)
+            cb_fn_(hdr.port, data, hdr.more, cb_cookie_);
+        },
+        rx_burst);
+    const bool idle = (count == 0) && from_switch.prepare_wait();
+    if (poll(pfds, 2, idle ? -1 : 0) < 0) {
+      assert(errno == EINTR);
+      continue;
+    }
+    if (pfds[0].revents) return;
+    if (pfds[1].revents) {
+      uint64_t v;
+      if (read(pfds[1].fd, &v, sizeof(v)) < 0) assert(errno == EAGAIN);
+    }
+  }
+}
+
+ShmPacketInject::ShmPacketInject(const std::string &path)
+    : pimp(new ShmPacketInjectImp(path)) { }
+
+ShmPacketInject::~ShmPacketInject() { }
+
+void
+ShmPacketInject::start() {
+  pimp->start();
+}
+
+void
+ShmPacketInject::set_packet_receiver(const PacketReceiveCb &cb,
+                                     void *cookie) {
+  pimp->set_packet_receiver(cb, cookie);
+}
+
+bool
+ShmPacketInject::send(int port_num, const char *buffer, int len) {
+  return pimp->send_batch(&port_num, &buffer, &len, 1) == 1;
+}
+
+size_t
+ShmPacketInject::send_batch(const int *port_nums, const char * const *buffers,
+                            const int *lens, size_t n) {
+  return pimp->send_batch(port_nums, buffers, lens, n);
+}
+
+void
+ShmPacketInject::port_add(int port_num) {
+  pimp->port_add(port_num);
+}
+
+void
+ShmPacketInject::port_remove(int port_num) {
+  pimp->port_remove(port_num);
+}
+
+void
+ShmPacketInject::port_bring_up(int port_num) {
+  pimp->port_bring_up(port_num);
+}
+
+void
+ShmPacketInject::port_bring_down(int port_num) {
+  pimp->port_bring_down(port_num);
+}
+
+}  // namespace bm_apps
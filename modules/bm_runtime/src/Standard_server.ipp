@@ -103,6 +103,10 @@ public:
         params.emplace_back(MatchKeyParam::Type::VALID,
                             bm_param.valid.key ? std::string("\x01", 1) : std::string("\x00", 1));
         break;
+      case BmMatchParamType::type::RANGE:
+        params.emplace_back(MatchKeyParam::Type::RANGE,
+                            bm_param.range.start, bm_param.range.end_);
+        break;
       default:
         assert(0 && "wrong type");
       }
@@ -70,6 +70,17 @@ class P4Objects {
                    const std::set<header_field_pair> &arith_fields =
                      std::set<header_field_pair>());
 
+  // cfg_root is only read, which means that several instances can be built
+  // concurrently from the same parsed configuration
+  int init_objects(const Json::Value &cfg_root,
+                   LookupStructureFactory * lookup_factory,
+                   int device_id = 0, size_t cxt_id = 0,
+                   std::shared_ptr<TransportIface> transport = nullptr,
+                   const std::set<header_field_pair> &required_fields =
+                     std::set<header_field_pair>(),
+                   const std::set<header_field_pair> &arith_fields =
+                     std::set<header_field_pair>());
+
   P4Objects(const P4Objects &other) = delete;
   P4Objects &operator=(const P4Objects &) = delete;
 
@@ -82,6 +93,12 @@ class P4Objects {
 
   void reset_state();
 
+  // see Pipeline::set_decision_cache_size()
+  void set_decision_cache_size(size_t max_entries);
+
+  // see MatchTableAbstract::set_adaptive_lookup()
+  void set_adaptive_lookup(bool adaptive);
+
   ActionFn *get_action_by_id(p4object_id_t id) {
     return actions_map.at(id).get();
   }
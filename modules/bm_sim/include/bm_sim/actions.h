@@ -421,6 +421,19 @@ struct unpack_caller {
 
 class ActionPrimitive_ {
  public:
+  //! Well-known primitive semantics, see get_semantics()
+  enum class Semantics {
+    //! the action engine always calls the primitive
+    NONE,
+    //! `(Data &dst, const Data &src)`, does `dst.set(src)`
+    MODIFY_FIELD,
+    //! `(Field &f, const Data &d)`, does `f.add(f, d)`
+    ADD_TO_FIELD,
+    //! `(CounterArray &counter_array, const Data &idx)`, does
+    //! `counter_array.get_counter(idx.get_uint()).increment_counter(pkt)`
+    COUNT
+  };
+
   virtual ~ActionPrimitive_() { }
 
   virtual void execute(
@@ -429,6 +442,13 @@ class ActionPrimitive_ {
 
   virtual size_t get_num_params() = 0;
 
+  //! A primitive can override this method to declare that it implements one of
+  //! the well-known Semantics. When the parameters of a call to the primitive
+  //! allow it (e.g. the destination of a MODIFY_FIELD call is a field and not
+  //! a register), the action engine then executes the call directly, without
+  //! calling the primitive.
+  virtual Semantics get_semantics() const { return Semantics::NONE; }
+
  protected:
   // This used to be regular members in ActionPrimitive, but there could be a
   // race condition. Making them thread_local solves the issue. I moved these
@@ -491,6 +511,28 @@ class ActionPrimitive :  public ActionPrimitive_ {
 // forward declaration
 class ActionFnEntry;
 
+// A call to an action primitive, as compiled by ActionFn. Calls to primitives
+// with well-known semantics (see ActionPrimitive_::get_semantics()) are
+// specialized based on the type of their parameters, which lets the action
+// engine skip the virtual call to the primitive and the unpacking of its
+// parameters. Everything else goes through the primitive (GENERIC).
+struct ActionPrimitiveCall {
+  enum {GENERIC,
+        SET_FIELD_FROM_CONST, SET_FIELD_FROM_ACTION_DATA, SET_FIELD_FROM_FIELD,
+        ADD_CONST_TO_FIELD, ADD_ACTION_DATA_TO_FIELD, ADD_FIELD_TO_FIELD,
+        COUNT} opcode;
+
+  ActionPrimitive_ *primitive;
+  // offset of the first parameter in ActionFn::params
+  size_t param_offset;
+
+  // specialized calls only
+  ActionParam dst;
+  ActionParam src;
+  CounterArray *counter_array;
+  size_t counter_idx;
+};
+
 class ActionFn :  public NamedP4Object {
   friend class ActionFnEntry;
 
@@ -516,8 +558,23 @@ class ActionFn :  public NamedP4Object {
 
   void push_back_primitive(ActionPrimitive_ *primitive);
 
+  size_t get_num_primitives() const { return calls.size(); }
+
+  // true if the action accesses state which is shared between packets
+  // (registers, meters or extern instances); counters are not included since
+  // the order in which packets increment them does not matter
+  bool is_stateful() const;
+
+ private:
+  void push_back_param(const ActionParam &param);
+  // specializes the calls for which all the parameters are known
+  void specialize_calls();
+
  private:
-  std::vector<ActionPrimitive_ *> primitives{};
+  std::vector<ActionPrimitiveCall> calls{};
+  // calls[0, nb_specialized_calls) are final
+  size_t nb_specialized_calls{0};
+  size_t nb_call_params{0};
   std::vector<ActionParam> params{};
   RegisterSync register_sync{};
   std::vector<Data> const_values{};
@@ -559,6 +616,11 @@ class ActionFnEntry {
 
   void dump(std::ostream *stream) const;
 
+  friend std::ostream& operator<<(std::ostream &out, const ActionFnEntry &e) {
+    e.dump(&out);
+    return out;
+  }
+
   p4object_id_t get_action_id() const {
     if (!action_fn) return std::numeric_limits<p4object_id_t>::max();
     return action_fn->get_id();
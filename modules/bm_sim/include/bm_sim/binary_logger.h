@@ -0,0 +1,188 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+//! @file binary_logger.h
+//! Provides a binary trace mode for the per-packet logging macros
+//! (BMLOG_DEBUG_PKT() and BMLOG_TRACE_PKT()). In this mode, the messages are
+//! not formatted when they are logged. Instead, each log site records the id of
+//! its (static) format string, along with the raw values of its arguments, in a
+//! ring buffer owned by the calling thread. A background thread drains the ring
+//! buffers to a binary file, which can be turned into text later on with the
+//! `bm_log_decode` tool.
+
+#ifndef BM_SIM_INCLUDE_BM_SIM_BINARY_LOGGER_H_
+#define BM_SIM_INCLUDE_BM_SIM_BINARY_LOGGER_H_
+
+#include <atomic>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+#include "logger.h"
+#include "bytecontainer.h"
+
+namespace bm {
+
+//! Records per-packet log messages in binary form. See binary_logger.h for an
+//! overview. There is a single instance of this class, and all methods are
+//! static.
+//!
+//! Each record includes a timestamp, the packet id, copy id and context, and
+//! the log site arguments. Integral values are recorded as is, strings and
+//! ByteContainer instances are copied, and any other argument type is
+//! formatted with `operator<<` when the message is logged (which is what the
+//! text logger does anyway). When a ring buffer is full, the message is dropped
+//! and counted (see get_dropped_records()).
+class BinaryLogger {
+ public:
+  //! Type tags used in the binary trace file, right before each argument
+  enum class ArgType : uint8_t {
+    INT = 0, UINT, BOOL, STRING, BYTES
+  };
+
+  //! Starts recording messages with a level greater or equal to \p level in
+  //! file \p path. Returns false if the file cannot be opened.
+  static bool enable(const std::string &path,
+                     Logger::LogLevel level = Logger::LogLevel::TRACE);
+
+  //! Stops recording messages. All the messages recorded so far are written to
+  //! the file, which is then closed.
+  static void disable();
+
+  //! Returns true if messages with level \p level need to be recorded
+  static bool is_enabled(Logger::LogLevel level) {
+    return static_cast<int>(level) >= min_level.load(std::memory_order_relaxed);
+  }
+
+  //! Assigns an id to a log site; this is done once per log site by the
+  //! logging macros.
+  static int register_format(Logger::LogLevel level, const char *file,
+                             int line, const char *fmt);
+
+  //! Records one message for packet \p pkt
+  template <typename P, typename ...Args>
+  static void record(int fmt_id, const P &pkt, const Args &...args) {
+    static thread_local std::string buffer;
+    buffer.clear();
+    // the record length is filled in by push
+    put_raw<uint32_t>(&buffer, 0u);
+    put_raw<uint32_t>(&buffer, static_cast<uint32_t>(fmt_id));
+    put_raw<uint64_t>(&buffer, get_time_ns());
+    put_raw<uint64_t>(&buffer, pkt.get_packet_id());
+    put_raw<uint64_t>(&buffer, pkt.get_copy_id());
+    put_raw<uint32_t>(&buffer, static_cast<uint32_t>(pkt.get_context()));
+    put_raw<uint8_t>(&buffer, static_cast<uint8_t>(sizeof...(args)));
+    encode_all(&buffer, args...);
+    push(&buffer);
+  }
+
+  //! Returns the number of messages which were dropped because a ring buffer
+  //! was full
+  static uint64_t get_dropped_records();
+
+ private:
+  template <typename T>
+  static void put_raw(std::string *buffer, T v) {
+    buffer->append(reinterpret_cast<const char *>(&v), sizeof(v));
+  }
+
+  static void put_bytes(std::string *buffer, ArgType type,
+                        const char *data, size_t len) {
+    put_raw<uint8_t>(buffer, static_cast<uint8_t>(type));
+    put_raw<uint32_t>(buffer, static_cast<uint32_t>(len));
+    buffer->append(data, len);
+  }
+
+  static void encode_all(std::string *buffer) { (void) buffer; }
+
+  template <typename T, typename ...Args>
+  static void encode_all(std::string *buffer, const T &v,
+                         const Args &...args) {
+    encode(buffer, v);
+    encode_all(buffer, args...);
+  }
+
+  static void encode(std::string *buffer, bool v) {
+    put_raw<uint8_t>(buffer, static_cast<uint8_t>(ArgType::BOOL));
+    put_raw<uint8_t>(buffer, v ? 1 : 0);
+  }
+
+  static void encode(std::string *buffer, const std::string &v) {
+    put_bytes(buffer, ArgType::STRING, v.data(), v.size());
+  }
+
+  static void encode(std::string *buffer, const char *v) {
+    put_bytes(buffer, ArgType::STRING, v, std::strlen(v));
+  }
+
+  static void encode(std::string *buffer, const ByteContainer &v) {
+    put_bytes(buffer, ArgType::BYTES, v.data(), v.size());
+  }
+
+  template <typename T>
+  static typename std::enable_if<std::is_signed<T>::value &&
+                                 std::is_integral<T>::value, void>::type
+  encode(std::string *buffer, const T &v) {
+    put_raw<uint8_t>(buffer, static_cast<uint8_t>(ArgType::INT));
+    put_raw<int64_t>(buffer, static_cast<int64_t>(v));
+  }
+
+  template <typename T>
+  static typename std::enable_if<(std::is_unsigned<T>::value &&
+                                  std::is_integral<T>::value) ||
+                                 std::is_enum<T>::value, void>::type
+  encode(std::string *buffer, const T &v) {
+    put_raw<uint8_t>(buffer, static_cast<uint8_t>(ArgType::UINT));
+    put_raw<uint64_t>(buffer, static_cast<uint64_t>(v));
+  }
+
+  template <typename T>
+  static typename std::enable_if<!std::is_integral<T>::value &&
+                                 !std::is_enum<T>::value, void>::type
+  encode(std::string *buffer, const T &v) {
+    std::ostringstream ss;
+    ss << v;
+    encode(buffer, ss.str());
+  }
+
+  static uint64_t get_time_ns();
+
+  static void push(std::string *buffer);
+
+  static std::atomic<int> min_level;
+};
+
+}  // namespace bm
+
+//! Records a message in the binary trace, if it is enabled for \p level. This
+//! is what BMLOG_DEBUG_PKT() and BMLOG_TRACE_PKT() use in binary mode, but it
+//! can also be used directly by log sites which can provide cheaper arguments
+//! in binary mode (e.g. a raw match key rather than a formatted one).
+#define BMLOG_BINARY_PKT(level, pkt, s, ...)                              \
+  do {                                                                    \
+    if (bm::BinaryLogger::is_enabled(level)) {                            \
+      static const int bm_fmt_id_ = bm::BinaryLogger::register_format(    \
+          level, __FILE__, __LINE__, s);                                  \
+      bm::BinaryLogger::record(bm_fmt_id_, (pkt), ##__VA_ARGS__);         \
+    }                                                                     \
+  } while (0)
+
+#endif  // BM_SIM_INCLUDE_BM_SIM_BINARY_LOGGER_H_
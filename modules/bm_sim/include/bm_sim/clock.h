@@ -0,0 +1,134 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+//! @file clock.h
+//! Includes the Clock class, used for all the time-dependent behavior of the
+//! switch (packet timestamps, meters, ageing, learning timeouts, rate-limited
+//! queues, ...), and the VirtualTime class, which lets a simulation drive that
+//! clock instead of following the wall clock.
+
+#ifndef BM_SIM_INCLUDE_BM_SIM_CLOCK_H_
+#define BM_SIM_INCLUDE_BM_SIM_CLOCK_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace bm {
+
+//! A monotonic clock, which satisfies the TrivialClock requirements so that it
+//! can be used with std::chrono. By default, it follows
+//! `std::chrono::steady_clock`. Once VirtualTime::enable() has been called, it
+//! only moves forward when the simulation driver advances it.
+class Clock {
+ public:
+  typedef std::chrono::nanoseconds duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef std::chrono::time_point<Clock> time_point;
+
+  static constexpr bool is_steady = true;
+
+  //! Returns the current (wall or virtual) time
+  static time_point now() noexcept;
+};
+
+//! Discrete-event simulation support. In virtual time mode, the Clock is frozen
+//! while the switch processes packets, and a driver (e.g. a PcapFilesReader
+//! replaying capture files) moves it forward. Before moving it, the driver
+//! waits for the switch to be idle, i.e. for all packets to have left the
+//! switch or to be waiting in a rate-limited queue; it then jumps directly to
+//! the next timer deadline (a queue releasing a packet, an ageing sweep, ...)
+//! or to the time of the next input packet, whichever comes first. A 10-second
+//! trace therefore does not take 10 seconds to simulate, and the timestamps
+//! seen by the switch do not depend on the speed of the host.
+//!
+//! To take part in the simulation, a component which waits for some time must
+//! use wait_until() (and wait(), for its untimed waits) instead of the
+//! corresponding std::condition_variable methods; the Packet class counts live
+//! packets with add_work() and remove_work(). In wall clock mode, these
+//! functions reduce to the std::condition_variable ones.
+//!
+//! The virtual clock is global, so several switches running in the same
+//! process share it.
+class VirtualTime {
+ public:
+  typedef std::unique_lock<std::mutex> Lock;
+
+  //! Switches the Clock to virtual time, starting from the current time. This
+  //! should be called before the switch starts processing packets.
+  static void enable();
+
+  //! Switches the Clock back to the wall clock; time keeps moving forward from
+  //! the last virtual time. Meant for testing.
+  static void disable();
+
+  static bool is_enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  //! Waits for the switch to be idle, then advances the clock to \p tp, firing
+  //! the timers which expire on the way (in order, waiting for the switch to be
+  //! idle again after each one). Does nothing if the clock is already past \p
+  //! tp. Should only be called by the simulation driver.
+  static void advance_to(const Clock::time_point &tp);
+
+  //! Advances the clock until none of the timers are holding back packets,
+  //! e.g. when the input is exhausted and the rate-limited queues still need to
+  //! be drained.
+  static void run_until_idle();
+
+  //! Same as `cv->wait_until(*lock, tp)`. In virtual time mode, the thread
+  //! sleeps until the virtual clock reaches \p tp (or until \p cv is
+  //! notified). \p parked_work is the number of work units (e.g. packets)
+  //! held by the caller and which cannot make progress before \p tp: they do
+  //! not prevent the clock from moving forward while the caller sleeps. As
+  //! with `std::condition_variable`, the caller has to check its condition
+  //! again when the function returns.
+  static std::cv_status wait_until(std::condition_variable *cv, Lock *lock,
+                                   const Clock::time_point &tp,
+                                   size_t parked_work = 0);
+
+  //! Same as `cv->wait(*lock)`; in virtual time mode, this tells the driver
+  //! that the calling thread is done with the work it was woken up for.
+  static void wait(std::condition_variable *cv, Lock *lock);
+
+  //! Records that a new work unit (e.g. a packet) is in the switch; the clock
+  //! does not move forward until it is removed.
+  static void add_work() {
+    if (is_enabled()) add_work_();
+  }
+
+  //! Removes a work unit previously added with add_work().
+  static void remove_work() {
+    if (is_enabled()) remove_work_();
+  }
+
+ private:
+  static void add_work_();
+  static void remove_work_();
+
+  static std::atomic<bool> enabled_;
+};
+
+}  // namespace bm
+
+#endif  // BM_SIM_INCLUDE_BM_SIM_CLOCK_H_
@@ -48,8 +48,22 @@ class Conditional
     false_next = next_node;
   }
 
+  const ControlFlowNode *get_next_node_if_true() const {
+    return true_next;
+  }
+
+  const ControlFlowNode *get_next_node_if_false() const {
+    return false_next;
+  }
+
   // return pointer to next control flow node
-  const ControlFlowNode *operator()(Packet *pkt) const override;
+  const ControlFlowNode *operator()(Packet *pkt) const override {
+    return apply(pkt) ? true_next : false_next;
+  }
+
+  // evaluates the condition for the packet; this is what operator() does, but
+  // it can be called without virtual dispatch, which is what Pipeline does
+  bool apply(Packet *pkt) const;
 
   Conditional(const Conditional &other) = delete;
   Conditional &operator=(const Conditional &other) = delete;
@@ -167,6 +167,10 @@ class Context final {
                    entry_handle_t handle,
                    unsigned int ttl_ms);
 
+  MatchErrorCode
+  mt_get_lookup_stats(const std::string &table_name,
+                      MatchTableAbstract::LookupStats *stats) const;
+
   MatchErrorCode
   mt_indirect_add_member(const std::string &table_name,
                          const std::string &action_name,
@@ -336,8 +340,16 @@ class Context final {
 
   void set_force_arith(bool force_arith);
 
+  // applied to all the pipelines every time a new config is loaded
+  void set_decision_cache_size(size_t max_entries);
+
+  // applied to all the match tables every time a new config is loaded
+  void set_adaptive_lookup(bool adaptive);
+
   typedef P4Objects::header_field_pair header_field_pair;
-  int init_objects(std::istream *is,
+  // cfg_root is the parsed JSON configuration, which may be shared with other
+  // contexts being initialized concurrently
+  int init_objects(const Json::Value &cfg_root,
                    LookupStructureFactory * lookup_factory,
                    const std::set<header_field_pair> &required_fields =
                      std::set<header_field_pair>(),
@@ -345,7 +357,7 @@ class Context final {
                      std::set<header_field_pair>());
 
   ErrorCode load_new_config(
-      std::istream *is,
+      const Json::Value &cfg_root,
       LookupStructureFactory * lookup_factory,
       const std::set<header_field_pair> &required_fields =
         std::set<header_field_pair>(),
@@ -377,6 +389,10 @@ class Context final {
   std::atomic<bool> swap_ordered{false};
 
   bool force_arith{false};
+
+  size_t decision_cache_size{0};
+
+  bool adaptive_lookup{false};
 };
 
 }  // namespace bm
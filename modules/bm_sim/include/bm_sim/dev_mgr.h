@@ -27,19 +27,26 @@
 //! implementations are:
 //!   - BmiDevMgrImp: uses the BMI library (a libpcap wrapper) to send and
 //! receive packets
+//!   - AfPacketDevMgrImp: uses Linux AF_PACKET sockets with TPACKET_V3
+//! memory-mapped rings to send and receive packets
 //!   - PacketInDevMgrImp: uses a nanomsg PAIR socket to send and receive
 //! packets
+//!   - ShmDevMgrImp: uses shared memory rings to send and receive packets, see
+//! shm_ring.h
 //!   - FilesDevMgrImp: reads incoming packets from pcap files and writes
 //! outgoing packet to different pcap files
 
 #ifndef BM_SIM_INCLUDE_BM_SIM_DEV_MGR_H_
 #define BM_SIM_INCLUDE_BM_SIM_DEV_MGR_H_
 
+#include <sys/uio.h>
+
 #include <functional>
 #include <string>
 #include <map>
 
 #include "bm_sim/packet_handler.h"
+#include "bm_sim/pcap_capture.h"
 #include "bm_sim/port_monitor.h"
 
 namespace bm {
@@ -68,6 +75,15 @@ class DevMgrIface : public PacketDispatcherIface {
     std::map<std::string, std::string> extra{};
   };
 
+  // A packet to transmit, made of one or more segments which are sent back to
+  // back (e.g. rewritten headers followed by the untouched payload), so that
+  // the packet does not need to be linearized first.
+  struct TransmitDesc {
+    int port_num;
+    const struct iovec *iov;
+    int iovcnt;
+  };
+
   virtual ~DevMgrIface();
 
   ReturnCode port_add(const std::string &iface_name, port_t port_num,
@@ -82,6 +98,11 @@ class DevMgrIface : public PacketDispatcherIface {
     transmit_fn_(port_num, buffer, len);
   }
 
+  // transmits n packets, which can go out of different ports
+  void transmit_batch_fn(const TransmitDesc *pkts, size_t n) {
+    transmit_batch_fn_(pkts, n);
+  }
+
   // start the thread that performs packet processing
   void start();
 
@@ -95,6 +116,15 @@ class DevMgrIface : public PacketDispatcherIface {
   std::map<port_t, PortInfo> get_port_info() const;
 
  protected:
+  typedef std::function<void(int port_num, const TransmitDesc *pkts,
+                             size_t n)> PortBatchFn;
+
+  // for implementations of transmit_batch_fn_() which send to one port at a
+  // time: calls fn once for each port in the batch, with all the packets for
+  // that port (in their original order)
+  static void for_each_port_batch(const TransmitDesc *pkts, size_t n,
+                                  const PortBatchFn &fn);
+
   std::unique_ptr<PortMonitorIface> p_monitor{nullptr};
 
  private:
@@ -105,6 +135,10 @@ class DevMgrIface : public PacketDispatcherIface {
 
   virtual void transmit_fn_(int port_num, const char *buffer, int len) = 0;
 
+  // the default implementation calls transmit_fn_() for each packet, after
+  // linearizing the packet if needed
+  virtual void transmit_batch_fn_(const TransmitDesc *pkts, size_t n);
+
   virtual void start_() = 0;
 
   virtual ReturnCode set_packet_handler_(const PacketHandler &handler,
@@ -136,14 +170,25 @@ class DevMgr : public PacketDispatcherIface {
   // meant for testing
   void set_dev_mgr(std::unique_ptr<DevMgrIface> my_pimp);
 
+  // pcap dumps are written asynchronously, according to pcap_config
   void set_dev_mgr_bmi(
+      int device_id,
+      std::shared_ptr<TransportIface> notifications_transport = nullptr,
+      const PcapCaptureConfig &pcap_config = PcapCaptureConfig());
+
+  // pcap dumps are not supported with this one
+  void set_dev_mgr_af_packet(
       int device_id,
       std::shared_ptr<TransportIface> notifications_transport = nullptr);
 
   // The interface names are instead interpreted as file names.
   // wait_time_in_seconds indicate how long the starting thread should
   // wait before starting to process packets.
-  void set_dev_mgr_files(unsigned wait_time_in_seconds);
+  // If replay_loops is not 0, the input files are replayed that many times as
+  // fast as possible, or at replay_pps packets per second if it is not 0 (see
+  // PcapFilesReader::setFastReplay).
+  void set_dev_mgr_files(unsigned wait_time_in_seconds,
+                         unsigned replay_loops = 0, uint64_t replay_pps = 0);
 
   // if enforce ports is set to true, packets coming in on un-registered ports
   // are dropped
@@ -152,6 +197,16 @@ class DevMgr : public PacketDispatcherIface {
       std::shared_ptr<TransportIface> notifications_transport = nullptr,
       bool enforce_ports = false);
 
+  // same as set_dev_mgr_packet_in, but packets are exchanged through shared
+  // memory; a client connects to the Unix socket at path to get access to it.
+  // Only one client can be attached at a time, it stays attached until it
+  // closes its connection (or writes an invalid message to the ring) and other
+  // connection attempts are rejected.
+  void set_dev_mgr_shm(
+      int device_id, const std::string &path,
+      std::shared_ptr<TransportIface> notifications_transport = nullptr,
+      bool enforce_ports = false);
+
   ReturnCode port_add(const std::string &iface_name, port_t port_num,
                       const char *in_pcap, const char *out_pcap);
 
@@ -164,6 +219,16 @@ class DevMgr : public PacketDispatcherIface {
   //! Transmits a data packet out of port \p port_num
   void transmit_fn(int port_num, const char *buffer, int len);
 
+  //! @copydoc DevMgrIface::TransmitDesc
+  typedef DevMgrIface::TransmitDesc TransmitDesc;
+
+  //! Transmits \p n data packets, possibly out of different ports. Depending
+  //! on the implementation, this can be a lot more efficient than calling
+  //! transmit_fn() for each packet (e.g. with AF_PACKET, only one syscall is
+  //! required for each port). The packet data only needs to remain valid until
+  //! the function returns.
+  void transmit_batch_fn(const TransmitDesc *pkts, size_t n);
+
   ReturnCode set_packet_handler(const PacketHandler &handler, void *cookie)
       override;
 
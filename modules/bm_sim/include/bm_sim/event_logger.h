@@ -25,6 +25,7 @@
 
 #include <string>
 #include <memory>
+#include <atomic>
 
 #include "packet.h"
 #include "phv.h"
@@ -63,11 +64,26 @@ typedef uint64_t entry_handle_t;
 //! responsible of generated "packet in" and "packet out" messages (when a
 //! packet is received / transmitted). Obviously, this is optional and you do
 //! not have to do it if you are not interested in using the event logger.
+//!
+//! By default, messages are sent synchronously, by the thread which generates
+//! the event. In asynchronous mode (see start_async()), each thread instead
+//! copies its messages to its own lock-free ring buffer, and a background
+//! thread drains all the ring buffers and hands the messages over to the
+//! transport in batches. Messages from a given thread are always published in
+//! order; messages from different threads are ordered by a global sequence
+//! number, on a best-effort basis. If a ring buffer is full, the message is
+//! dropped (and counted, see get_dropped_events()) rather than blocking the
+//! packet processing thread.
 class EventLogger {
  public:
+  //! Default capacity (number of messages) of the per-thread ring buffers used
+  //! in asynchronous mode
+  static constexpr size_t default_ring_capacity = 4096;
+
   explicit EventLogger(std::unique_ptr<TransportIface> transport,
-                       int device_id = 0)
-      : transport_instance(std::move(transport)), device_id(device_id) { }
+                       int device_id = 0);
+
+  ~EventLogger();
 
   // we need the ingress / egress ports, but they are part of the Packet
   //! Signal that a packet was received by the switch
@@ -97,20 +113,47 @@ class EventLogger {
   void action_execute(const Packet &packet,
                       const ActionFn &action_fn, const ActionData &action_data);
 
+  //! Switches the logger to asynchronous mode and starts the background
+  //! thread. Ring buffers are created lazily, the first time a given thread
+  //! logs an event, with room for \p ring_capacity messages.
+  void start_async(size_t ring_capacity = default_ring_capacity);
+  //! Switches the logger back to synchronous mode. The background thread
+  //! publishes all pending messages before exiting. This is not meant to be
+  //! called while packets are being processed.
+  void stop_async();
+  //! Returns true if the logger is in asynchronous mode
+  bool is_async() const;
+
+  //! Returns the number of messages which were dropped because a ring buffer
+  //! was full (asynchronous mode only)
+  uint64_t get_dropped_events() const;
+  //! Returns the number of messages which were handed over to the transport by
+  //! the background thread (asynchronous mode only)
+  uint64_t get_published_events() const;
+
   static EventLogger *get() {
     static EventLogger event_logger(TransportIface::make_dummy());
     return &event_logger;
   }
 
   static void init(std::unique_ptr<TransportIface> transport,
-                   int device_id = 0) {
+                   int device_id = 0, bool async = false) {
+    get()->stop_async();
     get()->transport_instance = std::move(transport);
     get()->device_id = device_id;
+    if (async) get()->start_async();
   }
 
  private:
+  struct AsyncState;
+
+  void emit(const char *msg, size_t len);
+  void drain_events();
+
   std::unique_ptr<TransportIface> transport_instance{nullptr};
   int device_id{};
+  std::atomic<bool> async{false};
+  std::unique_ptr<AsyncState> async_state;
 };
 
 }  // namespace bm
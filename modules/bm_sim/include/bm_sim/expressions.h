@@ -24,6 +24,8 @@
 #include <unordered_map>
 #include <string>
 #include <vector>
+#include <memory>
+#include <utility>  // for std::pair
 
 #include "data.h"
 #include "phv_forward.h"
@@ -61,11 +63,11 @@ struct Op {
   ExprOpcode opcode;
 
   union {
-    int data_dest_index;
-
     struct {
       header_id_t header;
       int field_offset;
+      // 0 if unknown
+      int nbits;
     } field;
 
     header_id_t header;
@@ -91,11 +93,21 @@ struct Op {
   };
 };
 
+//! An expression is built as a sequence of ops in postfix order (see the
+//! push_back_* methods). When build() is called, this sequence is compiled into
+//! a program for a simple register machine: constant sub-expressions are
+//! folded, `and` / `or` are short-circuited, comparisons which feed a branch
+//! are fused with it and, when the bitwidth of the operands is known (see
+//! push_back_load_field()), arithmetic is done on 64-bit integers rather than
+//! on bignums whenever the result is guaranteed to fit.
 class Expression {
  public:
   Expression() { }
 
-  void push_back_load_field(header_id_t header, int field_offset);
+  //! Loads a field. \p nbits is the bitwidth of the field, 0 meaning that it
+  //! is not known (in which case bignum arithmetic is used for the field).
+  void push_back_load_field(header_id_t header, int field_offset,
+                            int nbits = 0);
   void push_back_load_bool(bool value);
   void push_back_load_header(header_id_t header);
   void push_back_load_const(const Data &data);
@@ -110,6 +122,12 @@ class Expression {
 
   void grab_register_accesses(RegisterSync *register_sync) const;
 
+  //! Appends the fields read by the expression to \p fields and the headers
+  //! whose validity it reads to \p headers. Returns false if the expression
+  //! also reads something which is not in the PHV (a register or a local).
+  bool get_phv_dependencies(std::vector<std::pair<header_id_t, int> > *fields,
+                            std::vector<header_id_t> *headers) const;
+
   bool eval_bool(const PHV &phv, const std::vector<Data> &locals = {}) const;
   Data eval_arith(const PHV &phv, const std::vector<Data> &locals = {}) const;
   void eval_arith(const PHV &phv, Data *data,
@@ -125,8 +143,10 @@ class Expression {
  private:
   enum class ExprType {EXPR_BOOL, EXPR_DATA};
 
+  // the compiled program, see expressions.cpp
+  struct Program;
+
  private:
-  int assign_dest_registers();
   void eval_(const PHV &phv, ExprType expr_type,
              const std::vector<Data> &locals,
              bool *b_res, Data *d_res) const;
@@ -136,7 +156,8 @@ class Expression {
  private:
   std::vector<Op> ops{};
   std::vector<Data> const_values{};
-  int data_registers_cnt{0};
+  // the program is immutable once built, so copies can share it
+  std::shared_ptr<const Program> program{nullptr};
   bool built{false};
 
   friend class VLHeaderExpression;
@@ -33,11 +33,14 @@
 #include <condition_variable>
 #include <memory>
 #include <functional>
+#include <atomic>
 
+#include "clock.h"
 #include "packet.h"
 #include "phv.h"
 #include "bytecontainer.h"
 #include "transport.h"
+#include "spsc_queue.h"
 
 namespace bm {
 
@@ -136,7 +139,7 @@ class LearnEngine {
     std::vector<ByteContainer> constants{};
   };
 
-  typedef std::chrono::high_resolution_clock clock;
+  typedef Clock clock;
   typedef std::chrono::milliseconds milliseconds;
 
   typedef std::unordered_set<ByteContainer, ByteContainerKeyHash> LearnFilter;
@@ -147,6 +150,23 @@ class LearnEngine {
     std::vector<LearnFilter::iterator> buffer{0};
   };
 
+  // Each thread calling learn() gets its own staging ring for each list. The
+  // dataplane thread pushes samples to it without taking the list mutex and
+  // the transmit thread merges them into the list buffer. recent is a
+  // per-thread pre-filter: it only contains samples which are known to be in
+  // the list filter (or staged). Because acks remove samples from the filter,
+  // it is only valid for a given filter generation.
+  struct SampleStage {
+    static constexpr size_t ring_size = 1024;
+    static constexpr size_t max_recent = 4096;
+
+    SampleStage() : ring(ring_size) { }
+
+    SPSCQueue<ByteContainer> ring;
+    LearnFilter recent{};
+    uint64_t generation{0};
+  };
+
   class LearnList {
    public:
     enum class LearnMode {NONE, WRITER, CB};
@@ -191,6 +211,11 @@ class LearnEngine {
     void buffer_transmit_loop();
     void buffer_transmit();
 
+    SampleStage *get_stage();
+    // the 2 following methods must be called with the mutex held
+    void add_sample_(const ByteContainer &sample);
+    void merge_staged_samples();
+
    private:
     mutable MutexType mutex{};
 
@@ -220,6 +245,19 @@ class LearnEngine {
     std::thread transmit_thread{};
     bool stop_transmit_thread{false};
 
+    // used as the key for the per-thread map of stages, list ids are not
+    // unique across contexts and pointers can be re-used
+    const uint64_t uid;
+    std::vector<std::unique_ptr<SampleStage> > stages{};
+    // protects stages (the vector, not the rings), only taken by a dataplane
+    // thread the first time it learns on this list
+    mutable std::mutex stages_mutex{};
+    // number of samples staged since the transmit thread last looked at the
+    // rings, used to know when it needs to be woken up
+    std::atomic<size_t> staged_count{0};
+    // incremented every time samples are removed from the filter
+    std::atomic<uint64_t> filter_generation{0};
+
     LearnMode learn_mode{LearnMode::NONE};
 
     // should I use a union here? or is it not worth the trouble?
@@ -120,18 +120,44 @@ class Logger {
 #define BMLOG_TRACE(...)
 #endif
 
+// needs to come after the Logger class definition
+#include "binary_logger.h"
+
+#ifdef BMLOG_DEBUG_ON
 //! Same as for BMLOG_DEBUG but for messages regarding a specific packet. Will
 //! automatically print the packet id and packet context, along with your
-//! message.
-#define BMLOG_DEBUG_PKT(pkt, s, ...)                     \
-  BMLOG_DEBUG("[{}] [cxt {}] " s, (pkt).get_unique_id(), \
-              (pkt).get_context(), ##__VA_ARGS__)
+//! message. If the binary trace is enabled for debug messages (see
+//! BinaryLogger), the message is recorded in binary form instead.
+#define BMLOG_DEBUG_PKT(pkt, s, ...)                                        \
+  do {                                                                      \
+    if (bm::BinaryLogger::is_enabled(bm::Logger::LogLevel::DEBUG)) {        \
+      BMLOG_BINARY_PKT(bm::Logger::LogLevel::DEBUG, pkt, s, ##__VA_ARGS__); \
+    } else {                                                                \
+      BMLOG_DEBUG("[{}] [cxt {}] " s, (pkt).get_unique_id(),              \
+                  (pkt).get_context(), ##__VA_ARGS__)                       \
+    }                                                                       \
+  } while (0)
+#else
+#define BMLOG_DEBUG_PKT(pkt, s, ...)
+#endif
+
+#ifdef BMLOG_TRACE_ON
 //! Same as for BMLOG_TRACE but for messages regarding a specific packet. Will
 //! automatically print the packet id and packet context, along with your
-//! message.
-#define BMLOG_TRACE_PKT(pkt, s, ...)                     \
-  BMLOG_TRACE("[{}] [cxt {}] " s, (pkt).get_unique_id(), \
-              (pkt).get_context(), ##__VA_ARGS__)
+//! message. If the binary trace is enabled for trace messages (see
+//! BinaryLogger), the message is recorded in binary form instead.
+#define BMLOG_TRACE_PKT(pkt, s, ...)                                        \
+  do {                                                                      \
+    if (bm::BinaryLogger::is_enabled(bm::Logger::LogLevel::TRACE)) {        \
+      BMLOG_BINARY_PKT(bm::Logger::LogLevel::TRACE, pkt, s, ##__VA_ARGS__); \
+    } else {                                                                \
+      BMLOG_TRACE("[{}] [cxt {}] " s, (pkt).get_unique_id(),              \
+                  (pkt).get_context(), ##__VA_ARGS__)                       \
+    }                                                                       \
+  } while (0)
+#else
+#define BMLOG_TRACE_PKT(pkt, s, ...)
+#endif
 
 #define BMLOG_ERROR(...) bm::Logger::get()->error(__VA_ARGS__)
 
@@ -23,8 +23,8 @@
 //! bm::LookupStructureFactory. When implementing your target, you may wish
 //! to provide custom implementations of the data structures used to perform
 //! matches. This can be done by inheriting from one or more of
-//! bm::ExactLookupStructure, bm::LPMMatchStructure, and
-//! bm::TernaryMatchStructure. Each of these is a specialization of the
+//! bm::ExactLookupStructure, bm::LPMMatchStructure, bm::TernaryMatchStructure
+//! and bm::RangeLookupStructure. Each of these is a specialization of the
 //! bm::LookupStructure template for the corresponding match key type.
 //!
 //! Once the implementation of the new lookup structure is complete, you must
@@ -125,6 +125,18 @@ class LookupStructure {
   virtual bool lookup(const ByteContainer &key_data,
                       internal_handle_t *handle) const = 0;
 
+  //! Look up \p n keys at once. For each key `keys[i]`, set `found[i]` to
+  //! true and `handles[i]` to the found value if there is a match, or set
+  //! `found[i]` to false if there is no match. This is used when packets are
+  //! processed in batches (see Pipeline::apply_batch()). The default
+  //! implementation calls lookup() for each key, but implementations can
+  //! override it to overlap the memory accesses of the different lookups, e.g.
+  //! by prefetching.
+  virtual void lookup_batch(const ByteContainer *const *keys, size_t n,
+                            internal_handle_t *handles, bool *found) const {
+    for (size_t i = 0; i < n; i++) found[i] = lookup(*keys[i], &handles[i]);
+  }
+
   //! Check whether an entry exists. This is distinct from a lookup operation
   //! in that this will also match against the prefix length in the case of
   //! an LPM structure, and against the mask and priority in the case of a
@@ -141,6 +153,10 @@ class LookupStructure {
 
   //! Completely remove all entries from the data structure.
   virtual void clear() = 0;
+
+  //! Name of the data structure, which is reported in the lookup statistics
+  //! of match tables (see MatchTableAbstract::get_lookup_stats()).
+  virtual const char *get_name() const { return "custom"; }
 };
 
 // Convenience typedefs to simplify the code needed to override LookupStructure
@@ -148,6 +164,7 @@ class LookupStructure {
 typedef LookupStructure<ExactMatchKey>   ExactLookupStructure;
 typedef LookupStructure<LPMMatchKey>     LPMLookupStructure;
 typedef LookupStructure<TernaryMatchKey> TernaryLookupStructure;
+typedef LookupStructure<RangeMatchKey>   RangeLookupStructure;
 
 //! This class is used by match units to create instances of the appropriate
 //! LookupStructure implementation. In order to use custom data structures in
@@ -166,6 +183,14 @@ class LookupStructureFactory {
   static std::unique_ptr<LookupStructure<K> > create(
       LookupStructureFactory *f, size_t size, size_t nbytes_key);
 
+  //! Same as create(), but calls the `create_for_<type>_tuple_space`
+  //! function. Returns nullptr for exact matches, for which there is no
+  //! tuple space variant. This is used by bm::MatchUnitGeneric in adaptive
+  //! mode.
+  template <typename K>
+  static std::unique_ptr<LookupStructure<K> > create_tuple_space(
+      LookupStructureFactory *f, size_t size, size_t nbytes_key);
+
   //! Create a lookup structure for exact matches.
   virtual std::unique_ptr<ExactLookupStructure>
   create_for_exact(size_t size, size_t nbytes_key);
@@ -177,6 +202,23 @@ class LookupStructureFactory {
   //! Create a lookup structure for ternary matches.
   virtual std::unique_ptr<TernaryLookupStructure>
   create_for_ternary(size_t size, size_t nbytes_key);
+
+  //! Create a lookup structure for range matches (which can also include
+  //! exact, LPM and ternary fields).
+  virtual std::unique_ptr<RangeLookupStructure>
+  create_for_range(size_t size, size_t nbytes_key);
+
+  //! Create a lookup structure for LPM matches which uses one hash table per
+  //! prefix length. It is more efficient than the default structure when the
+  //! entries use very few different prefix lengths.
+  virtual std::unique_ptr<LPMLookupStructure>
+  create_for_LPM_tuple_space(size_t size, size_t nbytes_key);
+
+  //! Create a lookup structure for ternary matches which uses one hash table
+  //! per mask. It is more efficient than the default structure when the
+  //! entries use few different masks (e.g. when all entries use a full mask).
+  virtual std::unique_ptr<TernaryLookupStructure>
+  create_for_ternary_tuple_space(size_t size, size_t nbytes_key);
 };
 
 
@@ -22,6 +22,7 @@
 #define BM_SIM_INCLUDE_BM_SIM_MATCH_KEY_TYPES_H_
 
 #include <limits>
+#include <vector>
 
 #include "bytecontainer.h"
 
@@ -31,7 +32,7 @@ typedef uintptr_t internal_handle_t;
 typedef uint64_t entry_handle_t;
 
 enum class MatchUnitType {
-  EXACT, LPM, TERNARY
+  EXACT, LPM, TERNARY, RANGE
 };
 
 // Entry types.
@@ -76,6 +77,25 @@ struct TernaryMatchKey : public MatchKey {
   static constexpr MatchUnitType mut = MatchUnitType::TERNARY;
 };
 
+// The range fields always come last in the key. For these fields, data holds
+// the lower bound of the range and mask holds the upper bound (both
+// inclusive). The other fields are matched like in a TernaryMatchKey.
+struct RangeMatchKey : public MatchKey {
+  RangeMatchKey() {}
+  RangeMatchKey(ByteContainer data, ByteContainer mask, int priority,
+                std::vector<size_t> range_widths, uint32_t version)
+    : MatchKey(data, version), mask(std::move(mask)), priority(priority),
+      range_widths(std::move(range_widths)) {}
+
+  ByteContainer mask{};
+  // see TernaryMatchKey
+  int priority{std::numeric_limits<decltype(priority)>::max()};
+  // width in bytes of each range field, in key order
+  std::vector<size_t> range_widths{};
+
+  static constexpr MatchUnitType mut = MatchUnitType::RANGE;
+};
+
 }  // namespace bm
 
 #endif  // BM_SIM_INCLUDE_BM_SIM_MATCH_KEY_TYPES_H_
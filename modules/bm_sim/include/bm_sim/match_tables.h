@@ -25,6 +25,7 @@
 #include <type_traits>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 
 #include "match_units.h"
 #include "actions.h"
@@ -64,6 +65,25 @@ class MatchTableAbstract : public NamedP4Object {
     const ControlFlowNode *next_node{nullptr};
   };
 
+  // what apply_action() did for a given packet, which can be replayed for
+  // another packet with the same match key as long as the table has not been
+  // modified in between; used by the Pipeline decision cache
+  struct AppliedEntry {
+    bool hit{false};
+    entry_handle_t handle{0};
+    ActionFnEntry action_fn{};
+    const ControlFlowNode *next_node{nullptr};
+    uint64_t generation{0};
+  };
+
+  typedef MatchUnitAbstract_::LookupStats LookupStats;
+
+  struct LookupResult {
+    const ActionEntry *entry;
+    entry_handle_t handle;
+    bool hit;
+  };
+
  public:
   MatchTableAbstract(const std::string &name, p4object_id_t id,
                      size_t size, bool with_counters, bool with_ageing,
@@ -71,11 +91,35 @@ class MatchTableAbstract : public NamedP4Object {
 
   virtual ~MatchTableAbstract() { }
 
-  const ControlFlowNode *apply_action(Packet *pkt);
+  // if applied is not nullptr, it is filled with what was done for pkt
+  const ControlFlowNode *apply_action(Packet *pkt,
+                                      AppliedEntry *applied = nullptr);
+
+  // same as apply_action(), for n packets at once: all the lookups are done
+  // first (with a single acquisition of the table lock), then all the actions
+  // are executed, in packet order
+  void apply_action_batch(Packet *const *pkts, size_t n,
+                          const ControlFlowNode **next_nodes);
+
+  // replays an entry previously returned by apply_action(); returns false
+  // (without doing anything) if the table has been modified since
+  bool replay_action(Packet *pkt, const AppliedEntry &applied);
+
+  // true if the outcome of apply_action() only depends on the match key and
+  // on the table entries, i.e. if it can be replayed
+  virtual bool supports_replay() const { return !with_meters; }
+
+  const MatchKeyBuilder &get_match_key_builder() const {
+    return match_unit_->get_match_key_builder();
+  }
 
   virtual const ActionEntry &lookup(const Packet &pkt, bool *hit,
                                     entry_handle_t *handle) = 0;
 
+  // calls lookup() for each packet by default
+  virtual void lookup_batch(const Packet *const *pkts, size_t n,
+                            LookupResult *results);
+
   virtual size_t get_num_entries() const = 0;
 
   virtual bool is_valid_handle(entry_handle_t handle) const = 0;
@@ -95,6 +139,11 @@ class MatchTableAbstract : public NamedP4Object {
 
   void reset_state();
 
+  // see MatchUnitAbstract_::set_adaptive_lookup()
+  void set_adaptive_lookup(bool adaptive);
+
+  LookupStats get_lookup_stats() const;
+
   void set_next_node(p4object_id_t action_id, const ControlFlowNode *next_node);
   void set_next_node_hit(const ControlFlowNode *next_node);
   // one of set_next_node_miss / set_next_node_miss_default has to be called
@@ -105,10 +154,21 @@ class MatchTableAbstract : public NamedP4Object {
   void set_next_node_miss(const ControlFlowNode *next_node);
   void set_next_node_miss_default(const ControlFlowNode *next_node);
 
+  // all the nodes which apply_action() may return, nullptr excepted
+  std::vector<const ControlFlowNode *> get_possible_next_nodes() const;
+
   void set_direct_meters(MeterArray *meter_array,
                          header_id_t target_header,
                          int target_offset);
 
+  // to be called (before the table is added to a Pipeline) if one of the
+  // actions of the table is stateful, see ActionFn::is_stateful()
+  void set_stateful_actions() { stateful_actions = true; }
+
+  // true if applying the table to a packet may have an effect on the other
+  // packets, i.e. if the table has direct meters or stateful actions
+  bool is_stateful() const { return with_meters || stateful_actions; }
+
   MatchErrorCode query_counters(entry_handle_t handle,
                                 counter_value_t *bytes,
                                 counter_value_t *packets) const;
@@ -140,7 +200,12 @@ class MatchTableAbstract : public NamedP4Object {
   const ControlFlowNode *get_next_node_default(p4object_id_t action_id) const;
 
   ReadLock lock_read() const { return ReadLock(t_mutex); }
-  WriteLock lock_write() const { return WriteLock(t_mutex); }
+  // any write access invalidates the entries returned by apply_action()
+  WriteLock lock_write() const {
+    WriteLock lock(t_mutex);
+    generation++;
+    return lock;
+  }
   void unlock(ReadLock &lock) const { lock.unlock(); }  //NOLINT
   void unlock(WriteLock &lock) const { lock.unlock(); }  // NOLINT
 
@@ -152,6 +217,7 @@ class MatchTableAbstract : public NamedP4Object {
   std::atomic_bool with_counters{false};
   std::atomic_bool with_meters{false};
   std::atomic_bool with_ageing{false};
+  bool stateful_actions{false};
 
   std::unordered_map<p4object_id_t, const ControlFlowNode *> next_nodes{};
   const ControlFlowNode *next_node_hit{nullptr};
@@ -177,8 +243,13 @@ class MatchTableAbstract : public NamedP4Object {
   // the internal version does not acquire the lock
   std::string dump_entry_string_(entry_handle_t handle) const;
 
+  void execute_action_(Packet *pkt, bool hit, entry_handle_t handle,
+                       const ActionFnEntry &action_fn) const;
+
  private:
   mutable boost::shared_mutex t_mutex{};
+  // incremented every time the write lock is acquired
+  mutable std::atomic<uint64_t> generation{0};
   MatchUnitAbstract_ *match_unit_{nullptr};
 };
 
@@ -217,6 +288,9 @@ class MatchTable : public MatchTableAbstract {
   const ActionEntry &lookup(const Packet &pkt, bool *hit,
                             entry_handle_t *handle) override;
 
+  void lookup_batch(const Packet *const *pkts, size_t n,
+                    LookupResult *results) override;
+
   size_t get_num_entries() const override {
     return match_unit->get_num_entries();
   }
@@ -433,6 +507,8 @@ class MatchTableIndirectWS : public MatchTableIndirect {
 
   typedef unsigned int hash_t;
 
+  static constexpr size_t default_nb_buckets = 256;
+
  public:
   MatchTableIndirectWS(
       const std::string &name, p4object_id_t id,
@@ -443,6 +519,18 @@ class MatchTableIndirectWS : public MatchTableIndirect {
     hash = std::move(h);
   }
 
+  // Members are selected with resilient hashing: the hash of the packet picks
+  // one of nb_buckets buckets, and each bucket maps to a member of the group.
+  // When a member is added to a group, it takes over some buckets from the
+  // other members; when a member is removed, its buckets are spread over the
+  // remaining members. In both cases, all the other buckets keep their member,
+  // which means that most flows are not affected. nb_buckets should be much
+  // larger than the number of members in a group, for the traffic to be evenly
+  // distributed. Changing it remaps all the groups.
+  void set_nb_buckets(size_t nb_buckets);
+
+  size_t get_nb_buckets() const;
+
   MatchErrorCode create_group(grp_hdl_t *grp);
 
   MatchErrorCode delete_group(grp_hdl_t grp);
@@ -479,6 +567,9 @@ class MatchTableIndirectWS : public MatchTableIndirect {
 
   MatchErrorCode get_num_members_in_group(grp_hdl_t grp, size_t *nb) const;
 
+  // the member is selected by hashing fields which are not part of the key
+  bool supports_replay() const override { return false; }
+
   void dump(std::ostream *stream) const override;
 
  public:
@@ -514,12 +605,23 @@ class MatchTableIndirectWS : public MatchTableIndirect {
     typedef RandAccessUIntSet::iterator iterator;
     typedef RandAccessUIntSet::const_iterator const_iterator;
 
+    explicit GroupInfo(size_t nb_buckets = default_nb_buckets)
+        : buckets(nb_buckets) { }
+
     MatchErrorCode add_member(mbr_hdl_t mbr);
     MatchErrorCode delete_member(mbr_hdl_t mbr);
     bool contains_member(mbr_hdl_t mbr) const;
     size_t size() const;
     mbr_hdl_t get_nth(size_t n) const;
 
+    // the group cannot be empty
+    mbr_hdl_t get_from_bucket(hash_t h) const {
+      return buckets[h % buckets.size()];
+    }
+
+    // re-assigns all the buckets, from scratch
+    void reset_buckets(size_t nb_buckets);
+
     // iterators
     iterator begin() { return mbrs.begin(); }
     const_iterator begin() const { return mbrs.begin(); }
@@ -529,7 +631,14 @@ class MatchTableIndirectWS : public MatchTableIndirect {
     void dump(std::ostream *stream) const;
 
    private:
+    // the member with the most (or the fewest) buckets, ties are broken in
+    // favor of the smallest handle
+    mbr_hdl_t find_member(bool most, mbr_hdl_t ignore) const;
+
     RandAccessUIntSet mbrs{};
+    std::vector<mbr_hdl_t> buckets;
+    // buckets currently assigned to each member
+    std::unordered_map<mbr_hdl_t, std::vector<size_t> > mbr_buckets{};
   };
 
  private:
@@ -537,6 +646,7 @@ class MatchTableIndirectWS : public MatchTableIndirect {
   size_t num_groups{0};
   std::vector<GroupInfo> group_entries{};
   std::unique_ptr<Calculation> hash{nullptr};
+  size_t nb_buckets{default_nb_buckets};
 };
 
 }  // namespace bm
@@ -31,6 +31,7 @@
 #include <atomic>
 #include <utility>  // for pair<>
 #include <memory>
+#include <mutex>
 
 #include "match_key_types.h"
 #include "match_error_codes.h"
@@ -52,7 +53,8 @@ struct MatchKeyParam {
     VALID,
     EXACT,
     LPM,
-    TERNARY
+    TERNARY,
+    RANGE
   };
 
   MatchKeyParam(const Type &type, std::string key)
@@ -69,6 +71,7 @@ struct MatchKeyParam {
   static std::string type_to_string(Type t);
 
   Type type;
+  // for RANGE, key is the lower bound and mask the upper bound (inclusive)
   std::string key;
   std::string mask{};  // optional
   int prefix_length{0};  // optional
@@ -83,6 +86,8 @@ class MatchKeyBuilderHelper;
 
 // Fields should be pushed in the P4 program (i.e. JSON) order. Internally, they
 // will be re-ordered for a more efficient implementation.
+// build() must be called before keys can be built; it compiles the fields into
+// a fixed list of byte ranges to copy out of the PHV, with the masks folded in.
 class MatchKeyBuilder {
   friend class detail::MatchKeyBuilderHelper;
  public:
@@ -97,8 +102,12 @@ class MatchKeyBuilder {
 
   void apply_big_mask(ByteContainer *key) const;
 
+  // appends the key to *key
   void operator()(const PHV &phv, ByteContainer *key) const;
 
+  // writes the key to [dst, dst + get_nbytes_key())
+  void operator()(const PHV &phv, char *dst) const;
+
   std::vector<std::string> key_to_fields(const ByteContainer &key) const;
 
   std::string key_to_string(const ByteContainer &key,
@@ -118,10 +127,24 @@ class MatchKeyBuilder {
 
   size_t get_nbytes_key() const { return nbytes_key; }
 
+  // builders which build the same keys out of the same PHV share the same id,
+  // which is assigned by build(); -1 if not built yet
+  int get_key_id() const { return key_id; }
+
   const std::string &get_name(size_t idx) const { return name_map.get(idx); }
 
   size_t max_name_size() const { return name_map.max_size(); }
 
+  // a PHV field the key depends on, or the validity of a header if f_offset is
+  // -1; only the bits set in mask (which is as wide as the field) matter
+  struct FieldRef {
+    header_id_t header;
+    int f_offset;
+    ByteContainer mask;
+  };
+
+  std::vector<FieldRef> get_field_refs() const;
+
  private:
   struct KeyF {
     header_id_t header;
@@ -130,6 +153,17 @@ class MatchKeyBuilder {
     size_t nbits;
   };
 
+  // copy nbytes from the field (or the validity of the header if f_offset is
+  // -1) to the key, at the given offset
+  struct GatherOp {
+    header_id_t header;
+    int f_offset;
+    size_t offset;
+    size_t nbytes;
+    // if true, the bytes are and-ed with big_mask
+    bool masked;
+  };
+
   struct NameMap {
     void push_back(const std::string &name);
     const std::string &get(size_t idx) const;
@@ -149,7 +183,7 @@ class MatchKeyBuilder {
   ByteContainer big_mask{};
   // maps the position of the field in the original P4 key to its actual
   // position in the implementation-specific key. In the implementation, VALID
-  // match keys come first, followed by EXACT, then LPM and TERNARY.
+  // match keys come first, followed by EXACT, then LPM, TERNARY and RANGE.
   std::vector<size_t> key_mapping{};
   // inverse of key_mapping, could be handy
   std::vector<size_t> inv_mapping{};
@@ -157,11 +191,16 @@ class MatchKeyBuilder {
   NameMap name_map{};
   bool built{false};
   std::vector<ByteContainer> masks{};
+  std::vector<GatherOp> plan{};
+  int key_id{-1};
 };
 
 namespace MatchUnit {
 
 struct AtomicTimestamp {
+  // needs to be a power of 2
+  static constexpr uint64_t epoch_length_ms = 16;
+
   std::atomic<uint64_t> ms_{};
 
   AtomicTimestamp() { }
@@ -185,6 +224,17 @@ struct AtomicTimestamp {
     ms_ = ms;
   }
 
+  // Used on table hits: the timestamp is only recorded with the granularity of
+  // an "epoch" and the store is skipped if the entry was already hit during the
+  // current epoch. This way, a hot entry does not cause a write to a shared
+  // cache line for every packet. As a consequence, an entry may age up to one
+  // epoch early.
+  void set_coarse(uint64_t ms) {
+    uint64_t epoch_ms = ms & ~(epoch_length_ms - 1);
+    if (ms_.load(std::memory_order_relaxed) != epoch_ms)
+      ms_.store(epoch_ms, std::memory_order_relaxed);
+  }
+
   uint64_t get_ms() const {
     return ms_;
   }
@@ -202,27 +252,134 @@ struct AtomicTimestamp {
   }
 };
 
-struct EntryMeta {
-  typedef Packet::clock clock;
-
+// per-entry state which is only needed when ageing is enabled
+struct AgeingMeta {
   AtomicTimestamp ts{};
   uint32_t timeout_ms{0};
-  Counter counter{};
-  uint32_t version{};
+  uint32_t version{0};
+  // the item currently scheduled in the AgeingWheel for this entry (seq is 0
+  // if none); any other item found in the wheel for this entry is stale (e.g.
+  // the TTL was shortened, or the item was re-inserted) and is discarded
+  uint32_t scheduled_seq{0};
+  uint64_t scheduled_deadline_ms{0};
+};
+
+// Entry metadata is stored as a struct of arrays, with one column per feature
+// (counters, ageing), and a column is only allocated if the table uses the
+// feature. The column is allocated in chunks, as the handles in use grow. Since
+// handles are always allocated lowest first, the memory used is proportional to
+// the maximum number of entries the table has held, not to its size. Chunks
+// never move once allocated, so elements do not need to be movable (counters
+// are atomic) and references remain valid when the column grows.
+template <typename T>
+class MetaColumn {
+ public:
+  static constexpr size_t chunk_size = 1024;
 
-  void reset() {
-    counter.reset_counter();
-    ts.set(clock::now());
+  // a column for up to size entries, nothing is allocated until grow() is
+  // called
+  void init(size_t size) {
+    chunks = std::vector<std::unique_ptr<T[]> >(
+        (size + chunk_size - 1) / chunk_size);
   }
+
+  // makes sure the element at idx is allocated
+  void grow(size_t idx) {
+    auto &chunk = chunks[idx / chunk_size];
+    if (!chunk) chunk.reset(new T[chunk_size]());
+  }
+
+  T &operator[](size_t idx) {
+    return chunks[idx / chunk_size][idx % chunk_size];
+  }
+
+  const T &operator[](size_t idx) const {
+    return chunks[idx / chunk_size][idx % chunk_size];
+  }
+
+  // calls f on all the allocated elements
+  template <typename F>
+  void for_each(F f) {
+    for (auto &chunk : chunks) {
+      if (!chunk) continue;
+      for (size_t i = 0; i < chunk_size; i++) f(&chunk[i]);
+    }
+  }
+
+  // releases all the chunks
+  void clear() {
+    for (auto &chunk : chunks) chunk.reset();
+  }
+
+  size_t get_allocated_bytes() const {
+    size_t bytes = chunks.size() * sizeof(chunks[0]);
+    for (const auto &chunk : chunks)
+      if (chunk) bytes += chunk_size * sizeof(T);
+    return bytes;
+  }
+
+ private:
+  std::vector<std::unique_ptr<T[]> > chunks{};
+};
+
+template <typename T>
+constexpr size_t MetaColumn<T>::chunk_size;
+
+// Expiry index for ageing, implemented as a hashed timing wheel. Entries are
+// bucketed by the time at which they are due to expire, so a sweep only has to
+// look at the slots which have elapsed since the previous sweep, instead of
+// walking the whole table. Entries which are further in the future than one
+// rotation of the wheel simply stay in their slot until their round comes.
+// Table hits do not touch the wheel: when an entry becomes due, the caller
+// re-computes its actual deadline and re-inserts it if it was hit in the
+// meantime (lazy re-insertion).
+class AgeingWheel {
+ public:
+  struct Item {
+    uint64_t deadline_ms;
+    internal_handle_t handle;
+    // identifies the insertion, used by the caller to discard stale items
+    uint32_t seq;
+  };
+
+  explicit AgeingWheel(size_t nb_slots = 1024, uint64_t tick_ms = 16)
+    : tick_ms(tick_ms), slots(nb_slots) { }
+
+  void insert(const Item &item, uint64_t now_ms);
+
+  // appends to due all the items with a deadline <= now_ms and removes them
+  // from the wheel
+  void advance(uint64_t now_ms, std::vector<Item> *due);
+
+  void clear();
+
+ private:
+  uint64_t tick_ms;
+  std::vector<std::vector<Item> > slots;
+  // tick of the oldest slot which may contain due items
+  uint64_t cursor{0};
+  bool started{false};
 };
 
 }  // namespace MatchUnit
 
 class MatchUnitAbstract_ {
  public:
+  struct LookupStats {
+    // name of the lookup structure in use, see LookupStructure::get_name()
+    std::string structure;
+    size_t num_entries;
+    // number of distinct masks (ternary) or prefix lengths (LPM) among the
+    // entries
+    size_t num_shapes;
+    // number of times the lookup structure was replaced in adaptive mode
+    uint64_t migrations;
+    bool adaptive;
+  };
+
   MatchUnitAbstract_(size_t size, const MatchKeyBuilder &key_builder)
     : size(size), nbytes_key(key_builder.get_nbytes_key()),
-      match_key_builder(key_builder), entry_meta(size) {
+      match_key_builder(key_builder) {
     match_key_builder.build();
   }
 
@@ -234,11 +391,31 @@ class MatchUnitAbstract_ {
 
   bool valid_handle(entry_handle_t handle) const;
 
-  MatchUnit::EntryMeta &get_entry_meta(entry_handle_t handle);
-  const MatchUnit::EntryMeta &get_entry_meta(entry_handle_t handle) const;
+  // counters are only available if enabled with set_with_counters()
+  Counter &get_counter(entry_handle_t handle);
+  const Counter &get_counter(entry_handle_t handle) const;
+
+  const MatchKeyBuilder &get_match_key_builder() const {
+    return match_key_builder;
+  }
+
+  // does what lookup() does when an entry is hit (counters and ageing), for
+  // lookups which have been cached by the caller
+  void touch_entry(entry_handle_t handle, const Packet &pkt);
 
   void reset_counters();
 
+  // The metadata for a feature is only allocated (lazily, see
+  // MatchUnit::MetaColumn) if the feature is enabled. These need to be called
+  // before any entry is added.
+  void set_with_counters(bool with_counters);
+
+  // when ageing is disabled, the hit timestamp of entries is not maintained
+  void set_with_ageing(bool with_ageing);
+
+  // memory currently allocated for the entry metadata
+  size_t get_entry_meta_bytes() const;
+
   void set_direct_meters(MeterArray *meter_array);
 
   Meter &get_meter(entry_handle_t handle);
@@ -247,6 +424,15 @@ class MatchUnitAbstract_ {
 
   void sweep_entries(std::vector<entry_handle_t> *entries) const;
 
+  // In adaptive mode, the match unit may replace its lookup structure with a
+  // better one for the entries currently installed (e.g. a single hash table
+  // for a ternary table in which all entries use the same mask). The decision
+  // is re-evaluated every time an entry is added or removed. Not all match
+  // units support it, in which case this is a no-op.
+  virtual void set_adaptive_lookup(bool adaptive);
+
+  virtual LookupStats get_lookup_stats() const;
+
   void dump_key_params(std::ostream *out,
                        const std::vector<MatchKeyParam> &params,
                        int priority = -1) const;
@@ -256,23 +442,36 @@ class MatchUnitAbstract_ {
   MatchErrorCode unset_handle(internal_handle_t handle);
   bool valid_handle_(internal_handle_t handle) const;
 
+  void schedule_ageing(internal_handle_t handle);
+  void reset_ageing();
+
+  // called once an entry has been added, to (re)initialize its metadata
+  void init_entry_meta(entry_handle_t handle);
+
+  // updates the metadata of an entry on a hit (counters and ageing)
+  void hit_entry(internal_handle_t handle, const Packet &pkt) {
+    if (with_counters) counters[handle].increment_counter(pkt);
+    if (with_ageing)
+      ageing_meta[handle].ts.set_coarse(pkt.get_ingress_ts_ms());
+  }
+
   void build_key(const PHV &phv, ByteContainer *key) const {
     match_key_builder(phv, key);
   }
 
+  // returns the key for pkt; it is either built in *scratch or, if the
+  // packet's key memo is enabled (see Packet::enable_key_memo()), taken from
+  // the memo, which may have been filled by a previous table using the same
+  // key
+  const ByteContainer &get_key(const Packet &pkt, ByteContainer *scratch) const;
+
   std::string key_to_string(const ByteContainer &key) const {
     return match_key_builder.key_to_string(key);
   }
 
   std::string key_to_string_with_names(const ByteContainer &key) const;
 
-  void update_counters(Counter *c, const Packet &pkt) {
-    c->increment_counter(pkt);
-  }
-
-  void update_ts(MatchUnit::AtomicTimestamp *ts, const Packet &pkt) {
-    ts->set(pkt.get_ingress_ts_ms());
-  }
+  void log_key(const Packet &pkt, const ByteContainer &key) const;
 
  protected:
   ~MatchUnitAbstract_() { }
@@ -283,9 +482,28 @@ class MatchUnitAbstract_ {
   size_t nbytes_key;
   HandleMgr handles{};
   MatchKeyBuilder match_key_builder;
-  std::vector<MatchUnit::EntryMeta> entry_meta{};
+  MatchUnit::MetaColumn<Counter> counters{};
+  // mutable because sweep_entries() updates the scheduling state
+  mutable MatchUnit::MetaColumn<MatchUnit::AgeingMeta> ageing_meta{};
   // non-owning pointer, the meter array still belongs to P4Objects
   MeterArray *direct_meters{nullptr};
+  bool with_counters{false};
+  bool with_ageing{false};
+
+ private:
+  void check_ageing(const MatchUnit::AgeingWheel::Item &item, uint64_t now_ms,
+                    std::vector<entry_handle_t> *entries) const;
+
+ private:
+  // ageing state, only allocated once a TTL is set on an entry; mutable
+  // because sweep_entries() is const and only holds the table read lock
+  mutable std::mutex ageing_mutex{};
+  mutable MatchUnit::AgeingWheel ageing_wheel{};
+  mutable uint32_t ageing_seq{0};
+  // entries found expired at the last sweep; they are re-checked at every
+  // sweep until they are either hit or deleted
+  mutable std::vector<MatchUnit::AgeingWheel::Item> ageing_expired{};
+  mutable std::vector<MatchUnit::AgeingWheel::Item> ageing_due{};
 };
 
 template <typename V>
@@ -311,6 +529,11 @@ class MatchUnitAbstract : public MatchUnitAbstract_ {
 
   MatchUnitLookup lookup(const Packet &pkt);
 
+  // same as lookup(), for n packets at once; the keys are all built before
+  // any of them is looked up, see LookupStructure::lookup_batch()
+  void lookup_batch(const Packet *const *pkts, size_t n,
+                    MatchUnitLookup *results);
+
   MatchErrorCode add_entry(const std::vector<MatchKeyParam> &match_key,
                            V value,  // by value for possible std::move
                            entry_handle_t *handle,
@@ -370,6 +593,10 @@ class MatchUnitAbstract : public MatchUnitAbstract_ {
   virtual void reset_state_() = 0;
 
   virtual MatchUnitLookup lookup_key(const ByteContainer &key) const = 0;
+
+  // calls lookup_key() for each key by default
+  virtual void lookup_key_batch(const ByteContainer *const *keys, size_t n,
+                                MatchUnitLookup *results) const;
 };
 
 
@@ -389,10 +616,15 @@ class MatchUnitGeneric : public MatchUnitAbstract<V> {
   MatchUnitGeneric(size_t size, const MatchKeyBuilder &match_key_builder,
                    LookupStructureFactory *lookup_factory)
     : MatchUnitAbstract<V>(size, match_key_builder), entries(size),
+      lookup_factory(lookup_factory),
       lookup_structure(
         LookupStructureFactory::create<K>(
           lookup_factory, size, match_key_builder.get_nbytes_key())) {}
 
+  void set_adaptive_lookup(bool adaptive) override;
+
+  MatchUnitAbstract_::LookupStats get_lookup_stats() const override;
+
  private:
   MatchErrorCode add_entry_(const std::vector<MatchKeyParam> &match_key,
                             V value,  // by value for possible std::move
@@ -418,9 +650,24 @@ class MatchUnitGeneric : public MatchUnitAbstract<V> {
 
   MatchUnitLookup lookup_key(const ByteContainer &key) const override;
 
+  void lookup_key_batch(const ByteContainer *const *keys, size_t n,
+                        MatchUnitLookup *results) const override;
+
+  void update_shapes(const K &key, bool add);
+  void maybe_migrate();
+  void migrate(bool use_tuple_space);
+
  private:
   std::vector<Entry> entries{};
+  LookupStructureFactory *lookup_factory{nullptr};
   std::unique_ptr<LookupStructure<K>> lookup_structure{nullptr};
+  bool adaptive{false};
+  // true if lookup_structure was created with
+  // LookupStructureFactory::create_tuple_space
+  bool tuple_space{false};
+  uint64_t migrations{0};
+  // number of entries for each mask / prefix length
+  std::unordered_map<ByteContainer, size_t, ByteContainerKeyHash> shapes{};
 };
 
 // Alias all of our concrete MatchUnit types for convenience
@@ -435,6 +682,9 @@ using MatchUnitLPM = MatchUnitGeneric<LPMMatchKey, V>;
 template <typename V>
 using MatchUnitTernary = MatchUnitGeneric<TernaryMatchKey, V>;
 
+template <typename V>
+using MatchUnitRange = MatchUnitGeneric<RangeMatchKey, V>;
+
 
 }  // namespace bm
 
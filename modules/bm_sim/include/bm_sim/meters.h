@@ -40,6 +40,7 @@
 #include <memory>
 #include <string>
 
+#include "clock.h"
 #include "named_p4object.h"
 #include "packet.h"
 #include "logger.h"
@@ -76,7 +77,7 @@ class Meter {
       return {info_rate, burst_size};
     }
   };
-  typedef std::chrono::steady_clock clock;
+  typedef Clock clock;
 
  public:
   enum class MeterType {
@@ -23,6 +23,7 @@
 #ifndef BM_SIM_INCLUDE_BM_SIM_OPTIONS_PARSE_H_
 #define BM_SIM_INCLUDE_BM_SIM_OPTIONS_PARSE_H_
 
+#include <cstdint>
 #include <string>
 #include <map>
 
@@ -61,23 +62,44 @@ class OptionsParser {
   std::string config_file_path{};
   InterfaceList ifaces{};
   bool pcap{false};
+  // pcap files: max number of bytes written for each packet (0 means all),
+  // and when to start a new file (0 means never)
+  uint32_t pcap_snaplen{0};
+  uint64_t pcap_rotate_size{0};
+  unsigned pcap_rotate_seconds{0};
   int thrift_port{};
   int device_id{};
   // if true read/write packets from files instead of interfaces
   bool use_files{false};
   // time to wait (in seconds) before starting packet processing
   int wait_time{0};
+  // if not 0, replay the input files this many times, without respecting
+  // timestamps
+  unsigned replay_loops{0};
+  // if not 0, pace the fast replay to this many packets per second
+  uint64_t replay_rate{0};
+  // if true, the clock is driven by the input files (see VirtualTime)
+  bool virtual_time{false};
   // if true read/write packets from nanomsg socket instead of interfaces
   bool packet_in{false};
   std::string packet_in_addr{};
+  // if true read/write packets from shared memory rings instead of interfaces
+  bool packet_in_shm{false};
+  std::string packet_in_shm_path{};
+  // if true use AF_PACKET mmap rings instead of libpcap for interfaces
+  bool af_packet{false};
   std::string event_logger_addr{};
   std::string file_logger{};
+  std::string binary_logger{};
   bool console_logging{false};
   // by default everything is logged
   Logger::LogLevel log_level{Logger::LogLevel::TRACE};
   std::string notifications_addr{};
   bool debugger{false};
   std::string debugger_addr{};
+  // 0 if the pipeline decision cache is disabled
+  size_t decision_cache_size{0};
+  bool adaptive_lookup{false};
 };
 
 }  // namespace bm
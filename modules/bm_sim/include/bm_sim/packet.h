@@ -35,6 +35,7 @@
 
 #include <cassert>
 
+#include "clock.h"
 #include "packet_buffer.h"
 #include "phv_source.h"
 #include "phv.h"
@@ -99,7 +100,7 @@ class Packet final {
   friend class Switch;
 
  public:
-  typedef std::chrono::system_clock clock;
+  typedef Clock clock;
 
   typedef PacketBuffer::state_t buffer_state_t;
 
@@ -239,6 +240,28 @@ class Packet final {
   //! called on the packet).
   bool is_marked_for_exit() const { return flags & (1 << FLAGS_EXIT); }
 
+  //! The last match key built for this packet. Consecutive tables which use
+  //! the same key can look it up without building it again. The memo is only
+  //! used while the packet goes through a Pipeline, which takes care of
+  //! invalidating it whenever the PHV may have been modified.
+  struct KeyMemo {
+    bool enabled{false};
+    //! see MatchKeyBuilder::get_key_id(), -1 if the memo is empty
+    int key_id{-1};
+    ByteContainer key{};
+  };
+
+  //! Enables or disables the key memo; the memo is emptied in both cases
+  void enable_key_memo(bool enable) {
+    key_memo.enabled = enable;
+    key_memo.key_id = -1;
+  }
+  //! Empties the key memo; needs to be called every time the PHV is modified
+  //! while the memo is enabled
+  void invalidate_key_memo() { key_memo.key_id = -1; }
+  //! Returns the key memo for this packet
+  KeyMemo *get_key_memo() const { return &key_memo; }
+
   //! Changes the context of the packet. You will only need to call this
   //! function if you target switch leverages the Context class and if your
   //! Packet instance changes contexts during its lifetime. This is needed
@@ -260,6 +283,16 @@ class Packet final {
   //! Returns the id of the Context this packet currently belongs to
   size_t get_context() const { return cxt_id; }
 
+  //! Returns the configuration (i.e. the P4Objects instance) this packet was
+  //! created with, in its current Context. A target must use it to process the
+  //! packet (parse, pipelines, deparse, field lists, ...) instead of the
+  //! Context's current configuration: when a new configuration is swapped in,
+  //! the packets which are already in the switch keep being processed with the
+  //! old one, which is kept alive until the last of them is destroyed. May be
+  //! `nullptr` if no configuration was given to the PHVSourceIface (e.g. in
+  //! unit tests).
+  P4Objects *get_p4objects() const { return p4objects.get(); }
+
   // the *_ptr function are just here for convenience, the same can be achieved
   // by the client by constructing a unique_ptr
 
@@ -313,8 +346,10 @@ class Packet final {
                          PacketBuffer &&buffer, PHVSourceIface *phv_source);
 
  private:
+  // if config is not null, the PHV is created for that configuration
   Packet(size_t cxt, int ingress_port, packet_id_t id, copy_id_t copy_id,
-         int ingress_length, PacketBuffer &&buffer, PHVSourceIface *phv_source);
+         int ingress_length, PacketBuffer &&buffer, PHVSourceIface *phv_source,
+         std::shared_ptr<P4Objects> config = nullptr);
 
   void update_signature(uint64_t seed = 0);
   void set_ingress_ts();
@@ -342,6 +377,9 @@ class Packet final {
   clock::time_point ingress_ts{};
   uint64_t ingress_ts_ms{};
 
+  // needs to outlive the PHV
+  std::shared_ptr<P4Objects> p4objects{nullptr};
+
   std::unique_ptr<PHV> phv{nullptr};
 
   PHVSourceIface *phv_source{nullptr};
@@ -350,6 +388,9 @@ class Packet final {
   // Packet::set_register and read with Packet::get_register
   std::array<uint64_t, nb_registers> registers;
 
+  // a cache, which is why it can be modified through a const Packet
+  mutable KeyMemo key_memo{};
+
  private:
   static CopyIdGenerator *copy_id_gen;
 };
@@ -0,0 +1,132 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#ifndef BM_SIM_INCLUDE_BM_SIM_PCAP_CAPTURE_H_
+#define BM_SIM_INCLUDE_BM_SIM_PCAP_CAPTURE_H_
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bm_sim/shm_ring.h"
+
+namespace bm {
+
+struct PcapCaptureConfig {
+  // packets are truncated to this many bytes in the file, 0 means no limit
+  uint32_t snaplen{0};
+  // start a new file when the current one would exceed this size, 0 to disable
+  uint64_t rotate_bytes{0};
+  // start a new file after this many seconds, 0 to disable
+  unsigned rotate_seconds{0};
+  // size of the queue between the capturing threads and the writer thread;
+  // when it is full, packets are dropped from the capture (not from the
+  // dataplane)
+  size_t queue_bytes{1 << 22};
+};
+
+// Writes packets to a pcap file from a background thread, so that capture can
+// stay enabled without slowing down forwarding. capture() only copies the
+// packet to a queue and never waits for the writer: if the writer cannot keep
+// up (e.g. slow disk), packets are dropped from the capture and counted.
+// Several threads can capture to the same instance concurrently (e.g. the
+// receive and transmit directions of a port sharing one file): they are
+// serialized by a mutex held only for the copy, and the writer thread never
+// takes it. The file is written with large buffered writes, which reach the
+// disk when the buffer is full, at least once per second, on flush() and when
+// the file is closed. Files can be rotated by size or by time: the first file
+// has the name given to the constructor, the next ones have a sequence number
+// inserted before the ".pcap" extension (e.g. port1.pcap, port1.1.pcap,
+// port1.2.pcap, ...).
+class PcapCapture {
+ public:
+  struct Stats {
+    uint64_t captured;
+    uint64_t dropped;
+    // number of files created so far
+    uint64_t files;
+  };
+
+  explicit PcapCapture(const std::string &filename,
+                       const PcapCaptureConfig &config = PcapCaptureConfig());
+
+  // writes all the packets still in the queue before closing the file
+  ~PcapCapture();
+
+  // can be called from any thread; returns false if the packet was dropped
+  bool capture(const char *data, size_t len);
+
+  // same, for a packet made of several segments
+  bool capture(const struct iovec *iov, int iovcnt);
+
+  // blocks until all the packets captured so far are in the file
+  void flush();
+
+  Stats get_stats() const;
+
+  PcapCapture(const PcapCapture &other) = delete;
+  PcapCapture &operator=(const PcapCapture &other) = delete;
+
+ private:
+  void writer_loop();
+  void write_record(const shm::MsgHdr &hdr, const char *data);
+  bool open_next_file();
+  void close_file();
+
+  std::string filename;
+  PcapCaptureConfig config;
+
+  // the queue has a single producer side, so producers are serialized by a
+  // mutex, which is only contended when several threads capture to the same
+  // file
+  std::vector<char> queue_mem;
+  shm::Ring queue;
+  std::mutex producer_mutex{};
+
+  std::FILE *file{nullptr};
+  std::vector<char> file_buffer;
+  uint64_t file_bytes{0};
+  uint64_t file_packets{0};
+  int64_t file_opened_at{0};
+  int64_t last_flush_at{0};
+
+  std::thread writer_thread{};
+  std::mutex mutex{};
+  std::condition_variable cv{};
+  bool stop{false};
+  uint64_t flush_requests{0};
+  uint64_t flush_done{0};
+  std::condition_variable flush_cv{};
+
+  std::atomic<uint64_t> captured{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> files{0};
+};
+
+}  // namespace bm
+
+#endif  // BM_SIM_INCLUDE_BM_SIM_PCAP_CAPTURE_H_
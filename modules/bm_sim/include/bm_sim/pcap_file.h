@@ -22,11 +22,14 @@
 #include <stdexcept>
 #include <mutex>
 #include <cassert>
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <memory>
 #include <unordered_map>
+#include "bm_sim/clock.h"
 #include "bm_sim/packet_handler.h"
+#include "bm_sim/pcap_capture.h"
 
 namespace bm {
 
@@ -109,6 +112,39 @@ class PcapFileIn : public PcapFileBase {
 };
 
 
+/* A pcap (or pcapng) file mapped in memory, for fast replay. The whole file is
+   parsed when it is opened, without going through libpcap, and the packets are
+   accessed in place: the data pointers are valid as long as this object is
+   alive.
+*/
+class PcapFileMmap : public PcapFileBase {
+ public:
+  struct Record {
+    uint64_t ts_ns;  // timestamp, in nanoseconds
+    const char* data;
+    unsigned length;
+  };
+
+  PcapFileMmap(unsigned port, std::string filename);
+  virtual ~PcapFileMmap();
+
+  unsigned getPort() const { return port; }
+  // All the packets in the file, in file order
+  const std::vector<Record>& getRecords() const { return records; }
+
+ private:
+  const char* base;
+  size_t size;
+  std::vector<Record> records;
+
+  void parsePcap();
+  void parsePcapng();
+
+  PcapFileMmap(PcapFileMmap const& ) = delete;
+  PcapFileMmap& operator=(PcapFileMmap const&) = delete;
+};
+
+
 class PcapFileOut :
     public PcapFileBase {
  public:
@@ -138,7 +174,20 @@ class PcapFilesReader :
   // case the 'start' method should probably be invoked by the caller on a
   // separate thread.  'wait_time_in_seconds' is the time that the reader should
   // wait before starting to process packets.
+  // In virtual time mode (see VirtualTime), the reader drives the simulation:
+  // instead of sleeping, it advances the Clock to the time of each packet
+  // (relative to the time of the 'start' call), after the switch is done with
+  // the previous ones, whatever the value of 'respectTiming'. Once all the
+  // packets have been sent, 'start' only returns when the switch is idle.
   PcapFilesReader(bool respectTiming, unsigned wait_time_in_seconds);
+  // Switch to fast replay mode; must be called before 'addFile'. The files are
+  // memory-mapped and merged up front into a single timestamp-ordered index,
+  // which is then fed to the handler back-to-back, in batches of
+  // 'replayBatchSize' packets, 'loops' times. Timestamps (and 'respectTiming')
+  // are ignored; if 'targetPps' is not 0, the replay is paced (once per batch)
+  // to emit that many packets per second (of virtual time, in virtual time
+  // mode).
+  void setFastReplay(unsigned loops, uint64_t targetPps = 0);
   // Add a file corresponding to the specified port.
   void addFile(unsigned port, std::string file);
   void start();  // start processing the pcap files
@@ -156,6 +205,8 @@ class PcapFilesReader :
   struct timeval startTime;
   // Time of first packet across all files
   struct timeval firstPacketTime;
+  // Clock time of the 'start' call, used in virtual time mode
+  Clock::time_point virtualStartTime;
   // constant zero (could be static, but it's easier to
   // initialize it this way)
   struct timeval zero;
@@ -164,6 +215,21 @@ class PcapFilesReader :
   unsigned scheduledIndex;
   bool started;
 
+  // fast replay mode
+  static constexpr size_t replayBatchSize = 64;
+  struct ReplayPacket {
+    const char* data;
+    unsigned length;
+    unsigned port;
+  };
+  bool fastReplay;
+  unsigned replayLoops;
+  uint64_t replayTargetPps;
+  std::vector<std::unique_ptr<PcapFileMmap>> mmapFiles;
+
+  std::vector<ReplayPacket> buildReplayIndex() const;
+  void replay();
+
   void scan();
   void schedulePacket(unsigned index, const struct timeval* delay);
   void timerFired();  // send a scheduled packet
@@ -177,16 +243,21 @@ class PcapFilesReader :
 };
 
 
-// Writes data to a set of Pcap files.
+// Writes data to a set of Pcap files. The files are written asynchronously
+// (see PcapCapture), call 'flush' to make sure that all the packets sent so far
+// have been written.
 class PcapFilesWriter : public PacketReceiverIface {
  public:
-  PcapFilesWriter();
+  explicit PcapFilesWriter(
+      const PcapCaptureConfig& config = PcapCaptureConfig());
   // Add a file corresponding to the specified port.
   void addFile(unsigned port, std::string file);
   void send_packet(int port_num, const char* buffer, int len);
+  void flush();
 
  private:
-  std::unordered_map<unsigned, std::unique_ptr<PcapFileOut>> files;
+  PcapCaptureConfig config;
+  std::unordered_map<unsigned, std::unique_ptr<PcapCapture>> files;
 
   PcapFilesWriter(PcapFilesWriter const& ) = delete;
   PcapFilesWriter& operator=(PcapFilesWriter const&) = delete;
@@ -257,6 +257,10 @@ class PHV {
   //! Returns the number of headers included in the PHV
   size_t num_headers() const { return headers.size(); }
 
+  //! Returns the PHVFactory which created this PHV, i.e. the configuration
+  //! this PHV belongs to
+  const PHVFactory *get_factory() const { return factory; }
+
  private:
   // To  be used only by PHVFactory
   // all headers need to be pushed back in order (according to header_index) !!!
@@ -284,6 +288,7 @@ class PHV {
   FieldNamesMap fields_map{};
   size_t capacity{0};
   size_t capacity_stacks{0};
+  const PHVFactory *factory{nullptr};
   Debugger::PacketId packet_id;
 };
 
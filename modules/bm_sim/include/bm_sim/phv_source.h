@@ -27,20 +27,37 @@
 
 namespace bm {
 
+class P4Objects;
+
+// For each context, the PHV source holds the current configuration: the
+// PHVFactory used to create PHVs and the P4Objects instance which owns it.
+// Packets keep a reference to the configuration they were created with, which
+// lets a new configuration be swapped in while packets are still being
+// processed with the old one: the old configuration is destroyed along with
+// its last packet.
 class PHVSourceIface {
  public:
   virtual ~PHVSourceIface() { }
 
-  std::unique_ptr<PHV> get(size_t cxt) {
-    return get_(cxt);
+  // if *config is not null, the returned PHV belongs to that configuration,
+  // even if it is no longer the current one (e.g. when cloning a packet);
+  // otherwise the PHV belongs to the current configuration, and *config is set
+  // to it
+  std::unique_ptr<PHV> get(size_t cxt,
+                           std::shared_ptr<P4Objects> *config = nullptr) {
+    std::shared_ptr<P4Objects> unused;
+    return get_(cxt, config ? config : &unused);
   }
 
+  // PHVs which do not belong to the current configuration are destroyed
+  // instead of being reused
   void release(size_t cxt, std::unique_ptr<PHV> phv) {
     release_(cxt, std::move(phv));
   }
 
-  void set_phv_factory(size_t cxt, const PHVFactory *factory) {
-    set_phv_factory_(cxt, factory);
+  void set_phv_factory(size_t cxt, const PHVFactory *factory,
+                       std::shared_ptr<P4Objects> config = nullptr) {
+    set_phv_factory_(cxt, factory, std::move(config));
   }
 
   size_t phvs_in_use(size_t cxt) {
@@ -50,11 +67,13 @@ class PHVSourceIface {
   static std::unique_ptr<PHVSourceIface> make_phv_source(size_t size = 1);
 
  private:
-  virtual std::unique_ptr<PHV> get_(size_t cxt) = 0;
+  virtual std::unique_ptr<PHV> get_(size_t cxt,
+                                    std::shared_ptr<P4Objects> *config) = 0;
 
   virtual void release_(size_t cxt, std::unique_ptr<PHV> phv) = 0;
 
-  virtual void set_phv_factory_(size_t cxt, const PHVFactory *factory) = 0;
+  virtual void set_phv_factory_(size_t cxt, const PHVFactory *factory,
+                                std::shared_ptr<P4Objects> config) = 0;
 
   virtual size_t phvs_in_use_(size_t cxt) = 0;
 };
@@ -23,21 +23,58 @@
 #ifndef BM_SIM_INCLUDE_BM_SIM_PIPELINE_H_
 #define BM_SIM_INCLUDE_BM_SIM_PIPELINE_H_
 
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>  // for std::pair
+#include <vector>
 
 #include "control_flow.h"
 #include "named_p4object.h"
 
 namespace bm {
 
+class Conditional;
+class MatchActionTable;
+
 //! Implements a P4 control flow. It essentially consists of a apply() method
 //! which is in charge of sending the Packet through the correct match-action
 //! tables and conditions.
+//!
+//! The control flow graph is flattened into a program when the Pipeline is
+//! constructed, which means that the next nodes of all the tables and
+//! conditions reachable from \p first_node must have been set by then.
+//!
+//! A Pipeline can optionally maintain a decision cache (see
+//! set_decision_cache_size()), similar to the megaflow cache of Open vSwitch:
+//! for each packet, the Pipeline records which PHV bits were read by the
+//! tables and conditions the packet went through, as well as the table entries
+//! which were hit. Subsequent packets with the same values for these bits
+//! replay the recorded actions without looking up the tables. Any change to
+//! one of the tables invalidates the cached decisions which involve it. Only
+//! tables and conditions which do not depend on anything else than the PHV
+//! and the table entries can be cached (e.g. tables with direct meters or
+//! action selectors, as well as conditions which read registers, cannot).
 class Pipeline : public NamedP4Object {
  public:
+  //! Statistics for the decision cache
+  struct DecisionCacheStats {
+    //! number of packets for which all the cached decisions were replayed
+    uint64_t hits;
+    //! number of packets for which no decision was found in the cache
+    uint64_t misses;
+    //! number of packets for which the cached decisions could only be
+    //! partially replayed, either because the packet diverged from them or
+    //! because one of the tables was modified
+    uint64_t invalidations;
+    //! number of cached decisions
+    size_t entries;
+  };
+
   Pipeline(const std::string &name, p4object_id_t id,
-           ControlFlowNode *first_node)
-    : NamedP4Object(name, id), first_node(first_node) {}
+           ControlFlowNode *first_node);
+
+  ~Pipeline();
 
   //! Sends the \p pkt through the correct match-action tables and
   //! condiitons. Each step is determined based on the result of the previous
@@ -45,18 +82,88 @@ class Pipeline : public NamedP4Object {
   //! flow graph.
   void apply(Packet *pkt);
 
+  //! Sends a batch of \p n packets through the pipeline. Tables are looked
+  //! up for several packets at a time, which amortizes locking and lets the
+  //! lookup structures prefetch memory: all the packets which reach the same
+  //! table at the same time are processed together, and they may diverge
+  //! after that. As a consequence, the steps of different packets are
+  //! interleaved, and this is only done when no table or condition in the
+  //! pipeline accesses state shared between packets (registers, meters,
+  //! extern instances, see MatchTableAbstract::is_stateful()); otherwise, and
+  //! when the decision cache is enabled, this calls apply() for each packet,
+  //! in order. Packets which reach a control flow node which is neither a
+  //! table nor a condition leave the batch and complete the pipeline on their
+  //! own, so such nodes should not access shared state either.
+  void apply_batch(Packet *const *pkts, size_t n);
+
+  //! Enables the decision cache, with room for \p max_entries cached
+  //! decisions (once the cache is full, it is flushed). 0 disables the
+  //! cache, which is the default. This must not be called while packets are
+  //! being processed.
+  void set_decision_cache_size(size_t max_entries);
+
+  //! Returns the decision cache statistics; all of them are 0 if the cache is
+  //! disabled
+  DecisionCacheStats get_decision_cache_stats() const;
+
   //! Deleted copy constructor
   Pipeline(const Pipeline &other) = delete;
   //! Deleted copy assignment operator
   Pipeline &operator=(const Pipeline &other) = delete;
 
   //! Default move constructor
-  Pipeline(Pipeline &&other) /*noexcept*/ = default;
+  Pipeline(Pipeline &&other) /*noexcept*/;
   //! Default move assignment operator
   Pipeline &operator=(Pipeline &&other) /*noexcept*/ = default;
 
  private:
+  // One instruction per control flow node. Tables and conditions are executed
+  // without virtual dispatch and their next node is resolved to an index in
+  // the program. Any other kind of node is called through ControlFlowNode.
+  struct Instr {
+    enum {TABLE, CONDITION, NODE} kind;
+    const ControlFlowNode *node;
+    const MatchActionTable *table;
+    const Conditional *condition;
+    // CONDITION only
+    int true_next;
+    int false_next;
+    // TABLE only, there are usually very few of them so a linear search is
+    // fine
+    std::vector<std::pair<const ControlFlowNode *, int> > successors;
+  };
+
+  // next instruction index for the end of the pipeline
+  static constexpr int end_idx = -1;
+
+  // see pipeline.cpp
+  struct DecisionCache;
+
+  void build_program();
+  void build_topo_order();
+  int get_index(const ControlFlowNode *node) const;
+  int get_table_next_index(const Instr &instr,
+                           const ControlFlowNode *next) const;
+
+  // both return the index of the instruction at which apply() needs to resume
+  // (end_idx if done); node is set if the next node is not in the program
+  int apply_cached(Packet *pkt, const ControlFlowNode **node);
+  int record_decisions(Packet *pkt, const ControlFlowNode **node);
+
+  void start(Packet *pkt) const;
+  void done(Packet *pkt) const;
+  // runs the program from instruction idx, then walks the graph from node (if
+  // not nullptr)
+  void run(Packet *pkt, int idx, const ControlFlowNode *node) const;
+
   ControlFlowNode *first_node;
+  std::vector<Instr> program{};
+  // only used to resolve the next node of generic nodes
+  std::unordered_map<const ControlFlowNode *, int> node_index{};
+  // indices of the instructions in topological order, empty if the control
+  // flow graph has a cycle or if the program accesses shared state
+  std::vector<int> topo_order{};
+  std::unique_ptr<DecisionCache> cache{nullptr};
 };
 
 }  // namespace bm
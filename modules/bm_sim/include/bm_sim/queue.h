@@ -99,6 +99,24 @@ class Queue {
     q_not_full.notify_one();
   }
 
+  //! Pops up to \p max elements from the back of the queue and moves them to
+  //! the \p items array, in the order in which pop_back() would have returned
+  //! them. Blocks until at least one element is available. Returns the number
+  //! of elements popped.
+  size_t pop_back_batch(T *items, size_t max) {
+    std::unique_lock<std::mutex> lock(q_mutex);
+    while (!is_not_empty())
+      q_not_empty.wait(lock);
+    size_t n = 0;
+    for (; n < max && is_not_empty(); n++) {
+      items[n] = std::move(queue.back());
+      queue.pop_back();
+    }
+    lock.unlock();
+    q_not_full.notify_all();
+    return n;
+  }
+
   //! Get queue occupancy
   size_t size() const {
     std::unique_lock<std::mutex> lock(q_mutex);
@@ -38,6 +38,8 @@
 #include <chrono>
 #include <algorithm>  // for std::max
 
+#include "clock.h"
+
 namespace bm {
 
 //! One of the most basic queueing block possible. Lets you choose (at runtime)
@@ -271,10 +273,12 @@ class QueueingLogicRL {
     std::unique_lock<std::mutex> lock(w_info.q_mutex);
     while (true) {
       if (queue.size() == 0) {
-        w_info.q_not_empty.wait(lock);
+        VirtualTime::wait(&w_info.q_not_empty, &lock);
       } else {
         if (queue.top().send <= clock::now()) break;
-        w_info.q_not_empty.wait_until(lock, queue.top().send);
+        // all the elements in the queue are waiting for this deadline
+        VirtualTime::wait_until(&w_info.q_not_empty, &lock, queue.top().send,
+                                queue.size());
       }
     }
     *queue_id = queue.top().queue_id;
@@ -330,9 +334,8 @@ class QueueingLogicRL {
 
  private:
   using ticks = std::chrono::nanoseconds;
-  // clock choice? switch to steady if observing re-ordering
-  // using clock = std::chrono::steady_clock;
-  using clock = std::chrono::high_resolution_clock;
+  // see clock.h, this is a steady clock which also supports virtual time
+  using clock = Clock;
 
   struct QE {
     // QE(T e, size_t queue_id, const clock::time_point &send, size_t id)
@@ -492,7 +495,7 @@ class QueueingLogicPriRL {
     size_t pri;
     while (true) {
       if (w_info.size == 0) {
-        w_info.q_not_empty.wait(lock);
+        VirtualTime::wait(&w_info.q_not_empty, &lock);
       } else {
         auto now = clock::now();
         auto next = clock::time_point::max();
@@ -506,7 +509,7 @@ class QueueingLogicPriRL {
           next = std::min(next, q.top().send);
         }
         if (queue) break;
-        w_info.q_not_empty.wait_until(lock, next);
+        VirtualTime::wait_until(&w_info.q_not_empty, &lock, next, w_info.size);
       }
     }
     *queue_id = queue->top().queue_id;
@@ -519,6 +522,7 @@ class QueueingLogicPriRL {
     auto &q_info_pri = q_info.at(*priority);
     q_info_pri.size--;
     q_info.size--;
+    w_info.size--;
   }
 
   //! Same as
@@ -589,9 +593,8 @@ class QueueingLogicPriRL {
 
  private:
   using ticks = std::chrono::nanoseconds;
-  // clock choice? switch to steady if observing re-ordering
-  // using clock = std::chrono::steady_clock;
-  using clock = std::chrono::high_resolution_clock;
+  // see clock.h, this is a steady clock which also supports virtual time
+  using clock = Clock;
 
   struct QE {
     QE(T e, size_t queue_id, const clock::time_point &send)
@@ -79,6 +79,11 @@ class RuntimeInterface {
                    entry_handle_t handle,
                    unsigned int ttl_ms) = 0;
 
+  virtual MatchErrorCode
+  mt_get_lookup_stats(size_t cxt_id,
+                      const std::string &table_name,
+                      MatchTableAbstract::LookupStats *stats) const = 0;
+
   virtual MatchErrorCode
   mt_indirect_add_member(size_t cxt_id,
                          const std::string &table_name,
@@ -0,0 +1,314 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+//! @file shm_ring.h
+//! Shared-memory transport used to exchange packets (and port messages)
+//! between the switch and another process on the same host. It is used by the
+//! shm device manager (see DevMgr::set_dev_mgr_shm) and by the matching client
+//! library (bm_apps::ShmPacketInject), and is meant as a much faster
+//! alternative to the nanomsg packet-in transport.
+//!
+//! The switch creates a memfd-backed shared memory region with 2 rings, one for
+//! each direction, and 2 eventfds used as doorbells. It listens on a Unix
+//! domain socket, and sends the 3 file descriptors to any process which
+//! connects to it. Each ring has exactly one producer and one consumer, so
+//! there can only be one client at a time. The messages are the same as for
+//! the nanomsg transport.
+//!
+//! A doorbell is only rung when the consumer has announced that it is about to
+//! sleep, so a busy consumer never costs a syscall to the producer, and a
+//! producer pushing a batch of packets rings the doorbell at most once.
+
+#ifndef BM_SIM_INCLUDE_BM_SIM_SHM_RING_H_
+#define BM_SIM_INCLUDE_BM_SIM_SHM_RING_H_
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+namespace bm {
+
+namespace shm {
+
+enum MsgType : int32_t {
+  MSG_TYPE_PORT_ADD = 0,
+  MSG_TYPE_PORT_REMOVE,
+  MSG_TYPE_PORT_SET_STATUS,
+  MSG_TYPE_PACKET_IN,
+  MSG_TYPE_PACKET_OUT,
+  // internal, used to skip the end of the ring when a record does not fit
+  MSG_TYPE_PAD = 0x7fffffff
+};
+
+enum MsgPortStatus : int32_t {
+  MSG_PORT_STATUS_DOWN = 0,
+  MSG_PORT_STATUS_UP
+};
+
+struct MsgHdr {
+  // size of the record, including this header, multiple of record_align
+  uint32_t size;
+  int32_t type;
+  int32_t port;
+  // status for PORT_SET_STATUS, data length for PACKET_IN and PACKET_OUT
+  int32_t more;
+};
+
+constexpr size_t record_align = sizeof(MsgHdr);
+
+// Control block of a ring, in shared memory; head and tail are on separate
+// cache lines, see SPSCQueue
+struct RingCtl {
+  std::atomic<uint64_t> head;
+  char _padding_0[56];
+  std::atomic<uint64_t> tail;
+  char _padding_1[56];
+  // set by the consumer before it sleeps on the doorbell
+  std::atomic<uint32_t> consumer_waiting;
+  char _padding_2[60];
+};
+
+//! Single-producer single-consumer ring of variable-size records, in shared
+//! memory. Records are never split: if there is not enough room at the end of
+//! the ring, a padding record is inserted and the record starts at offset 0.
+class Ring {
+ public:
+  //! \p capacity must be a power of 2
+  static size_t mem_size(size_t capacity) {
+    return sizeof(RingCtl) + capacity;
+  }
+
+  Ring() { }
+
+  Ring(void *mem, size_t capacity)
+      : ctl(static_cast<RingCtl *>(mem)),
+        data(static_cast<char *>(mem) + sizeof(RingCtl)),
+        capacity(capacity) { }
+
+  //! Must be called once, by the process which creates the region
+  void init() {
+    new (ctl) RingCtl();
+    ctl->head = 0;
+    ctl->tail = 0;
+    ctl->consumer_waiting = 0;
+    pending_tail = 0;
+  }
+
+  //! Must be called by the producer before its first push, if it did not
+  //! create the region (e.g. a client which reconnects)
+  void attach() {
+    pending_tail = ctl->tail.load(std::memory_order_acquire);
+  }
+
+  //! Producer: appends a record, whose data is made of \p iovcnt segments. The
+  //! record is not visible to the consumer until flush() is called. Returns
+  //! false if there is not enough room.
+  bool push(int32_t type, int32_t port, int32_t more,
+            const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    const size_t size =
+        (sizeof(MsgHdr) + len + record_align - 1) & ~(record_align - 1);
+    const size_t offset = pending_tail & (capacity - 1);
+    const size_t pad = (capacity - offset < size) ? (capacity - offset) : 0;
+    const uint64_t head = ctl->head.load(std::memory_order_acquire);
+    if (capacity - (pending_tail - head) < pad + size) return false;
+    if (pad > 0) {
+      write_hdr(offset, {static_cast<uint32_t>(pad), MSG_TYPE_PAD, 0, 0});
+      pending_tail += pad;
+    }
+    char *record = data + (pending_tail & (capacity - 1));
+    write_hdr(pending_tail & (capacity - 1),
+              {static_cast<uint32_t>(size), type, port, more});
+    char *dst = record + sizeof(MsgHdr);
+    for (int i = 0; i < iovcnt; i++) {
+      std::memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+      dst += iov[i].iov_len;
+    }
+    pending_tail += size;
+    return true;
+  }
+
+  //! Producer: publishes all the records pushed since the last call. Returns
+  //! true if the consumer is sleeping and the doorbell needs to be rung.
+  bool flush() {
+    ctl->tail.store(pending_tail, std::memory_order_seq_cst);
+    return ctl->consumer_waiting.load(std::memory_order_seq_cst) &&
+        ctl->consumer_waiting.exchange(0, std::memory_order_seq_cst);
+  }
+
+  //! Consumer: calls \p cb(const MsgHdr &, const char *data) for up to \p max
+  //! records, in place, then releases them all at once. Returns the number of
+  //! records consumed. Since the producer may be another process, the records
+  //! are validated first: consumption stops at the first invalid record, in
+  //! which case \p valid (if not nullptr) is set to false and the ring cannot
+  //! be used anymore until init() is called again.
+  template <typename F>
+  size_t consume(F cb, size_t max, bool *valid = nullptr) {
+    uint64_t head = ctl->head.load(std::memory_order_relaxed);
+    const uint64_t tail = ctl->tail.load(std::memory_order_acquire);
+    size_t count = 0;
+    bool ok = (tail - head <= capacity);
+    while (ok && head != tail && count < max) {
+      const size_t offset = head & (capacity - 1);
+      if (offset % record_align != 0) {
+        ok = false;
+        break;
+      }
+      const char *record = data + offset;
+      MsgHdr hdr;
+      std::memcpy(&hdr, record, sizeof(hdr));
+      if (!is_valid(hdr, offset, tail - head)) {
+        ok = false;
+        break;
+      }
+      if (hdr.type != MSG_TYPE_PAD) {
+        cb(hdr, record + sizeof(MsgHdr));
+        count++;
+      }
+      head += hdr.size;
+    }
+    ctl->head.store(head, std::memory_order_release);
+    if (valid) *valid = ok;
+    return count;
+  }
+
+  //! Consumer: announces that it is about to sleep on the doorbell. Returns
+  //! false if records arrived in the meantime, in which case the consumer
+  //! should not sleep.
+  bool prepare_wait() {
+    ctl->consumer_waiting.store(1, std::memory_order_seq_cst);
+    if (ctl->tail.load(std::memory_order_seq_cst) !=
+        ctl->head.load(std::memory_order_relaxed)) {
+      ctl->consumer_waiting.store(0, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  void write_hdr(size_t offset, const MsgHdr &hdr) {
+    std::memcpy(data + offset, &hdr, sizeof(hdr));
+  }
+
+  // a record must fit in what has been published and must not cross the end of
+  // the ring; for packets, the data must fit in the record
+  bool is_valid(const MsgHdr &hdr, size_t offset, uint64_t available) const {
+    if (hdr.size < sizeof(MsgHdr) || hdr.size % record_align != 0 ||
+        hdr.size > available || hdr.size > capacity - offset)
+      return false;
+    if (hdr.type == MSG_TYPE_PACKET_IN || hdr.type == MSG_TYPE_PACKET_OUT) {
+      return hdr.more >= 0 &&
+          static_cast<size_t>(hdr.more) <= hdr.size - sizeof(MsgHdr);
+    }
+    return true;
+  }
+
+  RingCtl *ctl{nullptr};
+  char *data{nullptr};
+  size_t capacity{0};
+  // only used by the producer, records are pushed here before being flushed
+  uint64_t pending_tail{0};
+};
+
+//! Layout of the shared memory region: a header followed by the 2 rings
+struct Region {
+  static constexpr uint32_t magic = 0x424d5348;  // "BMSH"
+  static constexpr size_t ring_capacity = 1 << 22;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t ring_capacity;
+    char _padding[56];
+  };
+
+  static size_t size() {
+    return sizeof(Header) + 2 * Ring::mem_size(ring_capacity);
+  }
+
+  // packet-in and port messages, from the client to the switch
+  static Ring to_switch(void *mem) {
+    return Ring(static_cast<char *>(mem) + sizeof(Header), ring_capacity);
+  }
+
+  // packet-out messages, from the switch to the client
+  static Ring from_switch(void *mem) {
+    return Ring(static_cast<char *>(mem) + sizeof(Header) +
+                Ring::mem_size(ring_capacity), ring_capacity);
+  }
+};
+
+//! The file descriptors sent by the switch to the client, in this order
+enum FdIndex {
+  FD_REGION = 0,
+  // rung by the client when it pushes to the to_switch ring
+  FD_TO_SWITCH_DOORBELL,
+  // rung by the switch when it pushes to the from_switch ring
+  FD_FROM_SWITCH_DOORBELL,
+  FD_COUNT
+};
+
+inline bool send_fds(int sock, const int *fds) {
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int) * FD_COUNT)];
+  std::memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * FD_COUNT);
+  std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * FD_COUNT);
+  return sendmsg(sock, &msg, 0) == 1;
+}
+
+inline bool recv_fds(int sock, int *fds) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int) * FD_COUNT)];
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, 0) != 1) return false;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * FD_COUNT))
+    return false;
+  std::memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * FD_COUNT);
+  return true;
+}
+
+}  // namespace shm
+
+}  // namespace bm
+
+#endif  // BM_SIM_INCLUDE_BM_SIM_SHM_RING_H_
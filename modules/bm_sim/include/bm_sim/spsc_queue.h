@@ -0,0 +1,129 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+//! @file spsc_queue.h
+
+#ifndef BM_SIM_INCLUDE_BM_SIM_SPSC_QUEUE_H_
+#define BM_SIM_INCLUDE_BM_SIM_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <vector>
+#include <algorithm>  // for std::swap
+
+namespace bm {
+
+//! A bounded, lock-free, single-producer single-consumer ring buffer. Unlike
+//! Queue, it never blocks: try_push() fails if the queue is full and try_pop()
+//! fails if it is empty, and it is up to the caller to decide what to do in
+//! these cases. Exactly one thread may push and exactly one thread may pop at
+//! any given time; if several threads may pop, the caller needs to serialize
+//! them.
+//!
+//! Slots are allocated once and never destroyed before the queue itself: a
+//! pushed item is copy-assigned to its slot and a popped item is swapped out of
+//! it, which means that containers (e.g. ByteContainer) get to re-use their
+//! heap storage.
+template <typename T>
+class SPSCQueue {
+ public:
+  //! Constructs a queue which can hold at least \p capacity elements (the
+  //! capacity is rounded up to the next power of 2).
+  explicit SPSCQueue(size_t capacity)
+      : slots(round_up_pow2(capacity)), mask(slots.size() - 1) { }
+
+  //! Copies \p item at the tail of the queue. Returns false if the queue is
+  //! full. Only to be called by the producer.
+  bool try_push(const T &item) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == slots.size()) return false;
+    slots[t & mask] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  //! Moves \p item at the tail of the queue. Returns false if the queue is
+  //! full, in which case \p item is left untouched. Only to be called by the
+  //! producer.
+  bool try_push(T &&item) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == slots.size()) return false;
+    slots[t & mask] = std::move(item);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  //! Pops the element at the head of the queue into `*pItem`. Returns false if
+  //! the queue is empty. Only to be called by the consumer.
+  bool try_pop(T *pItem) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    using std::swap;
+    swap(*pItem, slots[h & mask]);
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  //! Returns true if the queue is empty. Only accurate when called by the
+  //! consumer, and even then the producer may push right after.
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+        tail.load(std::memory_order_acquire);
+  }
+
+  //! Returns the number of elements in the queue; this is only a snapshot.
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) -
+        head.load(std::memory_order_acquire);
+  }
+
+  //! Returns the actual capacity of the queue
+  size_t capacity() const { return slots.size(); }
+
+  //! Deleted copy constructor
+  SPSCQueue(const SPSCQueue &) = delete;
+  //! Deleted copy assignment operator
+  SPSCQueue &operator =(const SPSCQueue &) = delete;
+
+  //! Deleted move constructor (class includes atomics)
+  SPSCQueue(SPSCQueue &&) = delete;
+  //! Deleted move assignment operator (class includes atomics)
+  SPSCQueue &operator =(SPSCQueue &&) = delete;
+
+ private:
+  static size_t round_up_pow2(size_t v) {
+    size_t p = 1;
+    while (p < v) p <<= 1;
+    return p;
+  }
+
+  std::vector<T> slots;
+  const size_t mask;
+  // head and tail are kept on different cache lines to avoid false sharing
+  // between the producer and the consumer; we use padding and not alignas,
+  // because over-aligned new is not available in C++11
+  char _padding_0[64];
+  std::atomic<size_t> head{0};
+  char _padding_1[64];
+  std::atomic<size_t> tail{0};
+};
+
+}  // namespace bm
+
+#endif  // BM_SIM_INCLUDE_BM_SIM_SPSC_QUEUE_H_
@@ -97,7 +97,7 @@ class RegisterArray : public NamedP4Object {
 
   RegisterArray(const std::string &name, p4object_id_t id,
                 size_t size, int bitwidth)
-    : NamedP4Object(name, id) {
+    : NamedP4Object(name, id), bitwidth(bitwidth) {
     registers.reserve(size);
     for (size_t i = 0; i < size; i++)
       registers.emplace_back(bitwidth);
@@ -144,6 +144,9 @@ class RegisterArray : public NamedP4Object {
   //! includes)
   size_t size() const { return registers.size(); }
 
+  //! Return the bitwidth of the registers in this RegisterArray
+  int get_bitwidth() const { return bitwidth; }
+
   void reset_state();
 
   //! Request exclusive access to this register array. This method needs to be
@@ -157,6 +160,7 @@ class RegisterArray : public NamedP4Object {
 
  private:
   std::vector<Register> registers;
+  int bitwidth;
 
   mutable std::mutex m_mutex{};
 };
@@ -178,6 +182,8 @@ class RegisterSync {
     for (auto &lock : locks) lock.unlock();
   }
 
+  bool empty() const { return register_arrays.empty(); }
+
  private:
   using UniqueLock = RegisterArray::UniqueLock;
   mutable std::vector<UniqueLock> locks;
@@ -50,17 +50,23 @@
 //! enable it you need to provide the correct flag to the constructor (see
 //! bm::SwitchWContexts::SwitchWContexts()). Swaps are ordered through the
 //! runtime interfaces. However, it is the target switch responsibility to
-//! decide when to "commit" the swap. This is because swapping configurations
-//! invalidate certain pointers that you may still be using. We plan on trying
-//! to make this more target-friendly in the future but it is not trivial. Here
-//! is an example of how the simple router target implements swapping:
+//! decide when to "commit" the swap, by calling
+//! bm::SwitchWContexts::do_swap(). The swap does not wait for the switch to
+//! drain: packets created before it keep a reference to the configuration
+//! they were created with, which stays alive until the last of them is
+//! destroyed, while new packets get the new configuration. This means that the
+//! target must process each packet with the objects of its own configuration
+//! (see bm::Packet::get_p4objects()), and not with the pointers returned by
+//! get_pipeline(), get_parser(), ..., which always refer to the current
+//! configuration. Here is an example of how the simple router target does it:
 //! @code
-//! // swap is enabled, so update pointers if needed
-//! if (this->do_swap() == 0) {  // a swap took place
-//!   ingress_mau = this->get_pipeline("ingress");
-//!   egress_mau = this->get_pipeline("egress");
-//!   parser = this->get_parser("parser");
-//!   deparser = this->get_deparser("deparser");
+//! P4Objects *config = packet->get_p4objects();
+//! if (config != current_config) {  // first packet of a new configuration
+//!   current_config = config;
+//!   ingress_mau = config->get_pipeline("ingress");
+//!   egress_mau = config->get_pipeline("egress");
+//!   parser = config->get_parser("parser");
+//!   deparser = config->get_deparser("deparser");
 //! }
 //! @endcode
 
@@ -193,12 +199,11 @@ class SwitchWContexts : public DevMgr, public RuntimeInterface {
   int swap_requested();
 
   //! Performs a configuration swap if one was requested by the control
-  //! plane. Returns `0` if a swap had indeed been requested, `1` otherwise. If
-  //! a swap was requested, the method will prevent new Packet instances from
-  //! being created and will block until all existing instances have been
-  //! destroyed. It will then perform the swap. Care should be taken when using
-  //! this function, as it invalidates some pointers that your target may still
-  //! be using. See switch.h documentation for more information.
+  //! plane. Returns `0` if a swap had indeed been requested, `1` otherwise. The
+  //! swap is immediate: Packet instances created after it use the new
+  //! configuration, while the existing ones keep using the old one, which is
+  //! destroyed with the last of them. See switch.h documentation for more
+  //! information on how a target should handle this.
   int do_swap();
 
   //! Construct and return a Packet instance for the given \p cxt_id.
@@ -281,6 +286,13 @@ class SwitchWContexts : public DevMgr, public RuntimeInterface {
     return contexts.at(cxt_id).mt_set_entry_ttl(table_name, handle, ttl_ms);
   }
 
+  MatchErrorCode
+  mt_get_lookup_stats(size_t cxt_id,
+                      const std::string &table_name,
+                      MatchTableAbstract::LookupStats *stats) const override {
+    return contexts.at(cxt_id).mt_get_lookup_stats(table_name, stats);
+  }
+
   MatchErrorCode
   mt_indirect_add_member(size_t cxt_id,
                          const std::string &table_name,
@@ -56,21 +56,68 @@ class MatchActionTable : public ControlFlowNode, public NamedP4Object {
       match_table(std::move(match_table)) { }
 
   const ControlFlowNode *operator()(Packet *pkt) const override {
+    return apply(pkt);
+  }
+
+  // same as operator(), but can be called without virtual dispatch, which is
+  // what Pipeline does; see MatchTableAbstract::apply_action() for applied
+  const ControlFlowNode *apply(
+      Packet *pkt,
+      MatchTableAbstract::AppliedEntry *applied = nullptr) const {
     // TODO(antonin)
     // this is temporary while we experiment with the debugger
     DEBUGGER_NOTIFY_CTR(
         Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
         DBG_CTR_TABLE | get_id());
     BMLOG_TRACE_PKT(*pkt, "Applying table '{}'", get_name());
-    const ControlFlowNode *next = match_table->apply_action(pkt);
+    const ControlFlowNode *next = match_table->apply_action(pkt, applied);
     DEBUGGER_NOTIFY_CTR(
         Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
         DBG_CTR_EXIT(DBG_CTR_TABLE) | get_id());
     return next;
   }
 
+  // applies the table to n packets at once, see
+  // MatchTableAbstract::apply_action_batch()
+  void apply_batch(Packet *const *pkts, size_t n,
+                   const ControlFlowNode **next_nodes) const {
+    for (size_t i = 0; i < n; i++) {
+      DEBUGGER_NOTIFY_CTR(
+          Debugger::PacketId::make(pkts[i]->get_packet_id(),
+                                   pkts[i]->get_copy_id()),
+          DBG_CTR_TABLE | get_id());
+      BMLOG_TRACE_PKT(*pkts[i], "Applying table '{}'", get_name());
+    }
+    match_table->apply_action_batch(pkts, n, next_nodes);
+    for (size_t i = 0; i < n; i++) {
+      DEBUGGER_NOTIFY_CTR(
+          Debugger::PacketId::make(pkts[i]->get_packet_id(),
+                                   pkts[i]->get_copy_id()),
+          DBG_CTR_EXIT(DBG_CTR_TABLE) | get_id());
+    }
+  }
+
+  // replays an entry returned by apply(), without looking up the table;
+  // returns false if the table has been modified since
+  bool replay(Packet *pkt,
+              const MatchTableAbstract::AppliedEntry &applied) const {
+    DEBUGGER_NOTIFY_CTR(
+        Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
+        DBG_CTR_TABLE | get_id());
+    BMLOG_TRACE_PKT(*pkt, "Applying table '{}' (cached)", get_name());
+    const bool replayed = match_table->replay_action(pkt, applied);
+    DEBUGGER_NOTIFY_CTR(
+        Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
+        DBG_CTR_EXIT(DBG_CTR_TABLE) | get_id());
+    return replayed;
+  }
+
   MatchTableAbstract *get_match_table() { return match_table.get(); }
 
+  const MatchTableAbstract *get_match_table() const {
+    return match_table.get();
+  }
+
  public:
   template <typename MT>
   static std::unique_ptr<MatchActionTable> create_match_action_table(
@@ -23,6 +23,8 @@
 
 #include <string>
 #include <initializer_list>
+#include <vector>
+#include <memory>
 
 namespace bm {
 
@@ -58,9 +60,19 @@ class TransportIface {
     return send_msgs_(msgs);
   }
 
+  // unlike send_msgs, which gathers its arguments into a single message, this
+  // sends every buffer as a separate message; transports which can do better
+  // than one send per message (e.g. the file transport) override send_batch_
+  int send_batch(const std::vector<MsgBuf> &msgs) const {
+    return send_batch_(msgs);
+  }
+
   static std::unique_ptr<TransportIface> make_nanomsg(const std::string &addr);
   static std::unique_ptr<TransportIface> make_dummy();
   static std::unique_ptr<TransportIface> make_stdout();
+  // messages are appended to a memory-mapped binary file, each one prefixed
+  // with its length (as a 32-bit integer in host byte order)
+  static std::unique_ptr<TransportIface> make_file(const std::string &path);
 
  private:
   virtual int open_() = 0;
@@ -72,6 +84,8 @@ class TransportIface {
       const std::initializer_list<std::string> &msgs) const = 0;
   virtual int send_msgs_(const std::initializer_list<MsgBuf> &msgs) const = 0;
 
+  virtual int send_batch_(const std::vector<MsgBuf> &msgs) const;
+
   bool opened{false};
 };
 
@@ -25,6 +25,8 @@
 #include <vector>
 #include <set>
 
+#include "utils.h"
+
 namespace bm {
 
 using std::unique_ptr;
@@ -81,7 +83,11 @@ P4Objects::build_expression(const Json::Value &json_expression,
     header_id_t header_id = get_header_id(header_name);
     const string field_name = json_value[1].asString();
     int field_offset = get_field_offset(header_id, field_name);
-    expr->push_back_load_field(header_id, field_offset);
+    // the bitwidth lets the expression use 64-bit arithmetic when possible;
+    // it is 0 for a VL field, which is what we want
+    const int nbits = header_to_type_map[header_name]->get_bit_width(
+        field_offset);
+    expr->push_back_load_field(header_id, field_offset, nbits);
 
     phv_factory.enable_field_arith(header_id, field_offset);
   } else if (type == "bool") {
@@ -120,7 +126,18 @@ P4Objects::init_objects(std::istream *is,
                         const std::set<header_field_pair> &arith_fields) {
   Json::Value cfg_root;
   (*is) >> cfg_root;
+  return init_objects(cfg_root, lookup_factory, device_id, cxt_id,
+                      std::move(notifications_transport), required_fields,
+                      arith_fields);
+}
 
+int
+P4Objects::init_objects(const Json::Value &cfg_root,
+                        LookupStructureFactory *lookup_factory,
+                        int device_id, size_t cxt_id,
+                        std::shared_ptr<TransportIface> notifications_transport,
+                        const std::set<header_field_pair> &required_fields,
+                        const std::set<header_field_pair> &arith_fields) {
   if (!notifications_transport) {
     notifications_transport = std::shared_ptr<TransportIface>(
         TransportIface::make_dummy());
@@ -472,35 +489,37 @@ P4Objects::init_objects(std::istream *is,
     add_named_calculation(name, unique_ptr<NamedCalculation>(calculation));
   }
 
-  // counter arrays
+  // counter, meter and register arrays do not depend on any other object and
+  // can be large, so they are allocated in parallel before being added in order
 
   const Json::Value &cfg_counter_arrays = cfg_root["counter_arrays"];
-  for (const auto &cfg_counter_array : cfg_counter_arrays) {
+  const Json::Value &cfg_meter_arrays = cfg_root["meter_arrays"];
+  const Json::Value &cfg_register_arrays = cfg_root["register_arrays"];
+  const size_t nb_counter_arrays = cfg_counter_arrays.size();
+  const size_t nb_meter_arrays = cfg_meter_arrays.size();
+  const size_t nb_register_arrays = cfg_register_arrays.size();
+
+  std::vector<unique_ptr<CounterArray> > counter_arrays(nb_counter_arrays);
+  std::vector<unique_ptr<MeterArray> > meter_arrays(nb_meter_arrays);
+  std::vector<unique_ptr<RegisterArray> > register_arrays(nb_register_arrays);
+
+  auto build_counter_array = [&cfg_counter_arrays, &counter_arrays](
+      Json::ArrayIndex idx) {
+    const Json::Value &cfg_counter_array = cfg_counter_arrays[idx];
     const string name = cfg_counter_array["name"].asString();
     const p4object_id_t id = cfg_counter_array["id"].asInt();
     const size_t size = cfg_counter_array["size"].asUInt();
     const Json::Value false_value(false);
     const bool is_direct =
       cfg_counter_array.get("is_direct", false_value).asBool();
-    if (is_direct) continue;
-
-    CounterArray *counter_array = new CounterArray(name, id, size);
-    add_counter_array(name, unique_ptr<CounterArray>(counter_array));
-  }
-
-  // meter arrays
+    if (is_direct) return;
 
-  // store direct meter info until the table gets created
-  struct DirectMeterArray {
-    MeterArray *meter;
-    header_id_t header;
-    int offset;
+    counter_arrays[idx].reset(new CounterArray(name, id, size));
   };
 
-  std::unordered_map<std::string, DirectMeterArray> direct_meters;
-
-  const Json::Value &cfg_meter_arrays = cfg_root["meter_arrays"];
-  for (const auto &cfg_meter_array : cfg_meter_arrays) {
+  auto build_meter_array = [&cfg_meter_arrays, &meter_arrays](
+      Json::ArrayIndex idx) {
+    const Json::Value &cfg_meter_array = cfg_meter_arrays[idx];
     const string name = cfg_meter_array["name"].asString();
     const p4object_id_t id = cfg_meter_array["id"].asInt();
     const string type = cfg_meter_array["type"].asString();
@@ -515,9 +534,59 @@ P4Objects::init_objects(std::istream *is,
     const size_t rate_count = cfg_meter_array["rate_count"].asUInt();
     const size_t size = cfg_meter_array["size"].asUInt();
 
-    MeterArray *meter_array = new MeterArray(name, id,
-                                             meter_type, rate_count, size);
-    add_meter_array(name, unique_ptr<MeterArray>(meter_array));
+    meter_arrays[idx].reset(
+        new MeterArray(name, id, meter_type, rate_count, size));
+  };
+
+  auto build_register_array = [&cfg_register_arrays, &register_arrays](
+      Json::ArrayIndex idx) {
+    const Json::Value &cfg_register_array = cfg_register_arrays[idx];
+    const string name = cfg_register_array["name"].asString();
+    const p4object_id_t id = cfg_register_array["id"].asInt();
+    const size_t size = cfg_register_array["size"].asUInt();
+    const int bitwidth = cfg_register_array["bitwidth"].asInt();
+
+    register_arrays[idx].reset(new RegisterArray(name, id, size, bitwidth));
+  };
+
+  utils::parallel_for(
+      nb_counter_arrays + nb_meter_arrays + nb_register_arrays,
+      [&](size_t i) {
+        if (i < nb_counter_arrays) {
+          build_counter_array(i);
+          return;
+        }
+        i -= nb_counter_arrays;
+        if (i < nb_meter_arrays)
+          build_meter_array(i);
+        else
+          build_register_array(i - nb_meter_arrays);
+      });
+
+  // counter arrays
+
+  for (auto &counter_array : counter_arrays) {
+    if (!counter_array) continue;  // direct counter
+    const string name = counter_array->get_name();
+    add_counter_array(name, std::move(counter_array));
+  }
+
+  // meter arrays
+
+  // store direct meter info until the table gets created
+  struct DirectMeterArray {
+    MeterArray *meter;
+    header_id_t header;
+    int offset;
+  };
+
+  std::unordered_map<std::string, DirectMeterArray> direct_meters;
+
+  for (size_t i = 0; i < nb_meter_arrays; i++) {
+    const Json::Value &cfg_meter_array =
+        cfg_meter_arrays[static_cast<Json::ArrayIndex>(i)];
+    const string name = meter_arrays[i]->get_name();
+    add_meter_array(name, std::move(meter_arrays[i]));
 
     const bool is_direct =
         cfg_meter_array.get("is_direct", Json::Value(false)).asBool();
@@ -536,15 +605,9 @@ P4Objects::init_objects(std::istream *is,
 
   // register arrays
 
-  const Json::Value &cfg_register_arrays = cfg_root["register_arrays"];
-  for (const auto &cfg_register_array : cfg_register_arrays) {
-    const string name = cfg_register_array["name"].asString();
-    const p4object_id_t id = cfg_register_array["id"].asInt();
-    const size_t size = cfg_register_array["size"].asUInt();
-    const int bitwidth = cfg_register_array["bitwidth"].asInt();
-
-    RegisterArray *register_array = new RegisterArray(name, id, size, bitwidth);
-    add_register_array(name, unique_ptr<RegisterArray>(register_array));
+  for (auto &register_array : register_arrays) {
+    const string name = register_array->get_name();
+    add_register_array(name, std::move(register_array));
   }
 
   // actions
@@ -678,6 +741,7 @@ P4Objects::init_objects(std::istream *is,
       { {"exact", MatchKeyParam::Type::EXACT},
         {"lpm", MatchKeyParam::Type::LPM},
         {"ternary", MatchKeyParam::Type::TERNARY},
+        {"range", MatchKeyParam::Type::RANGE},
         {"valid", MatchKeyParam::Type::VALID} };
 
   const Json::Value &cfg_pipelines = cfg_root["pipelines"];
@@ -802,6 +866,10 @@ P4Objects::init_objects(std::istream *is,
         MatchTableIndirectWS *mt_indirect_ws =
           static_cast<MatchTableIndirectWS *>(table->get_match_table());
         mt_indirect_ws->set_hash(std::move(calc));
+        if (cfg_table_selector.isMember("nb_buckets")) {
+          mt_indirect_ws->set_nb_buckets(
+              cfg_table_selector["nb_buckets"].asUInt());
+        }
       } else {
         assert(0 && "invalid table type");
       }
@@ -871,6 +939,7 @@ P4Objects::init_objects(std::istream *is,
         const Json::Value &cfg_next_node = cfg_next_nodes[action_name];
         const ControlFlowNode *next_node = get_next_node(cfg_next_node);
         table->set_next_node(action_id, next_node);
+        if (action->is_stateful()) table->set_stateful_actions();
         add_action_to_table(table_name, action_name, action);
       }
 
@@ -1046,6 +1115,18 @@ P4Objects::init_objects(std::istream *is,
   // NOLINTNEXTLINE(readability/fn_size)
 }
 
+void
+P4Objects::set_decision_cache_size(size_t max_entries) {
+  for (const auto &e : pipelines_map)
+    e.second->set_decision_cache_size(max_entries);
+}
+
+void
+P4Objects::set_adaptive_lookup(bool adaptive) {
+  for (const auto &e : match_action_tables_map)
+    e.second->get_match_table()->set_adaptive_lookup(adaptive);
+}
+
 void
 P4Objects::reset_state() {
   // TODO(antonin): is this robust?
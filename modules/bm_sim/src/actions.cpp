@@ -35,7 +35,7 @@ ActionFn::parameter_push_back_field(header_id_t header, int field_offset) {
   ActionParam param;
   param.tag = ActionParam::FIELD;
   param.field = {header, field_offset};
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -43,7 +43,7 @@ ActionFn::parameter_push_back_header(header_id_t header) {
   ActionParam param;
   param.tag = ActionParam::HEADER;
   param.header = header;
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -51,7 +51,7 @@ ActionFn::parameter_push_back_header_stack(header_stack_id_t header_stack) {
   ActionParam param;
   param.tag = ActionParam::HEADER_STACK;
   param.header_stack = header_stack;
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -60,7 +60,7 @@ ActionFn::parameter_push_back_const(const Data &data) {
   ActionParam param;
   param.tag = ActionParam::CONST;
   param.const_offset = const_values.size() - 1;;
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -68,7 +68,7 @@ ActionFn::parameter_push_back_action_data(int action_data_offset) {
   ActionParam param;
   param.tag = ActionParam::ACTION_DATA;
   param.action_data_offset = action_data_offset;
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -78,7 +78,7 @@ ActionFn::parameter_push_back_register_ref(RegisterArray *register_array,
   param.tag = ActionParam::REGISTER_REF;
   param.register_ref.array = register_array;
   param.register_ref.idx = idx;
-  params.push_back(param);
+  push_back_param(param);
 
   register_sync.add_register_array(register_array);
 }
@@ -94,7 +94,7 @@ ActionFn::parameter_push_back_register_gen(
 
   expressions.push_back(std::move(idx));
   param.register_gen.idx = expressions.back().get();
-  params.push_back(param);
+  push_back_param(param);
 
   register_sync.add_register_array(register_array);
 }
@@ -104,7 +104,7 @@ ActionFn::parameter_push_back_calculation(const NamedCalculation *calculation) {
   ActionParam param;
   param.tag = ActionParam::CALCULATION;
   param.calculation = calculation;
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -112,7 +112,7 @@ ActionFn::parameter_push_back_meter_array(MeterArray *meter_array) {
   ActionParam param;
   param.tag = ActionParam::METER_ARRAY;
   param.meter_array = meter_array;
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -120,7 +120,7 @@ ActionFn::parameter_push_back_counter_array(CounterArray *counter_array) {
   ActionParam param;
   param.tag = ActionParam::COUNTER_ARRAY;
   param.counter_array = counter_array;
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -128,7 +128,7 @@ ActionFn::parameter_push_back_register_array(RegisterArray *register_array) {
   ActionParam param;
   param.tag = ActionParam::REGISTER_ARRAY;
   param.register_array = register_array;
-  params.push_back(param);
+  push_back_param(param);
 
   register_sync.add_register_array(register_array);
 }
@@ -152,7 +152,7 @@ ActionFn::parameter_push_back_expression(
   param.tag = ActionParam::EXPRESSION;
   param.expression = {static_cast<unsigned int>(nb_expression_params),
                       expressions.back().get()};
-  params.push_back(param);
+  push_back_param(param);
 }
 
 void
@@ -160,12 +160,88 @@ ActionFn::parameter_push_back_extern_instance(ExternType *extern_instance) {
   ActionParam param;
   param.tag = ActionParam::EXTERN_INSTANCE;
   param.extern_instance = extern_instance;
-  params.push_back(param);
+  push_back_param(param);
+}
+
+bool
+ActionFn::is_stateful() const {
+  if (!register_sync.empty()) return true;
+  for (const ActionParam &p : params) {
+    if (p.tag == ActionParam::METER_ARRAY ||
+        p.tag == ActionParam::EXTERN_INSTANCE)
+      return true;
+  }
+  return false;
 }
 
 void
 ActionFn::push_back_primitive(ActionPrimitive_ *primitive) {
-  primitives.push_back(primitive);
+  ActionPrimitiveCall call;
+  call.opcode = ActionPrimitiveCall::GENERIC;
+  call.primitive = primitive;
+  // the parameters are pushed in order, after (or before) the primitive
+  call.param_offset = nb_call_params;
+  nb_call_params += primitive->get_num_params();
+  calls.push_back(call);
+  specialize_calls();
+}
+
+void
+ActionFn::push_back_param(const ActionParam &param) {
+  params.push_back(param);
+  specialize_calls();
+}
+
+void
+ActionFn::specialize_calls() {
+  using Semantics = ActionPrimitive_::Semantics;
+  for (; nb_specialized_calls < calls.size(); nb_specialized_calls++) {
+    ActionPrimitiveCall &call = calls[nb_specialized_calls];
+    const size_t num_params = call.primitive->get_num_params();
+    if (call.param_offset + num_params > params.size()) return;
+    const ActionParam *args = &params[call.param_offset];
+    switch (call.primitive->get_semantics()) {
+      case Semantics::NONE:
+        break;
+      case Semantics::MODIFY_FIELD:
+      case Semantics::ADD_TO_FIELD:
+        {
+          assert(num_params == 2);
+          if (args[0].tag != ActionParam::FIELD) break;
+          const bool is_set =
+              (call.primitive->get_semantics() == Semantics::MODIFY_FIELD);
+          switch (args[1].tag) {
+            case ActionParam::CONST:
+              call.opcode = is_set ? ActionPrimitiveCall::SET_FIELD_FROM_CONST
+                  : ActionPrimitiveCall::ADD_CONST_TO_FIELD;
+              break;
+            case ActionParam::ACTION_DATA:
+              call.opcode = is_set
+                  ? ActionPrimitiveCall::SET_FIELD_FROM_ACTION_DATA
+                  : ActionPrimitiveCall::ADD_ACTION_DATA_TO_FIELD;
+              break;
+            case ActionParam::FIELD:
+              call.opcode = is_set ? ActionPrimitiveCall::SET_FIELD_FROM_FIELD
+                  : ActionPrimitiveCall::ADD_FIELD_TO_FIELD;
+              break;
+            default:
+              continue;
+          }
+          call.dst = args[0];
+          call.src = args[1];
+        }
+        break;
+      case Semantics::COUNT:
+        assert(num_params == 2);
+        if (args[0].tag != ActionParam::COUNTER_ARRAY ||
+            args[1].tag != ActionParam::CONST)
+          break;
+        call.opcode = ActionPrimitiveCall::COUNT;
+        call.counter_array = args[0].counter_array;
+        call.counter_idx = const_values[args[1].const_offset].get_uint();
+        break;
+    }
+  }
 }
 
 
@@ -219,12 +295,49 @@ ActionFnEntry::operator()(Packet *pkt) const {
 
   action_fn->register_sync.lock_registers();
 
-  auto &primitives = action_fn->primitives;
-  size_t param_offset = 0;
-  // primitives is a vector of pointers
-  for (auto primitive : primitives) {
-    primitive->execute(&state, &(action_fn->params[param_offset]));
-    param_offset += primitive->get_num_params();
+  PHV *phv = pkt->get_phv();
+  auto field = [phv](const ActionParam &param) -> Field & {
+    return phv->get_field(param.field.header, param.field.field_offset);
+  };
+  const auto &const_values = action_fn->const_values;
+  for (const auto &call : action_fn->calls) {
+    switch (call.opcode) {
+      case ActionPrimitiveCall::GENERIC:
+        call.primitive->execute(&state,
+                                &(action_fn->params[call.param_offset]));
+        break;
+      case ActionPrimitiveCall::SET_FIELD_FROM_CONST:
+        field(call.dst).set(const_values[call.src.const_offset]);
+        break;
+      case ActionPrimitiveCall::SET_FIELD_FROM_ACTION_DATA:
+        field(call.dst).set(action_data.get(call.src.action_data_offset));
+        break;
+      case ActionPrimitiveCall::SET_FIELD_FROM_FIELD:
+        field(call.dst).set(field(call.src));
+        break;
+      case ActionPrimitiveCall::ADD_CONST_TO_FIELD:
+        {
+          Field &f = field(call.dst);
+          f.add(f, const_values[call.src.const_offset]);
+        }
+        break;
+      case ActionPrimitiveCall::ADD_ACTION_DATA_TO_FIELD:
+        {
+          Field &f = field(call.dst);
+          f.add(f, action_data.get(call.src.action_data_offset));
+        }
+        break;
+      case ActionPrimitiveCall::ADD_FIELD_TO_FIELD:
+        {
+          Field &f = field(call.dst);
+          f.add(f, field(call.src));
+        }
+        break;
+      case ActionPrimitiveCall::COUNT:
+        call.counter_array->get_counter(call.counter_idx).increment_counter(
+            *pkt);
+        break;
+    }
   }
 
   action_fn->register_sync.unlock_registers();
@@ -75,7 +75,7 @@ AgeingMonitor::sweep_loop() {
     do_sweep();
     milliseconds interval(sweep_interval_ms);
     tp += interval;
-    stop_condvar.wait_until(lock, tp);
+    VirtualTime::wait_until(&stop_condvar, &lock, tp);
   }
 }
 
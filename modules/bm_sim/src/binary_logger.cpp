@@ -0,0 +1,320 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bm_sim/binary_logger.h"
+
+namespace bm {
+
+namespace {
+
+// Binary trace file format (all integers in host byte order):
+//   file header: magic (u32), version (u32)
+//   then a sequence of blocks, each starting with a type (u8):
+//   - FORMAT: id (u32), level (u8), line (u32), file length (u32), file,
+//     format length (u32), format
+//   - RECORDS: thread index (u32), length (u32), followed by that many bytes
+//     of records
+//   each record is: length (u32, including itself), format id (u32),
+//   timestamp in ns since epoch (u64), packet id (u64), copy id (u64), context
+//   (u32), number of arguments (u8), then for each argument a type (u8, see
+//   BinaryLogger::ArgType) and a value: 8 bytes for INT and UINT, 1 byte for
+//   BOOL, length (u32) + bytes for STRING and BYTES.
+// A format block is always written before the first record block which may
+// reference it.
+constexpr uint32_t file_magic = 0x424d424c;  // "BMBL"
+constexpr uint32_t file_version = 1;
+
+enum BlockType : uint8_t {
+  FORMAT = 0, RECORDS = 1
+};
+
+// A single-producer single-consumer ring of bytes. The producer writes whole
+// records, which means the consumer only ever sees complete records.
+class ByteRing {
+ public:
+  explicit ByteRing(size_t capacity)
+      : buffer(capacity), mask(capacity - 1) { }
+
+  bool write(const char *data, size_t len) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (buffer.size() - (t - head.load(std::memory_order_acquire)) < len)
+      return false;
+    const size_t offset = t & mask;
+    const size_t first = std::min(len, buffer.size() - offset);
+    std::copy(data, data + first, &buffer[offset]);
+    std::copy(data + first, data + len, &buffer[0]);
+    tail.store(t + len, std::memory_order_release);
+    return true;
+  }
+
+  // returns the number of bytes available for reading; the data may wrap
+  // around, which is why there are 2 segments
+  size_t peek(const char **seg1, size_t *len1,
+              const char **seg2, size_t *len2) const {
+    const size_t h = head.load(std::memory_order_relaxed);
+    const size_t available = tail.load(std::memory_order_acquire) - h;
+    const size_t offset = h & mask;
+    *seg1 = &buffer[offset];
+    *len1 = std::min(available, buffer.size() - offset);
+    *seg2 = &buffer[0];
+    *len2 = available - *len1;
+    return available;
+  }
+
+  void consume(size_t len) {
+    head.store(head.load(std::memory_order_relaxed) + len,
+               std::memory_order_release);
+  }
+
+  // only incremented by the producer
+  std::atomic<uint64_t> dropped{0};
+
+ private:
+  std::vector<char> buffer;
+  const size_t mask;
+  // see SPSCQueue
+  char _padding_0[64];
+  std::atomic<size_t> head{0};
+  char _padding_1[64];
+  std::atomic<size_t> tail{0};
+};
+
+struct Format {
+  Logger::LogLevel level;
+  std::string file;
+  int line;
+  std::string fmt;
+};
+
+class BinaryLoggerState {
+ public:
+  // must be a power of 2
+  static constexpr size_t ring_capacity = 1 << 20;
+
+  static BinaryLoggerState *get() {
+    static BinaryLoggerState state;
+    return &state;
+  }
+
+  ~BinaryLoggerState() {
+    stop();
+  }
+
+  bool start(const std::string &path) {
+    stop();
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    f = std::fopen(path.c_str(), "wb");
+    if (!f) return false;
+    const uint32_t file_hdr[2] = {file_magic, file_version};
+    std::fwrite(file_hdr, sizeof(file_hdr), 1, f);
+    // formats registered during a previous session are still in use
+    formats_written = 0;
+    stop_writer = false;
+    writer = std::thread(&BinaryLoggerState::write_loop, this);
+    return true;
+  }
+
+  void stop() {
+    {
+      std::unique_lock<std::mutex> lock(writer_mutex);
+      if (!f) return;
+      stop_writer = true;
+    }
+    writer_cv.notify_one();
+    writer.join();
+    std::fclose(f);
+    f = nullptr;
+  }
+
+  int register_format(Logger::LogLevel level, const char *file, int line,
+                      const char *fmt) {
+    std::unique_lock<std::mutex> lock(formats_mutex);
+    formats.push_back({level, file, line, fmt});
+    return static_cast<int>(formats.size() - 1);
+  }
+
+  ByteRing *get_ring() {
+    // the state is a singleton and rings are never destroyed, so we can cache
+    // the pointer
+    static thread_local ByteRing *my_ring = nullptr;
+    if (my_ring) return my_ring;
+    std::unique_lock<std::mutex> lock(rings_mutex);
+    rings.emplace_back(new ByteRing(ring_capacity));
+    my_ring = rings.back().get();
+    return my_ring;
+  }
+
+  uint64_t get_dropped() const {
+    std::unique_lock<std::mutex> lock(rings_mutex);
+    uint64_t dropped = 0;
+    for (const auto &ring : rings)
+      dropped += ring->dropped.load(std::memory_order_relaxed);
+    return dropped;
+  }
+
+ private:
+  BinaryLoggerState() { }
+
+  template <typename T>
+  void write_raw(T v) {
+    std::fwrite(&v, sizeof(v), 1, f);
+  }
+
+  void write_string(const std::string &s) {
+    write_raw<uint32_t>(static_cast<uint32_t>(s.size()));
+    std::fwrite(s.data(), 1, s.size(), f);
+  }
+
+  void write_formats() {
+    std::unique_lock<std::mutex> lock(formats_mutex);
+    for (; formats_written < formats.size(); formats_written++) {
+      const auto &format = formats[formats_written];
+      write_raw<uint8_t>(BlockType::FORMAT);
+      write_raw<uint32_t>(static_cast<uint32_t>(formats_written));
+      write_raw<uint8_t>(static_cast<uint8_t>(format.level));
+      write_raw<uint32_t>(static_cast<uint32_t>(format.line));
+      write_string(format.file);
+      write_string(format.fmt);
+    }
+  }
+
+  size_t write_records() {
+    std::vector<ByteRing *> rings_;
+    {
+      std::unique_lock<std::mutex> lock(rings_mutex);
+      for (const auto &ring : rings) rings_.push_back(ring.get());
+    }
+    size_t written = 0;
+    for (size_t i = 0; i < rings_.size(); i++) {
+      const char *seg1, *seg2;
+      size_t len1, len2;
+      const size_t available = rings_[i]->peek(&seg1, &len1, &seg2, &len2);
+      if (available == 0) continue;
+      write_raw<uint8_t>(BlockType::RECORDS);
+      write_raw<uint32_t>(static_cast<uint32_t>(i));
+      write_raw<uint32_t>(static_cast<uint32_t>(available));
+      std::fwrite(seg1, 1, len1, f);
+      std::fwrite(seg2, 1, len2, f);
+      rings_[i]->consume(available);
+      written += available;
+    }
+    return written;
+  }
+
+  void write_loop() {
+    while (true) {
+      bool stopping;
+      {
+        std::unique_lock<std::mutex> lock(writer_mutex);
+        stopping = stop_writer;
+      }
+      // formats first, a record is always pushed after its format has been
+      // registered
+      write_formats();
+      const size_t written = write_records();
+      if (stopping) break;
+      if (written == 0) {
+        std::fflush(f);
+        // log sites never notify us, which is why we poll
+        std::unique_lock<std::mutex> lock(writer_mutex);
+        writer_cv.wait_for(lock, std::chrono::milliseconds(10),
+                           [this]() { return stop_writer; });
+      }
+    }
+    std::fflush(f);
+  }
+
+  std::vector<Format> formats{};
+  size_t formats_written{0};
+  std::mutex formats_mutex{};
+
+  std::vector<std::unique_ptr<ByteRing> > rings{};
+  mutable std::mutex rings_mutex{};
+
+  std::FILE *f{nullptr};
+  std::thread writer{};
+  std::mutex writer_mutex{};
+  std::condition_variable writer_cv{};
+  bool stop_writer{false};
+};
+
+constexpr size_t BinaryLoggerState::ring_capacity;
+
+}  // namespace
+
+std::atomic<int> BinaryLogger::min_level{
+  static_cast<int>(Logger::LogLevel::OFF)};
+
+bool
+BinaryLogger::enable(const std::string &path, Logger::LogLevel level) {
+  disable();
+  if (!BinaryLoggerState::get()->start(path)) return false;
+  min_level = static_cast<int>(level);
+  return true;
+}
+
+void
+BinaryLogger::disable() {
+  min_level = static_cast<int>(Logger::LogLevel::OFF);
+  BinaryLoggerState::get()->stop();
+}
+
+int
+BinaryLogger::register_format(Logger::LogLevel level, const char *file,
+                              int line, const char *fmt) {
+  return BinaryLoggerState::get()->register_format(level, file, line, fmt);
+}
+
+uint64_t
+BinaryLogger::get_dropped_records() {
+  return BinaryLoggerState::get()->get_dropped();
+}
+
+uint64_t
+BinaryLogger::get_time_ns() {
+  using std::chrono::duration_cast;
+  using std::chrono::nanoseconds;
+  using std::chrono::system_clock;
+  return duration_cast<nanoseconds>(
+      system_clock::now().time_since_epoch()).count();
+}
+
+void
+BinaryLogger::push(std::string *buffer) {
+  const uint32_t len = static_cast<uint32_t>(buffer->size());
+  std::memcpy(&(*buffer)[0], &len, sizeof(len));
+  ByteRing *ring = BinaryLoggerState::get()->get_ring();
+  if (!ring->write(buffer->data(), buffer->size())) {
+    ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+  }
+}
+
+}  // namespace bm
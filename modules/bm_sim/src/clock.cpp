@@ -0,0 +1,270 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include "bm_sim/clock.h"
+
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace bm {
+
+std::atomic<bool> VirtualTime::enabled_{false};
+
+namespace {
+
+typedef VirtualTime::Lock Lock;
+
+// These are constant-initialized, so Clock::now() can be called during static
+// initialization (e.g. by meters.cpp).
+// In wall clock mode, added to the steady clock so that time never goes back
+// after VirtualTime::disable()
+std::atomic<int64_t> wall_offset{0};
+std::atomic<int64_t> virtual_now{0};
+
+int64_t
+steady_now() {
+  using std::chrono::duration_cast;
+  return duration_cast<Clock::duration>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Timer {
+  Clock::time_point deadline;
+  // timers with the same deadline fire in the order in which they were set
+  uint64_t seq;
+  std::mutex *mutex;
+  std::condition_variable *cv;
+  size_t parked_work;
+  bool fired;
+};
+
+struct TimerComp {
+  bool operator()(const std::shared_ptr<Timer> &lhs,
+                  const std::shared_ptr<Timer> &rhs) const {
+    return (lhs->deadline == rhs->deadline) ?
+        lhs->seq < rhs->seq : lhs->deadline < rhs->deadline;
+  }
+};
+
+struct Scheduler {
+  static Scheduler *get() {
+    static Scheduler scheduler;
+    return &scheduler;
+  }
+
+  std::mutex mutex{};
+  std::condition_variable idle_cv{};
+  // number of work units preventing the clock from moving forward: live
+  // packets which are not parked behind a timer, plus one for each thread
+  // woken up by a timer which has not waited again yet
+  std::atomic<int64_t> busy{0};
+  std::set<std::shared_ptr<Timer>, TimerComp> timers{};
+  uint64_t next_seq{0};
+};
+
+// The work unit held by a thread after one of its timers fired; released when
+// the thread waits again, or when it exits.
+struct ThreadToken {
+  ~ThreadToken() {
+    if (held > 0 && VirtualTime::is_enabled()) {
+      Scheduler *s = Scheduler::get();
+      Lock lock(s->mutex);
+      release(s);
+    }
+  }
+
+  // the scheduler's mutex must be held
+  void release(Scheduler *s) {
+    if (held == 0) return;
+    s->busy -= held;
+    held = 0;
+    if (s->busy <= 0) s->idle_cv.notify_all();
+  }
+
+  int64_t held{0};
+};
+
+thread_local ThreadToken token;
+
+void
+wait_idle(Scheduler *s, Lock *lock) {
+  s->idle_cv.wait(*lock, [s]() { return s->busy <= 0; });
+}
+
+// Sets the clock to the deadline of the first timer and fires all the timers
+// expiring at that time. The lock is released while the waiting threads are
+// notified (they may be holding their own mutex while registering a timer).
+void
+fire_next(Scheduler *s, Lock *lock) {
+  const Clock::time_point deadline = (*s->timers.begin())->deadline;
+  if (deadline > Clock::now())
+    virtual_now = deadline.time_since_epoch().count();
+  std::vector<std::shared_ptr<Timer> > fired;
+  while (!s->timers.empty() && (*s->timers.begin())->deadline <= deadline) {
+    auto timer = *s->timers.begin();
+    s->timers.erase(s->timers.begin());
+    timer->fired = true;
+    // the parked work is back, and the thread is busy until it waits again
+    s->busy += timer->parked_work + 1;
+    fired.push_back(std::move(timer));
+  }
+  lock->unlock();
+  // taking the thread's mutex guarantees that it is waiting on the condition
+  // variable, so the notification cannot be lost
+  for (const auto &timer : fired) {
+    std::unique_lock<std::mutex> timer_lock(*timer->mutex);
+    timer->cv->notify_all();
+  }
+  lock->lock();
+}
+
+void
+advance_to_(Scheduler *s, Lock *lock, const Clock::time_point &tp) {
+  while (true) {
+    wait_idle(s, lock);
+    if (s->timers.empty() || (*s->timers.begin())->deadline > tp) break;
+    fire_next(s, lock);
+  }
+  if (tp > Clock::now()) virtual_now = tp.time_since_epoch().count();
+}
+
+}  // namespace
+
+Clock::time_point
+Clock::now() noexcept {
+  if (VirtualTime::is_enabled())
+    return time_point(duration(virtual_now.load(std::memory_order_acquire)));
+  return time_point(duration(
+      steady_now() + wall_offset.load(std::memory_order_relaxed)));
+}
+
+void
+VirtualTime::enable() {
+  Scheduler *s = Scheduler::get();
+  Lock lock(s->mutex);
+  if (is_enabled()) return;
+  virtual_now = Clock::now().time_since_epoch().count();
+  s->busy = 0;
+  enabled_ = true;
+}
+
+void
+VirtualTime::disable() {
+  Scheduler *s = Scheduler::get();
+  Lock lock(s->mutex);
+  if (!is_enabled()) return;
+  wall_offset = std::max(wall_offset.load(), virtual_now - steady_now());
+  enabled_ = false;
+  // the threads still waiting on a virtual timer wait again on the wall clock
+  std::vector<std::shared_ptr<Timer> > timers(s->timers.begin(),
+                                              s->timers.end());
+  s->timers.clear();
+  lock.unlock();
+  for (const auto &timer : timers) {
+    std::unique_lock<std::mutex> timer_lock(*timer->mutex);
+    timer->cv->notify_all();
+  }
+}
+
+void
+VirtualTime::advance_to(const Clock::time_point &tp) {
+  Scheduler *s = Scheduler::get();
+  Lock lock(s->mutex);
+  token.release(s);
+  advance_to_(s, &lock, tp);
+}
+
+void
+VirtualTime::run_until_idle() {
+  Scheduler *s = Scheduler::get();
+  Lock lock(s->mutex);
+  token.release(s);
+  while (true) {
+    wait_idle(s, &lock);
+    auto it = std::find_if(
+        s->timers.begin(), s->timers.end(),
+        [](const std::shared_ptr<Timer> &t) { return t->parked_work > 0; });
+    if (it == s->timers.end()) break;
+    advance_to_(s, &lock, (*it)->deadline);
+  }
+}
+
+std::cv_status
+VirtualTime::wait_until(std::condition_variable *cv, Lock *lock,
+                        const Clock::time_point &tp, size_t parked_work) {
+  if (!is_enabled()) {
+    using std::chrono::duration_cast;
+    typedef std::chrono::steady_clock steady_clock;
+    const steady_clock::time_point steady_tp(
+        duration_cast<steady_clock::duration>(
+            tp.time_since_epoch() - Clock::duration(wall_offset.load())));
+    return cv->wait_until(*lock, steady_tp);
+  }
+
+  Scheduler *s = Scheduler::get();
+  auto timer = std::make_shared<Timer>();
+  {
+    Lock sched_lock(s->mutex);
+    if (tp <= Clock::now()) return std::cv_status::timeout;
+    *timer = {tp, s->next_seq++, lock->mutex(), cv, parked_work, false};
+    s->timers.insert(timer);
+    s->busy -= parked_work;
+    token.release(s);
+    if (s->busy <= 0) s->idle_cv.notify_all();
+  }
+  cv->wait(*lock);
+  {
+    Lock sched_lock(s->mutex);
+    if (timer->fired)
+      token.held++;
+    else if (s->timers.erase(timer) > 0)
+      s->busy += parked_work;
+  }
+  return (Clock::now() >= tp) ? std::cv_status::timeout :
+      std::cv_status::no_timeout;
+}
+
+void
+VirtualTime::wait(std::condition_variable *cv, Lock *lock) {
+  if (is_enabled() && token.held > 0) {
+    Scheduler *s = Scheduler::get();
+    Lock sched_lock(s->mutex);
+    token.release(s);
+  }
+  cv->wait(*lock);
+}
+
+void
+VirtualTime::add_work_() {
+  Scheduler::get()->busy++;
+}
+
+void
+VirtualTime::remove_work_() {
+  Scheduler *s = Scheduler::get();
+  if (--s->busy <= 0) {
+    Lock lock(s->mutex);
+    s->idle_cv.notify_all();
+  }
+}
+
+}  // namespace bm
@@ -25,8 +25,8 @@
 
 namespace bm {
 
-const ControlFlowNode *
-Conditional::operator()(Packet *pkt) const {
+bool
+Conditional::apply(Packet *pkt) const {
   // TODO(antonin)
   // this is temporary while we experiment with the debugger
   DEBUGGER_NOTIFY_CTR(
@@ -41,7 +41,7 @@ Conditional::operator()(Packet *pkt) const {
   DEBUGGER_NOTIFY_CTR(
       Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
       DBG_CTR_EXIT(DBG_CTR_CONDITION) | get_id());
-  return result ? true_next : false_next;
+  return result;
 }
 
 }  // namespace bm
@@ -105,6 +105,17 @@ Context::mt_set_entry_ttl(const std::string &table_name,
   return abstract_table->set_entry_ttl(handle, ttl_ms);
 }
 
+MatchErrorCode
+Context::mt_get_lookup_stats(const std::string &table_name,
+                             MatchTableAbstract::LookupStats *stats) const {
+  boost::shared_lock<boost::shared_mutex> lock(request_mutex);
+  MatchTableAbstract *abstract_table =
+    p4objects_rt->get_abstract_match_table(table_name);
+  if (!abstract_table) return MatchErrorCode::INVALID_TABLE_NAME;
+  *stats = abstract_table->get_lookup_stats();
+  return MatchErrorCode::SUCCESS;
+}
+
 MatchErrorCode
 Context::get_mt_indirect(
     const std::string &table_name, MatchTableIndirect **table
@@ -501,24 +512,38 @@ Context::set_force_arith(bool v) {
   force_arith = v;
 }
 
+void
+Context::set_decision_cache_size(size_t max_entries) {
+  decision_cache_size = max_entries;
+}
+
+void
+Context::set_adaptive_lookup(bool adaptive) {
+  adaptive_lookup = adaptive;
+}
+
 int
-Context::init_objects(std::istream *is,
+Context::init_objects(const Json::Value &cfg_root,
                       LookupStructureFactory *lookup_factory,
                       const std::set<header_field_pair> &required_fields,
                       const std::set<header_field_pair> &arith_fields) {
   // initally p4objects_rt == p4objects, so this works
-  int status = p4objects_rt->init_objects(is, lookup_factory, device_id, cxt_id,
-                                          notifications_transport,
+  int status = p4objects_rt->init_objects(cfg_root, lookup_factory, device_id,
+                                          cxt_id, notifications_transport,
                                           required_fields, arith_fields);
   if (status) return status;
   if (force_arith)
     get_phv_factory().enable_all_arith();
+  if (decision_cache_size > 0)
+    p4objects_rt->set_decision_cache_size(decision_cache_size);
+  if (adaptive_lookup)
+    p4objects_rt->set_adaptive_lookup(true);
   return 0;
 }
 
 Context::ErrorCode
 Context::load_new_config(
-    std::istream *is,
+    const Json::Value &cfg_root,
     LookupStructureFactory *lookup_factory,
     const std::set<header_field_pair> &required_fields,
     const std::set<header_field_pair> &arith_fields) {
@@ -526,7 +551,7 @@ Context::load_new_config(
   // check that there is no ongoing config swap
   if (p4objects != p4objects_rt) return ErrorCode::ONGOING_SWAP;
   p4objects_rt = std::make_shared<P4Objects>();
-  init_objects(is, lookup_factory, required_fields, arith_fields);
+  init_objects(cfg_root, lookup_factory, required_fields, arith_fields);
   return ErrorCode::SUCCESS;
 }
 
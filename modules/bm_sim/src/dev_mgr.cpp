@@ -18,11 +18,13 @@
  *
  */
 
+#include <algorithm>
 #include <cassert>
 #include <thread>
 #include <mutex>
 #include <string>
 #include <map>
+#include <vector>
 
 #define UNUSED(x) (void)(x)
 
@@ -38,8 +40,10 @@ namespace bm {
 // Implementation which uses Pcap files to read/write packets
 class FilesDevMgrImp : public DevMgrIface {
  public:
-  FilesDevMgrImp(bool respectTiming, unsigned wait_time_in_seconds)
+  FilesDevMgrImp(bool respectTiming, unsigned wait_time_in_seconds,
+                 unsigned replay_loops, uint64_t replay_pps)
       : reader(respectTiming, wait_time_in_seconds) {
+    if (replay_loops > 0) reader.setFastReplay(replay_loops, replay_pps);
     p_monitor = PortMonitorIface::make_dummy();
   }
 
@@ -105,7 +109,8 @@ class FilesDevMgrImp : public DevMgrIface {
 ////////////////////////////////////////////////////////////////////////////////
 
 DevMgrIface::~DevMgrIface() {
-  p_monitor->stop();
+  // not set if the implementation's constructor threw
+  if (p_monitor) p_monitor->stop();
 }
 
 PacketDispatcherIface::ReturnCode
@@ -116,6 +121,43 @@ DevMgrIface::port_add(const std::string &iface_name, port_t port_num,
   return port_add_(iface_name, port_num, in_pcap, out_pcap);
 }
 
+void
+DevMgrIface::transmit_batch_fn_(const TransmitDesc *pkts, size_t n) {
+  static thread_local std::vector<char> buffer;
+  for (size_t i = 0; i < n; i++) {
+    const TransmitDesc &pkt = pkts[i];
+    if (pkt.iovcnt == 1) {
+      transmit_fn_(pkt.port_num, static_cast<const char *>(pkt.iov[0].iov_base),
+                   static_cast<int>(pkt.iov[0].iov_len));
+      continue;
+    }
+    buffer.clear();
+    for (int j = 0; j < pkt.iovcnt; j++) {
+      const char *base = static_cast<const char *>(pkt.iov[j].iov_base);
+      buffer.insert(buffer.end(), base, base + pkt.iov[j].iov_len);
+    }
+    transmit_fn_(pkt.port_num, buffer.data(), static_cast<int>(buffer.size()));
+  }
+}
+
+void
+DevMgrIface::for_each_port_batch(const TransmitDesc *pkts, size_t n,
+                                 const PortBatchFn &fn) {
+  static thread_local std::vector<TransmitDesc> sorted;
+  sorted.assign(pkts, pkts + n);
+  // order needs to be maintained for a given port
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const TransmitDesc &p1, const TransmitDesc &p2) {
+                     return p1.port_num < p2.port_num; });
+  for (size_t first = 0; first < n;) {
+    size_t last = first + 1;
+    while (last < n && sorted[last].port_num == sorted[first].port_num)
+      last++;
+    fn(sorted[first].port_num, &sorted[first], last - first);
+    first = last;
+  }
+}
+
 PacketDispatcherIface::ReturnCode
 DevMgrIface::port_remove(port_t port_num) {
   assert(p_monitor);
@@ -167,10 +209,12 @@ DevMgr::set_dev_mgr(std::unique_ptr<DevMgrIface> my_pimp) {
 }
 
 void
-DevMgr::set_dev_mgr_files(unsigned wait_time_in_seconds) {
+DevMgr::set_dev_mgr_files(unsigned wait_time_in_seconds,
+                          unsigned replay_loops, uint64_t replay_pps) {
   assert(!pimp);
   pimp = std::unique_ptr<DevMgrIface>(new FilesDevMgrImp(
-      false /* no real-time packet replay */, wait_time_in_seconds));
+      false /* no real-time packet replay */, wait_time_in_seconds,
+      replay_loops, replay_pps));
 }
 
 void
@@ -196,6 +240,12 @@ DevMgr::transmit_fn(int port_num, const char *buffer, int len) {
   pimp->transmit_fn(port_num, buffer, len);
 }
 
+void
+DevMgr::transmit_batch_fn(const TransmitDesc *pkts, size_t n) {
+  assert(pimp);
+  pimp->transmit_batch_fn(pkts, n);
+}
+
 PacketDispatcherIface::ReturnCode
 DevMgr::port_remove(port_t port_num) {
   assert(pimp);
@@ -0,0 +1,459 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "bm_sim/dev_mgr.h"
+#include "bm_sim/logger.h"
+
+namespace bm {
+
+namespace {
+
+// TPACKET_V3 rings are made of blocks; for RX, the kernel fills a block with
+// as many packets as fit and hands the whole block over to user space at once
+// (or when the retire timeout expires), which is what makes receive batched
+constexpr unsigned int block_size = 1 << 18;
+constexpr unsigned int rx_block_nr = 16;
+constexpr unsigned int tx_block_nr = 4;
+// for RX, frames have a variable size and this is only used for validation;
+// TX frames are sized based on the MTU, see AfPacketPort::open()
+constexpr unsigned int rx_frame_size = 2048;
+// max time (in ms) a partially-filled RX block can be held by the kernel
+constexpr unsigned int rx_block_timeout_ms = 1;
+
+// where packet data starts in a TX frame, this is imposed by the kernel
+constexpr size_t tx_data_offset =
+    TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+
+// the status words are shared with the kernel
+uint32_t load_status(const volatile uint32_t *status) {
+  uint32_t v = *status;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return v;
+}
+
+void store_status(volatile uint32_t *status, uint32_t v) {
+  std::atomic_thread_fence(std::memory_order_release);
+  *status = v;
+}
+
+// One AF_PACKET socket with its mmap'ed RX and TX rings. The RX ring is only
+// accessed by the receive thread, the TX ring is protected by tx_mutex. The
+// socket is closed when the last reference goes away, so a port can safely be
+// removed while it is being used to send or receive.
+class AfPacketPort {
+ public:
+  AfPacketPort() { }
+
+  ~AfPacketPort() {
+    if (ring != MAP_FAILED) munmap(ring, ring_size());
+    if (fd >= 0) close(fd);
+  }
+
+  bool open(const std::string &iface_name) {
+    // with protocol 0, the socket does not receive anything until it is bound
+    // to the interface; otherwise the RX ring would get the packets of all the
+    // interfaces in the meantime
+    fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0) return error("socket");
+
+    ifindex = if_nametoindex(iface_name.c_str());
+    if (ifindex == 0) return error("if_nametoindex");
+
+    struct ifreq ifr;
+    std::memset(&ifr, 0, sizeof(ifr));
+    std::strncpy(ifr.ifr_name, iface_name.c_str(), IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFMTU, &ifr) != 0) return error("SIOCGIFMTU");
+    // room for the Ethernet header and a VLAN tag; frames must divide blocks
+    const size_t max_len = tx_data_offset + ifr.ifr_mtu + ETH_HLEN + 4;
+    while (tx_frame_size < max_len) tx_frame_size *= 2;
+    if (tx_frame_size > block_size) {
+      Logger::get()->error("AF_PACKET: MTU of {} is too large", iface_name);
+      return false;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) != 0)
+      return error("PACKET_VERSION");
+
+    struct tpacket_req3 req;
+    std::memset(&req, 0, sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_frame_size = rx_frame_size;
+    req.tp_block_nr = rx_block_nr;
+    req.tp_frame_nr = (block_size / rx_frame_size) * rx_block_nr;
+    req.tp_retire_blk_tov = rx_block_timeout_ms;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+      return error("PACKET_RX_RING");
+
+    req.tp_frame_size = tx_frame_size;
+    req.tp_block_nr = tx_block_nr;
+    req.tp_frame_nr = tx_frame_nr();
+    req.tp_retire_blk_tov = 0;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0)
+      return error("PACKET_TX_RING");
+
+    // the RX ring comes first, followed by the TX ring
+    ring = static_cast<char *>(mmap(nullptr, ring_size(),
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_LOCKED, fd, 0));
+    if (ring == MAP_FAILED) {
+      // MAP_LOCKED can fail because of RLIMIT_MEMLOCK
+      ring = static_cast<char *>(mmap(nullptr, ring_size(),
+                                      PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      fd, 0));
+    }
+    if (ring == MAP_FAILED) return error("mmap");
+
+    struct sockaddr_ll addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifindex;
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr),
+             sizeof(addr)) != 0)
+      return error("bind");
+
+    return true;
+  }
+
+  int get_fd() const { return fd; }
+
+  // Calls cb for each packet in the RX blocks which have been released by the
+  // kernel, and returns the blocks to the kernel. Packets are not copied, the
+  // memory is only valid during the callback.
+  template <typename F>
+  size_t receive(F cb) {
+    size_t count = 0;
+    while (true) {
+      auto *block = reinterpret_cast<struct tpacket_block_desc *>(
+          ring + rx_block_idx * block_size);
+      if (!(load_status(&block->hdr.bh1.block_status) & TP_STATUS_USER))
+        break;
+      const uint32_t num_pkts = block->hdr.bh1.num_pkts;
+      auto *hdr = reinterpret_cast<struct tpacket3_hdr *>(
+          reinterpret_cast<char *>(block) +
+          block->hdr.bh1.offset_to_first_pkt);
+      for (uint32_t i = 0; i < num_pkts; i++) {
+        auto *ll = reinterpret_cast<struct sockaddr_ll *>(
+            reinterpret_cast<char *>(hdr) +
+            TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        // we see the packets sent on the interface by other processes, we need
+        // to ignore them; truncated packets are dropped, like with the BMI
+        if (ll->sll_pkttype != PACKET_OUTGOING &&
+            ll->sll_ifindex == ifindex &&
+            hdr->tp_snaplen == hdr->tp_len) {
+          cb(reinterpret_cast<const char *>(hdr) + hdr->tp_mac,
+             static_cast<int>(hdr->tp_snaplen));
+          count++;
+        }
+        hdr = reinterpret_cast<struct tpacket3_hdr *>(
+            reinterpret_cast<char *>(hdr) + hdr->tp_next_offset);
+      }
+      store_status(&block->hdr.bh1.block_status, TP_STATUS_KERNEL);
+      rx_block_idx = (rx_block_idx + 1) % rx_block_nr;
+    }
+    return count;
+  }
+
+  // Copies the packets to the TX ring (gathering their segments) and tells the
+  // kernel to send all of them with a single syscall. The port_num of the
+  // descriptors is ignored. Returns the number of packets queued; packets are
+  // dropped when the ring is full.
+  size_t send(const DevMgrIface::TransmitDesc *pkts, size_t n) {
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    size_t queued = 0;
+    for (size_t i = 0; i < n; i++) {
+      size_t len = 0;
+      for (int j = 0; j < pkts[i].iovcnt; j++) len += pkts[i].iov[j].iov_len;
+      if (tx_data_offset + len > tx_frame_size) {
+        Logger::get()->error(
+            "AF_PACKET: dropping packet of size {}, larger than the MTU", len);
+        continue;
+      }
+      auto *hdr = reinterpret_cast<struct tpacket3_hdr *>(
+          ring + rx_ring_size() + tx_frame_idx * tx_frame_size);
+      if (load_status(&hdr->tp_status) != TP_STATUS_AVAILABLE) {
+        // ring is full, kick the kernel and wait for it to free some frames
+        kick(true);
+        if (load_status(&hdr->tp_status) != TP_STATUS_AVAILABLE) break;
+      }
+      // tp_next_offset has to be 0 for TX
+      std::memset(hdr, 0, sizeof(*hdr));
+      char *data = reinterpret_cast<char *>(hdr) + tx_data_offset;
+      for (int j = 0; j < pkts[i].iovcnt; j++) {
+        std::memcpy(data, pkts[i].iov[j].iov_base, pkts[i].iov[j].iov_len);
+        data += pkts[i].iov[j].iov_len;
+      }
+      hdr->tp_len = len;
+      hdr->tp_snaplen = len;
+      store_status(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+      tx_frame_idx = (tx_frame_idx + 1) % tx_frame_nr();
+      queued++;
+    }
+    if (queued > 0) kick(false);
+    return queued;
+  }
+
+ private:
+  size_t rx_ring_size() const {
+    return static_cast<size_t>(block_size) * rx_block_nr;
+  }
+
+  size_t ring_size() const {
+    return static_cast<size_t>(block_size) * (rx_block_nr + tx_block_nr);
+  }
+
+  size_t tx_frame_nr() const {
+    return (block_size / tx_frame_size) * tx_block_nr;
+  }
+
+  void kick(bool wait) {
+    if (sendto(fd, nullptr, 0, wait ? 0 : MSG_DONTWAIT, nullptr, 0) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS) {
+      Logger::get()->error("AF_PACKET: sendto failed: {}",
+                           std::strerror(errno));
+    }
+  }
+
+  bool error(const char *what) {
+    Logger::get()->error("AF_PACKET: {} failed: {}", what,
+                         std::strerror(errno));
+    return false;
+  }
+
+  int fd{-1};
+  int ifindex{0};
+  // a power of 2, at least rx_frame_size
+  size_t tx_frame_size{rx_frame_size};
+  char *ring{static_cast<char *>(MAP_FAILED)};
+  size_t rx_block_idx{0};
+  size_t tx_frame_idx{0};
+  std::mutex tx_mutex{};
+};
+
+}  // namespace
+
+// Implementation which uses Linux AF_PACKET sockets with TPACKET_V3
+// memory-mapped rings to send / receive packets on real interfaces (e.g. veth
+// pairs). Unlike with libpcap, received packets are read directly from the
+// ring, one block of packets at a time, and sending a batch of packets only
+// requires one syscall.
+class AfPacketDevMgrImp : public DevMgrIface {
+ public:
+  AfPacketDevMgrImp(int device_id,
+                    std::shared_ptr<TransportIface> notifications_transport) {
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    assert(stop_fd >= 0 && epoll_fd >= 0);
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = stop_event;
+    int rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+    assert(rc == 0);
+    (void) rc;
+
+    p_monitor = PortMonitorIface::make_active(device_id,
+                                              notifications_transport);
+  }
+
+ private:
+  ~AfPacketDevMgrImp() override {
+    // the monitor calls port_is_up_(), so it needs to be stopped before this
+    // object is destroyed
+    p_monitor->stop();
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one))
+      Logger::get()->error("AF_PACKET: cannot stop receive thread");
+    if (receive_thread.joinable()) receive_thread.join();
+    close(epoll_fd);
+    close(stop_fd);
+  }
+
+  ReturnCode port_add_(const std::string &iface_name, port_t port_num,
+                       const char *in_pcap, const char *out_pcap) override {
+    if (in_pcap || out_pcap)
+      Logger::get()->warn("pcap dumps are not supported with AF_PACKET");
+
+    std::shared_ptr<AfPacketPort> port(new AfPacketPort());
+    if (!port->open(iface_name)) return ReturnCode::ERROR;
+
+    {
+      Lock lock(mutex);
+      if (ports.find(port_num) != ports.end()) return ReturnCode::ERROR;
+      struct epoll_event ev;
+      std::memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.u64 = static_cast<uint64_t>(port_num);
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, port->get_fd(), &ev) != 0)
+        return ReturnCode::ERROR;
+      ports.emplace(port_num, port);
+      port_info.emplace(port_num, PortInfo(port_num, iface_name));
+    }
+
+    return ReturnCode::SUCCESS;
+  }
+
+  ReturnCode port_remove_(port_t port_num) override {
+    Lock lock(mutex);
+    auto it = ports.find(port_num);
+    if (it == ports.end()) return ReturnCode::ERROR;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second->get_fd(), nullptr);
+    ports.erase(it);
+    port_info.erase(port_num);
+    return ReturnCode::SUCCESS;
+  }
+
+  void transmit_fn_(int port_num, const char *buffer, int len) override {
+    struct iovec iov = {const_cast<char *>(buffer), static_cast<size_t>(len)};
+    TransmitDesc pkt = {port_num, &iov, 1};
+    transmit_batch_fn_(&pkt, 1);
+  }
+
+  // one kick for each port in the batch
+  void transmit_batch_fn_(const TransmitDesc *pkts, size_t n) override {
+    if (n == 1) {
+      auto port = get_port(pkts[0].port_num);
+      if (port) port->send(pkts, 1);
+      return;
+    }
+    for_each_port_batch(
+        pkts, n,
+        [this](int port_num, const TransmitDesc *port_pkts, size_t port_n) {
+          auto port = get_port(port_num);
+          if (port) port->send(port_pkts, port_n);
+        });
+  }
+
+  void start_() override {
+    receive_thread = std::thread(&AfPacketDevMgrImp::receive_loop, this);
+  }
+
+  ReturnCode set_packet_handler_(const PacketHandler &handler, void *cookie)
+      override {
+    pkt_handler = handler;
+    pkt_cookie = cookie;
+    return ReturnCode::SUCCESS;
+  }
+
+  bool port_is_up_(port_t port) const override {
+    std::string iface_name;
+    {
+      Lock lock(mutex);
+      auto it = port_info.find(port);
+      if (it == port_info.end()) return false;
+      iface_name = it->second.iface_name;
+    }
+    std::ifstream fs("/sys/class/net/" + iface_name + "/operstate");
+    std::string operstate;
+    return (fs >> operstate) && operstate == "up";
+  }
+
+  std::map<port_t, PortInfo> get_port_info_() const override {
+    std::map<port_t, PortInfo> info;
+    {
+      Lock lock(mutex);
+      info = port_info;
+    }
+    for (auto &pi : info) {
+      pi.second.is_up = port_is_up_(pi.first);
+    }
+    return info;
+  }
+
+  std::shared_ptr<AfPacketPort> get_port(port_t port_num) const {
+    Lock lock(mutex);
+    auto it = ports.find(port_num);
+    return (it == ports.end()) ? nullptr : it->second;
+  }
+
+  void receive_loop() {
+    constexpr int max_events = 64;
+    struct epoll_event events[max_events];  // NOLINT(runtime/arrays)
+    while (true) {
+      int n = epoll_wait(epoll_fd, events, max_events, -1);
+      if (n < 0) {
+        assert(errno == EINTR);
+        continue;
+      }
+      for (int i = 0; i < n; i++) {
+        if (events[i].data.u64 == stop_event) return;
+        const port_t port_num = static_cast<port_t>(events[i].data.u64);
+        // the port may have been removed since epoll_wait returned
+        auto port = get_port(port_num);
+        if (!port) continue;
+        port->receive([this, port_num](const char *data, int len) {
+            if (pkt_handler) pkt_handler(port_num, data, len, pkt_cookie);
+          });
+      }
+    }
+  }
+
+ private:
+  using Mutex = std::mutex;
+  using Lock = std::lock_guard<std::mutex>;
+
+  // epoll event data for stop_fd, port events use the port number
+  static constexpr uint64_t stop_event = ~static_cast<uint64_t>(0);
+
+  PacketHandler pkt_handler{};
+  void *pkt_cookie{nullptr};
+  int epoll_fd{-1};
+  int stop_fd{-1};
+  std::thread receive_thread{};
+  mutable Mutex mutex{};
+  std::map<port_t, std::shared_ptr<AfPacketPort> > ports{};
+  std::map<port_t, DevMgrIface::PortInfo> port_info{};
+};
+
+constexpr uint64_t AfPacketDevMgrImp::stop_event;
+
+void
+DevMgr::set_dev_mgr_af_packet(
+    int device_id, std::shared_ptr<TransportIface> notifications_transport) {
+  assert(!pimp);
+  pimp = std::unique_ptr<DevMgrIface>(
+      new AfPacketDevMgrImp(device_id, notifications_transport));
+}
+
+}  // namespace bm
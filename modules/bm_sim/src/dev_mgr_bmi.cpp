@@ -18,12 +18,20 @@
  *
  */
 
+#include <boost/thread/shared_mutex.hpp>
+
+#include <atomic>
 #include <string>
 #include <cassert>
+#include <memory>
 #include <mutex>
 #include <map>
+#include <unordered_map>
+#include <vector>
 
 #include "bm_sim/dev_mgr.h"
+#include "bm_sim/logger.h"
+#include "bm_sim/pcap_capture.h"
 
 extern "C" {
 #include "BMI/bmi_port.h"
@@ -42,7 +50,9 @@ namespace bm {
 class BmiDevMgrImp : public DevMgrIface {
  public:
   BmiDevMgrImp(int device_id,
-               std::shared_ptr<TransportIface> notifications_transport) {
+               std::shared_ptr<TransportIface> notifications_transport,
+               const PcapCaptureConfig &pcap_config)
+      : pcap_config(pcap_config) {
     assert(!bmi_port_create_mgr(&port_mgr));
 
     p_monitor = PortMonitorIface::make_active(device_id,
@@ -54,12 +64,30 @@ class BmiDevMgrImp : public DevMgrIface {
     bmi_port_destroy_mgr(port_mgr);
   }
 
+  // we do the pcap capture ourselves, instead of letting the BMI dump packets
+  // synchronously from the dataplane threads
   ReturnCode port_add_(const std::string &iface_name, port_t port_num,
                        const char *in_pcap, const char *out_pcap) override {
-    if (bmi_port_interface_add(port_mgr, iface_name.c_str(), port_num, in_pcap,
-                               out_pcap))
+    if (bmi_port_interface_add(port_mgr, iface_name.c_str(), port_num, nullptr,
+                               nullptr))
       return ReturnCode::ERROR;
 
+    if (in_pcap || out_pcap) {
+      PortCaptures port_captures;
+      if (in_pcap)
+        port_captures.in = std::make_shared<PcapCapture>(in_pcap, pcap_config);
+      // both directions share the capture (which supports concurrent
+      // producers) when they go to the same file
+      if (out_pcap && in_pcap && std::string(in_pcap) == out_pcap)
+        port_captures.out = port_captures.in;
+      else if (out_pcap)
+        port_captures.out = std::make_shared<PcapCapture>(out_pcap,
+                                                          pcap_config);
+      WriteLock lock(captures_mutex);
+      captures[port_num] = std::move(port_captures);
+      has_captures = true;
+    }
+
     PortInfo p_info(port_num, iface_name);
     if (in_pcap) p_info.add_extra("in_pcap", std::string(in_pcap));
     if (out_pcap) p_info.add_extra("out_pcap", std::string(out_pcap));
@@ -74,6 +102,11 @@ class BmiDevMgrImp : public DevMgrIface {
     if (bmi_port_interface_remove(port_mgr, port_num))
       return ReturnCode::ERROR;
 
+    {
+      WriteLock lock(captures_mutex);
+      captures.erase(port_num);
+    }
+
     Lock lock(mutex);
     port_info.erase(port_num);
 
@@ -81,9 +114,42 @@ class BmiDevMgrImp : public DevMgrIface {
   }
 
   void transmit_fn_(int port_num, const char *buffer, int len) override {
+    if (has_captures) {
+      struct iovec iov = {const_cast<char *>(buffer),
+                          static_cast<size_t>(len)};
+      TransmitDesc pkt = {port_num, &iov, 1};
+      capture_out(port_num, &pkt, 1);
+    }
     bmi_port_send(port_mgr, port_num, buffer, len);
   }
 
+  // one sendmmsg for each port in the batch
+  void transmit_batch_fn_(const TransmitDesc *pkts, size_t n) override {
+    for_each_port_batch(
+        pkts, n,
+        [this](int port_num, const TransmitDesc *port_pkts, size_t port_n) {
+          static thread_local std::vector<const struct iovec *> iovs;
+          static thread_local std::vector<int> iovcnts;
+          iovs.resize(port_n);
+          iovcnts.resize(port_n);
+          for (size_t i = 0; i < port_n; i++) {
+            iovs[i] = port_pkts[i].iov;
+            iovcnts[i] = port_pkts[i].iovcnt;
+          }
+          if (has_captures) capture_out(port_num, port_pkts, port_n);
+          int dropped = bmi_port_send_batch(port_mgr, port_num, iovs.data(),
+                                            iovcnts.data(),
+                                            static_cast<int>(port_n));
+          if (dropped < 0) {
+            Logger::get()->warn("Cannot transmit packets on port {}",
+                                port_num);
+          } else if (dropped > 0) {
+            Logger::get()->warn("{} packet(s) dropped when transmitting on "
+                                "port {}", dropped, port_num);
+          }
+        });
+  }
+
   void start_() override {
     assert(port_mgr);
     assert(!bmi_start_mgr(port_mgr));
@@ -95,7 +161,10 @@ class BmiDevMgrImp : public DevMgrIface {
     function_t * const*ptr_fun = handler.target<function_t *>();
     assert(ptr_fun);
     assert(*ptr_fun);
-    assert(!bmi_set_packet_handler(port_mgr, *ptr_fun, cookie));
+    pkt_handler = *ptr_fun;
+    pkt_cookie = cookie;
+    assert(!bmi_set_packet_handler(port_mgr, &BmiDevMgrImp::receive_packet,
+                                   this));
     return ReturnCode::SUCCESS;
   }
 
@@ -119,21 +188,58 @@ class BmiDevMgrImp : public DevMgrIface {
     return info;
   }
 
+  static void receive_packet(int port_num, const char *buffer, int len,
+                             void *cookie) {
+    auto *self = static_cast<BmiDevMgrImp *>(cookie);
+    if (self->has_captures) {
+      ReadLock lock(self->captures_mutex);
+      auto it = self->captures.find(port_num);
+      if (it != self->captures.end() && it->second.in)
+        it->second.in->capture(buffer, len);
+    }
+    self->pkt_handler(port_num, buffer, len, self->pkt_cookie);
+  }
+
+  void capture_out(int port_num, const TransmitDesc *pkts, size_t n) {
+    ReadLock lock(captures_mutex);
+    auto it = captures.find(port_num);
+    if (it == captures.end() || !it->second.out) return;
+    for (size_t i = 0; i < n; i++)
+      it->second.out->capture(pkts[i].iov, pkts[i].iovcnt);
+  }
+
  private:
   using Mutex = std::mutex;
   using Lock = std::lock_guard<std::mutex>;
+  using ReadLock = boost::shared_lock<boost::shared_mutex>;
+  using WriteLock = boost::unique_lock<boost::shared_mutex>;
+
+  // in and out can be the same capture, if both directions go to one file
+  struct PortCaptures {
+    std::shared_ptr<PcapCapture> in{nullptr};
+    std::shared_ptr<PcapCapture> out{nullptr};
+  };
 
   bmi_port_mgr_t *port_mgr{nullptr};
+  bmi_packet_handler_t pkt_handler{nullptr};
+  void *pkt_cookie{nullptr};
+  PcapCaptureConfig pcap_config;
+  mutable boost::shared_mutex captures_mutex{};
+  std::unordered_map<port_t, PortCaptures> captures{};
+  // captures are only looked up when at least one port was added with a pcap
+  // file
+  std::atomic<bool> has_captures{false};
   mutable Mutex mutex;
   std::map<port_t, DevMgrIface::PortInfo> port_info;
 };
 
 void
 DevMgr::set_dev_mgr_bmi(
-    int device_id, std::shared_ptr<TransportIface> notifications_transport) {
+    int device_id, std::shared_ptr<TransportIface> notifications_transport,
+    const PcapCaptureConfig &pcap_config) {
   assert(!pimp);
   pimp = std::unique_ptr<DevMgrIface>(
-      new BmiDevMgrImp(device_id, notifications_transport));
+      new BmiDevMgrImp(device_id, notifications_transport, pcap_config));
 }
 
 }  // namespace bm
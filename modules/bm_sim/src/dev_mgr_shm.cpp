@@ -0,0 +1,438 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "bm_sim/dev_mgr.h"
+#include "bm_sim/logger.h"
+#include "bm_sim/shm_ring.h"
+
+namespace bm {
+
+// private implementation
+
+// Implementation which exchanges packets with another process through shared
+// memory rings (see shm_ring.h). It supports the same messages as
+// PacketInDevMgrImp, but packets are never copied more than once in each
+// direction and no syscall is needed as long as both sides are busy.
+// The rings have a single producer and a single consumer on each side, so only
+// one client can be attached at a time: it keeps its connection to the Unix
+// socket open for as long as it uses the rings, and other connections are
+// closed right away until it disconnects.
+class ShmDevMgrImp : public DevMgrIface {
+ public:
+  ShmDevMgrImp(int device_id, const std::string &path,
+               std::shared_ptr<TransportIface> notifications_transport,
+               bool enforce_ports = false)
+      : path(path), enforce_ports(enforce_ports) {
+    try {
+      init();
+    } catch (...) {
+      release();
+      throw;
+    }
+
+    p_monitor = PortMonitorIface::make_passive(device_id,
+                                               notifications_transport);
+
+    // clients can connect before start() is called, but the ring is only
+    // drained after
+    receive_thread = std::thread(&ShmDevMgrImp::receive_loop, this);
+  }
+
+ private:
+  ~ShmDevMgrImp() override {
+    if (receive_thread.joinable()) {
+      uint64_t one = 1;
+      if (write(stop_fd, &one, sizeof(one)) != sizeof(one))
+        Logger::get()->error("shm: cannot stop receive thread");
+      receive_thread.join();
+    }
+    release();
+  }
+
+  // throws std::runtime_error on failure, in which case the caller is
+  // responsible for calling release()
+  void init() {
+    region_size = shm::Region::size();
+    fds[shm::FD_REGION] = memfd_create("bm_shm_packet_in", MFD_CLOEXEC);
+    if (fds[shm::FD_REGION] < 0 ||
+        ftruncate(fds[shm::FD_REGION], region_size) != 0)
+      fail("cannot create shared memory region");
+    region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fds[shm::FD_REGION], 0);
+    if (region == MAP_FAILED) fail("cannot map shared memory region");
+    auto *hdr = static_cast<shm::Region::Header *>(region);
+    hdr->magic = shm::Region::magic;
+    hdr->ring_capacity = shm::Region::ring_capacity;
+    to_switch = shm::Region::to_switch(region);
+    from_switch = shm::Region::from_switch(region);
+    to_switch.init();
+    from_switch.init();
+
+    fds[shm::FD_TO_SWITCH_DOORBELL] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds[shm::FD_FROM_SWITCH_DOORBELL] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (fds[shm::FD_TO_SWITCH_DOORBELL] < 0 ||
+        fds[shm::FD_FROM_SWITCH_DOORBELL] < 0 || stop_fd < 0)
+      fail("cannot create eventfd");
+
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) fail("socket path is too long");
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) fail("cannot create socket");
+    // a stale socket file from a previous run is removed, anything else at
+    // that path is left alone and bind fails
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path.c_str());
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr),
+             sizeof(addr)) != 0)
+      fail("cannot bind to " + path);
+    bound = true;
+    if (listen(listen_fd, 1) != 0) fail("cannot listen on " + path);
+  }
+
+  void release() {
+    if (client_fd >= 0) close(client_fd);
+    if (listen_fd >= 0) close(listen_fd);
+    if (bound) unlink(path.c_str());
+    if (stop_fd >= 0) close(stop_fd);
+    for (int fd : fds)
+      if (fd >= 0) close(fd);
+    if (region != MAP_FAILED) munmap(region, region_size);
+  }
+
+  ReturnCode port_add_(const std::string &iface_name, port_t port_num,
+                       const char *in_pcap, const char *out_pcap) override {
+    (void) iface_name;
+    (void) port_num;
+    (void) in_pcap;
+    (void) out_pcap;
+    Logger::get()->warn("When using shm packet in, port_add is done "
+                        "through IPC messages");
+    return ReturnCode::UNSUPPORTED;
+  }
+
+  ReturnCode port_remove_(port_t port_num) override {
+    (void) port_num;
+    Logger::get()->warn("When using shm packet in, port_remove is done "
+                        "through IPC messages");
+    return ReturnCode::UNSUPPORTED;
+  }
+
+  void transmit_fn_(int port_num, const char *buffer, int len) override {
+    struct iovec iov = {const_cast<char *>(buffer), static_cast<size_t>(len)};
+    TransmitDesc pkt = {port_num, &iov, 1};
+    transmit_batch_fn_(&pkt, 1);
+  }
+
+  void transmit_batch_fn_(const TransmitDesc *pkts, size_t n) override;
+
+  void start_() override {
+    started = true;
+    ring_doorbell(fds[shm::FD_TO_SWITCH_DOORBELL]);
+  }
+
+  ReturnCode set_packet_handler_(const PacketHandler &handler, void *cookie)
+      override {
+    pkt_handler = handler;
+    pkt_cookie = cookie;
+    return ReturnCode::SUCCESS;
+  }
+
+  bool port_is_up_(port_t port) const override {
+    if (!enforce_ports) return true;
+    Lock lock(mutex);
+    auto it = port_info.find(port);
+    return (it != port_info.end() && it->second.is_up);
+  }
+
+  std::map<port_t, PortInfo> get_port_info_() const override {
+    Lock lock(mutex);
+    return port_info;
+  }
+
+ private:
+  void receive_loop();
+
+  void accept_client();
+
+  void check_client();
+
+  void detach_invalid_client();
+
+  void handle_msg(const shm::MsgHdr &hdr, const char *data);
+
+  void do_port_add(port_t port) {
+    {
+      Lock lock(mutex);
+      auto it = port_info.find(port);
+      if (it != port_info.end()) return;
+      PortInfo p_info(port, "N/A");
+      p_info.add_extra("socket_addr", path);
+      port_info.emplace(port, std::move(p_info));
+    }
+
+    if (!enforce_ports) return;
+    p_monitor->notify(port, PortStatus::PORT_ADDED);
+    p_monitor->notify(port, PortStatus::PORT_UP);
+  }
+
+  void do_port_remove(port_t port) {
+    {
+      Lock lock(mutex);
+      auto it = port_info.find(port);
+      if (it == port_info.end()) return;
+      port_info.erase(it);
+    }
+
+    if (!enforce_ports) return;
+    p_monitor->notify(port, PortStatus::PORT_REMOVED);
+  }
+
+  void do_port_set_status(port_t port, PortStatus status) {
+    {
+      Lock lock(mutex);
+      auto it = port_info.find(port);
+      if (it == port_info.end()) return;
+      it->second.set_is_up(status == PortStatus::PORT_UP);
+    }
+
+    if (!enforce_ports) return;
+    p_monitor->notify(port, status);
+  }
+
+  static void ring_doorbell(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+      Logger::get()->error("shm: cannot ring doorbell");
+  }
+
+  static void fail(const std::string &what) {
+    Logger::get()->error("shm: {}: {}", what, std::strerror(errno));
+    throw std::runtime_error("shm: " + what);
+  }
+
+ private:
+  using Mutex = std::mutex;
+  using Lock = std::lock_guard<std::mutex>;
+
+  // max number of messages handled between 2 polls
+  static constexpr size_t rx_burst = 64;
+
+  std::string path{};
+  bool enforce_ports{false};
+  void *region{MAP_FAILED};
+  size_t region_size{0};
+  int fds[shm::FD_COUNT] = {-1, -1, -1};
+  int listen_fd{-1};
+  bool bound{false};
+  // connection of the attached client, -1 if there is none
+  int client_fd{-1};
+  // false once an invalid record has been read from to_switch, until the next
+  // client attaches
+  bool to_switch_valid{true};
+  int stop_fd{-1};
+  shm::Ring to_switch{};
+  shm::Ring from_switch{};
+  // there can be several transmit threads, but only one producer
+  Mutex tx_mutex{};
+  PacketHandler pkt_handler{};
+  void *pkt_cookie{nullptr};
+  std::thread receive_thread{};
+  std::atomic<bool> started{false};
+  mutable Mutex mutex{};
+  std::map<port_t, DevMgrIface::PortInfo> port_info{};
+};
+
+constexpr size_t ShmDevMgrImp::rx_burst;
+
+// packets are dropped when the client does not drain the ring fast enough (or
+// when there is no client)
+void
+ShmDevMgrImp::transmit_batch_fn_(const TransmitDesc *pkts, size_t n) {
+  Lock lock(tx_mutex);
+  size_t dropped = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t len = 0;
+    for (int j = 0; j < pkts[i].iovcnt; j++) len += pkts[i].iov[j].iov_len;
+    if (!from_switch.push(shm::MSG_TYPE_PACKET_OUT, pkts[i].port_num,
+                          static_cast<int32_t>(len),
+                          pkts[i].iov, pkts[i].iovcnt))
+      dropped++;
+  }
+  if (dropped < n && from_switch.flush())
+    ring_doorbell(fds[shm::FD_FROM_SWITCH_DOORBELL]);
+  if (dropped > 0)
+    Logger::get()->debug("shm: ring full, dropped {} packets", dropped);
+}
+
+void
+ShmDevMgrImp::handle_msg(const shm::MsgHdr &hdr, const char *data) {
+  switch (hdr.type) {
+    case shm::MSG_TYPE_PORT_ADD:
+      do_port_add(hdr.port);
+      break;
+    case shm::MSG_TYPE_PORT_REMOVE:
+      do_port_remove(hdr.port);
+      break;
+    case shm::MSG_TYPE_PORT_SET_STATUS:
+      switch (hdr.more) {
+        case shm::MSG_PORT_STATUS_DOWN:
+          do_port_set_status(hdr.port, PortStatus::PORT_DOWN);
+          break;
+        case shm::MSG_PORT_STATUS_UP:
+          do_port_set_status(hdr.port, PortStatus::PORT_UP);
+          break;
+        default:
+          Logger::get()->error("Unknown port status requested");
+          break;
+      }
+      break;
+    case shm::MSG_TYPE_PACKET_IN:
+      if (!port_is_up_(hdr.port)) break;
+      if (pkt_handler) pkt_handler(hdr.port, data, hdr.more, pkt_cookie);
+      break;
+    case shm::MSG_TYPE_PACKET_OUT:
+      Logger::get()->error("Invalid PACKET_OUT message received");
+      break;
+    default:
+      Logger::get()->error("Unknown message type");
+      break;
+  }
+}
+
+// the connection is only used to hand over the file descriptors, and then to
+// detect when the client goes away
+void
+ShmDevMgrImp::accept_client() {
+  int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd < 0) return;
+  if (client_fd >= 0) {
+    Logger::get()->warn("shm: a client is already attached, rejecting new "
+                        "connection");
+    close(fd);
+    return;
+  }
+  // the previous client left the ring in an invalid state
+  if (!to_switch_valid) {
+    to_switch.init();
+    to_switch_valid = true;
+  }
+  if (!shm::send_fds(fd, fds)) {
+    Logger::get()->error("shm: cannot send file descriptors to client");
+    close(fd);
+    return;
+  }
+  client_fd = fd;
+}
+
+// the client is not expected to send anything, we just wait for the end of
+// file (or an error)
+void
+ShmDevMgrImp::check_client() {
+  char byte;
+  ssize_t rc = recv(client_fd, &byte, sizeof(byte), MSG_DONTWAIT);
+  if (rc > 0 || (rc < 0 && (errno == EAGAIN || errno == EINTR))) return;
+  close(client_fd);
+  client_fd = -1;
+}
+
+// we stop reading from the ring, the client has to reconnect
+void
+ShmDevMgrImp::detach_invalid_client() {
+  Logger::get()->error("shm: invalid record received, detaching client");
+  to_switch_valid = false;
+  if (client_fd < 0) return;
+  close(client_fd);
+  client_fd = -1;
+}
+
+void
+ShmDevMgrImp::receive_loop() {
+  auto handler = [this](const shm::MsgHdr &hdr, const char *data) {
+    handle_msg(hdr, data);
+  };
+  struct pollfd pfds[4];
+  pfds[0] = {stop_fd, POLLIN, 0};
+  pfds[1] = {fds[shm::FD_TO_SWITCH_DOORBELL], POLLIN, 0};
+  pfds[2] = {listen_fd, POLLIN, 0};
+  while (true) {
+    // we only block when the ring is empty, otherwise we just check for other
+    // events once for each burst
+    const bool consuming = started && to_switch_valid;
+    bool valid = true;
+    const size_t count =
+        consuming ? to_switch.consume(handler, rx_burst, &valid) : 0;
+    if (!valid) detach_invalid_client();
+    const bool idle = (count == 0) &&
+        (!consuming || !valid || to_switch.prepare_wait());
+    // ignored by poll when negative
+    pfds[3] = {client_fd, POLLIN, 0};
+    int rc = poll(pfds, 4, idle ? -1 : 0);
+    if (rc < 0) {
+      assert(errno == EINTR);
+      continue;
+    }
+    if (pfds[0].revents) return;
+    if (pfds[1].revents) {
+      uint64_t v;
+      if (read(pfds[1].fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        Logger::get()->error("shm: cannot read doorbell");
+    }
+    // a client which disconnects right before another one connects must be
+    // detached first
+    if (pfds[3].revents) check_client();
+    if (pfds[2].revents) accept_client();
+  }
+}
+
+void
+DevMgr::set_dev_mgr_shm(
+    int device_id, const std::string &path,
+    std::shared_ptr<TransportIface> notifications_transport,
+    bool enforce_ports) {
+  assert(!pimp);
+  pimp = std::unique_ptr<DevMgrIface>(
+      new ShmDevMgrImp(device_id, path, notifications_transport,
+                       enforce_ports));
+}
+
+}  // namespace bm
@@ -18,9 +18,19 @@
  *
  */
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "bm_sim/event_logger.h"
+#include "bm_sim/logger.h"
+#include "bm_sim/spsc_queue.h"
 #include "bm_sim/parser.h"
 #include "bm_sim/deparser.h"
 #include "bm_sim/tables.h"
@@ -63,6 +73,189 @@ fill_msg_hdr(EventType type, int device_id,
 
 }  // namespace
 
+struct EventLogger::AsyncState {
+  // all messages fit in this, the largest one is currently 44 bytes
+  static constexpr size_t max_msg_size = 64;
+
+  struct Record {
+    uint64_t seq;
+    uint32_t len;
+    char data[max_msg_size];  // NOLINT(runtime/arrays)
+  };
+
+  struct Ring {
+    explicit Ring(size_t capacity)
+        : records(capacity) { }
+
+    SPSCQueue<Record> records;
+    // only incremented by the producer
+    std::atomic<uint64_t> dropped{0};
+  };
+
+  // rings are never destroyed before the logger itself, which means that a
+  // thread can cache a pointer to its ring; we use a unique id rather than the
+  // logger's address as the cache key, in case an address gets re-used
+  Ring *get_ring() {
+    static thread_local std::unordered_map<uint64_t, Ring *> my_rings;
+    auto it = my_rings.find(uid);
+    if (it != my_rings.end()) return it->second;
+    std::unique_lock<std::mutex> lock(rings_mutex);
+    rings.emplace_back(new Ring(ring_capacity));
+    Ring *ring = rings.back().get();
+    my_rings[uid] = ring;
+    return ring;
+  }
+
+  static std::atomic<uint64_t> next_uid;
+
+  const uint64_t uid{next_uid++};
+  size_t ring_capacity{default_ring_capacity};
+  std::vector<std::unique_ptr<Ring> > rings{};
+  mutable std::mutex rings_mutex{};
+
+  std::atomic<uint64_t> next_seq{0};
+  std::atomic<uint64_t> published{0};
+
+  std::thread drain_thread{};
+  std::mutex drain_mutex{};
+  std::condition_variable drain_cv{};
+  bool stop{false};
+};
+
+std::atomic<uint64_t> EventLogger::AsyncState::next_uid{0};
+
+constexpr size_t EventLogger::default_ring_capacity;
+
+EventLogger::EventLogger(std::unique_ptr<TransportIface> transport,
+                         int device_id)
+    : transport_instance(std::move(transport)), device_id(device_id),
+      async_state(new AsyncState()) { }
+
+EventLogger::~EventLogger() {
+  stop_async();
+}
+
+void
+EventLogger::start_async(size_t ring_capacity) {
+  if (async) return;
+  async_state->ring_capacity = ring_capacity;
+  async_state->stop = false;
+  async_state->drain_thread = std::thread(&EventLogger::drain_events, this);
+  async = true;
+}
+
+void
+EventLogger::stop_async() {
+  if (!async) return;
+  async = false;
+  {
+    std::unique_lock<std::mutex> lock(async_state->drain_mutex);
+    async_state->stop = true;
+  }
+  async_state->drain_cv.notify_one();
+  async_state->drain_thread.join();
+  const uint64_t dropped = get_dropped_events();
+  if (dropped > 0) {
+    Logger::get()->warn("Event logger dropped {} messages", dropped);
+  }
+}
+
+bool
+EventLogger::is_async() const {
+  return async;
+}
+
+uint64_t
+EventLogger::get_dropped_events() const {
+  std::unique_lock<std::mutex> lock(async_state->rings_mutex);
+  uint64_t dropped = 0;
+  for (const auto &ring : async_state->rings)
+    dropped += ring->dropped.load(std::memory_order_relaxed);
+  return dropped;
+}
+
+uint64_t
+EventLogger::get_published_events() const {
+  return async_state->published.load(std::memory_order_relaxed);
+}
+
+void
+EventLogger::emit(const char *msg, size_t len) {
+  if (!async.load(std::memory_order_relaxed)) {
+    transport_instance->send(msg, static_cast<int>(len));
+    return;
+  }
+  assert(len <= AsyncState::max_msg_size);
+  AsyncState::Ring *ring = async_state->get_ring();
+  AsyncState::Record record;
+  record.seq = async_state->next_seq.fetch_add(1, std::memory_order_relaxed);
+  record.len = static_cast<uint32_t>(len);
+  std::memcpy(record.data, msg, len);
+  if (!ring->records.try_push(record)) {
+    ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+  }
+}
+
+void
+EventLogger::drain_events() {
+  AsyncState &state = *async_state;
+  std::vector<AsyncState::Ring *> rings;
+  std::vector<AsyncState::Record> batch;
+  std::vector<TransportIface::MsgBuf> msgs;
+  AsyncState::Record record;
+  auto by_seq = [](const AsyncState::Record &r1, const AsyncState::Record &r2) {
+    return r1.seq < r2.seq;
+  };
+
+  while (true) {
+    bool stopping;
+    {
+      std::unique_lock<std::mutex> lock(state.drain_mutex);
+      stopping = state.stop;
+    }
+    // all the messages numbered below the watermark have already been pushed
+    // to their ring (save for a tiny window between the sequence number
+    // allocation and the push), so they can be published in order; more recent
+    // messages are held back until the next iteration
+    const uint64_t watermark = state.next_seq.load(std::memory_order_acquire);
+    {
+      std::unique_lock<std::mutex> lock(state.rings_mutex);
+      if (rings.size() != state.rings.size()) {
+        rings.clear();
+        for (const auto &ring : state.rings) rings.push_back(ring.get());
+      }
+    }
+    for (auto ring : rings) {
+      while (ring->records.try_pop(&record)) batch.push_back(record);
+    }
+    std::sort(batch.begin(), batch.end(), by_seq);
+
+    auto last = batch.end();
+    if (!stopping) {
+      AsyncState::Record bound{};
+      bound.seq = watermark;
+      last = std::lower_bound(batch.begin(), batch.end(), bound, by_seq);
+    }
+    msgs.clear();
+    for (auto it = batch.begin(); it != last; ++it)
+      msgs.push_back({it->data, it->len});
+    if (!msgs.empty()) {
+      transport_instance->send_batch(msgs);
+      state.published.fetch_add(msgs.size(), std::memory_order_relaxed);
+    }
+    batch.erase(batch.begin(), last);
+
+    if (stopping) break;
+    if (msgs.empty()) {
+      // packet processing threads never notify us, which is why we poll
+      std::unique_lock<std::mutex> lock(state.drain_mutex);
+      state.drain_cv.wait_for(lock, std::chrono::milliseconds(1),
+                              [&state]() { return state.stop; });
+    }
+  }
+}
+
 void
 EventLogger::packet_in(const Packet &packet) {
   typedef struct : msg_hdr_t {
@@ -72,7 +265,7 @@ EventLogger::packet_in(const Packet &packet) {
   msg_t msg;
   fill_msg_hdr(EventType::PACKET_IN, device_id, packet, &msg);
   msg.port_in = packet.get_ingress_port();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -84,7 +277,7 @@ EventLogger::packet_out(const Packet &packet) {
   msg_t msg;
   fill_msg_hdr(EventType::PACKET_OUT, device_id, packet, &msg);
   msg.port_out = packet.get_egress_port();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -96,7 +289,7 @@ EventLogger::parser_start(const Packet &packet, const Parser &parser) {
   msg_t msg;
   fill_msg_hdr(EventType::PARSER_START, device_id, packet, &msg);
   msg.parser_id = parser.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -108,7 +301,7 @@ EventLogger::parser_done(const Packet &packet, const Parser &parser) {
   msg_t msg;
   fill_msg_hdr(EventType::PARSER_DONE, device_id, packet, &msg);
   msg.parser_id = parser.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -120,7 +313,7 @@ EventLogger::parser_extract(const Packet &packet, header_id_t header) {
   msg_t msg;
   fill_msg_hdr(EventType::PARSER_EXTRACT, device_id, packet, &msg);
   msg.header_id = header;
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -132,7 +325,7 @@ EventLogger::deparser_start(const Packet &packet, const Deparser &deparser) {
   msg_t msg;
   fill_msg_hdr(EventType::DEPARSER_START, device_id, packet, &msg);
   msg.deparser_id = deparser.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -144,7 +337,7 @@ EventLogger::deparser_done(const Packet &packet, const Deparser &deparser) {
   msg_t msg;
   fill_msg_hdr(EventType::DEPARSER_DONE, device_id, packet, &msg);
   msg.deparser_id = deparser.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -156,7 +349,7 @@ EventLogger::deparser_emit(const Packet &packet, header_id_t header) {
   msg_t msg;
   fill_msg_hdr(EventType::DEPARSER_EMIT, device_id, packet, &msg);
   msg.header_id = header;
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -168,7 +361,7 @@ EventLogger::checksum_update(const Packet &packet, const Checksum &checksum) {
   msg_t msg;
   fill_msg_hdr(EventType::CHECKSUM_UPDATE, device_id, packet, &msg);
   msg.checksum_id = checksum.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -180,7 +373,7 @@ EventLogger::pipeline_start(const Packet &packet, const Pipeline &pipeline) {
   msg_t msg;
   fill_msg_hdr(EventType::PIPELINE_START, device_id, packet, &msg);
   msg.pipeline_id = pipeline.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -192,7 +385,7 @@ EventLogger::pipeline_done(const Packet &packet, const Pipeline &pipeline) {
   msg_t msg;
   fill_msg_hdr(EventType::PIPELINE_DONE, device_id, packet, &msg);
   msg.pipeline_id = pipeline.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -207,7 +400,7 @@ EventLogger::condition_eval(const Packet &packet,
   fill_msg_hdr(EventType::CONDITION_EVAL, device_id, packet, &msg);
   msg.condition_id = cond.get_id();
   msg.result = result;
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 // static inline size_t get_pascal_str_size(const ByteContainer &src) {
@@ -232,7 +425,7 @@ EventLogger::table_hit(const Packet &packet, const MatchTableAbstract &table,
   fill_msg_hdr(EventType::TABLE_HIT, device_id, packet, &msg);
   msg.table_id = table.get_id();
   msg.entry_hdl = static_cast<int>(handle);
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -244,7 +437,7 @@ EventLogger::table_miss(const Packet &packet, const MatchTableAbstract &table) {
   msg_t msg;
   fill_msg_hdr(EventType::TABLE_MISS, device_id, packet, &msg);
   msg.table_id = table.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
 }
 
 void
@@ -258,7 +451,7 @@ EventLogger::action_execute(const Packet &packet,
   msg_t msg;
   fill_msg_hdr(EventType::ACTION_EXECUTE, device_id, packet, &msg);
   msg.action_id = action_fn.get_id();
-  transport_instance->send(reinterpret_cast<char *>(&msg), sizeof(msg));
+  emit(reinterpret_cast<char *>(&msg), sizeof(msg));
   // to costly to send action data?
   (void) action_data;
 }
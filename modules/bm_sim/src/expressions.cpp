@@ -18,10 +18,12 @@
  *
  */
 
-#include <stack>
 #include <string>
 #include <vector>
 #include <algorithm>  // for std::max
+#include <limits>
+#include <memory>
+#include <utility>  // for std::pair
 
 #include <cassert>
 
@@ -82,10 +84,11 @@ Expression::get_num_ops() const {
 }
 
 void
-Expression::push_back_load_field(header_id_t header, int field_offset) {
+Expression::push_back_load_field(header_id_t header, int field_offset,
+                                 int nbits) {
   Op op;
   op.opcode = ExprOpcode::LOAD_FIELD;
-  op.field = {header, field_offset};
+  op.field = {header, field_offset, nbits};
   ops.push_back(op);
 }
 
@@ -190,259 +193,949 @@ Expression::push_back_ternary_op(const Expression &e1, const Expression &e2) {
   append_expression(e2);
 }
 
-void
-Expression::build() {
-  data_registers_cnt = assign_dest_registers();
-  built = true;
-}
+// Expressions are compiled to a program for a register machine with 3 register
+// files: 64-bit integers, pointers to Data values (bignums) and booleans. Each
+// node of the expression tree gets its own destination register, which is fine
+// given the size of the expressions we see in P4 programs. A data node is
+// evaluated with integer registers if we can prove that its value (and the
+// value of all the nodes below it) fits in an int64_t; this is the common case
+// for expressions involving fields and constants, and it means we do not have
+// to touch the bignum library at all for these.
+struct Expression::Program {
+  enum Opcode : uint8_t {
+    // integer registers
+    I_LOAD_FIELD, I_LOAD_REGISTER_REF, I_LOAD_REGISTER_GEN, I_LOAD_IMM,
+    I_ADD, I_SUB, I_MUL, I_SHL, I_SHR, I_AND, I_OR, I_XOR, I_NEG,
+    I_TWO_COMP_MOD, I_FROM_BOOL, I_FROM_DATA, I_MOV,
+    // data registers
+    D_LOAD_FIELD, D_LOAD_CONST, D_LOAD_LOCAL, D_LOAD_REGISTER_REF,
+    D_LOAD_REGISTER_GEN, D_FROM_INT,
+    D_ADD, D_SUB, D_MUL, D_MOD, D_SHL, D_SHR, D_AND, D_OR, D_XOR, D_NEG,
+    D_TWO_COMP_MOD, D_MOV,
+    // bool registers
+    B_LOAD, B_VALID, B_NOT, B_MOV, B_FROM_INT, B_FROM_DATA, B_CMP_I, B_CMP_D,
+    // control flow
+    JUMP, JUMP_IF_TRUE, JUMP_IF_FALSE,
+    // jumps if the comparison of 2 integer registers is false
+    JUMP_IF_NOT_CMP_I
+  };
 
-void
-Expression::grab_register_accesses(RegisterSync *register_sync) const {
-  for (auto &op : ops) {
-    switch (op.opcode) {
-      case ExprOpcode::LOAD_REGISTER_REF:
-      case ExprOpcode::LOAD_REGISTER_GEN:
-        register_sync->add_register_array(op.register_array);
-        break;
-      default:
-        continue;
+  enum Cmp : uint8_t { EQ, NE, GT, LT, GE, LE };
+
+  template <typename T>
+  static bool compare(Cmp cmp, const T &a, const T &b) {
+    switch (cmp) {
+      case EQ: return a == b;
+      case NE: return a != b;
+      case GT: return a > b;
+      case LT: return a < b;
+      case GE: return a >= b;
+      case LE: return a <= b;
     }
+    return false;
   }
-}
 
-/* I have made this function more efficient by using thread_local variables
-   instead of dynamic allocation at each call. Maybe it would be better to just
-   try to use a stack allocator */
-void
-Expression::eval_(const PHV &phv, ExprType expr_type,
-                  const std::vector<Data> &locals,
-                  bool *b_res, Data *d_res) const {
-  assert(built);
+  enum class RegType { INT, DATA, BOOL };
+
+  struct Instr {
+    Opcode opcode;
+    Cmp cmp;
+    int dst;
+    int src1;
+    int src2;
+
+    union {
+      struct {
+        header_id_t header;
+        int field_offset;
+      } field;
+
+      header_id_t header;
+      int64_t imm;
+      bool bool_value;
+      int const_offset;
+      int local_offset;
+
+      struct {
+        RegisterArray *array;
+        unsigned int idx;
+      } register_ref;
+
+      RegisterArray *register_array;
+      // jump target
+      size_t target;
+    };
+  };
 
-  static thread_local int data_temps_size = 4;
-  // std::vector<Data> data_temps(data_registers_cnt);
-  static thread_local std::vector<Data> data_temps(data_temps_size);
-  while (data_temps_size < data_registers_cnt) {
-    data_temps.emplace_back();
-    data_temps_size++;
+  std::vector<Instr> instrs{};
+  // the constants which do not fit in an integer register
+  std::vector<Data> consts{};
+  int num_int_regs{0};
+  int num_data_regs{0};
+  int num_bool_regs{0};
+  RegType result_type{RegType::BOOL};
+  int result_reg{-1};
+
+  class Compiler;
+};
+
+class Expression::Program::Compiler {
+ public:
+  Compiler(const std::vector<Op> &ops, const std::vector<Data> &const_values,
+           Program *program)
+      : ops(ops), const_values(const_values), program(program) { }
+
+  void compile() {
+    if (ops.empty()) return;
+    const Reg res = emit(parse(0, ops.size()));
+    program->result_type = res.type;
+    program->result_reg = res.idx;
   }
 
-  /* Logically, I am using these as stacks but experiments showed that using
-     vectors directly was more efficient (also I can call reserve to avoid
-     multiple calls to malloc */
-
-  /* 4 is arbitrary, it is possible to do an analysis on the Expression to find
-     the exact number needed, but I don't think it is worth it... */
-
-  static thread_local std::vector<bool> bool_temps_stack;
-  bool_temps_stack.clear();
-  // bool_temps_stack.reserve(4);
-
-  static thread_local std::vector<const Data *> data_temps_stack;
-  data_temps_stack.clear();
-  // data_temps_stack.reserve(4);
+ private:
+  enum class Type { BOOL, DATA, HEADER };
+
+  // the value of a node is in [-2^nbits, 2^nbits), or unknown if nbits is
+  // unbounded; only values with nbits <= max_nbits fit in an int64_t
+  static constexpr int unbounded = -1;
+  static constexpr int max_nbits = 63;
+
+  struct Node {
+    Op op;
+    Type type;
+    int children[3];
+    int num_children{0};
+    bool is_const{false};
+    bool bool_value{false};
+    Data data_value{};
+    int nbits{unbounded};
+  };
 
-  static thread_local std::vector<const Header *> header_temps_stack;
-  header_temps_stack.clear();
-  // header_temps_stack.reserve(4);
+  struct Reg {
+    RegType type;
+    int idx;
+  };
 
-  bool lb, rb;
-  const Data *ld, *rd;
+  // builds the expression tree for ops in [begin, end) and returns the index
+  // of the root
+  int parse(size_t begin, size_t end) {
+    std::vector<int> stacks[3];
+    auto pop = [&stacks](Type type) {
+      auto &stack = stacks[static_cast<int>(type)];
+      assert(!stack.empty());
+      const int n = stack.back();
+      stack.pop_back();
+      return n;
+    };
+    int last = -1;
+    for (size_t i = begin; i < end; i++) {
+      const Op &op = ops[i];
+      int n, l, r;
+      switch (op.opcode) {
+        case ExprOpcode::LOAD_FIELD:
+        case ExprOpcode::LOAD_CONST:
+        case ExprOpcode::LOAD_LOCAL:
+        case ExprOpcode::LOAD_REGISTER_REF:
+          n = make(op, Type::DATA, {});
+          break;
+        case ExprOpcode::LOAD_BOOL:
+          n = make(op, Type::BOOL, {});
+          break;
+        case ExprOpcode::LOAD_HEADER:
+          n = make(op, Type::HEADER, {});
+          break;
+        case ExprOpcode::LOAD_REGISTER_GEN:
+        case ExprOpcode::BIT_NEG:
+          n = make(op, Type::DATA, {pop(Type::DATA)});
+          break;
+        case ExprOpcode::ADD:
+        case ExprOpcode::SUB:
+        case ExprOpcode::MOD:
+        case ExprOpcode::MUL:
+        case ExprOpcode::SHIFT_LEFT:
+        case ExprOpcode::SHIFT_RIGHT:
+        case ExprOpcode::BIT_AND:
+        case ExprOpcode::BIT_OR:
+        case ExprOpcode::BIT_XOR:
+        case ExprOpcode::TWO_COMP_MOD:
+          r = pop(Type::DATA);
+          l = pop(Type::DATA);
+          n = make(op, Type::DATA, {l, r});
+          break;
+        case ExprOpcode::EQ_DATA:
+        case ExprOpcode::NEQ_DATA:
+        case ExprOpcode::GT_DATA:
+        case ExprOpcode::LT_DATA:
+        case ExprOpcode::GET_DATA:
+        case ExprOpcode::LET_DATA:
+          r = pop(Type::DATA);
+          l = pop(Type::DATA);
+          n = make(op, Type::BOOL, {l, r});
+          break;
+        case ExprOpcode::AND:
+        case ExprOpcode::OR:
+          r = pop(Type::BOOL);
+          l = pop(Type::BOOL);
+          n = make(op, Type::BOOL, {l, r});
+          break;
+        case ExprOpcode::NOT:
+          n = make(op, Type::BOOL, {pop(Type::BOOL)});
+          break;
+        case ExprOpcode::VALID_HEADER:
+          n = make(op, Type::BOOL, {pop(Type::HEADER)});
+          break;
+        case ExprOpcode::DATA_TO_BOOL:
+          n = make(op, Type::BOOL, {pop(Type::DATA)});
+          break;
+        case ExprOpcode::BOOL_TO_DATA:
+          n = make(op, Type::DATA, {pop(Type::BOOL)});
+          break;
+        case ExprOpcode::TERNARY_OP:
+          {
+            // see push_back_ternary_op() for the layout
+            const int cond = pop(Type::BOOL);
+            const size_t e1_begin = i + 2;
+            const size_t e1_end = i + 1 + ops[i + 1].skip_num;
+            const size_t e2_begin = e1_end + 1;
+            const size_t e2_end = e2_begin + ops[e1_end].skip_num;
+            const int e1 = parse(e1_begin, e1_end);
+            const int e2 = parse(e2_begin, e2_end);
+            n = make(op, nodes[e1].type, {cond, e1, e2});
+            i = e2_end - 1;
+          }
+          break;
+        default:
+          assert(0 && "invalid operand");
+          return -1;
+      }
+      stacks[static_cast<int>(nodes[n].type)].push_back(n);
+      last = n;
+    }
+    return last;
+  }
 
-  for (size_t i = 0; i < ops.size(); i++) {
-    const auto &op = ops[i];
-    switch (op.opcode) {
-      case ExprOpcode::LOAD_FIELD:
-        data_temps_stack.push_back(
-            &(phv.get_field(op.field.header, op.field.field_offset)));
-        break;
+  // creates a new node, which may be simplified, in which case the returned
+  // index is the one of an existing node
+  int make(const Op &op, Type type, std::initializer_list<int> children) {
+    Node node;
+    node.op = op;
+    node.type = type;
+    for (const int c : children) node.children[node.num_children++] = c;
+    nodes.push_back(std::move(node));
+    return simplify(static_cast<int>(nodes.size()) - 1);
+  }
 
-      case ExprOpcode::LOAD_HEADER:
-        header_temps_stack.push_back(&(phv.get_header(op.header)));
+  int simplify(int n) {
+    Node &node = nodes[n];
+    const int *c = node.children;
+    switch (node.op.opcode) {
+      case ExprOpcode::LOAD_CONST:
+        node.is_const = true;
+        node.data_value = const_values[node.op.const_offset];
         break;
-
       case ExprOpcode::LOAD_BOOL:
-        bool_temps_stack.push_back(op.bool_value);
+        node.is_const = true;
+        node.bool_value = node.op.bool_value;
         break;
-
-      case ExprOpcode::LOAD_CONST:
-        data_temps_stack.push_back(&const_values[op.const_offset]);
+      case ExprOpcode::AND:
+      case ExprOpcode::OR:
+        {
+          // "true and x" is "x", "false and x" is "false", and conversely for
+          // "or"
+          const bool neutral = (node.op.opcode == ExprOpcode::AND);
+          if (nodes[c[0]].is_const)
+            return (nodes[c[0]].bool_value == neutral) ? c[1] : c[0];
+          if (nodes[c[1]].is_const)
+            return (nodes[c[1]].bool_value == neutral) ? c[0] : c[1];
+        }
+        break;
+      case ExprOpcode::TERNARY_OP:
+        if (nodes[c[0]].is_const)
+          return nodes[c[0]].bool_value ? c[1] : c[2];
+        break;
+      default:
+        if (can_fold(node)) fold(&node);
         break;
+    }
+    if (node.type == Type::DATA) node.nbits = bound(node);
+    return n;
+  }
 
-      case ExprOpcode::LOAD_LOCAL:
-        data_temps_stack.push_back(&locals[op.local_offset]);
+  bool can_fold(const Node &node) const {
+    switch (node.op.opcode) {
+      // register values can change between 2 evaluations
+      case ExprOpcode::LOAD_REGISTER_GEN:
+      case ExprOpcode::VALID_HEADER:
+        return false;
+      default:
         break;
+    }
+    if (node.num_children == 0) return false;
+    for (int i = 0; i < node.num_children; i++)
+      if (!nodes[node.children[i]].is_const) return false;
+    // leave the undefined cases to the evaluation
+    const Node &right = nodes[node.children[node.num_children - 1]];
+    switch (node.op.opcode) {
+      case ExprOpcode::MOD:
+        return !right.data_value.test_eq(0);
+      case ExprOpcode::SHIFT_LEFT:
+      case ExprOpcode::SHIFT_RIGHT:
+        return right.data_value >= Data(0);
+      default:
+        return true;
+    }
+  }
+
+  void fold(Node *node) {
+    const int *c = node->children;
+    const Data &a = nodes[c[0]].data_value;
+    const Data &b = nodes[c[node->num_children - 1]].data_value;
+    const bool ab = nodes[c[0]].bool_value;
+    Data &v = node->data_value;
+    bool &vb = node->bool_value;
+    switch (node->op.opcode) {
+      case ExprOpcode::ADD: v.add(a, b); break;
+      case ExprOpcode::SUB: v.sub(a, b); break;
+      case ExprOpcode::MOD: v.mod(a, b); break;
+      case ExprOpcode::MUL: v.multiply(a, b); break;
+      case ExprOpcode::SHIFT_LEFT: v.shift_left(a, b); break;
+      case ExprOpcode::SHIFT_RIGHT: v.shift_right(a, b); break;
+      case ExprOpcode::BIT_AND: v.bit_and(a, b); break;
+      case ExprOpcode::BIT_OR: v.bit_or(a, b); break;
+      case ExprOpcode::BIT_XOR: v.bit_xor(a, b); break;
+      case ExprOpcode::BIT_NEG: v.bit_neg(a); break;
+      case ExprOpcode::TWO_COMP_MOD: v.two_comp_mod(a, b); break;
+      case ExprOpcode::EQ_DATA: vb = (a == b); break;
+      case ExprOpcode::NEQ_DATA: vb = (a != b); break;
+      case ExprOpcode::GT_DATA: vb = (a > b); break;
+      case ExprOpcode::LT_DATA: vb = (a < b); break;
+      case ExprOpcode::GET_DATA: vb = (a >= b); break;
+      case ExprOpcode::LET_DATA: vb = (a <= b); break;
+      case ExprOpcode::NOT: vb = !ab; break;
+      case ExprOpcode::DATA_TO_BOOL: vb = !a.test_eq(0); break;
+      case ExprOpcode::BOOL_TO_DATA: v.set(static_cast<int>(ab)); break;
+      default:
+        assert(0 && "cannot fold op");
+        return;
+    }
+    node->is_const = true;
+  }
+
+  static int const_nbits(const Data &v) {
+    for (int m = 0; m < max_nbits; m++) {
+      const int64_t limit = static_cast<int64_t>(1) << m;
+      if (v >= Data(-limit) && v < Data(limit)) return m;
+    }
+    if (v >= Data(std::numeric_limits<int64_t>::min()) &&
+        v <= Data(std::numeric_limits<int64_t>::max())) {
+      return max_nbits;
+    }
+    return unbounded;
+  }
 
+  // computes nbits for a data node (see Node), assuming nbits has already
+  // been computed for its children
+  int bound(const Node &node) const {
+    if (node.is_const) return const_nbits(node.data_value);
+    const int *c = node.children;
+    auto nb = [this, c](int i) { return nodes[c[i]].nbits; };
+    auto const_int = [this, c](int i, int64_t min, int64_t max, int *v) {
+      if (!nodes[c[i]].is_const) return false;
+      const Data &d = nodes[c[i]].data_value;
+      if (d < Data(min) || d > Data(max)) return false;
+      *v = d.get<int>();
+      return true;
+    };
+    int m = unbounded;
+    int k;
+    switch (node.op.opcode) {
+      case ExprOpcode::LOAD_FIELD:
+        // a field value is always in [-2^(n-1), 2^n), the lower bound being
+        // only reachable by signed fields
+        if (node.op.field.nbits > 0) m = node.op.field.nbits;
+        break;
       case ExprOpcode::LOAD_REGISTER_REF:
-        data_temps_stack.push_back(
-            &op.register_ref.array->at(op.register_ref.idx));
+        m = node.op.register_ref.array->get_bitwidth();
         break;
-
       case ExprOpcode::LOAD_REGISTER_GEN:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps_stack.push_back(&op.register_array->at(rd->get<size_t>()));
+        m = node.op.register_array->get_bitwidth();
         break;
-
       case ExprOpcode::ADD:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].add(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
-        break;
-
       case ExprOpcode::SUB:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].sub(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+        if (nb(0) >= 0 && nb(1) >= 0) m = std::max(nb(0), nb(1)) + 1;
         break;
-
       case ExprOpcode::MUL:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].multiply(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+        if (nb(0) >= 0 && nb(1) >= 0) m = nb(0) + nb(1) + 1;
         break;
-
       case ExprOpcode::SHIFT_LEFT:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].shift_left(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+        if (nb(0) >= 0 && const_int(1, 0, max_nbits, &k)) m = nb(0) + k;
         break;
-
       case ExprOpcode::SHIFT_RIGHT:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].shift_right(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+        if (nb(0) >= 0 && nb(1) >= 0) m = nb(0);
         break;
-
-      case ExprOpcode::EQ_DATA:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        bool_temps_stack.push_back(*ld == *rd);
+      case ExprOpcode::BIT_AND:
+      case ExprOpcode::BIT_OR:
+      case ExprOpcode::BIT_XOR:
+        if (nb(0) >= 0 && nb(1) >= 0) m = std::max(nb(0), nb(1));
         break;
-
-      case ExprOpcode::NEQ_DATA:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        bool_temps_stack.push_back(*ld != *rd);
+      case ExprOpcode::BIT_NEG:
+        m = nb(0);
         break;
-
-      case ExprOpcode::GT_DATA:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        bool_temps_stack.push_back(*ld > *rd);
+      case ExprOpcode::TWO_COMP_MOD:
+        if (nb(0) >= 0 && const_int(1, 1, max_nbits - 1, &k)) m = k - 1;
         break;
-
-      case ExprOpcode::LT_DATA:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        bool_temps_stack.push_back(*ld < *rd);
+      case ExprOpcode::BOOL_TO_DATA:
+        m = 1;
         break;
-
-      case ExprOpcode::GET_DATA:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        bool_temps_stack.push_back(*ld >= *rd);
+      case ExprOpcode::TERNARY_OP:
+        if (nb(1) >= 0 && nb(2) >= 0) m = std::max(nb(1), nb(2));
         break;
-
-      case ExprOpcode::LET_DATA:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        bool_temps_stack.push_back(*ld <= *rd);
+      default:  // LOAD_LOCAL, MOD
         break;
+    }
+    return (m > max_nbits) ? unbounded : m;
+  }
 
-      case ExprOpcode::AND:
-        rb = bool_temps_stack.back(); bool_temps_stack.pop_back();
-        lb = bool_temps_stack.back(); bool_temps_stack.pop_back();
-        bool_temps_stack.push_back(lb && rb);
-        break;
+  bool is_int(int n) const {
+    return nodes[n].type == Type::DATA && nodes[n].nbits >= 0;
+  }
 
+  Reg new_reg(RegType type) {
+    switch (type) {
+      case RegType::INT:
+        return {type, program->num_int_regs++};
+      case RegType::DATA:
+        return {type, program->num_data_regs++};
+      case RegType::BOOL:
+        return {type, program->num_bool_regs++};
+    }
+    return {type, -1};
+  }
+
+  size_t push(Opcode opcode, Reg dst, int src1 = -1, int src2 = -1) {
+    Instr instr;
+    instr.opcode = opcode;
+    instr.cmp = EQ;
+    instr.dst = dst.idx;
+    instr.src1 = src1;
+    instr.src2 = src2;
+    instr.imm = 0;
+    program->instrs.push_back(instr);
+    return program->instrs.size() - 1;
+  }
+
+  Instr &last() { return program->instrs.back(); }
+
+  void patch(size_t jump) {
+    program->instrs[jump].target = program->instrs.size();
+  }
+
+  Reg to_data(Reg r) {
+    if (r.type == RegType::DATA) return r;
+    assert(r.type == RegType::INT);
+    const Reg dst = new_reg(RegType::DATA);
+    push(D_FROM_INT, dst, r.idx);
+    return dst;
+  }
+
+  Reg to_int(Reg r) {
+    if (r.type == RegType::INT) return r;
+    assert(r.type == RegType::DATA);
+    const Reg dst = new_reg(RegType::INT);
+    push(I_FROM_DATA, dst, r.idx);
+    return dst;
+  }
+
+  void move(Reg dst, Reg src) {
+    if (dst.type == RegType::DATA && src.type == RegType::INT) {
+      push(D_FROM_INT, dst, src.idx);
+      return;
+    }
+    assert(dst.type == src.type);
+    switch (dst.type) {
+      case RegType::INT: push(I_MOV, dst, src.idx); break;
+      case RegType::DATA: push(D_MOV, dst, src.idx); break;
+      case RegType::BOOL: push(B_MOV, dst, src.idx); break;
+    }
+  }
+
+  static bool get_cmp(ExprOpcode opcode, Cmp *cmp) {
+    switch (opcode) {
+      case ExprOpcode::EQ_DATA: *cmp = EQ; return true;
+      case ExprOpcode::NEQ_DATA: *cmp = NE; return true;
+      case ExprOpcode::GT_DATA: *cmp = GT; return true;
+      case ExprOpcode::LT_DATA: *cmp = LT; return true;
+      case ExprOpcode::GET_DATA: *cmp = GE; return true;
+      case ExprOpcode::LET_DATA: *cmp = LE; return true;
+      default: return false;
+    }
+  }
+
+  static Cmp negate(Cmp cmp) {
+    static const Cmp negated[] = {NE, EQ, LE, GE, LT, GT};
+    return negated[cmp];
+  }
+
+  // emits a jump which is taken iff the value of bool node n is jump_if; the
+  // jump target needs to be patched by the caller
+  size_t emit_branch(int n, bool jump_if) {
+    const Node &node = nodes[n];
+    Cmp cmp;
+    if (!node.is_const && get_cmp(node.op.opcode, &cmp) &&
+        is_int(node.children[0]) && is_int(node.children[1])) {
+      const Reg a = emit(node.children[0]);
+      const Reg b = emit(node.children[1]);
+      const size_t jump = push(JUMP_IF_NOT_CMP_I, {RegType::BOOL, -1},
+                               a.idx, b.idx);
+      last().cmp = jump_if ? negate(cmp) : cmp;
+      return jump;
+    }
+    const Reg r = emit(n);
+    return push(jump_if ? JUMP_IF_TRUE : JUMP_IF_FALSE, {RegType::BOOL, -1},
+                r.idx);
+  }
+
+  Reg emit_data_op(const Node &node, Opcode i_opcode, Opcode d_opcode) {
+    const int *c = node.children;
+    if (node.nbits >= 0) {
+      const Reg a = emit(c[0]);
+      const Reg b = (node.num_children > 1) ? emit(c[1]) : a;
+      assert(a.type == RegType::INT && b.type == RegType::INT);
+      const Reg dst = new_reg(RegType::INT);
+      push(i_opcode, dst, a.idx, b.idx);
+      return dst;
+    }
+    const Reg a = to_data(emit(c[0]));
+    const Reg b = (node.num_children > 1) ? to_data(emit(c[1])) : a;
+    const Reg dst = new_reg(RegType::DATA);
+    push(d_opcode, dst, a.idx, b.idx);
+    return dst;
+  }
+
+  Reg emit(int n) {
+    const Node &node = nodes[n];
+    const Op &op = node.op;
+    const int *c = node.children;
+    Reg dst;
+
+    if (node.is_const) {
+      if (node.type == Type::BOOL) {
+        dst = new_reg(RegType::BOOL);
+        push(B_LOAD, dst);
+        last().bool_value = node.bool_value;
+      } else if (node.nbits >= 0) {
+        dst = new_reg(RegType::INT);
+        push(I_LOAD_IMM, dst);
+        last().imm = node.data_value.get<int64_t>();
+      } else {
+        program->consts.push_back(node.data_value);
+        dst = new_reg(RegType::DATA);
+        push(D_LOAD_CONST, dst);
+        last().const_offset = static_cast<int>(program->consts.size()) - 1;
+      }
+      return dst;
+    }
+
+    Cmp cmp;
+    if (get_cmp(op.opcode, &cmp)) {
+      const Reg a = emit(c[0]);
+      const Reg b = emit(c[1]);
+      dst = new_reg(RegType::BOOL);
+      if (a.type == RegType::INT && b.type == RegType::INT)
+        push(B_CMP_I, dst, a.idx, b.idx);
+      else
+        push(B_CMP_D, dst, to_data(a).idx, to_data(b).idx);
+      last().cmp = cmp;
+      return dst;
+    }
+
+    switch (op.opcode) {
+      case ExprOpcode::LOAD_FIELD:
+        dst = new_reg(node.nbits >= 0 ? RegType::INT : RegType::DATA);
+        push(node.nbits >= 0 ? I_LOAD_FIELD : D_LOAD_FIELD, dst);
+        last().field = {op.field.header, op.field.field_offset};
+        break;
+      case ExprOpcode::LOAD_LOCAL:
+        dst = new_reg(RegType::DATA);
+        push(D_LOAD_LOCAL, dst);
+        last().local_offset = op.local_offset;
+        break;
+      case ExprOpcode::LOAD_REGISTER_REF:
+        dst = new_reg(node.nbits >= 0 ? RegType::INT : RegType::DATA);
+        push(node.nbits >= 0 ? I_LOAD_REGISTER_REF : D_LOAD_REGISTER_REF, dst);
+        last().register_ref = {op.register_ref.array, op.register_ref.idx};
+        break;
+      case ExprOpcode::LOAD_REGISTER_GEN:
+        {
+          const Reg idx = to_int(emit(c[0]));
+          dst = new_reg(node.nbits >= 0 ? RegType::INT : RegType::DATA);
+          push(node.nbits >= 0 ? I_LOAD_REGISTER_GEN : D_LOAD_REGISTER_GEN,
+               dst, idx.idx);
+          last().register_array = op.register_array;
+        }
+        break;
+      case ExprOpcode::ADD: return emit_data_op(node, I_ADD, D_ADD);
+      case ExprOpcode::SUB: return emit_data_op(node, I_SUB, D_SUB);
+      case ExprOpcode::MUL: return emit_data_op(node, I_MUL, D_MUL);
+      // MOD is never bounded, so there is no integer version
+      case ExprOpcode::MOD: return emit_data_op(node, I_MOV, D_MOD);
+      case ExprOpcode::SHIFT_LEFT: return emit_data_op(node, I_SHL, D_SHL);
+      case ExprOpcode::SHIFT_RIGHT: return emit_data_op(node, I_SHR, D_SHR);
+      case ExprOpcode::BIT_AND: return emit_data_op(node, I_AND, D_AND);
+      case ExprOpcode::BIT_OR: return emit_data_op(node, I_OR, D_OR);
+      case ExprOpcode::BIT_XOR: return emit_data_op(node, I_XOR, D_XOR);
+      case ExprOpcode::BIT_NEG: return emit_data_op(node, I_NEG, D_NEG);
+      case ExprOpcode::TWO_COMP_MOD:
+        return emit_data_op(node, I_TWO_COMP_MOD, D_TWO_COMP_MOD);
+      case ExprOpcode::AND:
       case ExprOpcode::OR:
-        rb = bool_temps_stack.back(); bool_temps_stack.pop_back();
-        lb = bool_temps_stack.back(); bool_temps_stack.pop_back();
-        bool_temps_stack.push_back(lb || rb);
+        {
+          const bool is_and = (op.opcode == ExprOpcode::AND);
+          dst = new_reg(RegType::BOOL);
+          push(B_LOAD, dst);
+          last().bool_value = !is_and;
+          const size_t jump = emit_branch(c[0], !is_and);
+          move(dst, emit(c[1]));
+          patch(jump);
+        }
         break;
-
       case ExprOpcode::NOT:
-        rb = bool_temps_stack.back(); bool_temps_stack.pop_back();
-        bool_temps_stack.push_back(!rb);
+        dst = new_reg(RegType::BOOL);
+        push(B_NOT, dst, emit(c[0]).idx);
         break;
-
-      case ExprOpcode::BIT_AND:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].bit_and(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+      case ExprOpcode::VALID_HEADER:
+        dst = new_reg(RegType::BOOL);
+        push(B_VALID, dst);
+        last().header = nodes[c[0]].op.header;
         break;
-
-      case ExprOpcode::BIT_OR:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].bit_or(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+      case ExprOpcode::DATA_TO_BOOL:
+        {
+          const Reg src = emit(c[0]);
+          dst = new_reg(RegType::BOOL);
+          push(src.type == RegType::INT ? B_FROM_INT : B_FROM_DATA, dst,
+               src.idx);
+        }
         break;
-
-      case ExprOpcode::BIT_XOR:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].bit_xor(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+      case ExprOpcode::BOOL_TO_DATA:
+        dst = new_reg(RegType::INT);
+        push(I_FROM_BOOL, dst, emit(c[0]).idx);
         break;
-
-      case ExprOpcode::BIT_NEG:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].bit_neg(*rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+      case ExprOpcode::TERNARY_OP:
+        {
+          if (node.type == Type::BOOL)
+            dst = new_reg(RegType::BOOL);
+          else
+            dst = new_reg(node.nbits >= 0 ? RegType::INT : RegType::DATA);
+          const size_t jump_false = emit_branch(c[0], false);
+          move(dst, emit(c[1]));
+          const size_t jump_end = push(JUMP, {RegType::BOOL, -1});
+          patch(jump_false);
+          move(dst, emit(c[2]));
+          patch(jump_end);
+        }
         break;
-
-      case ExprOpcode::VALID_HEADER:
-        bool_temps_stack.push_back(header_temps_stack.back()->is_valid());
-        header_temps_stack.pop_back();
+      default:
+        assert(0 && "invalid operand");
         break;
+    }
+    return dst;
+  }
 
-      case ExprOpcode::TERNARY_OP:
-        if (bool_temps_stack.back())
-          i += 1;
-        bool_temps_stack.pop_back();
+  const std::vector<Op> &ops;
+  const std::vector<Data> &const_values;
+  Program *program;
+  std::vector<Node> nodes{};
+};
+
+constexpr int Expression::Program::Compiler::unbounded;
+constexpr int Expression::Program::Compiler::max_nbits;
+
+void
+Expression::build() {
+  std::shared_ptr<Program> new_program(new Program());
+  Program::Compiler compiler(ops, const_values, new_program.get());
+  compiler.compile();
+  program = std::move(new_program);
+  built = true;
+}
+
+void
+Expression::grab_register_accesses(RegisterSync *register_sync) const {
+  for (auto &op : ops) {
+    switch (op.opcode) {
+      case ExprOpcode::LOAD_REGISTER_REF:
+      case ExprOpcode::LOAD_REGISTER_GEN:
+        register_sync->add_register_array(op.register_array);
         break;
+      default:
+        continue;
+    }
+  }
+}
 
-      case ExprOpcode::SKIP:
-        i += op.skip_num;
+bool
+Expression::get_phv_dependencies(
+    std::vector<std::pair<header_id_t, int> > *fields,
+    std::vector<header_id_t> *headers) const {
+  for (auto &op : ops) {
+    switch (op.opcode) {
+      case ExprOpcode::LOAD_FIELD:
+        fields->emplace_back(op.field.header, op.field.field_offset);
+        break;
+      case ExprOpcode::LOAD_HEADER:
+        headers->push_back(op.header);
         break;
+      case ExprOpcode::LOAD_LOCAL:
+      case ExprOpcode::LOAD_REGISTER_REF:
+      case ExprOpcode::LOAD_REGISTER_GEN:
+        return false;
+      default:
+        continue;
+    }
+  }
+  return true;
+}
 
-      case ExprOpcode::TWO_COMP_MOD:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        ld = data_temps_stack.back(); data_temps_stack.pop_back();
-        data_temps[op.data_dest_index].two_comp_mod(*ld, *rd);
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+/* The registers are thread_local variables which are only ever grown, to avoid
+   dynamic allocation at each call */
+void
+Expression::eval_(const PHV &phv, ExprType expr_type,
+                  const std::vector<Data> &locals,
+                  bool *b_res, Data *d_res) const {
+  assert(built);
+  const Program &p = *program;
+
+  static thread_local std::vector<int64_t> int_regs;
+  static thread_local std::vector<const Data *> data_regs;
+  // storage for the data registers which are not just pointers to existing
+  // values
+  static thread_local std::vector<Data> data_temps;
+  // std::vector<bool> is too slow
+  static thread_local std::vector<char> bool_regs;
+  if (int_regs.size() < static_cast<size_t>(p.num_int_regs))
+    int_regs.resize(p.num_int_regs);
+  if (data_regs.size() < static_cast<size_t>(p.num_data_regs)) {
+    data_regs.resize(p.num_data_regs);
+    data_temps.resize(p.num_data_regs);
+  }
+  if (bool_regs.size() < static_cast<size_t>(p.num_bool_regs))
+    bool_regs.resize(p.num_bool_regs);
+
+  int64_t *I = int_regs.data();
+  const Data **D = data_regs.data();
+  Data *T = data_temps.data();
+  char *B = bool_regs.data();
+
+  const Program::Instr *instrs = p.instrs.data();
+  const size_t num_instrs = p.instrs.size();
+  size_t pc = 0;
+  while (pc < num_instrs) {
+    const Program::Instr &in = instrs[pc];
+    switch (in.opcode) {
+      case Program::I_LOAD_FIELD:
+        I[in.dst] = phv.get_field(in.field.header, in.field.field_offset)
+            .get<int64_t>();
+        break;
+      case Program::I_LOAD_REGISTER_REF:
+        I[in.dst] = in.register_ref.array->at(in.register_ref.idx)
+            .get<int64_t>();
+        break;
+      case Program::I_LOAD_REGISTER_GEN:
+        I[in.dst] = in.register_array->at(static_cast<size_t>(I[in.src1]))
+            .get<int64_t>();
+        break;
+      case Program::I_LOAD_IMM:
+        I[in.dst] = in.imm;
+        break;
+      // the compiler guarantees that none of these overflow
+      case Program::I_ADD:
+        I[in.dst] = I[in.src1] + I[in.src2];
+        break;
+      case Program::I_SUB:
+        I[in.dst] = I[in.src1] - I[in.src2];
+        break;
+      case Program::I_MUL:
+        I[in.dst] = I[in.src1] * I[in.src2];
+        break;
+      case Program::I_SHL:
+        I[in.dst] = static_cast<int64_t>(
+            static_cast<uint64_t>(I[in.src1]) << I[in.src2]);
+        break;
+      case Program::I_SHR:
+        assert(I[in.src2] >= 0);
+        if (I[in.src2] >= 63)
+          I[in.dst] = (I[in.src1] < 0) ? -1 : 0;
+        else
+          I[in.dst] = I[in.src1] >> I[in.src2];
+        break;
+      case Program::I_AND:
+        I[in.dst] = I[in.src1] & I[in.src2];
+        break;
+      case Program::I_OR:
+        I[in.dst] = I[in.src1] | I[in.src2];
+        break;
+      case Program::I_XOR:
+        I[in.dst] = I[in.src1] ^ I[in.src2];
+        break;
+      case Program::I_NEG:
+        I[in.dst] = ~I[in.src1];
+        break;
+      case Program::I_TWO_COMP_MOD:
+        {
+          // same as Data::two_comp_mod, the width is in [1, 62]
+          const int64_t v = I[in.src1];
+          const int64_t w = I[in.src2];
+          const int64_t max = (static_cast<int64_t>(1) << (w - 1)) - 1;
+          const int64_t min = -(static_cast<int64_t>(1) << (w - 1));
+          if (v < min || v > max) {
+            const uint64_t mask = (static_cast<uint64_t>(1) << w) - 1;
+            int64_t r = static_cast<int64_t>(static_cast<uint64_t>(v) & mask);
+            if (r > max) r -= (static_cast<int64_t>(1) << w);
+            I[in.dst] = r;
+          } else {
+            I[in.dst] = v;
+          }
+        }
+        break;
+      case Program::I_FROM_BOOL:
+        I[in.dst] = B[in.src1] ? 1 : 0;
+        break;
+      case Program::I_FROM_DATA:
+        I[in.dst] = static_cast<int64_t>(D[in.src1]->get<size_t>());
+        break;
+      case Program::I_MOV:
+        I[in.dst] = I[in.src1];
         break;
 
-      case ExprOpcode::DATA_TO_BOOL:
-        rd = data_temps_stack.back(); data_temps_stack.pop_back();
-        bool_temps_stack.push_back(!rd->test_eq(0));
+      case Program::D_LOAD_FIELD:
+        D[in.dst] = &phv.get_field(in.field.header, in.field.field_offset);
+        break;
+      case Program::D_LOAD_CONST:
+        D[in.dst] = &p.consts[in.const_offset];
+        break;
+      case Program::D_LOAD_LOCAL:
+        D[in.dst] = &locals[in.local_offset];
+        break;
+      case Program::D_LOAD_REGISTER_REF:
+        D[in.dst] = &in.register_ref.array->at(in.register_ref.idx);
+        break;
+      case Program::D_LOAD_REGISTER_GEN:
+        D[in.dst] = &in.register_array->at(static_cast<size_t>(I[in.src1]));
+        break;
+      case Program::D_FROM_INT:
+        T[in.dst].set(I[in.src1]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_ADD:
+        T[in.dst].add(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_SUB:
+        T[in.dst].sub(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_MUL:
+        T[in.dst].multiply(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_MOD:
+        T[in.dst].mod(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_SHL:
+        T[in.dst].shift_left(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_SHR:
+        T[in.dst].shift_right(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_AND:
+        T[in.dst].bit_and(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_OR:
+        T[in.dst].bit_or(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_XOR:
+        T[in.dst].bit_xor(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_NEG:
+        T[in.dst].bit_neg(*D[in.src1]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_TWO_COMP_MOD:
+        T[in.dst].two_comp_mod(*D[in.src1], *D[in.src2]);
+        D[in.dst] = &T[in.dst];
+        break;
+      case Program::D_MOV:
+        D[in.dst] = D[in.src1];
         break;
 
-      case ExprOpcode::BOOL_TO_DATA:
-        rb = bool_temps_stack.back(); bool_temps_stack.pop_back();
-        data_temps[op.data_dest_index].set(static_cast<int>(rb));
-        data_temps_stack.push_back(&data_temps[op.data_dest_index]);
+      case Program::B_LOAD:
+        B[in.dst] = in.bool_value;
+        break;
+      case Program::B_VALID:
+        B[in.dst] = phv.get_header(in.header).is_valid();
+        break;
+      case Program::B_NOT:
+        B[in.dst] = !B[in.src1];
+        break;
+      case Program::B_MOV:
+        B[in.dst] = B[in.src1];
+        break;
+      case Program::B_FROM_INT:
+        B[in.dst] = (I[in.src1] != 0);
+        break;
+      case Program::B_FROM_DATA:
+        B[in.dst] = !D[in.src1]->test_eq(0);
+        break;
+      case Program::B_CMP_I:
+        B[in.dst] = Program::compare(in.cmp, I[in.src1], I[in.src2]);
+        break;
+      case Program::B_CMP_D:
+        B[in.dst] = Program::compare(in.cmp, *D[in.src1], *D[in.src2]);
         break;
 
-      default:
-        assert(0 && "invalid operand");
+      case Program::JUMP:
+        pc = in.target;
+        continue;
+      case Program::JUMP_IF_TRUE:
+        if (B[in.src1]) {
+          pc = in.target;
+          continue;
+        }
+        break;
+      case Program::JUMP_IF_FALSE:
+        if (!B[in.src1]) {
+          pc = in.target;
+          continue;
+        }
+        break;
+      case Program::JUMP_IF_NOT_CMP_I:
+        if (!Program::compare(in.cmp, I[in.src1], I[in.src2])) {
+          pc = in.target;
+          continue;
+        }
         break;
     }
+    pc++;
   }
 
   switch (expr_type) {
     case ExprType::EXPR_BOOL:
-      *b_res = bool_temps_stack.back();
+      assert(p.result_type == Program::RegType::BOOL);
+      *b_res = B[p.result_reg];
       break;
     case ExprType::EXPR_DATA:
-      d_res->set(*(data_temps_stack.back()));
+      if (p.result_type == Program::RegType::INT) {
+        d_res->set(I[p.result_reg]);
+      } else {
+        assert(p.result_type == Program::RegType::DATA);
+        d_res->set(*D[p.result_reg]);
+      }
       break;
   }
 }
@@ -467,100 +1160,6 @@ Expression::eval_arith(const PHV &phv, Data *data,
   eval_(phv, ExprType::EXPR_DATA, locals, nullptr, data);
 }
 
-// TODO(antonin): If there is a ternary op, we will over-estimate this number,
-// see if there is an easy fix
-int
-Expression::assign_dest_registers() {
-  int registers_cnt = 0;
-  int registers_curr = 0;
-  std::stack<int> new_registers;
-  for (auto &op : ops) {
-    switch (op.opcode) {
-      case ExprOpcode::ADD:
-      case ExprOpcode::SUB:
-      case ExprOpcode::MOD:
-      case ExprOpcode::MUL:
-      case ExprOpcode::SHIFT_LEFT:
-      case ExprOpcode::SHIFT_RIGHT:
-      case ExprOpcode::BIT_AND:
-      case ExprOpcode::BIT_OR:
-      case ExprOpcode::BIT_XOR:
-      case ExprOpcode::TWO_COMP_MOD:
-        registers_curr -= new_registers.top();
-        new_registers.pop();
-        registers_curr -= new_registers.top();
-        new_registers.pop();
-
-        op.data_dest_index = registers_curr;
-
-        new_registers.push(1);
-        registers_curr += 1;
-        break;
-
-      case ExprOpcode::BIT_NEG:
-        registers_curr -= new_registers.top();
-        new_registers.pop();
-
-        op.data_dest_index = registers_curr;
-
-        new_registers.push(1);
-        registers_curr += 1;
-        break;
-
-      case ExprOpcode::BOOL_TO_DATA:
-        op.data_dest_index = registers_curr;
-
-        new_registers.push(1);
-        registers_curr += 1;
-        break;
-
-      // added recently; not necessary but could decrease number of registers
-      case ExprOpcode::EQ_DATA:
-      case ExprOpcode::NEQ_DATA:
-      case ExprOpcode::GT_DATA:
-      case ExprOpcode::LT_DATA:
-      case ExprOpcode::GET_DATA:
-      case ExprOpcode::LET_DATA:
-        registers_curr -= new_registers.top();
-        new_registers.pop();
-        registers_curr -= new_registers.top();
-        new_registers.pop();
-        break;
-
-      case ExprOpcode::DATA_TO_BOOL:
-        registers_curr -= new_registers.top();
-        new_registers.pop();
-        break;
-
-      case ExprOpcode::LOAD_CONST:
-      case ExprOpcode::LOAD_LOCAL:
-      case ExprOpcode::LOAD_FIELD:
-      case ExprOpcode::LOAD_REGISTER_REF:
-        new_registers.push(0);
-        break;
-
-      case ExprOpcode::LOAD_REGISTER_GEN:
-        registers_curr -= new_registers.top();
-        new_registers.pop();
-
-        new_registers.push(0);
-        break;
-
-      // here to emphasize the fact that with my skip implementation choice,
-      // nothing special needs to be done here
-      case ExprOpcode::TERNARY_OP:
-        break;
-
-      default:
-        break;
-    }
-
-    registers_cnt = std::max(registers_cnt, registers_curr);
-  }
-
-  return registers_cnt;
-}
-
 VLHeaderExpression::VLHeaderExpression(const ArithExpression &expr)
     : expr(expr) {
   for (const Op &op : expr.ops) {
@@ -588,8 +1187,11 @@ VLHeaderExpression::resolve(header_id_t header_id) {
       op.opcode = ExprOpcode::LOAD_FIELD;
       op.field.field_offset = op.local_offset;
       op.field.header = header_id;
+      op.field.nbits = 0;
     }
   }
+  // the program needs to be re-compiled since the ops have changed
+  new_expr.build();
   return new_expr;
 }
 
@@ -32,6 +32,15 @@ namespace bm {
 static_assert(sizeof(LearnEngine::msg_hdr_t) == 32u,
               "Invalid size for learning notification header");
 
+constexpr size_t LearnEngine::SampleStage::ring_size;
+constexpr size_t LearnEngine::SampleStage::max_recent;
+
+namespace {
+
+std::atomic<uint64_t> next_list_uid{0};
+
+}  // namespace
+
 void
 LearnEngine::LearnSampleBuilder::push_back_constant(
     const ByteContainer &constant) {
@@ -75,7 +84,8 @@ LearnEngine::LearnSampleBuilder::operator()(const PHV &phv,
 LearnEngine::LearnList::LearnList(list_id_t list_id, int device_id, int cxt_id,
                                   size_t max_samples, unsigned int timeout)
     : list_id(list_id), device_id(device_id), cxt_id(cxt_id),
-      max_samples(max_samples), timeout(timeout), with_timeout(timeout > 0) { }
+      max_samples(max_samples), timeout(timeout), with_timeout(timeout > 0),
+      uid(next_list_uid++) { }
 
 void
 LearnEngine::LearnList::init() {
@@ -159,26 +169,84 @@ LearnEngine::LearnList::process_full_buffer(LockType &lock) {
   b_can_send.notify_one();
 }
 
-void
-LearnEngine::LearnList::add_sample(const PHV &phv) {
-  static thread_local ByteContainer sample;
-  sample.clear();
-  builder(phv, &sample);
-
-  LockType lock(mutex);
+LearnEngine::SampleStage *
+LearnEngine::LearnList::get_stage() {
+  // stages are only destroyed with the list and uids are never re-used, so
+  // caching raw pointers is safe
+  static thread_local std::unordered_map<uint64_t, SampleStage *> my_stages;
+  auto it = my_stages.find(uid);
+  if (it != my_stages.end()) return it->second;
+  std::unique_lock<std::mutex> lock(stages_mutex);
+  stages.emplace_back(new SampleStage());
+  SampleStage *stage = stages.back().get();
+  my_stages[uid] = stage;
+  return stage;
+}
 
+void
+LearnEngine::LearnList::add_sample_(const ByteContainer &sample) {
   const auto it = filter.find(sample);
   if (it != filter.end()) return;
 
   buffer.insert(buffer.end(), sample.begin(), sample.end());
   num_samples++;
-  auto filter_it = filter.insert(filter.end(), std::move(sample));
+  auto filter_it = filter.insert(filter.end(), sample);
   FilterPtrs &filter_ptrs = old_buffers[buffer_id];
   filter_ptrs.unacked_count++;
   filter_ptrs.buffer.push_back(filter_it);
 
+  if (num_samples == 1) buffer_started = clock::now();
+}
+
+// called by the transmit thread only, so buffer_tmp is not being sent
+void
+LearnEngine::LearnList::merge_staged_samples() {
+  static thread_local ByteContainer sample;
+  std::unique_lock<std::mutex> lock(stages_mutex);
+  for (auto &stage : stages) {
+    while (buffer_tmp.size() == 0 && stage->ring.try_pop(&sample)) {
+      add_sample_(sample);
+      if (num_samples >= max_samples) swap_buffers();
+    }
+  }
+}
+
+void
+LearnEngine::LearnList::add_sample(const PHV &phv) {
+  static thread_local ByteContainer sample;
+  sample.clear();
+  builder(phv, &sample);
+
+  SampleStage *stage = get_stage();
+
+  // drop samples which this thread knows are already in the filter, without
+  // taking the mutex
+  const uint64_t generation = filter_generation.load();
+  if (stage->generation != generation) {
+    stage->recent.clear();
+    stage->generation = generation;
+  }
+  if (stage->recent.find(sample) != stage->recent.end()) return;
+  if (stage->recent.size() >= SampleStage::max_recent) stage->recent.clear();
+  stage->recent.insert(sample);
+
+  if (stage->ring.try_push(sample)) {
+    // only the first sample staged since the transmit thread last looked at
+    // the rings needs to wake it up
+    if (staged_count.fetch_add(1) == 0) {
+      LockType lock(mutex);
+      b_can_send.notify_one();
+    }
+    return;
+  }
+
+  // the ring is full, the transmit thread cannot keep up: we add the sample
+  // directly to the buffer, which slows down this thread
+  LockType lock(mutex);
+  size_t num_samples_prev = num_samples;
+  add_sample_(sample);
+  if (num_samples == num_samples_prev) return;
   if (num_samples == 1 && max_samples > 1) {
-    buffer_started = clock::now();
     // wake transmit thread to update cond var wait time
     b_can_send.notify_one();
   } else if (num_samples >= max_samples) {
@@ -191,15 +259,24 @@ LearnEngine::LearnList::buffer_transmit() {
   size_t num_samples_to_send;
   LockType lock(mutex);
   clock::time_point now = clock::now();
-  while (!stop_transmit_thread &&
-         buffer_tmp.size() == 0 &&
-         (!with_timeout ||
-          num_samples == 0 ||
-          now < (buffer_started + timeout))) {
+  while (!stop_transmit_thread) {
+    // reset before looking at the rings: a sample staged after that will
+    // either be merged now or increment the count (and wake us up)
+    staged_count = 0;
+    merge_staged_samples();
+    if (buffer_tmp.size() != 0 ||
+        (with_timeout && num_samples > 0 &&
+         now >= (buffer_started + timeout))) {
+      break;
+    }
+    if (staged_count > 0) {
+      now = clock::now();
+      continue;
+    }
     if (with_timeout && num_samples > 0) {
-      b_can_send.wait_until(lock, buffer_started + timeout);
+      VirtualTime::wait_until(&b_can_send, &lock, buffer_started + timeout);
     } else {
-      b_can_send.wait(lock);
+      VirtualTime::wait(&b_can_send, &lock);
     }
     now = clock::now();
   }
@@ -275,6 +352,7 @@ LearnEngine::LearnList::ack(buffer_id_t buffer_id,
   // we assume that this was acked already, and simply return
   if (it == old_buffers.end())
     return;
+  filter_generation++;
   FilterPtrs &filter_ptrs = it->second;
   for (int sample_id : sample_ids) {
     // what happens if bad input :(
@@ -293,6 +371,7 @@ LearnEngine::LearnList::ack_buffer(buffer_id_t buffer_id) {
   // we assume that this was acked already, and simply return
   if (it == old_buffers.end())
     return;
+  filter_generation++;
   FilterPtrs &filter_ptrs = it->second;
   // we optimize for this case (no learning occured since the buffer as sent out
   // and the ack clears out the filter
@@ -316,6 +395,15 @@ LearnEngine::LearnList::reset_state() {
   filter.clear();
   old_buffers.clear();
   buffer_tmp.clear();
+  // discard staged samples
+  {
+    ByteContainer sample;
+    std::unique_lock<std::mutex> stages_lock(stages_mutex);
+    for (auto &stage : stages)
+      while (stage->ring.try_pop(&sample)) { }
+  }
+  staged_count = 0;
+  filter_generation++;
 }
 
 LearnEngine::LearnEngine(int device_id, int cxt_id)
@@ -20,10 +20,12 @@
 
 #include <bf_lpm_trie/bf_lpm_trie.h>
 
-#include <algorithm>  // for std::swap
+#include <algorithm>  // for std::swap, std::min, std::fill, std::sort
+#include <cstring>  // for std::memcmp
 #include <unordered_map>
 #include <vector>
 #include <tuple>
+#include <utility>
 #include <limits>
 
 #include "bm_sim/lookup_structures.h"
@@ -37,6 +39,10 @@ namespace {  // anonymous
 static_assert(sizeof(uintptr_t) == sizeof(internal_handle_t),
               "Invalid type sizes");
 
+// batches are processed in chunks of this size, which lets us use arrays on
+// the stack for the intermediate state
+constexpr size_t batch_chunk_size = 32;
+
 // We don't need or want to export these classes outside of this
 // compilation unit.
 
@@ -84,6 +90,8 @@ class LPMTrieStructure : public LPMLookupStructure {
     trie.clear();
   }
 
+  const char *get_name() const override { return "lpm_trie"; }
+
  private:
   LPMTrie trie;
 };
@@ -105,6 +113,34 @@ class ExactMap : public ExactLookupStructure {
     }
   }
 
+  // The keys are hashed and their bucket is prefetched in a first pass, the
+  // lookups are resolved in a second pass. This way the cache misses for the
+  // different keys overlap instead of being paid one after the other.
+  void lookup_batch(const ByteContainer *const *keys, size_t n,
+                    internal_handle_t *handles, bool *found) const override {
+    size_t buckets[batch_chunk_size];  // NOLINT(runtime/arrays)
+    for (size_t offset = 0; offset < n; offset += batch_chunk_size) {
+      const size_t chunk = std::min(n - offset, batch_chunk_size);
+      for (size_t i = 0; i < chunk; i++) {
+        buckets[i] = entries_map.bucket(*keys[offset + i]);
+        auto it = entries_map.cbegin(buckets[i]);
+        if (it != entries_map.cend(buckets[i])) __builtin_prefetch(&*it);
+      }
+      for (size_t i = 0; i < chunk; i++) {
+        const ByteContainer &key = *keys[offset + i];
+        found[offset + i] = false;
+        for (auto it = entries_map.cbegin(buckets[i]);
+             it != entries_map.cend(buckets[i]); ++it) {
+          if (it->first == key) {
+            handles[offset + i] = it->second;
+            found[offset + i] = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
   bool entry_exists(const ExactMatchKey &key) const override {
     (void) key;
     return entries_map.find(key.data) != entries_map.end();
@@ -123,6 +159,8 @@ class ExactMap : public ExactLookupStructure {
     entries_map.clear();
   }
 
+  const char *get_name() const override { return "exact_hash"; }
+
  private:
   std::unordered_map<ByteContainer, internal_handle_t, ByteContainerKeyHash>
     entries_map{};
@@ -169,6 +207,40 @@ class TernaryMap : public TernaryLookupStructure {
     return false;
   }
 
+  // The entries are the outer loop, so that each entry is only read once per
+  // chunk of keys, instead of once per key.
+  void lookup_batch(const ByteContainer *const *keys_data, size_t n,
+                    internal_handle_t *handles, bool *found) const override {
+    typedef decltype(TernaryMatchKey::priority) priority_t;
+    const priority_t empty_priority = std::numeric_limits<priority_t>::max();
+    priority_t min_priorities[batch_chunk_size];  // NOLINT(runtime/arrays)
+    for (size_t offset = 0; offset < n; offset += batch_chunk_size) {
+      const size_t chunk = std::min(n - offset, batch_chunk_size);
+      std::fill(min_priorities, min_priorities + chunk, empty_priority);
+      std::fill(found + offset, found + offset + chunk, false);
+      for (auto it = keys.begin(); it != keys.end(); ++it) {
+        if (it->priority == empty_priority) continue;
+        for (size_t i = 0; i < chunk; i++) {
+          if (it->priority >= min_priorities[i]) continue;
+          const ByteContainer &key_data = *keys_data[offset + i];
+          bool match = true;
+          for (size_t byte_index = 0; byte_index < nbytes_key; byte_index++) {
+            if (it->data[byte_index] !=
+                (key_data[byte_index] & it->mask[byte_index])) {
+              match = false;
+              break;
+            }
+          }
+          if (match) {
+            min_priorities[i] = it->priority;
+            handles[offset + i] = std::distance(keys.begin(), it);
+            found[offset + i] = true;
+          }
+        }
+      }
+    }
+  }
+
   bool entry_exists(const TernaryMatchKey &key) const override {
     auto handle = find_handle(key);
 
@@ -197,6 +269,8 @@ class TernaryMap : public TernaryLookupStructure {
     }
   }
 
+  const char *get_name() const override { return "ternary_linear"; }
+
  private:
   std::vector<TernaryMatchKey> keys;
   size_t nbytes_key;
@@ -215,6 +289,441 @@ class TernaryMap : public TernaryLookupStructure {
   }
 };
 
+// One hash table per prefix length, which are searched from the longest prefix
+// to the shortest one. The hash tables are keyed by the prefix bytes of the
+// key, with the bits after the prefix set to 0.
+class LPMTupleSpace : public LPMLookupStructure {
+ public:
+  bool lookup(const ByteContainer &key_data,
+              internal_handle_t *handle) const override {
+    static thread_local ByteContainer prefix;
+    for (const auto &tuple : tuples) {
+      get_prefix(key_data, tuple.prefix_length, &prefix);
+      const auto it = tuple.entries.find(prefix);
+      if (it != tuple.entries.end()) {
+        *handle = it->second;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool entry_exists(const LPMMatchKey &key) const override {
+    const Tuple *tuple = find_tuple(key.prefix_length);
+    if (!tuple) return false;
+    ByteContainer prefix;
+    get_prefix(key.data, key.prefix_length, &prefix);
+    return tuple->entries.find(prefix) != tuple->entries.end();
+  }
+
+  void add_entry(const LPMMatchKey &key,
+                 internal_handle_t handle) override {
+    Tuple *tuple = find_tuple(key.prefix_length);
+    if (!tuple) {
+      // keep the tuples sorted by decreasing prefix length
+      auto it = std::find_if(tuples.begin(), tuples.end(),
+                             [&key](const Tuple &t) {
+                               return t.prefix_length < key.prefix_length; });
+      it = tuples.insert(it, Tuple());
+      it->prefix_length = key.prefix_length;
+      tuple = &*it;
+    }
+    ByteContainer prefix;
+    get_prefix(key.data, key.prefix_length, &prefix);
+    tuple->entries[prefix] = handle;
+  }
+
+  void delete_entry(const LPMMatchKey &key) override {
+    Tuple *tuple = find_tuple(key.prefix_length);
+    if (!tuple) return;
+    ByteContainer prefix;
+    get_prefix(key.data, key.prefix_length, &prefix);
+    tuple->entries.erase(prefix);
+    if (tuple->entries.empty())
+      tuples.erase(tuples.begin() + (tuple - tuples.data()));
+  }
+
+  void clear() override {
+    tuples.clear();
+  }
+
+  const char *get_name() const override { return "lpm_tuple_space"; }
+
+ private:
+  struct Tuple {
+    int prefix_length;
+    std::unordered_map<ByteContainer, internal_handle_t, ByteContainerKeyHash>
+      entries;
+  };
+
+  static void get_prefix(const ByteContainer &data, int prefix_length,
+                         ByteContainer *prefix) {
+    const size_t nbytes = (prefix_length + 7) / 8;
+    prefix->clear();
+    prefix->append(data.data(), nbytes);
+    if (prefix_length % 8 != 0) {
+      (*prefix)[nbytes - 1] &= static_cast<char>(
+          0xff << (8 - prefix_length % 8));
+    }
+  }
+
+  const Tuple *find_tuple(int prefix_length) const {
+    for (const auto &tuple : tuples)
+      if (tuple.prefix_length == prefix_length) return &tuple;
+    return nullptr;
+  }
+
+  Tuple *find_tuple(int prefix_length) {
+    return const_cast<Tuple *>(
+        static_cast<const LPMTupleSpace *>(this)->find_tuple(prefix_length));
+  }
+
+  // sorted by decreasing prefix length
+  std::vector<Tuple> tuples{};
+};
+
+// One hash table per mask, keyed by the masked key. Each hash table slot holds
+// all the entries with the same masked key, sorted by priority. The tuples are
+// sorted by the priority of their best entry, which lets us stop searching as
+// soon as no remaining tuple can contain a better match. In case of equal
+// priorities, the entry with the smallest handle wins, like with TernaryMap.
+class TernaryTupleSpace : public TernaryLookupStructure {
+ public:
+  bool lookup(const ByteContainer &key_data,
+              internal_handle_t *handle) const override {
+    static thread_local ByteContainer masked;
+    Rank best(std::numeric_limits<int>::max(), 0);
+    bool found = false;
+    for (const auto &tuple : tuples) {
+      if (!(tuple.best < best)) break;
+      get_masked(key_data, tuple.mask, &masked);
+      const auto it = tuple.entries.find(masked);
+      if (it != tuple.entries.end() && it->second.front() < best) {
+        best = it->second.front();
+        found = true;
+      }
+    }
+    if (found) *handle = best.second;
+    return found;
+  }
+
+  bool entry_exists(const TernaryMatchKey &key) const override {
+    const Tuple *tuple = find_tuple(key.mask);
+    if (!tuple) return false;
+    ByteContainer masked;
+    get_masked(key.data, key.mask, &masked);
+    const auto it = tuple->entries.find(masked);
+    if (it == tuple->entries.end()) return false;
+    return std::any_of(it->second.begin(), it->second.end(),
+                       [&key](const Rank &r) {
+                         return r.first == key.priority; });
+  }
+
+  void add_entry(const TernaryMatchKey &key,
+                 internal_handle_t handle) override {
+    Tuple *tuple = find_tuple(key.mask);
+    if (!tuple) {
+      tuples.emplace_back();
+      tuple = &tuples.back();
+      tuple->mask = key.mask;
+    }
+    ByteContainer masked;
+    get_masked(key.data, key.mask, &masked);
+    auto &ranks = tuple->entries[masked];
+    const Rank rank(key.priority, handle);
+    ranks.insert(std::upper_bound(ranks.begin(), ranks.end(), rank), rank);
+    tuple->best = std::min(tuple->best, rank);
+    sort_tuples();
+  }
+
+  void delete_entry(const TernaryMatchKey &key) override {
+    Tuple *tuple = find_tuple(key.mask);
+    if (!tuple) return;
+    ByteContainer masked;
+    get_masked(key.data, key.mask, &masked);
+    auto it = tuple->entries.find(masked);
+    if (it == tuple->entries.end()) return;
+    auto &ranks = it->second;
+    ranks.erase(std::remove_if(ranks.begin(), ranks.end(),
+                               [&key](const Rank &r) {
+                                 return r.first == key.priority; }),
+                ranks.end());
+    if (ranks.empty()) tuple->entries.erase(it);
+    if (tuple->entries.empty()) {
+      tuples.erase(tuples.begin() + (tuple - tuples.data()));
+      return;
+    }
+    tuple->best = empty_rank();
+    for (const auto &e : tuple->entries)
+      tuple->best = std::min(tuple->best, e.second.front());
+    sort_tuples();
+  }
+
+  void clear() override {
+    tuples.clear();
+  }
+
+  const char *get_name() const override { return "ternary_tuple_space"; }
+
+ private:
+  // (priority, handle)
+  typedef std::pair<int, internal_handle_t> Rank;
+
+  struct Tuple {
+    ByteContainer mask{};
+    std::unordered_map<ByteContainer, std::vector<Rank>, ByteContainerKeyHash>
+      entries{};
+    Rank best{empty_rank()};
+  };
+
+  static Rank empty_rank() {
+    return Rank(std::numeric_limits<int>::max(), 0);
+  }
+
+  static void get_masked(const ByteContainer &data, const ByteContainer &mask,
+                         ByteContainer *masked) {
+    masked->clear();
+    masked->append(data);
+    masked->apply_mask(mask);
+  }
+
+  const Tuple *find_tuple(const ByteContainer &mask) const {
+    for (const auto &tuple : tuples)
+      if (tuple.mask == mask) return &tuple;
+    return nullptr;
+  }
+
+  Tuple *find_tuple(const ByteContainer &mask) {
+    return const_cast<Tuple *>(
+        static_cast<const TernaryTupleSpace *>(this)->find_tuple(mask));
+  }
+
+  void sort_tuples() {
+    std::sort(tuples.begin(), tuples.end(),
+              [](const Tuple &t1, const Tuple &t2) {
+                return t1.best < t2.best; });
+  }
+
+  // sorted by the rank of their best entry
+  std::vector<Tuple> tuples{};
+};
+
+// Range entries are indexed on their first range field with a segment tree. The
+// lower bounds and the upper bounds (+ 1) of the entries split the domain of
+// that field into elementary segments, which are the leaves of the tree. Each
+// entry is stored in the O(log n) nodes which exactly cover its range, which
+// means that a lookup only has to consider the entries stored in the nodes on
+// the path from the root to the leaf which contains the key. The entries of a
+// node are sorted by priority and the other fields (including the other range
+// fields) are checked against each candidate, so we can stop at the first match
+// in each node. Adding an entry with a bound which is not already a segment
+// boundary requires re-building the tree, which is fine since entries are
+// added by the control plane.
+class RangeSegmentTree : public RangeLookupStructure {
+ public:
+  RangeSegmentTree(size_t size, size_t nbytes_key)
+    : keys(size), nbytes_key(nbytes_key) { }
+
+  bool lookup(const ByteContainer &key_data,
+              internal_handle_t *handle) const override {
+    if (nodes.empty()) return false;
+    const size_t leaf = find_leaf(key_data.data() + dim_offset);
+    Rank best = empty_rank();
+    bool found = false;
+    size_t node = 1;
+    size_t lo = 0;
+    size_t hi = bounds.size() - 1;
+    while (true) {
+      for (const auto &rank : nodes[node]) {
+        if (!(rank < best)) break;
+        if (matches(keys[rank.second], key_data)) {
+          best = rank;
+          found = true;
+          break;
+        }
+      }
+      if (lo == hi) break;
+      const size_t mid = (lo + hi) / 2;
+      if (leaf <= mid) {
+        node = 2 * node;
+        hi = mid;
+      } else {
+        node = 2 * node + 1;
+        lo = mid + 1;
+      }
+    }
+    if (found) *handle = best.second;
+    return found;
+  }
+
+  bool entry_exists(const RangeMatchKey &key) const override {
+    return find_handle(key) != keys.size();
+  }
+
+  void add_entry(const RangeMatchKey &key,
+                 internal_handle_t handle) override {
+    if (nodes.empty()) set_layout(key.range_widths);
+    keys.at(handle) = key;
+    ByteContainer next;
+    const bool bounded = get_next(key.mask.data() + dim_offset, &next);
+    if (nodes.empty() || !is_bound(key.data.data() + dim_offset) ||
+        (bounded && !is_bound(next.data()))) {
+      rebuild();
+    } else {
+      update(handle, true);
+    }
+  }
+
+  void delete_entry(const RangeMatchKey &key) override {
+    const internal_handle_t handle = find_handle(key);
+    if (handle == keys.size()) return;
+    update(handle, false);
+    keys[handle].priority = empty_rank().first;
+  }
+
+  void clear() override {
+    for (auto &k : keys) k.priority = empty_rank().first;
+    bounds.clear();
+    nodes.clear();
+  }
+
+  const char *get_name() const override { return "range_segment_tree"; }
+
+ private:
+  // (priority, handle)
+  typedef std::pair<int, internal_handle_t> Rank;
+
+  static Rank empty_rank() {
+    return Rank(std::numeric_limits<int>::max(), 0);
+  }
+
+  void set_layout(const std::vector<size_t> &widths) {
+    range_widths = widths;
+    dim_offset = nbytes_key;
+    for (const auto w : range_widths) dim_offset -= w;
+    // if there is no range field, all the entries end up in the root
+    dim_width = range_widths.empty() ? 0 : range_widths.front();
+  }
+
+  int compare(const char *v1, const char *v2) const {
+    return std::memcmp(v1, v2, dim_width);
+  }
+
+  // sets *next to v + 1, returns false if v is the maximum value
+  bool get_next(const char *v, ByteContainer *next) const {
+    *next = ByteContainer(v, dim_width);
+    for (size_t i = dim_width; i > 0; i--) {
+      char &c = (*next)[i - 1];
+      if (c != '\xff') {
+        c++;
+        return true;
+      }
+      c = '\x00';
+    }
+    return false;
+  }
+
+  size_t find_leaf(const char *v) const {
+    const auto it = std::upper_bound(
+        bounds.begin(), bounds.end(), v,
+        [this](const char *value, const ByteContainer &b) {
+          return compare(value, b.data()) < 0; });
+    // bounds.front() is 0, so it cannot be bounds.begin()
+    return std::distance(bounds.begin(), it) - 1;
+  }
+
+  bool is_bound(const char *v) const {
+    const auto it = std::lower_bound(
+        bounds.begin(), bounds.end(), v,
+        [this](const ByteContainer &b, const char *value) {
+          return compare(b.data(), value) < 0; });
+    return it != bounds.end() && compare(it->data(), v) == 0;
+  }
+
+  bool matches(const RangeMatchKey &entry, const ByteContainer &key) const {
+    for (size_t i = 0; i < dim_offset; i++) {
+      if (entry.data[i] != (key[i] & entry.mask[i])) return false;
+    }
+    size_t offset = dim_offset;
+    for (const auto w : range_widths) {
+      if (std::memcmp(key.data() + offset, entry.data.data() + offset, w) < 0 ||
+          std::memcmp(key.data() + offset, entry.mask.data() + offset, w) > 0)
+        return false;
+      offset += w;
+    }
+    return true;
+  }
+
+  // adds the entry to (or removes it from) the nodes covering its range
+  void update(internal_handle_t handle, bool add) {
+    const RangeMatchKey &key = keys[handle];
+    const size_t first = find_leaf(key.data.data() + dim_offset);
+    ByteContainer next;
+    const size_t last = get_next(key.mask.data() + dim_offset, &next) ?
+        find_leaf(next.data()) - 1 : bounds.size() - 1;
+    update(1, 0, bounds.size() - 1, first, last, Rank(key.priority, handle),
+           add);
+  }
+
+  void update(size_t node, size_t lo, size_t hi, size_t first, size_t last,
+              const Rank &rank, bool add) {
+    if (last < lo || hi < first) return;
+    if (first <= lo && hi <= last) {
+      auto &ranks = nodes[node];
+      if (add)
+        ranks.insert(std::upper_bound(ranks.begin(), ranks.end(), rank), rank);
+      else
+        ranks.erase(std::remove(ranks.begin(), ranks.end(), rank), ranks.end());
+      return;
+    }
+    const size_t mid = (lo + hi) / 2;
+    update(2 * node, lo, mid, first, last, rank, add);
+    update(2 * node + 1, mid + 1, hi, first, last, rank, add);
+  }
+
+  void rebuild() {
+    bounds.assign(1, ByteContainer(dim_width));
+    ByteContainer next;
+    for (const auto &key : keys) {
+      if (key.priority == empty_rank().first) continue;
+      bounds.emplace_back(key.data.data() + dim_offset, dim_width);
+      if (get_next(key.mask.data() + dim_offset, &next))
+        bounds.push_back(next);
+    }
+    std::sort(bounds.begin(), bounds.end(),
+              [this](const ByteContainer &b1, const ByteContainer &b2) {
+                return compare(b1.data(), b2.data()) < 0; });
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    nodes.assign(4 * bounds.size(), {});
+    for (size_t handle = 0; handle < keys.size(); handle++) {
+      if (keys[handle].priority == empty_rank().first) continue;
+      update(handle, true);
+    }
+  }
+
+  internal_handle_t find_handle(const RangeMatchKey &key) const {
+    auto it = keys.begin();
+    for (; it != keys.end(); ++it) {
+      if (it->priority == key.priority && it->data == key.data &&
+          it->mask == key.mask)
+        break;
+    }
+    return std::distance(keys.begin(), it);
+  }
+
+  // indexed by handle, an empty slot has the maximum priority
+  std::vector<RangeMatchKey> keys;
+  size_t nbytes_key;
+  std::vector<size_t> range_widths{};
+  // offset and width of the range field the tree is built on
+  size_t dim_offset{0};
+  size_t dim_width{0};
+  // sorted lower bounds of the elementary segments; the first one is always 0
+  std::vector<ByteContainer> bounds{};
+  // the tree, node i has children 2i and 2i + 1, the root is node 1
+  std::vector<std::vector<Rank> > nodes{};
+};
+
 }  // anonymous namespace
 
 template <>
@@ -238,6 +747,47 @@ LookupStructureFactory::create<TernaryMatchKey>(
   return f->create_for_ternary(size, nbytes_key);
 }
 
+template <>
+std::unique_ptr<LookupStructure<RangeMatchKey> >
+LookupStructureFactory::create<RangeMatchKey>(
+    LookupStructureFactory *f, size_t size, size_t nbytes_key) {
+  return f->create_for_range(size, nbytes_key);
+}
+
+template <>
+std::unique_ptr<LookupStructure<ExactMatchKey> >
+LookupStructureFactory::create_tuple_space<ExactMatchKey>(
+    LookupStructureFactory *f, size_t size, size_t nbytes_key) {
+  (void) f;
+  (void) size;
+  (void) nbytes_key;
+  return nullptr;
+}
+
+template <>
+std::unique_ptr<LookupStructure<LPMMatchKey> >
+LookupStructureFactory::create_tuple_space<LPMMatchKey>(
+    LookupStructureFactory *f, size_t size, size_t nbytes_key) {
+  return f->create_for_LPM_tuple_space(size, nbytes_key);
+}
+
+template <>
+std::unique_ptr<LookupStructure<TernaryMatchKey> >
+LookupStructureFactory::create_tuple_space<TernaryMatchKey>(
+    LookupStructureFactory *f, size_t size, size_t nbytes_key) {
+  return f->create_for_ternary_tuple_space(size, nbytes_key);
+}
+
+template <>
+std::unique_ptr<LookupStructure<RangeMatchKey> >
+LookupStructureFactory::create_tuple_space<RangeMatchKey>(
+    LookupStructureFactory *f, size_t size, size_t nbytes_key) {
+  (void) f;
+  (void) size;
+  (void) nbytes_key;
+  return nullptr;
+}
+
 
 std::unique_ptr<ExactLookupStructure>
 LookupStructureFactory::create_for_exact(size_t size, size_t nbytes_key) {
@@ -257,4 +807,26 @@ LookupStructureFactory::create_for_ternary(size_t size, size_t nbytes_key) {
                                                                 nbytes_key));
 }
 
+std::unique_ptr<RangeLookupStructure>
+LookupStructureFactory::create_for_range(size_t size, size_t nbytes_key) {
+  return std::unique_ptr<RangeLookupStructure>(new RangeSegmentTree(
+      size, nbytes_key));
+}
+
+std::unique_ptr<LPMLookupStructure>
+LookupStructureFactory::create_for_LPM_tuple_space(size_t size,
+                                                   size_t nbytes_key) {
+  (void) size;
+  (void) nbytes_key;
+  return std::unique_ptr<LPMLookupStructure>(new LPMTupleSpace());
+}
+
+std::unique_ptr<TernaryLookupStructure>
+LookupStructureFactory::create_for_ternary_tuple_space(size_t size,
+                                                       size_t nbytes_key) {
+  (void) size;
+  (void) nbytes_key;
+  return std::unique_ptr<TernaryLookupStructure>(new TernaryTupleSpace());
+}
+
 }  // namespace bm
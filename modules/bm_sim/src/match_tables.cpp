@@ -21,6 +21,7 @@
 #include <string>
 #include <vector>
 #include <limits>  // std::numeric_limits
+#include <algorithm>  // std::find
 
 #include "bm_sim/match_tables.h"
 #include "bm_sim/logger.h"
@@ -39,6 +40,7 @@ create_match_unit(const std::string match_type, const size_t size,
   typedef MatchUnitExact<V> MUExact;
   typedef MatchUnitLPM<V> MULPM;
   typedef MatchUnitTernary<V> MUTernary;
+  typedef MatchUnitRange<V> MURange;
 
   std::unique_ptr<MatchUnitAbstract<V> > match_unit;
   if (match_type == "exact")
@@ -50,6 +52,9 @@ create_match_unit(const std::string match_type, const size_t size,
   else if (match_type == "ternary")
     match_unit = std::unique_ptr<MUTernary>(
         new MUTernary(size, match_key_builder, lookup_factory));
+  else if (match_type == "range")
+    match_unit = std::unique_ptr<MURange>(
+        new MURange(size, match_key_builder, lookup_factory));
   else
     assert(0 && "invalid match type");
   return match_unit;
@@ -65,10 +70,13 @@ MatchTableAbstract::MatchTableAbstract(
     MatchUnitAbstract_ *mu)
     : NamedP4Object(name, id), size(size),
       with_counters(with_counters), with_ageing(with_ageing),
-      match_unit_(mu) { }
+      match_unit_(mu) {
+  match_unit_->set_with_counters(with_counters);
+  match_unit_->set_with_ageing(with_ageing);
+}
 
 const ControlFlowNode *
-MatchTableAbstract::apply_action(Packet *pkt) {
+MatchTableAbstract::apply_action(Packet *pkt, AppliedEntry *applied) {
   entry_handle_t handle;
   bool hit;
 
@@ -84,13 +92,85 @@ MatchTableAbstract::apply_action(Packet *pkt) {
     target_f.set(meter.execute(*pkt));
   }
 
-  // we're holding the lock for this...
+  const ControlFlowNode *next_node =
+      hit ? action_entry.next_node : next_node_miss;
+
+  if (applied) {
+    applied->hit = hit;
+    applied->handle = handle;
+    applied->action_fn = action_entry.action_fn;
+    applied->next_node = next_node;
+    applied->generation = generation;
+  }
+
+  execute_action_(pkt, hit, handle, action_entry.action_fn);
+
+  return next_node;
+}
+
+void
+MatchTableAbstract::apply_action_batch(Packet *const *pkts, size_t n,
+                                       const ControlFlowNode **next_nodes) {
+  static thread_local std::vector<LookupResult> results;
+  results.resize(n);
+
+  ReadLock lock = lock_read();
+
+  lookup_batch(pkts, n, results.data());
+
+  for (size_t i = 0; i < n; i++) {
+    Packet *pkt = pkts[i];
+    const LookupResult &res = results[i];
+    if (res.hit && with_meters) {
+      Field &target_f = pkt->get_phv()->get_field(
+          meter_target_header, meter_target_offset);
+      Meter &meter = match_unit_->get_meter(res.handle);
+      target_f.set(meter.execute(*pkt));
+    }
+    execute_action_(pkt, res.hit, res.handle, res.entry->action_fn);
+    next_nodes[i] = res.hit ? res.entry->next_node : next_node_miss;
+  }
+}
+
+void
+MatchTableAbstract::lookup_batch(const Packet *const *pkts, size_t n,
+                                 LookupResult *results) {
+  for (size_t i = 0; i < n; i++) {
+    LookupResult &res = results[i];
+    res.entry = &lookup(*pkts[i], &res.hit, &res.handle);
+  }
+}
+
+bool
+MatchTableAbstract::replay_action(Packet *pkt, const AppliedEntry &applied) {
+  ReadLock lock = lock_read();
+
+  // the handle may not even be valid anymore
+  if (applied.generation != generation) return false;
+
+  if (applied.hit) match_unit_->touch_entry(applied.handle, *pkt);
+
+  execute_action_(pkt, applied.hit, applied.handle, applied.action_fn);
+
+  return true;
+}
+
+// called with the read lock held
+void
+MatchTableAbstract::execute_action_(Packet *pkt, bool hit,
+                                    entry_handle_t handle,
+                                    const ActionFnEntry &action_fn) const {
+  // only used for logging, which may be disabled at compile time
+  (void) handle;
   if (hit) {
     BMELOG(table_hit, *pkt, *this, handle);
     BMLOG_DEBUG_PKT(*pkt, "Table '{}': hit with handle {}",
                     get_name(), handle);
     // TODO(antonin): change to trace?
-    BMLOG_DEBUG_PKT(*pkt, "{}", dump_entry_string_(handle));
+    // skipped in binary mode, where the handle identifies the entry
+    if (!BinaryLogger::is_enabled(Logger::LogLevel::DEBUG)) {
+      BMLOG_DEBUG_PKT(*pkt, "{}", dump_entry_string_(handle));
+    }
   } else {
     BMELOG(table_miss, *pkt, *this);
     BMLOG_DEBUG_PKT(*pkt, "Table '{}': miss", get_name());
@@ -98,13 +178,16 @@ MatchTableAbstract::apply_action(Packet *pkt) {
 
   DEBUGGER_NOTIFY_UPDATE_V(
       Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
-      Debugger::FIELD_ACTION, action_entry.action_fn.get_action_id());
+      Debugger::FIELD_ACTION, action_fn.get_action_id());
 
-  BMLOG_DEBUG_PKT(*pkt, "Action entry is {}", action_entry);
+  BMLOG_DEBUG_PKT(*pkt, "Action entry is {}", action_fn);
 
-  action_entry.action_fn(pkt);
+  // the direct meter or the action may modify the PHV
+  const ActionFn *fn = action_fn.get_action_fn();
+  if (with_meters || (fn && fn->get_num_primitives() > 0))
+    pkt->invalidate_key_memo();
 
-  return hit ? action_entry.next_node : next_node_miss;
+  action_fn(pkt);
 }
 
 void
@@ -113,6 +196,18 @@ MatchTableAbstract::reset_state() {
   reset_state_();
 }
 
+void
+MatchTableAbstract::set_adaptive_lookup(bool adaptive) {
+  WriteLock lock = lock_write();
+  match_unit_->set_adaptive_lookup(adaptive);
+}
+
+MatchTableAbstract::LookupStats
+MatchTableAbstract::get_lookup_stats() const {
+  ReadLock lock = lock_read();
+  return match_unit_->get_lookup_stats();
+}
+
 void
 MatchTableAbstract::set_next_node(p4object_id_t action_id,
                                   const ControlFlowNode *next_node) {
@@ -140,6 +235,20 @@ MatchTableAbstract::set_next_node_miss_default(
   next_node_miss_default = next_node;
 }
 
+std::vector<const ControlFlowNode *>
+MatchTableAbstract::get_possible_next_nodes() const {
+  std::vector<const ControlFlowNode *> nodes;
+  auto add = [&nodes](const ControlFlowNode *node) {
+    if (node && std::find(nodes.begin(), nodes.end(), node) == nodes.end())
+      nodes.push_back(node);
+  };
+  for (const auto &p : next_nodes) add(p.second);
+  add(next_node_hit);
+  add(next_node_miss);
+  add(next_node_miss_default);
+  return nodes;
+}
+
 void
 MatchTableAbstract::set_direct_meters(MeterArray *meter_array,
                                       header_id_t target_header,
@@ -158,15 +267,15 @@ MatchTableAbstract::query_counters(entry_handle_t handle,
   ReadLock lock = lock_read();
   if (!with_counters) return MatchErrorCode::COUNTERS_DISABLED;
   if (!is_valid_handle(handle)) return MatchErrorCode::INVALID_HANDLE;
-  const MatchUnit::EntryMeta &meta = match_unit_->get_entry_meta(handle);
   // should I hide counter implementation more?
-  meta.counter.query_counter(bytes, packets);
+  match_unit_->get_counter(handle).query_counter(bytes, packets);
   return MatchErrorCode::SUCCESS;
 }
 
 /* really needed ? */
 MatchErrorCode
 MatchTableAbstract::reset_counters() {
+  ReadLock lock = lock_read();
   if (!with_counters) return MatchErrorCode::COUNTERS_DISABLED;
   match_unit_->reset_counters();
   return MatchErrorCode::SUCCESS;
@@ -179,9 +288,8 @@ MatchTableAbstract::write_counters(entry_handle_t handle,
   ReadLock lock = lock_write();
   if (!with_counters) return MatchErrorCode::COUNTERS_DISABLED;
   if (!is_valid_handle(handle)) return MatchErrorCode::INVALID_HANDLE;
-  MatchUnit::EntryMeta &meta = match_unit_->get_entry_meta(handle);
   // should I hide counter implementation more?
-  meta.counter.write_counter(bytes, packets);
+  match_unit_->get_counter(handle).write_counter(bytes, packets);
   return MatchErrorCode::SUCCESS;
 }
 
@@ -251,6 +359,20 @@ MatchTable::lookup(const Packet &pkt, bool *hit, entry_handle_t *handle) {
   return (*hit) ? (*res.value) : default_entry;
 }
 
+void
+MatchTable::lookup_batch(const Packet *const *pkts, size_t n,
+                         LookupResult *results) {
+  typedef MatchUnitAbstract<ActionEntry>::MatchUnitLookup MatchUnitLookup;
+  static thread_local std::vector<MatchUnitLookup> lookups;
+  lookups.resize(n, MatchUnitLookup::empty_entry());
+  match_unit->lookup_batch(pkts, n, lookups.data());
+  for (size_t i = 0; i < n; i++) {
+    results[i].hit = lookups[i].found();
+    results[i].handle = lookups[i].handle;
+    results[i].entry = results[i].hit ? lookups[i].value : &default_entry;
+  }
+}
+
 MatchErrorCode
 MatchTable::add_entry(const std::vector<MatchKeyParam> &match_key,
                       const ActionFn *action_fn,
@@ -746,6 +868,8 @@ MatchTableIndirect::reset_state_() {
 }
 
 
+constexpr size_t MatchTableIndirectWS::default_nb_buckets;
+
 MatchTableIndirectWS::MatchTableIndirectWS(
     const std::string &name, p4object_id_t id,
     std::unique_ptr<MatchUnitAbstract<IndirectIndex> > match_unit,
@@ -753,18 +877,75 @@ MatchTableIndirectWS::MatchTableIndirectWS(
     : MatchTableIndirect(name, id, std::move(match_unit),
                          with_counters, with_ageing) { }
 
+MatchTableIndirect::mbr_hdl_t
+MatchTableIndirectWS::GroupInfo::find_member(bool most,
+                                             mbr_hdl_t ignore) const {
+  mbr_hdl_t res = ignore;
+  size_t res_count = 0;
+  for (const auto mbr : mbrs) {
+    if (mbr == ignore) continue;
+    const auto it = mbr_buckets.find(mbr);
+    const size_t count = (it == mbr_buckets.end()) ? 0 : it->second.size();
+    if (res == ignore || (most ? (count > res_count) : (count < res_count))) {
+      res = mbr;
+      res_count = count;
+    }
+  }
+  assert(res != ignore);
+  return res;
+}
+
+// A new member takes buckets away from the biggest members, until it has its
+// fair share.
 MatchErrorCode
 MatchTableIndirectWS::GroupInfo::add_member(mbr_hdl_t mbr) {
   if (!mbrs.add(mbr)) return MatchErrorCode::MBR_ALREADY_IN_GRP;
+  auto &mine = mbr_buckets[mbr];
+  if (mbrs.count() == 1) {
+    for (size_t b = 0; b < buckets.size(); b++) {
+      buckets[b] = mbr;
+      mine.push_back(b);
+    }
+    return MatchErrorCode::SUCCESS;
+  }
+  const size_t share = buckets.size() / mbrs.count();
+  while (mine.size() < share) {
+    auto &victim = mbr_buckets[find_member(true, mbr)];
+    const size_t b = victim.back();
+    victim.pop_back();
+    buckets[b] = mbr;
+    mine.push_back(b);
+  }
   return MatchErrorCode::SUCCESS;
 }
 
+// The buckets of the removed member go to the smallest members.
 MatchErrorCode
 MatchTableIndirectWS::GroupInfo::delete_member(mbr_hdl_t mbr) {
   if (!mbrs.remove(mbr)) return MatchErrorCode::MBR_NOT_IN_GRP;
+  auto it = mbr_buckets.find(mbr);
+  assert(it != mbr_buckets.end());
+  const std::vector<size_t> freed(std::move(it->second));
+  mbr_buckets.erase(it);
+  if (mbrs.count() == 0) return MatchErrorCode::SUCCESS;
+  for (const auto b : freed) {
+    const mbr_hdl_t new_mbr = find_member(false, mbr);
+    buckets[b] = new_mbr;
+    mbr_buckets[new_mbr].push_back(b);
+  }
   return MatchErrorCode::SUCCESS;
 }
 
+void
+MatchTableIndirectWS::GroupInfo::reset_buckets(size_t nb_buckets) {
+  std::vector<mbr_hdl_t> members;
+  for (const auto mbr : mbrs) members.push_back(mbr);
+  mbrs = RandAccessUIntSet();
+  mbr_buckets.clear();
+  buckets = std::vector<mbr_hdl_t>(nb_buckets);
+  for (const auto mbr : members) add_member(mbr);
+}
+
 bool
 MatchTableIndirectWS::GroupInfo::contains_member(mbr_hdl_t mbr) const {
   return mbrs.contains(mbr);
@@ -809,11 +990,25 @@ MatchTableIndirect::mbr_hdl_t
 MatchTableIndirectWS::choose_from_group(grp_hdl_t grp,
                                         const Packet &pkt) const {
   const GroupInfo &group_info = group_entries[grp];
-  size_t s = group_info.size();
-  assert(s > 0);
+  assert(group_info.size() > 0);
   if (!hash) return group_info.get_nth(0);
   hash_t h = static_cast<hash_t>(hash->output(pkt));
-  return group_info.get_nth(h % s);
+  return group_info.get_from_bucket(h);
+}
+
+void
+MatchTableIndirectWS::set_nb_buckets(size_t nb_buckets) {
+  assert(nb_buckets > 0);
+  WriteLock lock = lock_write();
+  this->nb_buckets = nb_buckets;
+  for (const auto grp : grp_handles)
+    group_entries[grp].reset_buckets(nb_buckets);
+}
+
+size_t
+MatchTableIndirectWS::get_nb_buckets() const {
+  ReadLock lock = lock_read();
+  return nb_buckets;
 }
 
 const ActionEntry &
@@ -848,9 +1043,9 @@ MatchTableIndirectWS::groups_insert(grp_hdl_t grp) {
   assert(grp <= group_entries.size());
 
   if (grp == group_entries.size())
-    group_entries.emplace_back();
+    group_entries.emplace_back(nb_buckets);
   else
-    group_entries[grp] = GroupInfo();
+    group_entries[grp] = GroupInfo(nb_buckets);
 
   index_ref_count.set(IndirectIndex::make_grp_index(grp), 0);
 }
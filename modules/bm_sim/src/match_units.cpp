@@ -19,9 +19,11 @@
  */
 
 #include <limits>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
-#include <algorithm>  // for std::copy, std::max
+#include <algorithm>  // for std::copy, std::max, std::min, std::any_of
 
 #include "bm_sim/match_units.h"
 #include "bm_sim/match_key_types.h"
@@ -36,7 +38,10 @@ namespace bm {
 #define HANDLE_INTERNAL(h) (h & 0xffffffff)
 #define HANDLE_SET(v, i) ((((uint64_t) v) << 32) | i)
 
-using MatchUnit::EntryMeta;
+using MatchUnit::AgeingMeta;
+using MatchUnit::AgeingWheel;
+
+constexpr uint64_t MatchUnit::AtomicTimestamp::epoch_length_ms;
 
 namespace {
 
@@ -44,6 +49,82 @@ size_t nbits_to_nbytes(size_t nbits) {
   return (nbits + 7) / 8;
 }
 
+// assigns the same id to all the builders with the same gather plan
+int assign_key_id(const std::string &plan_signature) {
+  static std::mutex mutex;
+  static std::unordered_map<std::string, int> ids;
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = ids.find(plan_signature);
+  if (it != ids.end()) return it->second;
+  const int id = static_cast<int>(ids.size());
+  ids.emplace(plan_signature, id);
+  return id;
+}
+
+// the "shape" of an entry is what the tuple space lookup structures group
+// entries by
+ByteContainer get_shape(const ExactMatchKey &key) {
+  (void) key;
+  return ByteContainer();
+}
+
+ByteContainer get_shape(const LPMMatchKey &key) {
+  return ByteContainer(reinterpret_cast<const char *>(&key.prefix_length),
+                       sizeof(key.prefix_length));
+}
+
+ByteContainer get_shape(const TernaryMatchKey &key) {
+  return key.mask;
+}
+
+ByteContainer get_shape(const RangeMatchKey &key) {
+  (void) key;
+  return ByteContainer();
+}
+
+// Whether a tuple space is preferable to the default lookup structure, given
+// the number of entries and of distinct shapes. The thresholds to switch back
+// and forth are different, to avoid rebuilding the lookup structure over and
+// over when the number of shapes oscillates.
+bool prefer_tuple_space(const ExactMatchKey *, size_t num_entries,
+                        size_t num_shapes, bool current) {
+  (void) num_entries;
+  (void) num_shapes;
+  (void) current;
+  return false;
+}
+
+// a trie lookup costs about as much as 2 hash table lookups
+bool prefer_tuple_space(const LPMMatchKey *, size_t num_entries,
+                        size_t num_shapes, bool current) {
+  (void) num_entries;
+  return current ? (num_shapes <= 2) : (num_shapes == 1);
+}
+
+// a linear search goes through all the entries, a tuple space search does one
+// hash table lookup per mask
+bool prefer_tuple_space(const TernaryMatchKey *, size_t num_entries,
+                        size_t num_shapes, bool current) {
+  if (num_shapes == 1) return true;
+  return current ? (num_shapes * 2 <= num_entries)
+                 : (num_shapes * 4 <= num_entries);
+}
+
+bool prefer_tuple_space(const RangeMatchKey *, size_t num_entries,
+                        size_t num_shapes, bool current) {
+  (void) num_entries;
+  (void) num_shapes;
+  (void) current;
+  return false;
+}
+
+uint64_t get_now_ms() {
+  using std::chrono::duration_cast;
+  using std::chrono::milliseconds;
+  auto tp = Packet::clock::now();
+  return duration_cast<milliseconds>(tp.time_since_epoch()).count();
+}
+
 }  // namespace
 
 std::string
@@ -57,6 +138,8 @@ MatchKeyParam::type_to_string(Type t) {
       return "TERNARY";
     case Type::VALID:
       return "VALID";
+    case Type::RANGE:
+      return "RANGE";
   }
   return "";
 }
@@ -95,6 +178,10 @@ std::ostream& operator<<(std::ostream &out, const MatchKeyParam &p) {
       out << " &&& ";
       dump_hexstring(out, p.mask);
       break;
+    case MatchKeyParam::Type::RANGE:
+      out << " -> ";
+      dump_hexstring(out, p.mask);
+      break;
     default:
       break;
   }
@@ -141,6 +228,30 @@ MatchKeyBuilder::build() {
     std::copy(masks.at(i).begin(), masks.at(i).end(),
               big_mask.begin() + key_offsets.at(i));
 
+  plan.clear();
+  std::string plan_signature;
+  auto append_signature = [&plan_signature](size_t v) {
+    plan_signature.append(reinterpret_cast<const char *>(&v), sizeof(v));
+  };
+  for (size_t i = 0; i < key_input.size(); i++) {
+    const auto &in = key_input[i];
+    GatherOp op;
+    op.header = in.header;
+    op.f_offset = (in.mtype == MatchKeyParam::Type::VALID) ? -1 : in.f_offset;
+    op.offset = offsets[i];
+    op.nbytes = nbits_to_nbytes(in.nbits);
+    op.masked = has_big_mask && std::any_of(
+        big_mask.begin() + op.offset, big_mask.begin() + op.offset + op.nbytes,
+        [](char c) { return c != '\xff'; });
+    plan.push_back(op);
+    append_signature(op.header);
+    append_signature(static_cast<size_t>(op.f_offset));
+    append_signature(op.nbytes);
+    append_signature(op.masked);
+    if (op.masked) plan_signature.append(&big_mask[op.offset], op.nbytes);
+  }
+  key_id = assign_key_id(plan_signature);
+
   built = true;
 }
 
@@ -193,28 +304,48 @@ MatchKeyBuilder::apply_big_mask(ByteContainer *key) const {
 
 void
 MatchKeyBuilder::operator()(const PHV &phv, ByteContainer *key) const {
-  for (const auto &in : key_input) {
-    const Header &header = phv.get_header(in.header);
-    // if speed is an issue here, I can probably come up with something faster
-    // (with a switch statement maybe)
-    if (in.mtype == MatchKeyParam::Type::VALID) {
-      key->push_back(header.is_valid() ? '\x01' : '\x00');
-    } else {
+  const size_t offset = key->size();
+  key->resize(offset + nbytes_key);
+  (*this)(phv, key->data() + offset);
+}
+
+void
+MatchKeyBuilder::operator()(const PHV &phv, char *dst) const {
+  assert(built);
+  for (const auto &op : plan) {
+    const Header &header = phv.get_header(op.header);
+    char *out = dst + op.offset;
+    if (op.f_offset < 0) {
+      *out = header.is_valid() ? '\x01' : '\x00';
+    } else if (!header.is_valid()) {
       // we do not reset all fields to 0 in between packets
       // so I need this hack if the P4 programmer assumed that:
       // field not valid => field set to 0
-      // const Field &field = phv.get_field(p.first, p.second);
-      // key->append(field.get_bytes());
-      const Field &field = header[in.f_offset];
-      if (header.is_valid()) {
-        key->append(field.get_bytes());
-      } else {
-        key->append(std::string(field.get_nbytes(), '\x00'));
-      }
+      std::fill(out, out + op.nbytes, '\x00');
+    } else {
+      const ByteContainer &bytes = header[op.f_offset].get_bytes();
+      assert(bytes.size() == op.nbytes);
+      std::copy(bytes.begin(), bytes.end(), out);
+    }
+    if (op.masked) {
+      const char *mask = big_mask.data() + op.offset;
+      for (size_t i = 0; i < op.nbytes; i++) out[i] &= mask[i];
     }
   }
-  if (has_big_mask)
-    key->apply_mask(big_mask);
+}
+
+std::vector<MatchKeyBuilder::FieldRef>
+MatchKeyBuilder::get_field_refs() const {
+  std::vector<FieldRef> refs;
+  for (size_t i = 0; i < key_input.size(); i++) {
+    // masks are in the P4 order, key_input is not once the key is built
+    const auto &in = built ? key_input.at(key_mapping.at(i)) : key_input.at(i);
+    if (in.mtype == MatchKeyParam::Type::VALID)
+      refs.push_back({in.header, -1, masks.at(i)});
+    else
+      refs.push_back({in.header, in.f_offset, masks.at(i)});
+  }
+  return refs;
 }
 
 std::vector<std::string>
@@ -398,6 +529,48 @@ class MatchKeyBuilderHelper {
                                 pref_len_from_mask(mask_start, mask_end));
             break;
           }
+        case MatchKeyParam::Type::RANGE:
+          assert(0);
+      }
+    }
+
+    return params;
+  }
+
+  // same as for ternary, except for the range fields, for which the mask holds
+  // the upper bound
+  template <typename K,
+            typename std::enable_if<K::mut == MatchUnitType::RANGE, int>::type
+            = 0>
+  static std::vector<MatchKeyParam>
+  entry_to_match_params(const MatchKeyBuilder &kb, const K &key) {
+    std::vector<MatchKeyParam> params;
+
+    size_t nfields = kb.key_mapping.size();
+    for (size_t i = 0; i < nfields; i++) {
+      const size_t imp_idx = kb.key_mapping.at(i);
+      const auto &f_info = kb.key_input.at(imp_idx);
+      const size_t byte_offset = kb.key_offsets.at(i);
+
+      auto start = key.data.begin() + byte_offset;
+      size_t nbytes = nbits_to_nbytes(f_info.nbits);
+      auto end = start + nbytes;
+      auto mask_start = key.mask.begin() + byte_offset;
+      auto mask_end = mask_start + nbytes;
+      switch (f_info.mtype) {
+        case MatchKeyParam::Type::VALID:
+        case MatchKeyParam::Type::EXACT:
+          params.emplace_back(f_info.mtype, std::string(start, end));
+          break;
+        case MatchKeyParam::Type::TERNARY:
+        case MatchKeyParam::Type::RANGE:
+          params.emplace_back(f_info.mtype, std::string(start, end),
+                              std::string(mask_start, mask_end));
+          break;
+        case MatchKeyParam::Type::LPM:
+          params.emplace_back(f_info.mtype, std::string(start, end),
+                              pref_len_from_mask(mask_start, mask_end));
+          break;
       }
     }
 
@@ -457,6 +630,7 @@ class MatchKeyBuilderHelper {
           entry.key.prefix_length += param.prefix_length;
           break;
         case MatchKeyParam::Type::TERNARY:
+        case MatchKeyParam::Type::RANGE:
           assert(0);
       }
       first_byte += param.key.size();
@@ -493,6 +667,8 @@ class MatchKeyBuilderHelper {
         case MatchKeyParam::Type::TERNARY:
           entry.key.mask.append(param.mask);
           break;
+        case MatchKeyParam::Type::RANGE:
+          assert(0);
       }
       first_byte += param.key.size();
     }
@@ -501,6 +677,55 @@ class MatchKeyBuilderHelper {
 
     return entry;
   }
+
+  template <typename E, typename std::enable_if<
+              decltype(E::key)::mut == MatchUnitType::RANGE, int>::type = 0>
+  static E
+  match_params_to_entry(const MatchKeyBuilder &kb,
+                        const std::vector<MatchKeyParam> &params) {
+    E entry;
+    entry.key.data.reserve(kb.nbytes_key);
+    entry.key.mask.reserve(kb.nbytes_key);
+
+    size_t first_byte = 0;
+    // the range fields come last, the bytes before are matched like a ternary
+    // key
+    size_t nbytes_ternary = 0;
+    for (size_t i = 0; i < kb.inv_mapping.size(); i++) {
+      const auto &param = params.at(kb.inv_mapping[i]);
+      const char byte0_mask = get_byte0_mask(kb.key_input[i].nbits);
+      entry.key.data.append(param.key);
+      entry.key.data[first_byte] &= byte0_mask;
+      switch (param.type) {
+        case MatchKeyParam::Type::VALID:
+          entry.key.mask.append("\xff");
+          break;
+        case MatchKeyParam::Type::EXACT:
+          entry.key.mask.append(std::string(param.key.size(), '\xff'));
+          break;
+        case MatchKeyParam::Type::LPM:
+          entry.key.mask.append(
+              create_mask_from_pref_len(param.prefix_length, param.key.size()));
+          break;
+        case MatchKeyParam::Type::TERNARY:
+          entry.key.mask.append(param.mask);
+          break;
+        case MatchKeyParam::Type::RANGE:
+          entry.key.mask.append(param.mask);
+          entry.key.mask[first_byte] &= byte0_mask;
+          entry.key.range_widths.push_back(param.key.size());
+          break;
+      }
+      first_byte += param.key.size();
+      if (param.type != MatchKeyParam::Type::RANGE)
+        nbytes_ternary = first_byte;
+    }
+
+    for (size_t i = 0; i < nbytes_ternary; i++)
+      entry.key.data[i] &= entry.key.mask[i];
+
+    return entry;
+  }
 };
 
 }  // namespace detail
@@ -544,6 +769,22 @@ MatchKeyBuilder::match_params_sanity_check(
       case MatchKeyParam::Type::TERNARY:
         if (param.mask.size() != nbytes) return false;
         break;
+      case MatchKeyParam::Type::RANGE:
+        {
+          if (param.mask.size() != nbytes) return false;
+          // the bits beyond the field width are ignored, see
+          // match_params_to_entry()
+          const char byte0_mask = detail::get_byte0_mask(f_info.nbits);
+          const unsigned char start_0 = param.key[0] & byte0_mask;
+          const unsigned char end_0 = param.mask[0] & byte0_mask;
+          if (start_0 != end_0) {
+            if (start_0 > end_0) return false;
+          } else if (param.key.compare(1, nbytes - 1,
+                                       param.mask, 1, nbytes - 1) > 0) {
+            return false;
+          }
+          break;
+        }
     }
   }
   return true;
@@ -566,6 +807,48 @@ MatchKeyBuilder::NameMap::max_size() const {
 }
 
 
+void
+AgeingWheel::insert(const Item &item, uint64_t now_ms) {
+  if (!started) {
+    cursor = now_ms / tick_ms;
+    started = true;
+  }
+  uint64_t tick = item.deadline_ms / tick_ms;
+  // items which are already due go to the first slot which will be processed
+  tick = std::max(tick, cursor);
+  slots[tick % slots.size()].push_back(item);
+}
+
+void
+AgeingWheel::advance(uint64_t now_ms, std::vector<Item> *due) {
+  if (!started) return;
+  const uint64_t now_tick = now_ms / tick_ms;
+  if (now_tick < cursor) return;
+  const uint64_t nb_ticks = std::min(now_tick - cursor + 1,
+                                     static_cast<uint64_t>(slots.size()));
+  for (uint64_t t = cursor; t < cursor + nb_ticks; t++) {
+    auto &slot = slots[t % slots.size()];
+    size_t i = 0;
+    while (i < slot.size()) {
+      if (slot[i].deadline_ms <= now_ms) {
+        due->push_back(slot[i]);
+        slot[i] = slot.back();
+        slot.pop_back();
+      } else {
+        i++;
+      }
+    }
+  }
+  // the current slot is not done, items may be due later in the same tick
+  cursor = now_tick;
+}
+
+void
+AgeingWheel::clear() {
+  for (auto &slot : slots) slot.clear();
+  started = false;
+}
+
 MatchErrorCode
 MatchUnitAbstract_::get_and_set_handle(internal_handle_t *handle) {
   if (num_entries >= size) {  // table is full
@@ -596,23 +879,108 @@ MatchUnitAbstract_::valid_handle(entry_handle_t handle) const {
   return this->valid_handle_(HANDLE_INTERNAL(handle));
 }
 
-EntryMeta &
-MatchUnitAbstract_::get_entry_meta(entry_handle_t handle) {
-  return this->entry_meta[HANDLE_INTERNAL(handle)];
+Counter &
+MatchUnitAbstract_::get_counter(entry_handle_t handle) {
+  assert(with_counters);
+  return this->counters[HANDLE_INTERNAL(handle)];
+}
+
+const Counter &
+MatchUnitAbstract_::get_counter(entry_handle_t handle) const {
+  assert(with_counters);
+  return this->counters[HANDLE_INTERNAL(handle)];
+}
+
+void
+MatchUnitAbstract_::set_with_counters(bool with_counters) {
+  assert(num_entries == 0);
+  this->with_counters = with_counters;
+  counters.init(with_counters ? size : 0);
+}
+
+void
+MatchUnitAbstract_::set_with_ageing(bool with_ageing) {
+  assert(num_entries == 0);
+  this->with_ageing = with_ageing;
+  ageing_meta.init(with_ageing ? size : 0);
+}
+
+size_t
+MatchUnitAbstract_::get_entry_meta_bytes() const {
+  return counters.get_allocated_bytes() + ageing_meta.get_allocated_bytes();
+}
+
+void
+MatchUnitAbstract_::init_entry_meta(entry_handle_t handle) {
+  const internal_handle_t handle_ = HANDLE_INTERNAL(handle);
+  if (with_counters) {
+    counters.grow(handle_);
+    counters[handle_].reset_counter();
+  }
+  if (with_ageing) {
+    ageing_meta.grow(handle_);
+    AgeingMeta &meta = ageing_meta[handle_];
+    meta.ts.set(Packet::clock::now());
+    meta.version = HANDLE_VERSION(handle);
+    schedule_ageing(handle_);
+  }
+}
+
+const ByteContainer &
+MatchUnitAbstract_::get_key(const Packet &pkt, ByteContainer *scratch) const {
+  Packet::KeyMemo *memo = pkt.get_key_memo();
+  if (!memo->enabled) {
+    scratch->clear();
+    build_key(*pkt.get_phv(), scratch);
+    return *scratch;
+  }
+  const int key_id = match_key_builder.get_key_id();
+  if (memo->key_id != key_id) {
+    memo->key.clear();
+    build_key(*pkt.get_phv(), &memo->key);
+    memo->key_id = key_id;
+  }
+  return memo->key;
+}
+
+void
+MatchUnitAbstract_::set_adaptive_lookup(bool adaptive) {
+  (void) adaptive;
+}
+
+MatchUnitAbstract_::LookupStats
+MatchUnitAbstract_::get_lookup_stats() const {
+  return {"", num_entries, 0, 0, false};
 }
 
-const EntryMeta &
-MatchUnitAbstract_::get_entry_meta(entry_handle_t handle) const {
-  return this->entry_meta[HANDLE_INTERNAL(handle)];
+void
+MatchUnitAbstract_::log_key(const Packet &pkt, const ByteContainer &key) const {
+  // BMLOG_DEBUG_PKT(pkt, "Looking up key {}", key_to_string(key));
+#ifdef BMLOG_DEBUG_ON
+  // the binary trace records the raw key, which is much cheaper than
+  // formatting it with the field names
+  if (BinaryLogger::is_enabled(Logger::LogLevel::DEBUG)) {
+    BMLOG_BINARY_PKT(Logger::LogLevel::DEBUG, pkt, "Looking up key {}", key);
+  } else {
+    BMLOG_DEBUG_PKT(pkt, "Looking up key:\n{}", key_to_string_with_names(key));
+  }
+#else
+  (void) pkt;
+  (void) key;
+#endif
+}
+
+void
+MatchUnitAbstract_::touch_entry(entry_handle_t handle, const Packet &pkt) {
+  hit_entry(HANDLE_INTERNAL(handle), pkt);
 }
 
 void
 MatchUnitAbstract_::reset_counters() {
   // could take a while, but do not block anyone else
-  // lock (even read lock) does not have to be held while doing this
-  for (EntryMeta &meta : entry_meta) {
-    meta.counter.reset_counter();
-  }
+  // the read lock needs to be held while doing this, as adding an entry may
+  // grow the column
+  counters.for_each([](Counter *c) { c->reset_counter(); });
 }
 
 void
@@ -631,25 +999,72 @@ MatchErrorCode
 MatchUnitAbstract_::set_entry_ttl(entry_handle_t handle, unsigned int ttl_ms) {
   internal_handle_t handle_ = HANDLE_INTERNAL(handle);
   if (!this->valid_handle_(handle_)) return MatchErrorCode::INVALID_HANDLE;
-  EntryMeta &meta = entry_meta[handle_];
+  if (!with_ageing) return MatchErrorCode::AGEING_DISABLED;
+  AgeingMeta &meta = ageing_meta[handle_];
   meta.timeout_ms = ttl_ms;
+  schedule_ageing(handle_);
   return MatchErrorCode::SUCCESS;
 }
 
 void
-MatchUnitAbstract_::sweep_entries(std::vector<entry_handle_t> *entries) const {
-  using std::chrono::duration_cast;
-  using std::chrono::milliseconds;
+MatchUnitAbstract_::schedule_ageing(internal_handle_t handle) {
+  AgeingMeta &meta = ageing_meta[handle];
+  if (meta.timeout_ms == 0) return;
+  std::unique_lock<std::mutex> lock(ageing_mutex);
+  uint64_t deadline = meta.ts.get_ms() + meta.timeout_ms;
+  // if the entry is already scheduled to be checked before the new deadline,
+  // there is nothing to do, it will be re-inserted lazily
+  if (meta.scheduled_seq != 0 && meta.scheduled_deadline_ms <= deadline)
+    return;
+  if (++ageing_seq == 0) ++ageing_seq;  // 0 is reserved
+  meta.scheduled_seq = ageing_seq;
+  meta.scheduled_deadline_ms = deadline;
+  ageing_wheel.insert({deadline, handle, ageing_seq}, get_now_ms());
+}
 
-  auto tp = Packet::clock::now();
-  uint64_t now_ms = duration_cast<milliseconds>(tp.time_since_epoch()).count();
-  for (auto it = handles.begin(); it != handles.end(); ++it) {
-    const EntryMeta &meta = entry_meta[*it];
-    assert(now_ms >= meta.ts.get_ms());
-    if (meta.timeout_ms > 0 && (now_ms - meta.ts.get_ms() >= meta.timeout_ms)) {
-      entries->push_back(HANDLE_SET(meta.version, *it));
-    }
+void
+MatchUnitAbstract_::reset_ageing() {
+  std::unique_lock<std::mutex> lock(ageing_mutex);
+  ageing_wheel.clear();
+  ageing_expired.clear();
+}
+
+// called with ageing_mutex held
+void
+MatchUnitAbstract_::check_ageing(const AgeingWheel::Item &item,
+                                 uint64_t now_ms,
+                                 std::vector<entry_handle_t> *entries) const {
+  AgeingMeta &meta = ageing_meta[item.handle];
+  if (meta.scheduled_seq != item.seq) return;  // stale item
+  if (!valid_handle_(item.handle) || meta.timeout_ms == 0) {
+    meta.scheduled_seq = 0;
+    return;
   }
+  assert(now_ms >= meta.ts.get_ms());
+  uint64_t deadline = meta.ts.get_ms() + meta.timeout_ms;
+  if (deadline > now_ms) {  // the entry was hit since it was scheduled
+    meta.scheduled_deadline_ms = deadline;
+    ageing_wheel.insert({deadline, item.handle, item.seq}, now_ms);
+    return;
+  }
+  entries->push_back(HANDLE_SET(meta.version, item.handle));
+  ageing_expired.push_back(
+      {meta.scheduled_deadline_ms, item.handle, item.seq});
+}
+
+void
+MatchUnitAbstract_::sweep_entries(std::vector<entry_handle_t> *entries) const {
+  uint64_t now_ms = get_now_ms();
+
+  std::unique_lock<std::mutex> lock(ageing_mutex);
+  if (!with_ageing) return;
+  ageing_due.clear();
+  // entries which were expired at the previous sweep are reported again,
+  // unless they were hit or deleted in the meantime
+  ageing_due.swap(ageing_expired);
+  ageing_wheel.advance(now_ms, &ageing_due);
+  for (const auto &item : ageing_due)
+    check_ageing(item, now_ms, entries);
 }
 
 void
@@ -696,31 +1111,52 @@ MatchUnitAbstract_::key_to_string_with_names(const ByteContainer &key) const {
 template<typename V>
 typename MatchUnitAbstract<V>::MatchUnitLookup
 MatchUnitAbstract<V>::lookup(const Packet &pkt) {
-  static thread_local ByteContainer key;
-  key.clear();
-  build_key(*pkt.get_phv(), &key);
+  static thread_local ByteContainer scratch;
+  const ByteContainer &key = get_key(pkt, &scratch);
 
-  // BMLOG_DEBUG_PKT(pkt, "Looking up key {}", key_to_string(key));
-  BMLOG_DEBUG_PKT(pkt, "Looking up key:\n{}", key_to_string_with_names(key));
+  log_key(pkt, key);
 
   MatchUnitLookup res = lookup_key(key);
-  if (res.found()) {
-    EntryMeta &meta = entry_meta[HANDLE_INTERNAL(res.handle)];
-    update_counters(&meta.counter, pkt);
-    update_ts(&meta.ts, pkt);
-  }
+  if (res.found()) hit_entry(HANDLE_INTERNAL(res.handle), pkt);
   return res;
 }
 
+template<typename V>
+void
+MatchUnitAbstract<V>::lookup_batch(const Packet *const *pkts, size_t n,
+                                   MatchUnitLookup *results) {
+  static thread_local std::vector<ByteContainer> keys;
+  static thread_local std::vector<const ByteContainer *> key_ptrs;
+  if (keys.size() < n) keys.resize(n);
+  key_ptrs.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    key_ptrs[i] = &get_key(*pkts[i], &keys[i]);
+    log_key(*pkts[i], *key_ptrs[i]);
+  }
+
+  lookup_key_batch(key_ptrs.data(), n, results);
+
+  for (size_t i = 0; i < n; i++) {
+    if (results[i].found())
+      hit_entry(HANDLE_INTERNAL(results[i].handle), *pkts[i]);
+  }
+}
+
+template<typename V>
+void
+MatchUnitAbstract<V>::lookup_key_batch(const ByteContainer *const *keys,
+                                       size_t n,
+                                       MatchUnitLookup *results) const {
+  for (size_t i = 0; i < n; i++) results[i] = lookup_key(*keys[i]);
+}
+
 template<typename V>
 MatchErrorCode
 MatchUnitAbstract<V>::add_entry(const std::vector<MatchKeyParam> &match_key,
                                 V value, entry_handle_t *handle, int priority) {
   MatchErrorCode rc = add_entry_(match_key, std::move(value), handle, priority);
   if (rc != MatchErrorCode::SUCCESS) return rc;
-  EntryMeta &meta = entry_meta[HANDLE_INTERNAL(*handle)];
-  meta.reset();
-  meta.version = HANDLE_VERSION(*handle);
+  init_entry_meta(*handle);
   return rc;
 }
 
@@ -776,7 +1212,9 @@ void
 MatchUnitAbstract<V>::reset_state() {
   this->num_entries = 0;
   this->handles.clear();
-  this->entry_meta = std::vector<EntryMeta>(size);
+  this->counters.clear();
+  this->ageing_meta.clear();
+  this->reset_ageing();
   reset_state_();
 }
 
@@ -796,6 +1234,10 @@ namespace {
     return key.priority;
   }
 
+  int get_priority(const RangeMatchKey &key) {
+    return key.priority;
+  }
+
   // Matching setter utility
 
   void set_priority(MatchKey *entry, int p) {
@@ -805,6 +1247,9 @@ namespace {
   void set_priority(TernaryMatchKey *entry, int p) {
     entry->priority = p;
   }
+  void set_priority(RangeMatchKey *entry, int p) {
+    entry->priority = p;
+  }
 
 }  // anonymous namespace
 
@@ -822,6 +1267,30 @@ MatchUnitGeneric<K, V>::lookup_key(const ByteContainer &key) const {
   return MatchUnitLookup::empty_entry();
 }
 
+template <typename K, typename V>
+void
+MatchUnitGeneric<K, V>::lookup_key_batch(const ByteContainer *const *keys,
+                                         size_t n,
+                                         MatchUnitLookup *results) const {
+  // processed in chunks to keep the lookup structure results on the stack
+  constexpr size_t chunk_size = 32;
+  internal_handle_t handles[chunk_size];  // NOLINT(runtime/arrays)
+  bool found[chunk_size];  // NOLINT(runtime/arrays)
+  for (size_t offset = 0; offset < n; offset += chunk_size) {
+    const size_t chunk = std::min(n - offset, chunk_size);
+    lookup_structure->lookup_batch(keys + offset, chunk, handles, found);
+    for (size_t i = 0; i < chunk; i++) {
+      if (!found[i]) {
+        results[offset + i] = MatchUnitLookup::empty_entry();
+        continue;
+      }
+      const Entry &entry = entries[handles[i]];
+      entry_handle_t handle = HANDLE_SET(entry.key.version, handles[i]);
+      results[offset + i] = MatchUnitLookup(handle, &entry.value);
+    }
+  }
+}
+
 template <typename K, typename V>
 MatchErrorCode
 MatchUnitGeneric<K, V>::add_entry_(const std::vector<MatchKeyParam> &match_key,
@@ -863,6 +1332,9 @@ MatchUnitGeneric<K, V>::add_entry_(const std::vector<MatchKeyParam> &match_key,
   entry.key.version = version;
   entries[handle_] = std::move(entry);
 
+  update_shapes(entries[handle_].key, true);
+  maybe_migrate();
+
   return MatchErrorCode::SUCCESS;
 }
 
@@ -876,8 +1348,11 @@ MatchUnitGeneric<K, V>::delete_entry_(entry_handle_t handle) {
     return MatchErrorCode::EXPIRED_HANDLE;
   entry.key.version += 1;
   lookup_structure->delete_entry(entry.key);
+  update_shapes(entry.key, false);
 
-  return this->unset_handle(handle_);
+  MatchErrorCode rc = this->unset_handle(handle_);
+  maybe_migrate();
+  return rc;
 }
 
 template <typename K, typename V>
@@ -956,17 +1431,44 @@ static void dump_entry_key_extra_(std::ostream *stream,
   (*stream) << " &&& " << key.mask.to_hex();
 }
 
+template <typename K>
+static void dump_entry_key_(std::ostream *stream,
+                            const MatchKeyBuilder &match_key_builder,
+                            const K &key) {
+  (*stream) << match_key_builder.key_to_string(key.data, " ");
+  // Print the mask in the case of a ternary entry, or the prefix length
+  // in the case of an LPM key
+  dump_entry_key_extra_(stream, key);
+}
+
+// the mask of a range key holds both the masks of the ternary fields and the
+// upper bounds of the range fields, so we print each field on its own, as
+// "start -> end" for range fields
+static void dump_entry_key_(std::ostream *stream,
+                            const MatchKeyBuilder &match_key_builder,
+                            const RangeMatchKey &key) {
+  bool first = true;
+  for (const auto &p : match_key_builder.entry_to_match_params(key)) {
+    if (!first) (*stream) << " ";
+    first = false;
+    dump_hexstring(*stream, p.key);
+    if (p.type == MatchKeyParam::Type::TERNARY) {
+      (*stream) << " &&& ";
+      dump_hexstring(*stream, p.mask);
+    } else if (p.type == MatchKeyParam::Type::RANGE) {
+      (*stream) << " -> ";
+      dump_hexstring(*stream, p.mask);
+    }
+  }
+}
+
 template <typename K, typename V>
 void
 MatchUnitGeneric<K, V>::dump_(std::ostream *stream) const {
   for (internal_handle_t handle_ : this->handles) {
     const Entry &entry = entries[handle_];
-    (*stream) << HANDLE_SET(entry.key.version, handle_) << ": "
-              << this->match_key_builder.key_to_string(entry.key.data, " ");
-
-    // Print the mask in the case of a ternary entry, or the prefix length
-    // in the case of an LPM key
-    dump_entry_key_extra_(stream, entry.key);
+    (*stream) << HANDLE_SET(entry.key.version, handle_) << ": ";
+    dump_entry_key_(stream, this->match_key_builder, entry.key);
 
     (*stream) << " => ";
     entry.value.dump(stream);
@@ -979,6 +1481,65 @@ void
 MatchUnitGeneric<K, V>::reset_state_() {
   entries = std::vector<Entry>(this->size);
   lookup_structure->clear();
+  shapes.clear();
+}
+
+template<typename K, typename V>
+void
+MatchUnitGeneric<K, V>::update_shapes(const K &key, bool add) {
+  const ByteContainer shape = get_shape(key);
+  if (add) {
+    shapes[shape]++;
+    return;
+  }
+  auto it = shapes.find(shape);
+  assert(it != shapes.end());
+  if (--it->second == 0) shapes.erase(it);
+}
+
+template<typename K, typename V>
+void
+MatchUnitGeneric<K, V>::maybe_migrate() {
+  if (!adaptive || this->num_entries == 0) return;
+  const bool prefer = prefer_tuple_space(
+      static_cast<const K *>(nullptr), this->num_entries, shapes.size(),
+      tuple_space);
+  if (prefer != tuple_space) migrate(prefer);
+}
+
+// The caller holds the table lock in write mode, which means no lookup can be
+// in progress when we swap the structures.
+template<typename K, typename V>
+void
+MatchUnitGeneric<K, V>::migrate(bool use_tuple_space) {
+  const size_t nbytes_key = this->match_key_builder.get_nbytes_key();
+  auto new_structure = use_tuple_space ?
+      LookupStructureFactory::create_tuple_space<K>(
+          lookup_factory, this->size, nbytes_key) :
+      LookupStructureFactory::create<K>(lookup_factory, this->size, nbytes_key);
+  if (!new_structure) return;
+  for (internal_handle_t handle_ : this->handles)
+    new_structure->add_entry(entries[handle_].key, handle_);
+  lookup_structure = std::move(new_structure);
+  tuple_space = use_tuple_space;
+  migrations++;
+}
+
+template<typename K, typename V>
+void
+MatchUnitGeneric<K, V>::set_adaptive_lookup(bool adaptive) {
+  this->adaptive = adaptive;
+  if (!adaptive && tuple_space)
+    migrate(false);
+  else
+    maybe_migrate();
+}
+
+template<typename K, typename V>
+MatchUnitAbstract_::LookupStats
+MatchUnitGeneric<K, V>::get_lookup_stats() const {
+  return {lookup_structure->get_name(), this->num_entries, shapes.size(),
+          migrations, adaptive};
 }
 
 // explicit template instantiation
@@ -1007,4 +1568,9 @@ MatchUnitGeneric<TernaryMatchKey, MatchTableAbstract::ActionEntry>;
 template class
 MatchUnitGeneric<TernaryMatchKey, MatchTableIndirect::IndirectIndex>;
 
+template class
+MatchUnitGeneric<RangeMatchKey, MatchTableAbstract::ActionEntry>;
+template class
+MatchUnitGeneric<RangeMatchKey, MatchTableIndirect::IndirectIndex>;
+
 }  // namespace bm
@@ -86,13 +86,34 @@ OptionsParser::parse(int argc, char *argv[]) {
        "Attach network interface <interface-name> as port <port-num> at "
        "startup. Can appear multiple times")
       ("pcap", "Generate pcap files for interfaces")
+      ("pcap-snaplen", po::value<uint32_t>(), "With --pcap, only write the "
+       "first bytes of each packet to the pcap files")
+      ("pcap-rotate-size", po::value<uint64_t>(), "With --pcap, start a new "
+       "pcap file when the current one reaches this size (in bytes)")
+      ("pcap-rotate-seconds", po::value<unsigned>(), "With --pcap, start a new "
+       "pcap file every so many seconds")
       ("use-files", po::value<int>(), "Read/write packets from files "
        "(interface X corresponds to two files X_in.pcap and X_out.pcap).  "
        "Argument is the time to wait (in seconds) before starting to process "
        "the packet files.")
+      ("replay-loops", po::value<unsigned>(), "With --use-files, replay the "
+       "input files this many times, as fast as possible (the files are "
+       "memory-mapped and merged up front)")
+      ("replay-rate", po::value<uint64_t>(), "With --replay-loops, pace the "
+       "replay to this many packets per second")
+      ("virtual-time", "With --use-files, run in virtual time: the clock "
+       "(timestamps, meters, ageing, rate limits, ...) follows the timestamps "
+       "of the input packets and jumps forward whenever the switch is idle, "
+       "instead of following the wall clock")
       ("packet-in", po::value<std::string>(),
        "Enable receiving packet on this (nanomsg) socket. "
        "The --interface options will be ignored.")
+      ("packet-in-shm", po::value<std::string>(),
+       "Enable receiving packets through shared memory rings; clients connect "
+       "to this Unix socket path. The --interface options will be ignored.")
+      ("af-packet", "Send/receive packets on the interfaces using AF_PACKET "
+       "sockets with memory-mapped (TPACKET_V3) rings instead of libpcap. "
+       "Incompatible with --pcap.")
       ("thrift-port", po::value<int>(),
        "TCP port on which to run the Thrift runtime server")
       ("device-id", po::value<int>(),
@@ -100,13 +121,27 @@ OptionsParser::parse(int argc, char *argv[]) {
       ("nanolog", po::value<std::string>(),
        "IPC socket to use for nanomsg pub/sub logs "
        "(default: no nanomsg logging")
+      ("event-trace-file", po::value<std::string>(),
+       "Write the event logger messages to the given binary trace file "
+       "instead of publishing them with nanomsg")
       ("log-console",
        "Enable logging on stdout")
       ("log-file", po::value<std::string>(),
        "Enable logging to given file")
+      ("log-binary-file", po::value<std::string>(),
+       "Record per-packet log messages in binary form in the given file, "
+       "instead of formatting them; use bm_log_decode to read the file")
       ("log-level,L", po::value<std::string>(),
        "Set log level, supported values are "
        "'trace', 'debug', 'info', 'warn', 'error', off'")
+      ("decision-cache", po::value<size_t>(),
+       "Cache the decisions taken by each pipeline (tables hit and conditions "
+       "results) for up to the given number of flows, and replay them for "
+       "packets which read the same header bits (default: disabled)")
+      ("adaptive-lookup",
+       "Let match tables pick their lookup data structure based on the entries "
+       "installed (e.g. a hash table for a ternary table in which all entries "
+       "use the same mask)")
       ("notifications-addr", po::value<std::string>(),
        "Specify the nanomsg address to use for notifications "
        "(e.g. learning, ageing, ...); "
@@ -169,6 +204,13 @@ OptionsParser::parse(int argc, char *argv[]) {
         + std::to_string(device_id) + std::string("-notifications.ipc");
   }
 
+  if (vm.count("nanolog") && vm.count("event-trace-file")) {
+    std::cout << "Error: --nanolog and --event-trace-file are exclusive\n";
+    exit(1);
+  }
+
+  // in both cases, the messages are published by a background thread, in order
+  // to keep the transport off the packet processing path
   if (vm.count("nanolog")) {
 #ifndef BMELOG_ON
     std::cout << "Warning: you requested the nanomsg event logger, but bmv2 "
@@ -178,7 +220,23 @@ OptionsParser::parse(int argc, char *argv[]) {
     event_logger_addr = vm["nanolog"].as<std::string>();
     auto event_transport = TransportIface::make_nanomsg(event_logger_addr);
     event_transport->open();
-    EventLogger::init(std::move(event_transport), device_id);
+    EventLogger::init(std::move(event_transport), device_id, true);
+#endif
+  }
+
+  if (vm.count("event-trace-file")) {
+#ifndef BMELOG_ON
+    std::cout << "Warning: you requested an event trace file, but bmv2 "
+              << "was compiled without -DBMELOG, and the event logger cannot "
+              << "be activated\n";
+#else
+    const std::string trace_path = vm["event-trace-file"].as<std::string>();
+    auto event_transport = TransportIface::make_file(trace_path);
+    if (event_transport->open() != 0) {
+      std::cout << "Error: cannot open event trace file " << trace_path << "\n";
+      exit(1);
+    }
+    EventLogger::init(std::move(event_transport), device_id, true);
 #endif
   }
 
@@ -195,6 +253,10 @@ OptionsParser::parse(int argc, char *argv[]) {
     file_logger = vm["log-file"].as<std::string>();
   }
 
+  if (vm.count("log-binary-file")) {
+    binary_logger = vm["log-binary-file"].as<std::string>();
+  }
+
   if (vm.count("log-level")) {
     const std::string log_level_str = vm["log-level"].as<std::string>();
     std::unordered_map<std::string, Logger::LogLevel> levels_map = {
@@ -222,6 +284,25 @@ OptionsParser::parse(int argc, char *argv[]) {
     pcap = true;
   }
 
+  if ((vm.count("pcap-snaplen") || vm.count("pcap-rotate-size") ||
+       vm.count("pcap-rotate-seconds")) && !pcap) {
+    std::cout << "Error: --pcap-snaplen, --pcap-rotate-size and "
+              << "--pcap-rotate-seconds require --pcap\n";
+    exit(1);
+  }
+
+  if (vm.count("pcap-snaplen")) {
+    pcap_snaplen = vm["pcap-snaplen"].as<uint32_t>();
+  }
+
+  if (vm.count("pcap-rotate-size")) {
+    pcap_rotate_size = vm["pcap-rotate-size"].as<uint64_t>();
+  }
+
+  if (vm.count("pcap-rotate-seconds")) {
+    pcap_rotate_seconds = vm["pcap-rotate-seconds"].as<unsigned>();
+  }
+
   if (vm.count("use-files")) {
     use_files = true;
     wait_time = vm["use-files"].as<int>();
@@ -229,6 +310,31 @@ OptionsParser::parse(int argc, char *argv[]) {
       wait_time = 0;
   }
 
+  if (vm.count("replay-loops")) {
+    replay_loops = vm["replay-loops"].as<unsigned>();
+    if (!use_files || replay_loops == 0) {
+      std::cout << "Error: --replay-loops requires --use-files and a "
+                << "positive number of loops\n";
+      exit(1);
+    }
+  }
+
+  if (vm.count("replay-rate")) {
+    if (replay_loops == 0) {
+      std::cout << "Error: --replay-rate requires --replay-loops\n";
+      exit(1);
+    }
+    replay_rate = vm["replay-rate"].as<uint64_t>();
+  }
+
+  if (vm.count("virtual-time")) {
+    if (!use_files) {
+      std::cout << "Error: --virtual-time requires --use-files\n";
+      exit(1);
+    }
+    virtual_time = true;
+  }
+
   if (vm.count("packet-in")) {
     packet_in = true;
     packet_in_addr = vm["packet-in"].as<std::string>();
@@ -241,6 +347,36 @@ OptionsParser::parse(int argc, char *argv[]) {
     exit(1);
   }
 
+  if (vm.count("packet-in-shm")) {
+    packet_in_shm = true;
+    packet_in_shm_path = vm["packet-in-shm"].as<std::string>();
+    ifaces.clear();
+  }
+
+  if (packet_in_shm && (use_files || packet_in)) {
+    std::cout << "Error: --packet-in-shm cannot be used with --use-files or "
+              << "--packet-in\n";
+    exit(1);
+  }
+
+  if (vm.count("af-packet")) {
+    af_packet = true;
+  }
+
+  if (af_packet && (use_files || packet_in || packet_in_shm || pcap)) {
+    std::cout << "Error: --af-packet cannot be used with --use-files, "
+              << "--packet-in, --packet-in-shm or --pcap\n";
+    exit(1);
+  }
+
+  if (vm.count("decision-cache")) {
+    decision_cache_size = vm["decision-cache"].as<size_t>();
+  }
+
+  if (vm.count("adaptive-lookup")) {
+    adaptive_lookup = true;
+  }
+
   if (vm.count("debugger-addr")) {
     debugger = true;
     debugger_addr = vm["debugger-addr"].as<std::string>();
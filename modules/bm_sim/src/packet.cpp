@@ -44,14 +44,16 @@ Packet::set_ingress_ts() {
 
 Packet::Packet(size_t cxt_id, int ingress_port, packet_id_t id,
                copy_id_t copy_id, int ingress_length, PacketBuffer &&buffer,
-               PHVSourceIface *phv_source)
+               PHVSourceIface *phv_source, std::shared_ptr<P4Objects> config)
     : cxt_id(cxt_id), ingress_port(ingress_port), packet_id(id),
       copy_id(copy_id), ingress_length(ingress_length),
-      buffer(std::move(buffer)), phv_source(phv_source) {
+      buffer(std::move(buffer)), p4objects(std::move(config)),
+      phv_source(phv_source) {
   assert(phv_source);
+  VirtualTime::add_work();
   update_signature();
   set_ingress_ts();
-  phv = phv_source->get(cxt_id);
+  phv = phv_source->get(cxt_id, &p4objects);
   phv->set_packet_id(packet_id, copy_id);
   DEBUGGER_PACKET_IN(PacketId::make(packet_id, copy_id), ingress_port);
 }
@@ -69,6 +71,7 @@ Packet::~Packet() {
     phv->reset_header_stacks();
     phv_source->release(cxt_id, std::move(phv));
     DEBUGGER_PACKET_OUT(PacketId::make(packet_id, copy_id), egress_port);
+    VirtualTime::remove_work();
   }
 }
 
@@ -79,7 +82,8 @@ Packet::change_context(size_t new_cxt) {
   phv->reset();
   phv->reset_header_stacks();
   phv_source->release(cxt_id, std::move(phv));
-  phv = phv_source->get(new_cxt);
+  p4objects = nullptr;
+  phv = phv_source->get(new_cxt, &p4objects);
   cxt_id = new_cxt;
 }
 
@@ -105,7 +109,7 @@ Packet
 Packet::clone_with_phv() const {
   copy_id_t new_copy_id = copy_id_gen->add_one(packet_id);
   Packet pkt(cxt_id, ingress_port, packet_id, new_copy_id, ingress_length,
-             buffer.clone(buffer.get_data_size()), phv_source);
+             buffer.clone(buffer.get_data_size()), phv_source, p4objects);
   pkt.phv->copy_headers(*phv);
   // return std::move(pkt);
   // Enable NRVO
@@ -121,7 +125,7 @@ Packet
 Packet::clone_with_phv_reset_metadata() const {
   copy_id_t new_copy_id = copy_id_gen->add_one(packet_id);
   Packet pkt(cxt_id, ingress_port, packet_id, new_copy_id, ingress_length,
-             buffer.clone(buffer.get_data_size()), phv_source);
+             buffer.clone(buffer.get_data_size()), phv_source, p4objects);
   // TODO(antonin): optimize this
   pkt.phv->copy_headers(*phv);
   pkt.phv->reset_metadata();
@@ -138,8 +142,10 @@ Packet::clone_with_phv_reset_metadata_ptr() const {
 Packet
 Packet::clone_choose_context(size_t new_cxt) const {
   copy_id_t new_copy_id = copy_id_gen->add_one(packet_id);
+  // a clone in the same context is processed with the same configuration
   Packet pkt(new_cxt, ingress_port, packet_id, new_copy_id, ingress_length,
-             buffer.clone(buffer.get_data_size()), phv_source);
+             buffer.clone(buffer.get_data_size()), phv_source,
+             (new_cxt == cxt_id) ? p4objects : nullptr);
   // return std::move(pkt);
   // Enable NRVO
   return pkt;
@@ -169,7 +175,7 @@ Packet::Packet(Packet &&other) noexcept
       copy_id(other.copy_id), ingress_length(other.ingress_length),
       signature(other.signature), payload_size(other.payload_size),
       ingress_ts(other.ingress_ts), ingress_ts_ms(other.ingress_ts_ms),
-      phv_source(other.phv_source) {
+      p4objects(std::move(other.p4objects)), phv_source(other.phv_source) {
   buffer = std::move(other.buffer);
   phv = std::move(other.phv);
 }
@@ -189,7 +195,9 @@ Packet::operator=(Packet &&other) noexcept {
   phv_source = other.phv_source;
 
   std::swap(buffer, other.buffer);
+  std::swap(p4objects, other.p4objects);
   std::swap(phv, other.phv);
+  key_memo = KeyMemo();
 
   return *this;
 }
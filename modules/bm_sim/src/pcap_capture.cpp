@@ -0,0 +1,297 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include "bm_sim/pcap_capture.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bm_sim/logger.h"
+
+namespace bm {
+
+namespace {
+
+// pcap file format, see https://wiki.wireshark.org/Development/LibpcapFileFormat
+struct PcapGlobalHdr {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct PcapRecordHdr {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t caplen;
+  uint32_t len;
+};
+
+constexpr uint32_t pcap_magic = 0xa1b2c3d4;
+constexpr uint32_t linktype_ethernet = 1;
+constexpr uint32_t max_snaplen = 65535;
+// with more segments than this, the packet is linearized before being queued
+constexpr int max_segments = 15;
+// size of the stdio buffer for the file
+constexpr size_t file_buffer_size = 1 << 20;
+// max number of packets written between 2 checks for flush requests
+constexpr size_t write_burst = 256;
+// the writer wakes up at least this often, to rotate files by time
+constexpr int64_t max_sleep_ms = 1000;
+// packets sitting in the stdio buffer are written to the file after at most
+// this many seconds; a full buffer is written out by stdio itself
+constexpr int64_t flush_interval_seconds = 1;
+
+int64_t
+now_seconds() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t
+round_up_pow2(size_t v) {
+  size_t r = 1;
+  while (r < v) r <<= 1;
+  return r;
+}
+
+}  // namespace
+
+PcapCapture::PcapCapture(const std::string &filename,
+                         const PcapCaptureConfig &config)
+    : filename(filename), config(config) {
+  const size_t capacity = round_up_pow2(
+      std::max(config.queue_bytes, static_cast<size_t>(1 << 16)));
+  // the control block of the ring needs to be cache-line aligned
+  queue_mem.resize(shm::Ring::mem_size(capacity) + 64);
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(queue_mem.data());
+  queue = shm::Ring(reinterpret_cast<void *>((addr + 63) & ~uintptr_t(63)),
+                    capacity);
+  queue.init();
+
+  file_buffer.resize(file_buffer_size);
+  open_next_file();
+  writer_thread = std::thread(&PcapCapture::writer_loop, this);
+}
+
+PcapCapture::~PcapCapture() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_one();
+  writer_thread.join();
+  close_file();
+  if (dropped > 0) {
+    Logger::get()->warn("pcap capture {}: {} packets could not be written",
+                        filename, dropped.load());
+  }
+}
+
+bool
+PcapCapture::capture(const char *data, size_t len) {
+  struct iovec iov = {const_cast<char *>(data), len};
+  return capture(&iov, 1);
+}
+
+bool
+PcapCapture::capture(const struct iovec *iov, int iovcnt) {
+  static thread_local std::vector<char> linear;
+  if (iovcnt > max_segments) {
+    linear.clear();
+    for (int i = 0; i < iovcnt; i++) {
+      const char *base = static_cast<const char *>(iov[i].iov_base);
+      linear.insert(linear.end(), base, base + iov[i].iov_len);
+    }
+    struct iovec single = {linear.data(), linear.size()};
+    return capture(&single, 1);
+  }
+
+  // the record in the queue is the pcap record (header + data), so that the
+  // writer can copy it to the file as is; clock_gettime does not make a
+  // syscall for CLOCK_REALTIME
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+  PcapRecordHdr hdr;
+  hdr.ts_sec = static_cast<uint32_t>(ts.tv_sec);
+  hdr.ts_usec = static_cast<uint32_t>(ts.tv_nsec / 1000);
+  hdr.len = static_cast<uint32_t>(len);
+  hdr.caplen = (config.snaplen > 0 && len > config.snaplen) ?
+      config.snaplen : hdr.len;
+
+  struct iovec segments[max_segments + 1];
+  segments[0] = {&hdr, sizeof(hdr)};
+  int nsegments = 1;
+  size_t remaining = hdr.caplen;
+  for (int i = 0; i < iovcnt && remaining > 0; i++) {
+    const size_t seg_len = std::min(remaining, iov[i].iov_len);
+    segments[nsegments++] = {iov[i].iov_base, seg_len};
+    remaining -= seg_len;
+  }
+
+  bool pushed, wake_up;
+  {
+    std::lock_guard<std::mutex> lock(producer_mutex);
+    pushed = queue.push(0, 0, 0, segments, nsegments);
+    wake_up = pushed && queue.flush();
+  }
+
+  if (!pushed) {
+    dropped++;
+    return false;
+  }
+  captured++;
+  if (wake_up) {
+    // the mutex guarantees that the writer is waiting on cv, see writer_loop
+    { std::unique_lock<std::mutex> lock(mutex); }
+    cv.notify_one();
+  }
+  return true;
+}
+
+void
+PcapCapture::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  const uint64_t request = ++flush_requests;
+  cv.notify_one();
+  flush_cv.wait(lock, [this, request]() { return flush_done >= request; });
+}
+
+PcapCapture::Stats
+PcapCapture::get_stats() const {
+  return {captured.load(), dropped.load(), files.load()};
+}
+
+void
+PcapCapture::write_record(const shm::MsgHdr &hdr, const char *data) {
+  (void) hdr;
+  PcapRecordHdr rec;
+  std::memcpy(&rec, data, sizeof(rec));
+  const size_t size = sizeof(rec) + rec.caplen;
+  if (file && config.rotate_bytes > 0 && file_packets > 0 &&
+      file_bytes + size > config.rotate_bytes)
+    open_next_file();
+  if (!file || std::fwrite(data, size, 1, file) != 1) {
+    dropped++;
+    return;
+  }
+  file_bytes += size;
+  file_packets++;
+}
+
+bool
+PcapCapture::open_next_file() {
+  close_file();
+
+  std::string name = filename;
+  const uint64_t index = files.load();
+  if (index > 0) {
+    const std::string ext(".pcap");
+    const bool has_ext = name.size() > ext.size() &&
+        name.compare(name.size() - ext.size(), ext.size(), ext) == 0;
+    if (has_ext)
+      name.insert(name.size() - ext.size(), "." + std::to_string(index));
+    else
+      name += "." + std::to_string(index);
+  }
+
+  file = std::fopen(name.c_str(), "wb");
+  if (!file) {
+    Logger::get()->error("pcap capture: cannot open {}: {}",
+                         name, std::strerror(errno));
+    return false;
+  }
+  std::setvbuf(file, file_buffer.data(), _IOFBF, file_buffer.size());
+  PcapGlobalHdr hdr;
+  hdr.magic = pcap_magic;
+  hdr.version_major = 2;
+  hdr.version_minor = 4;
+  hdr.thiszone = 0;
+  hdr.sigfigs = 0;
+  hdr.snaplen = (config.snaplen > 0) ? config.snaplen : max_snaplen;
+  hdr.linktype = linktype_ethernet;
+  std::fwrite(&hdr, sizeof(hdr), 1, file);
+  file_bytes = sizeof(hdr);
+  file_packets = 0;
+  file_opened_at = now_seconds();
+  last_flush_at = file_opened_at;
+  files++;
+  return true;
+}
+
+void
+PcapCapture::close_file() {
+  if (file) std::fclose(file);
+  file = nullptr;
+}
+
+// The writer only waits on cv after telling producers it is about to sleep
+// (Ring::prepare_wait), while holding the mutex; a producer which sees it
+// sleeping acquires the mutex before notifying it, so the wake-up cannot be
+// lost.
+void
+PcapCapture::writer_loop() {
+  auto write_cb = [this](const shm::MsgHdr &hdr, const char *data) {
+    write_record(hdr, data);
+  };
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    const bool stopping = stop;
+    const uint64_t flush_target = flush_requests;
+    lock.unlock();
+
+    while (queue.consume(write_cb, write_burst) > 0) {}
+    if (file) {
+      const int64_t now = now_seconds();
+      if (flush_done < flush_target ||
+          now - last_flush_at >= flush_interval_seconds) {
+        std::fflush(file);
+        last_flush_at = now;
+      }
+    }
+    if (file && config.rotate_seconds > 0 && file_packets > 0 &&
+        now_seconds() - file_opened_at >=
+        static_cast<int64_t>(config.rotate_seconds))
+      open_next_file();
+
+    lock.lock();
+    if (flush_done < flush_target) {
+      flush_done = flush_target;
+      flush_cv.notify_all();
+    }
+    if (stopping) break;
+    if (stop || flush_requests != flush_target) continue;
+    if (!queue.prepare_wait()) continue;
+    cv.wait_for(lock, std::chrono::milliseconds(max_sleep_ms));
+  }
+}
+
+}  // namespace bm
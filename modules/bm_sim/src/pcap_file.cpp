@@ -15,9 +15,19 @@
 
 #include "bm_sim/pcap_file.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <stdexcept>
 #include <cassert>
 #include <chrono>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
 #include <thread>
 #include <iostream>
 #include <iomanip>
@@ -159,23 +169,321 @@ bool PcapFileIn::atEOF() const {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+namespace {
+
+// pcap file format constants, see
+// https://wiki.wireshark.org/Development/LibpcapFileFormat and
+// https://github.com/pcapng/pcapng
+constexpr uint32_t PCAP_MAGIC_US = 0xa1b2c3d4;
+constexpr uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+constexpr uint32_t PCAPNG_SHB = 0x0a0d0d0a;
+constexpr uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+constexpr uint32_t PCAPNG_IDB = 1;
+constexpr uint32_t PCAPNG_SPB = 3;
+constexpr uint32_t PCAPNG_EPB = 6;
+constexpr uint16_t PCAPNG_OPT_IF_TSRESOL = 9;
+
+uint32_t
+read32(const char* p, bool swapped) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return swapped ? __builtin_bswap32(v) : v;
+}
+
+uint16_t
+read16(const char* p, bool swapped) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return swapped ? __builtin_bswap16(v) : v;
+}
+
+// pcapng timestamps are expressed in units of 10^-N or 2^-N seconds
+// (if_tsresol), we convert them to nanoseconds
+struct TsResolution {
+  bool power_of_2{false};
+  unsigned exponent{6};
+
+  // the units have to fit in 64 bits
+  bool is_valid() const {
+    return power_of_2 ? (exponent < 64) : (exponent <= 19);
+  }
+
+  uint64_t to_ns(uint64_t ts) const {
+    if (power_of_2) {
+      const uint64_t mask = (static_cast<uint64_t>(1) << exponent) - 1;
+      // the fractional part is truncated to 30 bits (which is still below a
+      // nanosecond) so that the multiplication cannot overflow
+      uint64_t frac = ts & mask;
+      unsigned frac_bits = exponent;
+      if (frac_bits > 30) {
+        frac >>= (frac_bits - 30);
+        frac_bits = 30;
+      }
+      return (ts >> exponent) * 1000000000ull +
+          ((frac * 1000000000ull) >> frac_bits);
+    }
+    uint64_t units = 1;
+    for (unsigned i = 0; i < exponent; i++) units *= 10;
+    return (units <= 1000000000ull) ? ts * (1000000000ull / units)
+                                    : ts / (units / 1000000000ull);
+  }
+};
+
+}  // namespace
+
+PcapFileMmap::PcapFileMmap(unsigned port, std::string filename)
+  : PcapFileBase(port, filename),
+    base(nullptr),
+    size(0) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    bm_fatal_error(std::string("Could not open file ") + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 4) {
+    close(fd);
+    bm_fatal_error(filename + " is not a pcap file");
+  }
+  size = static_cast<size_t>(st.st_size);
+  void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                    fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    bm_fatal_error(std::string("Could not map file ") + filename);
+  base = static_cast<const char*>(addr);
+  // we read it once, sequentially
+  madvise(addr, size, MADV_SEQUENTIAL);
+
+  if (read32(base, false) == PCAPNG_SHB)
+    parsePcapng();
+  else
+    parsePcap();
+}
+
+
+PcapFileMmap::~PcapFileMmap() {
+  if (base != nullptr)
+    munmap(const_cast<char*>(base), size);
+}
+
+
+void
+PcapFileMmap::parsePcap() {
+  constexpr size_t global_hdr_size = 24;
+  constexpr size_t record_hdr_size = 16;
+  if (size < global_hdr_size)
+    bm_fatal_error(filename + " is not a pcap file");
+  const uint32_t magic = read32(base, false);
+  bool swapped;
+  if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS)
+    swapped = false;
+  else if (__builtin_bswap32(magic) == PCAP_MAGIC_US ||
+           __builtin_bswap32(magic) == PCAP_MAGIC_NS)
+    swapped = true;
+  else
+    bm_fatal_error(filename + " is not a pcap file");
+  const bool ns = (read32(base, swapped) == PCAP_MAGIC_NS);
+
+  size_t offset = global_hdr_size;
+  while (offset + record_hdr_size <= size) {
+    const char* hdr = base + offset;
+    const uint64_t ts_sec = read32(hdr, swapped);
+    const uint64_t ts_frac = read32(hdr + 4, swapped);
+    const uint32_t caplen = read32(hdr + 8, swapped);
+    offset += record_hdr_size;
+    if (offset + caplen > size) {
+      std::cerr << "Truncated packet at the end of " << filename << std::endl;
+      break;
+    }
+    records.push_back({ts_sec * 1000000000ull + (ns ? ts_frac : ts_frac * 1000),
+                       base + offset, caplen});
+    offset += caplen;
+  }
+}
+
+
+// Only the blocks containing packets (and the ones we need to interpret them)
+// are parsed, all the others are skipped.
+void
+PcapFileMmap::parsePcapng() {
+  bool swapped = false;
+  // one entry per interface in the current section
+  std::vector<TsResolution> interfaces;
+  uint64_t last_ts_ns = 0;
+
+  size_t offset = 0;
+  while (offset + 12 <= size) {
+    const char* block = base + offset;
+    uint32_t type = read32(block, false);
+    if (type == PCAPNG_SHB) {
+      const uint32_t bom = read32(block + 8, false);
+      if (bom == PCAPNG_BYTE_ORDER_MAGIC)
+        swapped = false;
+      else if (__builtin_bswap32(bom) == PCAPNG_BYTE_ORDER_MAGIC)
+        swapped = true;
+      else
+        bm_fatal_error(filename + " is not a valid pcapng file");
+      interfaces.clear();
+    } else {
+      type = read32(block, swapped);
+    }
+    const uint32_t block_len = read32(block + 4, swapped);
+    if (block_len < 12 || block_len % 4 != 0 || offset + block_len > size) {
+      std::cerr << "Truncated block at the end of " << filename << std::endl;
+      break;
+    }
+
+    if (type == PCAPNG_IDB) {
+      TsResolution res;
+      size_t opt = 16;
+      while (opt + 4 <= block_len - 4) {
+        const uint16_t code = read16(block + opt, swapped);
+        const uint16_t len = read16(block + opt + 2, swapped);
+        if (code == 0) break;  // opt_endofopt
+        if (len > block_len - 4 - (opt + 4))
+          bm_fatal_error(std::string("Invalid interface block in ") +
+                         filename);
+        if (code == PCAPNG_OPT_IF_TSRESOL && len >= 1) {
+          const uint8_t v = static_cast<uint8_t>(block[opt + 4]);
+          res.power_of_2 = (v & 0x80) != 0;
+          res.exponent = v & 0x7f;
+          if (!res.is_valid())
+            bm_fatal_error(std::string("Unsupported timestamp resolution in ") +
+                           filename);
+        }
+        opt += 4 + ((len + 3u) & ~3u);
+      }
+      interfaces.push_back(res);
+    } else if (type == PCAPNG_EPB && block_len >= 32) {
+      const uint32_t if_id = read32(block + 8, swapped);
+      const uint64_t ts = (static_cast<uint64_t>(read32(block + 12, swapped))
+                           << 32) | read32(block + 16, swapped);
+      const uint32_t caplen = read32(block + 20, swapped);
+      // cannot overflow, unlike 28 + caplen
+      if (caplen > block_len - 32)
+        bm_fatal_error(std::string("Invalid packet block in ") + filename);
+      const TsResolution res = (if_id < interfaces.size()) ?
+          interfaces[if_id] : TsResolution();
+      last_ts_ns = res.to_ns(ts);
+      records.push_back({last_ts_ns, block + 28, caplen});
+    } else if (type == PCAPNG_SPB && block_len >= 16) {
+      // no timestamp, we use the one of the previous packet
+      const uint32_t origlen = read32(block + 8, swapped);
+      const uint32_t caplen = std::min(origlen, block_len - 16);
+      records.push_back({last_ts_ns, block + 12, caplen});
+    }
+
+    offset += block_len;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr size_t PcapFilesReader::replayBatchSize;
+
 PcapFilesReader::PcapFilesReader(bool respectTiming,
                                  unsigned wait_time_in_seconds)
   : nonEmptyFiles(0),
     wait_time_in_seconds(wait_time_in_seconds),
     respectTiming(respectTiming),
-    started(false) {
+    started(false),
+    fastReplay(false),
+    replayLoops(0),
+    replayTargetPps(0) {
   timerclear(&zero);
 }
 
 
+void
+PcapFilesReader::setFastReplay(unsigned loops, uint64_t targetPps) {
+  assert(files.empty() && mmapFiles.empty());
+  fastReplay = true;
+  replayLoops = loops;
+  replayTargetPps = targetPps;
+}
+
+
 void
 PcapFilesReader::addFile(unsigned index, std::string file) {
+  if (fastReplay) {
+    mmapFiles.emplace_back(new PcapFileMmap(index, file));
+    return;
+  }
   auto f = std::unique_ptr<PcapFileIn>(new PcapFileIn(index, file));
   files.push_back(std::move(f));
 }
 
 
+// k-way merge of the files, on timestamps; like for the regular mode, packets
+// with the same timestamp are taken from the file added first
+std::vector<PcapFilesReader::ReplayPacket>
+PcapFilesReader::buildReplayIndex() const {
+  size_t total = 0;
+  for (const auto &file : mmapFiles) total += file->getRecords().size();
+  std::vector<ReplayPacket> index;
+  index.reserve(total);
+
+  // (timestamp, file index)
+  typedef std::pair<uint64_t, size_t> Head;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+  std::vector<size_t> positions(mmapFiles.size(), 0);
+  for (size_t i = 0; i < mmapFiles.size(); i++) {
+    const auto &records = mmapFiles[i]->getRecords();
+    if (!records.empty()) heads.emplace(records[0].ts_ns, i);
+  }
+  while (!heads.empty()) {
+    const size_t i = heads.top().second;
+    heads.pop();
+    const auto &records = mmapFiles[i]->getRecords();
+    const auto &record = records[positions[i]++];
+    index.push_back({record.data, record.length, mmapFiles[i]->getPort()});
+    if (positions[i] < records.size())
+      heads.emplace(records[positions[i]].ts_ns, i);
+  }
+  return index;
+}
+
+
+void
+PcapFilesReader::replay() {
+  if (handler == nullptr)
+    bm_fatal_error("No packet handler set when sending packet");
+
+  const std::vector<ReplayPacket> index = buildReplayIndex();
+
+  typedef std::chrono::steady_clock clock;
+  const clock::time_point replayStart = clock::now();
+  const Clock::time_point virtualStart = Clock::now();
+  const bool virtualTime = VirtualTime::is_enabled();
+  uint64_t sent = 0;
+  for (unsigned loop = 0; loop < replayLoops; loop++) {
+    for (size_t i = 0; i < index.size(); i += replayBatchSize) {
+      if (replayTargetPps > 0) {
+        auto offset = std::chrono::nanoseconds(
+            static_cast<uint64_t>(sent * 1e9 / replayTargetPps));
+        if (virtualTime)
+          VirtualTime::advance_to(virtualStart + offset);
+        else
+          std::this_thread::sleep_until(replayStart + offset);
+      }
+      const size_t end = std::min(i + replayBatchSize, index.size());
+      for (size_t j = i; j < end; j++) {
+        const ReplayPacket &p = index[j];
+        handler(p.port, p.data, p.length, cookie);
+      }
+      sent += end - i;
+    }
+  }
+  if (virtualTime) VirtualTime::run_until_idle();
+
+#if DEBUG_TIMING
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      clock::now() - replayStart);
+  std::cout << "Replayed " << sent << " packets in " << elapsed.count()
+            << " us" << std::endl;
+#endif
+}
+
+
 void
 PcapFilesReader::scan() {
   if (nonEmptyFiles == 0) {
@@ -214,7 +522,17 @@ PcapFilesReader::scan() {
             << PcapPacket::timevalToString(earliest_time) << std::endl;
 #endif
 
-  if (respectTiming) {
+  if (VirtualTime::is_enabled()) {
+    // no sleeping, the clock jumps to the time of the packet; in virtual time
+    // packets are always scheduled according to their timestamps, whether
+    // respectTiming is set or not, since this costs nothing
+    struct timeval delta;
+    timersub(earliest_time, &firstPacketTime, &delta);
+    VirtualTime::advance_to(virtualStartTime +
+                            std::chrono::seconds(delta.tv_sec) +
+                            std::chrono::microseconds(delta.tv_usec));
+    timerclear(&delay);
+  } else if (respectTiming) {
     struct timeval delta;
     timersub(earliest_time, &firstPacketTime, &delta);
 
@@ -289,6 +607,14 @@ void PcapFilesReader::start() {
     std::this_thread::sleep_for(duration);
   }
 
+  if (fastReplay) {
+    if (started)
+      bm_fatal_error("Reader already started");
+    started = true;
+    replay();
+    return;
+  }
+
   // Find out time of first packet
   const struct timeval* firstTime = nullptr;
 
@@ -322,7 +648,9 @@ void PcapFilesReader::start() {
 
   started = true;
   gettimeofday(&startTime, nullptr);
+  virtualStartTime = Clock::now();
   scan();
+  if (VirtualTime::is_enabled()) VirtualTime::run_until_idle();
 }
 
 
@@ -370,16 +698,24 @@ PcapFileOut::~PcapFileOut() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-PcapFilesWriter::PcapFilesWriter() {}
+PcapFilesWriter::PcapFilesWriter(const PcapCaptureConfig& config)
+  : config(config) {}
 
 
 void
 PcapFilesWriter::addFile(unsigned port, std::string file) {
-  auto f = std::unique_ptr<PcapFileOut>(new PcapFileOut(port, file));
+  auto f = std::unique_ptr<PcapCapture>(new PcapCapture(file, config));
   files.emplace(port, std::move(f));
 }
 
 
+void
+PcapFilesWriter::flush() {
+  for (auto &f : files)
+    f.second->flush();
+}
+
+
 void
 PcapFilesWriter::send_packet(int port_num, const char* buffer, int len) {
   unsigned idx = port_num;
@@ -390,7 +726,7 @@ PcapFilesWriter::send_packet(int port_num, const char* buffer, int len) {
     return;
 
   auto file = files.at(idx).get();
-  file->writePacket(buffer, len);
+  file->capture(buffer, len);
 }
 
 }  // namespace bm
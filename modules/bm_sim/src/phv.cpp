@@ -176,6 +176,7 @@ PHVFactory::create() const {
   for (const auto &e : field_aliases)
     phv->add_field_alias(e.first, e.second);
 
+  phv->factory = this;
   return phv;
 }
 
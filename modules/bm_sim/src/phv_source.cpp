@@ -18,11 +18,14 @@
  *
  */
 
+#include <algorithm>  // for swap
+#include <memory>
 #include <vector>
 #include <mutex>
 #include <iostream>
 
 #include "bm_sim/phv_source.h"
+#include "bm_sim/P4Objects.h"
 
 namespace bm {
 
@@ -34,19 +37,31 @@ class PHVSourceContextPools : public PHVSourceIface {
  private:
   class PHVPool {
    public:
-    void set_phv_factory(const PHVFactory *factory) {
+    void set_phv_factory(const PHVFactory *factory,
+                         std::shared_ptr<P4Objects> new_config) {
       std::unique_lock<std::mutex> lock(mutex);
-      assert(count == 0);
-      phv_factory = factory;
+      // PHVs still in use by packets of the previous configuration are
+      // destroyed when released, see release()
       phvs.clear();
+      count = 0;
+      phv_factory = factory;
+      // may destroy the previous configuration, if it has no packets left
+      std::swap(config, new_config);
+      lock.unlock();
     }
 
-    std::unique_ptr<PHV> get() {
+    std::unique_ptr<PHV> get(std::shared_ptr<P4Objects> *pkt_config) {
       std::unique_lock<std::mutex> lock(mutex);
+      if (*pkt_config && *pkt_config != config) {
+        lock.unlock();
+        return (*pkt_config)->get_phv_factory().create();
+      }
+      *pkt_config = config;
       count++;
       if (phvs.size() == 0) {
+        const PHVFactory *factory = phv_factory;
         lock.unlock();
-        return phv_factory->create();
+        return factory->create();
       }
       std::unique_ptr<PHV> phv = std::move(phvs.back());
       phvs.pop_back();
@@ -55,6 +70,10 @@ class PHVSourceContextPools : public PHVSourceIface {
 
     void release(std::unique_ptr<PHV> phv) {
       std::unique_lock<std::mutex> lock(mutex);
+      if (phv->get_factory() != phv_factory) {
+        lock.unlock();
+        return;  // previous configuration
+      }
       count--;
       phvs.push_back(std::move(phv));
     }
@@ -68,19 +87,23 @@ class PHVSourceContextPools : public PHVSourceIface {
     mutable std::mutex mutex{};
     std::vector<std::unique_ptr<PHV> > phvs{};
     const PHVFactory *phv_factory{nullptr};
+    std::shared_ptr<P4Objects> config{nullptr};
+    // number of PHVs of the current configuration in use
     size_t count{0};
   };
 
-  std::unique_ptr<PHV> get_(size_t cxt) override {
-    return phv_pools.at(cxt).get();
+  std::unique_ptr<PHV> get_(size_t cxt,
+                            std::shared_ptr<P4Objects> *config) override {
+    return phv_pools.at(cxt).get(config);
   }
 
   void release_(size_t cxt, std::unique_ptr<PHV> phv) override {
     return phv_pools.at(cxt).release(std::move(phv));
   }
 
-  void set_phv_factory_(size_t cxt, const PHVFactory *factory) override {
-    phv_pools.at(cxt).set_phv_factory(factory);
+  void set_phv_factory_(size_t cxt, const PHVFactory *factory,
+                        std::shared_ptr<P4Objects> config) override {
+    phv_pools.at(cxt).set_phv_factory(factory, std::move(config));
   }
 
   size_t phvs_in_use_(size_t cxt) override {
@@ -18,15 +18,457 @@
  *
  */
 
+#include <boost/thread/shared_mutex.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 #include "bm_sim/pipeline.h"
+#include "bm_sim/conditionals.h"
+#include "bm_sim/tables.h"
 #include "bm_sim/event_logger.h"
 #include "bm_sim/logger.h"
 #include "bm_sim/debugger.h"
 
 namespace bm {
 
+// The decision cache works as follows. When it is enabled, we compute the PHV
+// bits read by each instruction: the match key fields (with their masks) and
+// the validity of their headers for tables, the fields and header validities
+// used by the expression for conditions.
+// On a cache miss, we run the program and record each decision (the result of
+// each condition and the entry returned by each table) in a trace. The trace
+// is then inserted in the cache, keyed by the values of all the bits read
+// along the way, as they were when the packet entered the pipeline. Traces
+// which read different sets of bits go to different sub-tables, which are all
+// searched on lookup, the same way Open vSwitch handles megaflow masks.
+// Because actions can modify the PHV, a table applied after a non-empty action
+// may see different values than the ones the trace is keyed with. For these
+// tables, we record the match key and compare it with the packet's key before
+// replaying the entry. Conditions are cheap, so we always evaluate them and
+// compare the result with the recorded one. If the packet diverges from the
+// trace, or if a table has been modified since the trace was recorded, we
+// resume normal processing from that point.
+struct Pipeline::DecisionCache {
+  // a PHV field, or the validity of a header if f_offset is -1
+  struct Read {
+    header_id_t header;
+    int f_offset;
+    // only the bits set in the mask matter, an empty mask means all of them
+    ByteContainer mask;
+  };
+
+  struct Step {
+    int idx{end_idx};
+    int next_idx{end_idx};
+    // CONDITION only
+    bool result{false};
+    // TABLE only
+    MatchTableAbstract::AppliedEntry applied{};
+    // if true, key is the match key which was looked up and the packet's key
+    // needs to be compared with it before replaying the entry
+    bool check_key{false};
+    ByteContainer key{};
+  };
+
+  typedef std::vector<Step> Trace;
+
+  // all the traces which read the same set of bits
+  struct SubTable {
+    std::vector<int> reads;
+    std::unordered_map<ByteContainer, std::shared_ptr<const Trace>,
+                       ByteContainerKeyHash> traces;
+  };
+
+  // bounds the cost of a lookup
+  static constexpr size_t max_sub_tables = 32;
+
+  explicit DecisionCache(size_t max_entries)
+      : max_entries(max_entries) { }
+
+  int add_read(header_id_t header, int f_offset, const ByteContainer &mask) {
+    for (size_t i = 0; i < reads.size(); i++) {
+      Read &read = reads[i];
+      if (read.header != header || read.f_offset != f_offset) continue;
+      if (read.mask.size() == 0 || mask.size() != read.mask.size()) {
+        read.mask.clear();
+      } else {
+        for (size_t j = 0; j < mask.size(); j++) read.mask[j] |= mask[j];
+      }
+      return static_cast<int>(i);
+    }
+    reads.push_back({header, f_offset, mask});
+    return static_cast<int>(reads.size() - 1);
+  }
+
+  void append_read(const PHV &phv, int read_id, ByteContainer *key) const {
+    const Read &read = reads[read_id];
+    const Header &header = phv.get_header(read.header);
+    if (read.f_offset < 0) {
+      key->push_back(header.is_valid() ? '\x01' : '\x00');
+      return;
+    }
+    const ByteContainer &bytes = header[read.f_offset].get_bytes();
+    if (read.mask.size() != bytes.size()) {
+      key->append(bytes);
+      return;
+    }
+    for (size_t i = 0; i < bytes.size(); i++)
+      key->push_back(bytes[i] & read.mask[i]);
+  }
+
+  std::shared_ptr<const Trace> lookup(const PHV &phv, size_t *sub_table,
+                                      ByteContainer *key) const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+    for (size_t i = 0; i < sub_tables.size(); i++) {
+      const SubTable &st = sub_tables[i];
+      key->clear();
+      for (const int read_id : st.reads) append_read(phv, read_id, key);
+      auto it = st.traces.find(*key);
+      if (it != st.traces.end()) {
+        *sub_table = i;
+        return it->second;
+      }
+    }
+    return nullptr;
+  }
+
+  // arguments by value for std::move
+  void insert(std::vector<int> trace_reads, ByteContainer key, Trace trace) {
+    auto trace_ptr = std::make_shared<const Trace>(std::move(trace));
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+    if (num_entries >= max_entries) {
+      sub_tables.clear();
+      num_entries = 0;
+    }
+    auto it = std::find_if(
+        sub_tables.begin(), sub_tables.end(),
+        [&trace_reads](const SubTable &st) { return st.reads == trace_reads; });
+    if (it == sub_tables.end()) {
+      if (sub_tables.size() >= max_sub_tables) return;
+      sub_tables.push_back({std::move(trace_reads), {}});
+      it = sub_tables.end() - 1;
+    }
+    auto r = it->traces.emplace(std::move(key), trace_ptr);
+    if (r.second)
+      num_entries++;
+    else
+      r.first->second = trace_ptr;
+  }
+
+  // the cache may have been flushed since the trace was looked up, hence the
+  // checks
+  void erase(size_t sub_table, const ByteContainer &key, const Trace *trace) {
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+    if (sub_table >= sub_tables.size()) return;
+    auto &traces = sub_tables[sub_table].traces;
+    auto it = traces.find(key);
+    if (it == traces.end() || it->second.get() != trace) return;
+    traces.erase(it);
+    num_entries--;
+  }
+
+  const size_t max_entries;
+  std::vector<Read> reads{};
+  // reads of each instruction, in program order
+  std::vector<std::vector<int> > instr_reads{};
+  // false for instructions we cannot record a decision for
+  std::vector<char> instr_cacheable{};
+
+  mutable boost::shared_mutex mutex{};
+  std::vector<SubTable> sub_tables{};
+  size_t num_entries{0};
+
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> invalidations{0};
+};
+
+constexpr int Pipeline::end_idx;
+constexpr size_t Pipeline::DecisionCache::max_sub_tables;
+
+Pipeline::Pipeline(const std::string &name, p4object_id_t id,
+                   ControlFlowNode *first_node)
+    : NamedP4Object(name, id), first_node(first_node) {
+  build_program();
+}
+
+Pipeline::~Pipeline() { }
+
+Pipeline::Pipeline(Pipeline &&other) = default;
+
+// Nodes are laid out in breadth-first order, starting with first_node at index
+// 0. We stop at generic nodes, since we do not know their successors; if a
+// generic node returns a node which is not in the program, apply() falls back
+// to walking the graph from that node.
 void
-Pipeline::apply(Packet *pkt) {
+Pipeline::build_program() {
+  program.clear();
+  node_index.clear();
+  if (!first_node) return;
+  auto add = [this](const ControlFlowNode *node) {
+    if (!node) return end_idx;
+    auto it = node_index.find(node);
+    if (it != node_index.end()) return it->second;
+    const int idx = static_cast<int>(program.size());
+    Instr instr;
+    instr.kind = Instr::NODE;
+    instr.node = node;
+    instr.table = nullptr;
+    instr.condition = nullptr;
+    instr.true_next = end_idx;
+    instr.false_next = end_idx;
+    program.push_back(std::move(instr));
+    node_index.emplace(node, idx);
+    return idx;
+  };
+  add(first_node);
+  // add() may grow the program, so we use indices and not references
+  for (size_t i = 0; i < program.size(); i++) {
+    const ControlFlowNode *node = program[i].node;
+    if (auto condition = dynamic_cast<const Conditional *>(node)) {
+      program[i].kind = Instr::CONDITION;
+      program[i].condition = condition;
+      const int true_next = add(condition->get_next_node_if_true());
+      const int false_next = add(condition->get_next_node_if_false());
+      program[i].true_next = true_next;
+      program[i].false_next = false_next;
+    } else if (auto table = dynamic_cast<const MatchActionTable *>(node)) {
+      program[i].kind = Instr::TABLE;
+      program[i].table = table;
+      for (auto next : table->get_match_table()->get_possible_next_nodes()) {
+        const int next_idx = add(next);
+        program[i].successors.emplace_back(next, next_idx);
+      }
+    }
+  }
+  build_topo_order();
+}
+
+// Kahn's algorithm; generic nodes have no known successors, which is fine
+// since packets leave the batch when they reach one (see apply_batch())
+void
+Pipeline::build_topo_order() {
+  topo_order.clear();
+  std::vector<int> in_degree(program.size(), 0);
+  auto successors = [this](int idx) {
+    std::vector<int> next;
+    const Instr &instr = program[idx];
+    if (instr.kind == Instr::CONDITION) {
+      next.push_back(instr.true_next);
+      next.push_back(instr.false_next);
+    } else if (instr.kind == Instr::TABLE) {
+      for (const auto &successor : instr.successors)
+        next.push_back(successor.second);
+    }
+    std::sort(next.begin(), next.end());
+    next.erase(std::unique(next.begin(), next.end()), next.end());
+    next.erase(std::remove(next.begin(), next.end(), end_idx), next.end());
+    return next;
+  };
+  for (size_t i = 0; i < program.size(); i++) {
+    for (const int next : successors(static_cast<int>(i))) in_degree[next]++;
+  }
+  std::vector<int> ready;
+  for (size_t i = 0; i < program.size(); i++)
+    if (in_degree[i] == 0) ready.push_back(static_cast<int>(i));
+  while (!ready.empty()) {
+    const int idx = ready.back();
+    ready.pop_back();
+    topo_order.push_back(idx);
+    for (const int next : successors(idx)) {
+      if (--in_degree[next] == 0) ready.push_back(next);
+    }
+  }
+  // the graph has a cycle, apply_batch() processes packets one by one
+  if (topo_order.size() != program.size()) topo_order.clear();
+  // same thing if one packet may observe the side effects of another one:
+  // packets reach each step in a different order in apply_batch()
+  std::vector<std::pair<header_id_t, int> > fields;
+  std::vector<header_id_t> headers;
+  for (const Instr &instr : program) {
+    if ((instr.kind == Instr::TABLE &&
+         instr.table->get_match_table()->is_stateful()) ||
+        (instr.kind == Instr::CONDITION &&
+         !instr.condition->get_phv_dependencies(&fields, &headers))) {
+      topo_order.clear();
+      break;
+    }
+  }
+}
+
+int
+Pipeline::get_index(const ControlFlowNode *node) const {
+  if (!node) return end_idx;
+  auto it = node_index.find(node);
+  return (it == node_index.end()) ? end_idx : it->second;
+}
+
+int
+Pipeline::get_table_next_index(const Instr &instr,
+                               const ControlFlowNode *next) const {
+  for (const auto &successor : instr.successors) {
+    if (successor.first == next) return successor.second;
+  }
+  return end_idx;
+}
+
+void
+Pipeline::set_decision_cache_size(size_t max_entries) {
+  if (max_entries == 0) {
+    cache.reset();
+    return;
+  }
+  cache.reset(new DecisionCache(max_entries));
+  cache->instr_reads.resize(program.size());
+  cache->instr_cacheable.resize(program.size(), 0);
+  for (size_t i = 0; i < program.size(); i++) {
+    const Instr &instr = program[i];
+    auto &reads = cache->instr_reads[i];
+    if (instr.kind == Instr::CONDITION) {
+      std::vector<std::pair<header_id_t, int> > fields;
+      std::vector<header_id_t> headers;
+      if (!instr.condition->get_phv_dependencies(&fields, &headers)) continue;
+      for (const auto &f : fields)
+        reads.push_back(cache->add_read(f.first, f.second, ByteContainer()));
+      for (const auto h : headers)
+        reads.push_back(cache->add_read(h, -1, ByteContainer()));
+      cache->instr_cacheable[i] = 1;
+    } else if (instr.kind == Instr::TABLE) {
+      const MatchTableAbstract *match_table = instr.table->get_match_table();
+      if (!match_table->supports_replay()) continue;
+      for (const auto &ref : match_table->get_match_key_builder()
+               .get_field_refs()) {
+        // the key uses 0 for the fields of invalid headers
+        reads.push_back(cache->add_read(ref.header, -1, ByteContainer()));
+        if (ref.f_offset >= 0)
+          reads.push_back(cache->add_read(ref.header, ref.f_offset, ref.mask));
+      }
+      cache->instr_cacheable[i] = 1;
+    }
+  }
+}
+
+Pipeline::DecisionCacheStats
+Pipeline::get_decision_cache_stats() const {
+  DecisionCacheStats stats = {0, 0, 0, 0};
+  if (!cache) return stats;
+  stats.hits = cache->hits;
+  stats.misses = cache->misses;
+  stats.invalidations = cache->invalidations;
+  boost::shared_lock<boost::shared_mutex> lock(cache->mutex);
+  stats.entries = cache->num_entries;
+  return stats;
+}
+
+int
+Pipeline::apply_cached(Packet *pkt, const ControlFlowNode **node) {
+  static thread_local ByteContainer key;
+  static thread_local ByteContainer table_key;
+  size_t sub_table = 0;
+  auto trace = cache->lookup(*pkt->get_phv(), &sub_table, &key);
+  if (!trace) {
+    cache->misses++;
+    return record_decisions(pkt, node);
+  }
+  for (const auto &step : *trace) {
+    if (pkt->is_marked_for_exit()) return step.idx;
+    const Instr &instr = program[step.idx];
+    if (instr.kind == Instr::CONDITION) {
+      const bool result = instr.condition->apply(pkt);
+      if (result != step.result) {
+        cache->invalidations++;
+        return result ? instr.true_next : instr.false_next;
+      }
+      continue;
+    }
+    assert(instr.kind == Instr::TABLE);
+    if (step.check_key) {
+      table_key.clear();
+      instr.table->get_match_table()->get_match_key_builder()(
+          *pkt->get_phv(), &table_key);
+      if (table_key != step.key) {
+        cache->invalidations++;
+        return step.idx;
+      }
+    }
+    if (!instr.table->replay(pkt, step.applied)) {
+      cache->invalidations++;
+      cache->erase(sub_table, key, trace.get());
+      return step.idx;
+    }
+  }
+  cache->hits++;
+  return trace->back().next_idx;
+}
+
+int
+Pipeline::record_decisions(Packet *pkt, const ControlFlowNode **node) {
+  const PHV &phv = *pkt->get_phv();
+  // the values of all the bits the program may read, before any action is
+  // executed
+  static thread_local std::vector<ByteContainer> input;
+  if (input.size() < cache->reads.size()) input.resize(cache->reads.size());
+  for (size_t i = 0; i < cache->reads.size(); i++) {
+    input[i].clear();
+    cache->append_read(phv, static_cast<int>(i), &input[i]);
+  }
+
+  DecisionCache::Trace trace;
+  std::vector<int> reads;
+  // true once an action which may have modified the PHV has been executed
+  bool phv_modified = false;
+  int idx = 0;
+  while (idx != end_idx) {
+    if (pkt->is_marked_for_exit()) break;
+    // we keep going without recording anything
+    if (!cache->instr_cacheable[idx]) return idx;
+    const Instr &instr = program[idx];
+    DecisionCache::Step step;
+    step.idx = idx;
+    if (instr.kind == Instr::CONDITION) {
+      step.result = instr.condition->apply(pkt);
+      step.next_idx = step.result ? instr.true_next : instr.false_next;
+    } else {
+      assert(instr.kind == Instr::TABLE);
+      if (phv_modified) {
+        step.check_key = true;
+        instr.table->get_match_table()->get_match_key_builder()(
+            phv, &step.key);
+      }
+      const ControlFlowNode *next = instr.table->apply(pkt, &step.applied);
+      step.next_idx = get_table_next_index(instr, next);
+      if (step.next_idx == end_idx && next) {
+        *node = next;
+        return end_idx;
+      }
+      const ActionFn *action_fn = step.applied.action_fn.get_action_fn();
+      if (action_fn && action_fn->get_num_primitives() > 0)
+        phv_modified = true;
+    }
+    const auto &instr_reads = cache->instr_reads[idx];
+    reads.insert(reads.end(), instr_reads.begin(), instr_reads.end());
+    idx = step.next_idx;
+    trace.push_back(std::move(step));
+  }
+
+  if (trace.empty()) return idx;
+  std::sort(reads.begin(), reads.end());
+  reads.erase(std::unique(reads.begin(), reads.end()), reads.end());
+  ByteContainer key;
+  for (const int read_id : reads) key.append(input[read_id]);
+  cache->insert(std::move(reads), std::move(key), std::move(trace));
+  return idx;
+}
+
+void
+Pipeline::start(Packet *pkt) const {
   BMELOG(pipeline_start, *pkt, *this);
   // TODO(antonin)
   // this is temporary while we experiment with the debugger
@@ -34,19 +476,136 @@ Pipeline::apply(Packet *pkt) {
       Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
       DBG_CTR_CONTROL | get_id());
   BMLOG_DEBUG_PKT(*pkt, "Pipeline '{}': start", get_name());
-  const ControlFlowNode *node = first_node;
+  // the PHV may have been modified since the packet was last in a pipeline
+  pkt->enable_key_memo(true);
+}
+
+void
+Pipeline::done(Packet *pkt) const {
+  BMELOG(pipeline_done, *pkt, *this);
+  DEBUGGER_NOTIFY_CTR(
+      Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
+      DBG_CTR_EXIT(DBG_CTR_CONTROL) | get_id());
+  BMLOG_DEBUG_PKT(*pkt, "Pipeline '{}': end", get_name());
+  pkt->enable_key_memo(false);
+}
+
+void
+Pipeline::run(Packet *pkt, int idx, const ControlFlowNode *node) const {
+  while (idx != end_idx) {
+    if (pkt->is_marked_for_exit()) {
+      BMLOG_DEBUG_PKT(*pkt, "Packet is marked for exit, interrupting pipeline");
+      return;
+    }
+    const Instr &instr = program[idx];
+    switch (instr.kind) {
+      case Instr::CONDITION:
+        idx = instr.condition->apply(pkt) ? instr.true_next : instr.false_next;
+        break;
+      case Instr::TABLE:
+        {
+          const ControlFlowNode *next = instr.table->apply(pkt);
+          idx = get_table_next_index(instr, next);
+          // should not happen, unless next nodes were changed after the
+          // pipeline was built
+          if (idx == end_idx) node = next;
+        }
+        break;
+      case Instr::NODE:
+        {
+          // we do not know what the node does to the PHV
+          pkt->invalidate_key_memo();
+          const ControlFlowNode *next = (*instr.node)(pkt);
+          idx = get_index(next);
+          if (idx == end_idx) node = next;
+        }
+        break;
+    }
+  }
   while (node) {
     if (pkt->is_marked_for_exit()) {
       BMLOG_DEBUG_PKT(*pkt, "Packet is marked for exit, interrupting pipeline");
-      break;
+      return;
     }
+    pkt->invalidate_key_memo();
     node = (*node)(pkt);
   }
-  BMELOG(pipeline_done, *pkt, *this);
-  DEBUGGER_NOTIFY_CTR(
-      Debugger::PacketId::make(pkt->get_packet_id(), pkt->get_copy_id()),
-      DBG_CTR_EXIT(DBG_CTR_CONTROL) | get_id());
-  BMLOG_DEBUG_PKT(*pkt, "Pipeline '{}': end", get_name());
+}
+
+void
+Pipeline::apply(Packet *pkt) {
+  start(pkt);
+  // nullptr unless we need to fall back to walking the graph
+  const ControlFlowNode *node = nullptr;
+  int idx = program.empty() ? end_idx : 0;
+  if (cache && idx != end_idx) idx = apply_cached(pkt, &node);
+  run(pkt, idx, node);
+  done(pkt);
+}
+
+// Instructions are visited in topological order; at each step, all the
+// packets which have reached the instruction go through it together. Since the
+// program is acyclic, a packet never goes back to an instruction which has
+// already been visited. Generic nodes may however return any node, which is why
+// packets which reach one leave the batch and complete the pipeline on their
+// own. Packets are interleaved, which is only fine because build_topo_order()
+// leaves topo_order empty when the tables or conditions access shared state.
+void
+Pipeline::apply_batch(Packet *const *pkts, size_t n) {
+  if (cache || topo_order.empty()) {
+    for (size_t i = 0; i < n; i++) apply(pkts[i]);
+    return;
+  }
+
+  // per-packet instruction index
+  static thread_local std::vector<int> pkt_idx;
+  static thread_local std::vector<Packet *> group;
+  static thread_local std::vector<const ControlFlowNode *> next_nodes;
+  pkt_idx.assign(n, 0);
+
+  for (size_t i = 0; i < n; i++) start(pkts[i]);
+
+  for (const int idx : topo_order) {
+    const Instr &instr = program[idx];
+    group.clear();
+    for (size_t i = 0; i < n; i++) {
+      if (pkt_idx[i] != idx) continue;
+      if (pkts[i]->is_marked_for_exit()) {
+        BMLOG_DEBUG_PKT(*pkts[i],
+                        "Packet is marked for exit, interrupting pipeline");
+        pkt_idx[i] = end_idx;
+        continue;
+      }
+      if (instr.kind == Instr::NODE) {
+        run(pkts[i], idx, nullptr);
+        pkt_idx[i] = end_idx;
+        continue;
+      }
+      group.push_back(pkts[i]);
+    }
+    if (group.empty()) continue;
+
+    if (instr.kind == Instr::CONDITION) {
+      for (size_t i = 0; i < n; i++) {
+        if (pkt_idx[i] != idx) continue;
+        pkt_idx[i] = instr.condition->apply(pkts[i]) ?
+            instr.true_next : instr.false_next;
+      }
+      continue;
+    }
+
+    assert(instr.kind == Instr::TABLE);
+    next_nodes.resize(group.size());
+    instr.table->apply_batch(group.data(), group.size(), next_nodes.data());
+    for (size_t i = 0, j = 0; i < n; i++) {
+      if (pkt_idx[i] != idx) continue;
+      const ControlFlowNode *next = next_nodes[j++];
+      pkt_idx[i] = get_table_next_index(instr, next);
+      if (pkt_idx[i] == end_idx && next) run(pkts[i], end_idx, next);
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) done(pkts[i]);
 }
 
 }  // namespace bm
@@ -23,14 +23,17 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <sstream>
 #include <streambuf>
 
 #include "bm_sim/switch.h"
 #include "bm_sim/P4Objects.h"
+#include "bm_sim/clock.h"
 #include "bm_sim/options_parse.h"
 #include "bm_sim/logger.h"
 #include "bm_sim/debugger.h"
 #include "md5.h"
+#include "utils.h"
 
 namespace bm {
 
@@ -83,22 +86,36 @@ SwitchWContexts::init_objects(const std::string &json_path, int dev_id,
     notifications_transport = std::move(transport);
   }
 
-  for (size_t cxt_id = 0; cxt_id < nb_cxts; cxt_id++) {
-    auto &cxt = contexts.at(cxt_id);
+  const std::string config((std::istreambuf_iterator<char>(fs)),
+                           std::istreambuf_iterator<char>());
+  // the JSON is parsed once and shared by all the contexts
+  Json::Value cfg_root;
+  {
+    std::istringstream ss(config);
+    ss >> cfg_root;
+  }
+
+  for (auto &cxt : contexts) {
     cxt.set_device_id(device_id);
     cxt.set_notifications_transport(notifications_transport);
-    int status = cxt.init_objects(&fs, get_lookup_factory(),
-                                  required_fields, arith_fields);
-    fs.clear();
-    fs.seekg(0, std::ios::beg);
-    if (status != 0) return status;
-    phv_source->set_phv_factory(cxt_id, &cxt.get_phv_factory());
+  }
+
+  std::vector<int> status(nb_cxts, 0);
+  utils::parallel_for(nb_cxts, [this, &cfg_root, &status](size_t cxt_id) {
+    status[cxt_id] = contexts.at(cxt_id).init_objects(
+        cfg_root, get_lookup_factory(), required_fields, arith_fields);
+  });
+
+  for (size_t cxt_id = 0; cxt_id < nb_cxts; cxt_id++) {
+    if (status[cxt_id] != 0) return status[cxt_id];
+    auto &cxt = contexts.at(cxt_id);
+    phv_source->set_phv_factory(cxt_id, &cxt.get_phv_factory(),
+                                cxt.p4objects);
   }
 
   {
     std::unique_lock<std::mutex> config_lock(config_mutex);
-    current_config = std::string((std::istreambuf_iterator<char>(fs)),
-                                 std::istreambuf_iterator<char>());
+    current_config = config;
   }
 
   return 0;
@@ -109,6 +126,9 @@ SwitchWContexts::init_from_command_line_options(int argc, char *argv[]) {
   OptionsParser parser;
   parser.parse(argc, argv);
 
+  // before any object starts waiting on the clock
+  if (parser.virtual_time) VirtualTime::enable();
+
   notifications_addr = parser.notifications_addr;
   auto transport = std::shared_ptr<TransportIface>(
       TransportIface::make_nanomsg(notifications_addr));
@@ -123,6 +143,11 @@ SwitchWContexts::init_from_command_line_options(int argc, char *argv[]) {
   }
 #endif
 
+  for (Context &c : contexts) {
+    c.set_decision_cache_size(parser.decision_cache_size);
+    c.set_adaptive_lookup(parser.adaptive_lookup);
+  }
+
   int status = init_objects(parser.config_file_path, parser.device_id,
                             transport);
   if (status != 0) return status;
@@ -135,12 +160,29 @@ SwitchWContexts::init_from_command_line_options(int argc, char *argv[]) {
 
   Logger::set_log_level(parser.log_level);
 
+  if (parser.binary_logger != "" &&
+      !BinaryLogger::enable(parser.binary_logger, parser.log_level)) {
+    std::cout << "Error: cannot open binary log file "
+              << parser.binary_logger << "\n";
+    return 1;
+  }
+
+  PcapCaptureConfig pcap_config;
+  pcap_config.snaplen = parser.pcap_snaplen;
+  pcap_config.rotate_bytes = parser.pcap_rotate_size;
+  pcap_config.rotate_seconds = parser.pcap_rotate_seconds;
+
   if (parser.use_files)
-    set_dev_mgr_files(parser.wait_time);
+    set_dev_mgr_files(parser.wait_time, parser.replay_loops,
+                      parser.replay_rate);
   else if (parser.packet_in)
     set_dev_mgr_packet_in(device_id, parser.packet_in_addr, transport);
+  else if (parser.packet_in_shm)
+    set_dev_mgr_shm(device_id, parser.packet_in_shm_path, transport);
+  else if (parser.af_packet)
+    set_dev_mgr_af_packet(device_id, transport);
   else
-    set_dev_mgr_bmi(device_id, transport);
+    set_dev_mgr_bmi(device_id, transport, pcap_config);
 
   for (const auto &iface : parser.ifaces) {
     std::cout << "Adding interface " << iface.second
@@ -178,29 +220,33 @@ SwitchWContexts::init_from_command_line_options(int argc, char *argv[]) {
 
 // TODO(antonin)
 // I wonder if the correct thing to do would be to lock all contexts' mutex
-// simultaneously for a swap. My first intuition is that it is not necessary. If
-// a second load_new_config (for e.g.) happens before the first call terminates,
-// we will return a ONGOING_SWAP error, since we always call
-// Context::load_new_config in the same order. Still, need to think about it
-// some more.
+// simultaneously for a swap. My first intuition is that it is not necessary.
+// The contexts load the new config concurrently, but concurrent calls to
+// load_new_config are serialized by config_mutex, so a second call will return
+// a ONGOING_SWAP error for all contexts. Still, need to think about it some
+// more.
 
 // for now, swap as to be done switch-wide, cannot be done on a per context
 // basis, but this could easily be changed
 RuntimeInterface::ErrorCode
 SwitchWContexts::load_new_config(const std::string &new_config) {
   if (!enable_swap) return ErrorCode::CONFIG_SWAP_DISABLED;
-  std::istringstream ss(new_config);
-  for (auto &cxt : contexts) {
-    ErrorCode rc = cxt.load_new_config(&ss, get_lookup_factory(),
-                                       required_fields, arith_fields);
-    if (rc != ErrorCode::SUCCESS) return rc;
-    ss.clear();
-    ss.seekg(0, std::ios::beg);
-  }
+  // the JSON is parsed once and shared by all the contexts
+  Json::Value cfg_root;
   {
-    std::unique_lock<std::mutex> config_lock(config_mutex);
-    current_config = new_config;
+    std::istringstream ss(new_config);
+    ss >> cfg_root;
+  }
+  std::unique_lock<std::mutex> config_lock(config_mutex);
+  std::vector<ErrorCode> rcs(nb_cxts, ErrorCode::SUCCESS);
+  utils::parallel_for(nb_cxts, [this, &cfg_root, &rcs](size_t cxt_id) {
+    rcs[cxt_id] = contexts.at(cxt_id).load_new_config(
+        cfg_root, get_lookup_factory(), required_fields, arith_fields);
+  });
+  for (ErrorCode rc : rcs) {
+    if (rc != ErrorCode::SUCCESS) return rc;
   }
+  current_config = new_config;
   return ErrorCode::SUCCESS;
 }
 
@@ -239,12 +285,13 @@ SwitchWContexts::do_swap() {
   for (size_t cxt_id = 0; cxt_id < nb_cxts; cxt_id++) {
     auto &cxt = contexts[cxt_id];
     if (!cxt.swap_requested()) continue;
-    // TODO(antonin): we spin until no more packets exist for this context, is
-    // there a better way of doing this?
-    while (phv_source->phvs_in_use(cxt_id) > 0) { }
+    // no need to wait for the in-flight packets: they hold a reference to the
+    // old configuration, which is destroyed with the last of them
     int swap_done = cxt.do_swap();
-    if (swap_done == 0)
-      phv_source->set_phv_factory(cxt_id, &cxt.get_phv_factory());
+    if (swap_done == 0) {
+      phv_source->set_phv_factory(cxt_id, &cxt.get_phv_factory(),
+                                  cxt.p4objects);
+    }
     rc &= swap_done;
   }
   return rc;
@@ -20,15 +20,31 @@
 
 #include <nanomsg/pubsub.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "bm_sim/transport.h"
 #include "bm_sim/nn.h"
 
 namespace bm {
 
+int
+TransportIface::send_batch_(const std::vector<MsgBuf> &msgs) const {
+  for (const auto &msg : msgs) {
+    int rc = send_(msg.buf, msg.len);
+    if (rc) return rc;
+  }
+  return 0;
+}
+
 class TransportNanomsg : public TransportIface {
  public:
   explicit TransportNanomsg(const std::string &addr)
@@ -171,6 +187,115 @@ class TransportDummy : public TransportIface {
   }
 };
 
+// The file starts with an 8-byte header (magic number and format version),
+// followed by the length-prefixed messages. The file is grown by doubling its
+// size and is truncated to the actual amount of data written on destruction.
+class TransportFile : public TransportIface {
+ public:
+  explicit TransportFile(const std::string &path)
+      : path(path) { }
+
+  ~TransportFile() {
+    if (fd < 0) return;
+    if (base) munmap(base, capacity);
+    // nothing we can do if this fails, the file will just have trailing zeros
+    int rc = ftruncate(fd, offset);
+    (void) rc;
+    close(fd);
+  }
+
+ private:
+  static constexpr uint32_t magic = 0x424d454c;  // "BMEL"
+  static constexpr uint32_t version = 1;
+  static constexpr size_t initial_capacity = 1 << 24;
+
+  int open_() override {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (!remap(initial_capacity)) return -1;
+    const uint32_t file_hdr[2] = {magic, version};
+    std::memcpy(base, file_hdr, sizeof(file_hdr));
+    offset = sizeof(file_hdr);
+    return 0;
+  }
+
+  int send_(const std::string &msg) const override {
+    return send_(msg.data(), static_cast<int>(msg.size()));
+  }
+
+  int send_(const char *msg, int len) const override {
+    std::unique_lock<std::mutex> lock(mutex);
+    return append(msg, len);
+  }
+
+  int send_msgs_(const std::initializer_list<std::string> &msgs)
+      const override {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (const auto &msg : msgs) {
+      int rc = append(msg.data(), static_cast<int>(msg.size()));
+      if (rc) return rc;
+    }
+    return 0;
+  }
+
+  int send_msgs_(const std::initializer_list<MsgBuf> &msgs) const override {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (const auto &msg : msgs) {
+      int rc = append(msg.buf, msg.len);
+      if (rc) return rc;
+    }
+    return 0;
+  }
+
+  int send_batch_(const std::vector<MsgBuf> &msgs) const override {
+    std::unique_lock<std::mutex> lock(mutex);
+    size_t needed = 0;
+    for (const auto &msg : msgs) needed += sizeof(uint32_t) + msg.len;
+    if (!reserve(needed)) return -1;
+    for (const auto &msg : msgs) {
+      int rc = append(msg.buf, msg.len);
+      if (rc) return rc;
+    }
+    return 0;
+  }
+
+  bool reserve(size_t needed) const {
+    if (!base) return false;
+    if (offset + needed <= capacity) return true;
+    size_t new_capacity = capacity;
+    while (offset + needed > new_capacity) new_capacity *= 2;
+    return remap(new_capacity);
+  }
+
+  bool remap(size_t new_capacity) const {
+    if (base) munmap(base, capacity);
+    base = nullptr;
+    if (ftruncate(fd, new_capacity) != 0) return false;
+    void *addr = mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) return false;
+    base = static_cast<char *>(addr);
+    capacity = new_capacity;
+    return true;
+  }
+
+  int append(const char *msg, int len) const {
+    const uint32_t msg_len = static_cast<uint32_t>(len);
+    if (!reserve(sizeof(msg_len) + msg_len)) return -1;
+    std::memcpy(base + offset, &msg_len, sizeof(msg_len));
+    std::memcpy(base + offset + sizeof(msg_len), msg, msg_len);
+    offset += sizeof(msg_len) + msg_len;
+    return 0;
+  }
+
+  std::string path;
+  int fd{-1};
+  mutable char *base{nullptr};
+  mutable size_t capacity{0};
+  mutable size_t offset{0};
+  mutable std::mutex mutex{};
+};
+
 std::unique_ptr<TransportIface>
 TransportIface::make_nanomsg(const std::string &addr) {
   return std::unique_ptr<TransportIface>(new TransportNanomsg(addr));
@@ -186,4 +311,9 @@ TransportIface::make_stdout() {
   return std::unique_ptr<TransportStdout>(new TransportStdout());
 }
 
+std::unique_ptr<TransportIface>
+TransportIface::make_file(const std::string &path) {
+  return std::unique_ptr<TransportFile>(new TransportFile(path));
+}
+
 }  // namespace bm
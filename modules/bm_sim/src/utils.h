@@ -21,6 +21,13 @@
 #ifndef BM_SIM_SRC_UTILS_H_
 #define BM_SIM_SRC_UTILS_H_
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 namespace bm {
 
 namespace utils {
@@ -40,6 +47,34 @@ struct StreamStateSaver final {
   std::ios state{nullptr};
 };
 
+// Calls f(i) for each i in [0, n), spreading the calls over up to
+// std::thread::hardware_concurrency() threads, the calling thread included. f
+// must be safe to call concurrently for different values of i. If some calls
+// throw, one of the exceptions is rethrown once all the threads are done.
+template <typename F>
+void parallel_for(size_t n, const F &f) {
+  const size_t nb_threads = std::min<size_t>(
+      n, std::max(1u, std::thread::hardware_concurrency()));
+  std::atomic<size_t> next{0};
+  std::exception_ptr error{nullptr};
+  std::mutex error_mutex;
+  auto worker = [n, &f, &next, &error, &error_mutex]() {
+    for (size_t i = next++; i < n; i = next++) {
+      try {
+        f(i);
+      } catch (...) {
+        std::unique_lock<std::mutex> lock(error_mutex);
+        error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < nb_threads; t++) threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads) t.join();
+  if (error) std::rethrow_exception(error);
+}
+
 }  // namespace utils
 
 }  // namespace bm
@@ -31,6 +31,10 @@ class modify_field : public ActionPrimitive<Field &, const Data &> {
   void operator ()(Field &f, const Data &d) {
     f.set(d);
   }
+
+  Semantics get_semantics() const override {
+    return Semantics::MODIFY_FIELD;
+  }
 };
 
 REGISTER_PRIMITIVE(modify_field);
@@ -39,6 +43,10 @@ class add_to_field : public ActionPrimitive<Field &, const Data &> {
   void operator ()(Field &f, const Data &d) {
     f.add(f, d);
   }
+
+  Semantics get_semantics() const override {
+    return Semantics::ADD_TO_FIELD;
+  }
 };
 
 REGISTER_PRIMITIVE(add_to_field);
@@ -43,6 +43,7 @@ using bm::PHV;
 using bm::Parser;
 using bm::Deparser;
 using bm::Pipeline;
+using bm::P4Objects;
 
 class SimpleSwitch : public Switch {
  public:
@@ -53,8 +54,9 @@ class SimpleSwitch : public Switch {
   int receive(int port_num, const char *buffer, int len) {
     static int pkt_id = 0;
 
-    if (this->do_swap() == 0)  // a swap took place
-      swap_happened = true;
+    // commit a configuration swap if one was requested; packets already in the
+    // switch keep their configuration
+    this->do_swap();
 
     auto packet = new_packet_ptr(port_num, pkt_id++, len,
                                  bm::PacketBuffer(2048, buffer, len));
@@ -79,7 +81,6 @@ class SimpleSwitch : public Switch {
  private:
   Queue<std::unique_ptr<Packet> > input_buffer;
   Queue<std::unique_ptr<Packet> > output_buffer;
-  bool swap_happened{false};
 };
 
 void SimpleSwitch::transmit_thread() {
@@ -95,10 +96,11 @@ void SimpleSwitch::transmit_thread() {
 }
 
 void SimpleSwitch::pipeline_thread() {
-  Pipeline *ingress_mau = this->get_pipeline("ingress");
-  Pipeline *egress_mau = this->get_pipeline("egress");
-  Parser *parser = this->get_parser("parser");
-  Deparser *deparser = this->get_deparser("deparser");
+  P4Objects *config = nullptr;
+  Pipeline *ingress_mau = nullptr;
+  Pipeline *egress_mau = nullptr;
+  Parser *parser = nullptr;
+  Deparser *deparser = nullptr;
   PHV *phv;
 
   while (1) {
@@ -110,13 +112,14 @@ void SimpleSwitch::pipeline_thread() {
     BMLOG_DEBUG_PKT(*packet, "Processing packet received on port {}",
                     ingress_port);
 
-    // update pointers if needed
-    if (swap_happened) {  // a swap took place
-      ingress_mau = this->get_pipeline("ingress");
-      egress_mau = this->get_pipeline("egress");
-      parser = this->get_parser("parser");
-      deparser = this->get_deparser("deparser");
-      swap_happened = false;
+    // update pointers if the packet was created with a different
+    // configuration (i.e. a swap took place)
+    if (packet->get_p4objects() != config) {
+      config = packet->get_p4objects();
+      ingress_mau = config->get_pipeline("ingress");
+      egress_mau = config->get_pipeline("egress");
+      parser = config->get_parser("parser");
+      deparser = config->get_deparser("deparser");
     }
 
     parser->parse(packet.get());
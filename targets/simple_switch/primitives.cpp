@@ -36,6 +36,10 @@ class modify_field : public ActionPrimitive<Data &, const Data &> {
   void operator ()(Data &dst, const Data &src) {
     dst.set(src);
   }
+
+  Semantics get_semantics() const override {
+    return Semantics::MODIFY_FIELD;
+  }
 };
 
 REGISTER_PRIMITIVE(modify_field);
@@ -60,6 +64,10 @@ class add_to_field : public ActionPrimitive<Field &, const Data &> {
   void operator ()(Field &f, const Data &d) {
     f.add(f, d);
   }
+
+  Semantics get_semantics() const override {
+    return Semantics::ADD_TO_FIELD;
+  }
 };
 
 REGISTER_PRIMITIVE(add_to_field);
@@ -282,6 +290,10 @@ class count : public ActionPrimitive<CounterArray &, const Data &> {
   void operator ()(CounterArray &counter_array, const Data &idx) {
     counter_array.get_counter(idx.get_uint()).increment_counter(get_packet());
   }
+
+  Semantics get_semantics() const override {
+    return Semantics::COUNT;
+  }
 };
 
 REGISTER_PRIMITIVE(count);
@@ -112,8 +112,8 @@ int
 SimpleSwitch::receive(int port_num, const char *buffer, int len) {
   static int pkt_id = 0;
 
-  // this is a good place to call this, because blocking this thread will not
-  // block the processing of existing packet instances, which is a requirement
+  // the packets already in the switch keep being processed with the
+  // configuration they were created with, see Packet::get_p4objects()
   if (do_swap() == 0) {
     check_queueing_metadata();
   }
@@ -162,14 +162,29 @@ SimpleSwitch::start_and_return() {
 
 void
 SimpleSwitch::transmit_thread() {
+  // packets are dequeued and handed to the device manager in batches, which
+  // lets it send them with fewer syscalls (see DevMgr::transmit_batch_fn)
+  constexpr size_t max_batch_size = 32;
+  std::unique_ptr<Packet> packets[max_batch_size];  // NOLINT(runtime/arrays)
+  struct iovec iovs[max_batch_size];  // NOLINT(runtime/arrays)
+  TransmitDesc descs[max_batch_size];  // NOLINT(runtime/arrays)
   while (1) {
-    std::unique_ptr<Packet> packet;
-    output_buffer.pop_back(&packet);
-    BMELOG(packet_out, *packet);
-    BMLOG_DEBUG_PKT(*packet, "Transmitting packet of size {} out of port {}",
-                    packet->get_data_size(), packet->get_egress_port());
-    transmit_fn(packet->get_egress_port(),
-                packet->data(), packet->get_data_size());
+    const size_t n = output_buffer.pop_back_batch(packets, max_batch_size);
+    for (size_t i = 0; i < n; i++) {
+      Packet *packet = packets[i].get();
+      BMELOG(packet_out, *packet);
+      BMLOG_DEBUG_PKT(*packet, "Transmitting packet of size {} out of port {}",
+                      packet->get_data_size(), packet->get_egress_port());
+      // the deparser writes the headers in front of the payload, in the same
+      // buffer, so there is only one segment
+      iovs[i].iov_base = packet->data();
+      iovs[i].iov_len = packet->get_data_size();
+      descs[i].port_num = packet->get_egress_port();
+      descs[i].iov = &iovs[i];
+      descs[i].iovcnt = 1;
+    }
+    transmit_batch_fn(descs, n);
+    for (size_t i = 0; i < n; i++) packets[i].reset();
   }
 }
 
@@ -184,7 +199,9 @@ SimpleSwitch::enqueue(int egress_port, std::unique_ptr<Packet> &&packet) {
 
     PHV *phv = packet->get_phv();
 
-    if (with_queueing_metadata) {
+    // the packet may belong to a configuration which was swapped out
+    if (with_queueing_metadata &&
+        phv->has_field("queueing_metadata.enq_timestamp")) {
       phv->get_field("queueing_metadata.enq_timestamp").set(get_ts().count());
       phv->get_field("queueing_metadata.enq_qdepth")
           .set(egress_buffers.size(egress_port));
@@ -213,7 +230,8 @@ SimpleSwitch::copy_ingress_pkt(
   std::unique_ptr<Packet> packet_copy = packet->clone_no_phv_ptr();
   PHV *phv_copy = packet_copy->get_phv();
   phv_copy->reset_metadata();
-  FieldList *field_list = this->get_field_list(field_list_id);
+  FieldList *field_list =
+      packet->get_p4objects()->get_field_list(field_list_id);
   const PHV *phv = packet->get_phv();
   for (const auto &p : *field_list) {
     phv_copy->get_field(p.header, p.offset)
@@ -240,138 +258,161 @@ SimpleSwitch::check_queueing_metadata() {
 
 void
 SimpleSwitch::ingress_thread() {
-  PHV *phv;
+  // packets are dequeued and sent through the ingress pipeline in batches, see
+  // Pipeline::apply_batch
+  constexpr size_t max_batch_size = 32;
+  std::unique_ptr<Packet> packets[max_batch_size];  // NOLINT(runtime/arrays)
+  Packet *batch[max_batch_size];  // NOLINT(runtime/arrays)
+  // NOLINTNEXTLINE(runtime/arrays)
+  Packet::buffer_state_t packet_in_states[max_batch_size];
 
   while (1) {
-    std::unique_ptr<Packet> packet;
-    input_buffer.pop_back(&packet);
-
-    // TODO(antonin): only update these if swapping actually happened?
-    Parser *parser = this->get_parser("parser");
-    Pipeline *ingress_mau = this->get_pipeline("ingress");
-
-    phv = packet->get_phv();
-    packet_id_t packet_id = packet->get_packet_id();
-
-    int ingress_port = packet->get_ingress_port();
-    BMLOG_DEBUG_PKT(*packet, "Processing packet received on port {}",
-                    ingress_port);
+    const size_t n = input_buffer.pop_back_batch(packets, max_batch_size);
+
+    // a batch is split if it mixes packets from before and after a
+    // configuration swap
+    for (size_t first = 0, last; first < n; first = last) {
+      P4Objects *config = packets[first]->get_p4objects();
+      Parser *parser = config->get_parser("parser");
+      Pipeline *ingress_mau = config->get_pipeline("ingress");
+
+      for (last = first;
+           last < n && packets[last]->get_p4objects() == config; last++) {
+        Packet *packet = packets[last].get();
+        BMLOG_DEBUG_PKT(*packet, "Processing packet received on port {}",
+                        packet->get_ingress_port());
+
+        /* This looks like it comes out of the blue. However this is needed for
+           ingress cloning. The parser updates the buffer state (pops the
+           parsed headers) to make the deparser's job easier (the same buffer
+           is re-used). But for ingress cloning, the original packet is needed.
+           This kind of looks hacky though. Maybe a better solution would be to
+           have the parser leave the buffer unchanged, and move the pop logic
+           to the deparser. TODO? */
+        packet_in_states[last] = packet->save_buffer_state();
+        parser->parse(packet);
+        batch[last] = packet;
+      }
 
-    /* This looks like it comes out of the blue. However this is needed for
-       ingress cloning. The parser updates the buffer state (pops the parsed
-       headers) to make the deparser's job easier (the same buffer is
-       re-used). But for ingress cloning, the original packet is needed. This
-       kind of looks hacky though. Maybe a better solution would be to have the
-       parser leave the buffer unchanged, and move the pop logic to the
-       deparser. TODO? */
-    const Packet::buffer_state_t packet_in_state = packet->save_buffer_state();
-    parser->parse(packet.get());
+      ingress_mau->apply_batch(batch + first, last - first);
 
-    ingress_mau->apply(packet.get());
+      for (size_t i = first; i < last; i++) {
+        ingress_post_process(parser, std::move(packets[i]),
+                             packet_in_states[i]);
+      }
+    }
+  }
+}
 
-    packet->reset_exit();
+void
+SimpleSwitch::ingress_post_process(
+    Parser *parser, std::unique_ptr<Packet> packet,
+    const Packet::buffer_state_t &packet_in_state) {
+  PHV *phv = packet->get_phv();
 
-    Field &f_egress_spec = phv->get_field("standard_metadata.egress_spec");
-    int egress_spec = f_egress_spec.get_int();
+  packet->reset_exit();
 
-    Field &f_clone_spec = phv->get_field("standard_metadata.clone_spec");
-    unsigned int clone_spec = f_clone_spec.get_uint();
+  Field &f_egress_spec = phv->get_field("standard_metadata.egress_spec");
+  int egress_spec = f_egress_spec.get_int();
 
-    int learn_id = 0;
-    unsigned int mgid = 0u;
+  Field &f_clone_spec = phv->get_field("standard_metadata.clone_spec");
+  unsigned int clone_spec = f_clone_spec.get_uint();
 
-    if (phv->has_field("intrinsic_metadata.lf_field_list")) {
-      Field &f_learn_id = phv->get_field("intrinsic_metadata.lf_field_list");
-      learn_id = f_learn_id.get_int();
-    }
+  int learn_id = 0;
+  unsigned int mgid = 0u;
 
-    // detect mcast support, if this is true we assume that other fields needed
-    // for mcast are also defined
-    if (phv->has_field("intrinsic_metadata.mcast_grp")) {
-      Field &f_mgid = phv->get_field("intrinsic_metadata.mcast_grp");
-      mgid = f_mgid.get_uint();
-    }
+  if (phv->has_field("intrinsic_metadata.lf_field_list")) {
+    Field &f_learn_id = phv->get_field("intrinsic_metadata.lf_field_list");
+    learn_id = f_learn_id.get_int();
+  }
 
-    int egress_port;
+  // detect mcast support, if this is true we assume that other fields needed
+  // for mcast are also defined
+  if (phv->has_field("intrinsic_metadata.mcast_grp")) {
+    Field &f_mgid = phv->get_field("intrinsic_metadata.mcast_grp");
+    mgid = f_mgid.get_uint();
+  }
 
-    // INGRESS CLONING
-    if (clone_spec) {
-      BMLOG_DEBUG_PKT(*packet, "Cloning packet at ingress");
-      egress_port = get_mirroring_mapping(clone_spec & 0xFFFF);
-      f_clone_spec.set(0);
-      if (egress_port >= 0) {
-        const Packet::buffer_state_t packet_out_state =
-            packet->save_buffer_state();
-        packet->restore_buffer_state(packet_in_state);
-        p4object_id_t field_list_id = clone_spec >> 16;
-        auto packet_copy = copy_ingress_pkt(
-            packet, PKT_INSTANCE_TYPE_INGRESS_CLONE, field_list_id);
-        // we need to parse again
-        // the alternative would be to pay the (huge) price of PHV copy for
-        // every ingress packet
-        parser->parse(packet_copy.get());
-        enqueue(egress_port, std::move(packet_copy));
-        packet->restore_buffer_state(packet_out_state);
-      }
+  int egress_port;
+
+  // INGRESS CLONING
+  if (clone_spec) {
+    BMLOG_DEBUG_PKT(*packet, "Cloning packet at ingress");
+    egress_port = get_mirroring_mapping(clone_spec & 0xFFFF);
+    f_clone_spec.set(0);
+    if (egress_port >= 0) {
+      const Packet::buffer_state_t packet_out_state =
+          packet->save_buffer_state();
+      packet->restore_buffer_state(packet_in_state);
+      p4object_id_t field_list_id = clone_spec >> 16;
+      auto packet_copy = copy_ingress_pkt(
+          packet, PKT_INSTANCE_TYPE_INGRESS_CLONE, field_list_id);
+      // we need to parse again
+      // the alternative would be to pay the (huge) price of PHV copy for
+      // every ingress packet
+      parser->parse(packet_copy.get());
+      enqueue(egress_port, std::move(packet_copy));
+      packet->restore_buffer_state(packet_out_state);
     }
+  }
 
-    // LEARNING
-    if (learn_id > 0) {
-      get_learn_engine()->learn(learn_id, *packet.get());
-    }
+  // LEARNING
+  if (learn_id > 0) {
+    packet->get_p4objects()->get_learn_engine()->learn(learn_id,
+                                                       *packet.get());
+  }
 
-    // RESUBMIT
-    if (phv->has_field("intrinsic_metadata.resubmit_flag")) {
-      Field &f_resubmit = phv->get_field("intrinsic_metadata.resubmit_flag");
-      if (f_resubmit.get_int()) {
-        BMLOG_DEBUG_PKT(*packet, "Resubmitting packet");
-        // get the packet ready for being parsed again at the beginning of
-        // ingress
-        packet->restore_buffer_state(packet_in_state);
-        p4object_id_t field_list_id = f_resubmit.get_int();
-        f_resubmit.set(0);
-        // TODO(antonin): a copy is not needed here, but I don't yet have an
-        // optimized way of doing this
-        auto packet_copy = copy_ingress_pkt(
-            packet, PKT_INSTANCE_TYPE_RESUBMIT, field_list_id);
-        input_buffer.push_front(std::move(packet_copy));
-        continue;
-      }
+  // RESUBMIT
+  if (phv->has_field("intrinsic_metadata.resubmit_flag")) {
+    Field &f_resubmit = phv->get_field("intrinsic_metadata.resubmit_flag");
+    if (f_resubmit.get_int()) {
+      BMLOG_DEBUG_PKT(*packet, "Resubmitting packet");
+      // get the packet ready for being parsed again at the beginning of
+      // ingress
+      packet->restore_buffer_state(packet_in_state);
+      p4object_id_t field_list_id = f_resubmit.get_int();
+      f_resubmit.set(0);
+      // TODO(antonin): a copy is not needed here, but I don't yet have an
+      // optimized way of doing this
+      auto packet_copy = copy_ingress_pkt(
+          packet, PKT_INSTANCE_TYPE_RESUBMIT, field_list_id);
+      input_buffer.push_front(std::move(packet_copy));
+      return;
     }
+  }
 
-    Field &f_instance_type = phv->get_field("standard_metadata.instance_type");
-
-    // MULTICAST
-    int instance_type = f_instance_type.get_int();
-    if (mgid != 0) {
-      BMLOG_DEBUG_PKT(*packet, "Multicast requested for packet");
-      Field &f_rid = phv->get_field("intrinsic_metadata.egress_rid");
-      const auto pre_out = pre->replicate({mgid});
-      for (const auto &out : pre_out) {
-        egress_port = out.egress_port;
-        // if (ingress_port == egress_port) continue; // pruning
-        BMLOG_DEBUG_PKT(*packet, "Replicating packet on port {}", egress_port);
-        f_rid.set(out.rid);
-        f_instance_type.set(PKT_INSTANCE_TYPE_REPLICATION);
-        std::unique_ptr<Packet> packet_copy = packet->clone_with_phv_ptr();
-        enqueue(egress_port, std::move(packet_copy));
-      }
-      f_instance_type.set(instance_type);
+  Field &f_instance_type = phv->get_field("standard_metadata.instance_type");
 
-      // when doing multicast, we discard the original packet
-      continue;
+  // MULTICAST
+  int instance_type = f_instance_type.get_int();
+  if (mgid != 0) {
+    BMLOG_DEBUG_PKT(*packet, "Multicast requested for packet");
+    Field &f_rid = phv->get_field("intrinsic_metadata.egress_rid");
+    const auto pre_out = pre->replicate({mgid});
+    for (const auto &out : pre_out) {
+      egress_port = out.egress_port;
+      // if (ingress_port == egress_port) continue; // pruning
+      BMLOG_DEBUG_PKT(*packet, "Replicating packet on port {}", egress_port);
+      f_rid.set(out.rid);
+      f_instance_type.set(PKT_INSTANCE_TYPE_REPLICATION);
+      std::unique_ptr<Packet> packet_copy = packet->clone_with_phv_ptr();
+      enqueue(egress_port, std::move(packet_copy));
     }
+    f_instance_type.set(instance_type);
 
-    egress_port = egress_spec;
-    BMLOG_DEBUG_PKT(*packet, "Egress port is {}", egress_port);
+    // when doing multicast, we discard the original packet
+    return;
+  }
 
-    if (egress_port == 511) {  // drop packet
-      BMLOG_DEBUG_PKT(*packet, "Dropping packet at the end of ingress");
-      continue;
-    }
+  egress_port = egress_spec;
+  BMLOG_DEBUG_PKT(*packet, "Egress port is {}", egress_port);
 
-    enqueue(egress_port, std::move(packet));
+  if (egress_port == 511) {  // drop packet
+    BMLOG_DEBUG_PKT(*packet, "Dropping packet at the end of ingress");
+    return;
   }
+
+  enqueue(egress_port, std::move(packet));
 }
 
 void
@@ -383,13 +424,15 @@ SimpleSwitch::egress_thread(size_t worker_id) {
     size_t port;
     egress_buffers.pop_back(worker_id, &port, &packet);
 
-    Deparser *deparser = this->get_deparser("deparser");
-    Pipeline *egress_mau = this->get_pipeline("egress");
+    P4Objects *config = packet->get_p4objects();
+    Deparser *deparser = config->get_deparser("deparser");
+    Pipeline *egress_mau = config->get_pipeline("egress");
 
     phv = packet->get_phv();
     packet_id_t packet_id = packet->get_packet_id();
 
-    if (with_queueing_metadata) {
+    if (with_queueing_metadata &&
+        phv->has_field("queueing_metadata.enq_timestamp")) {
       auto enq_timestamp =
           phv->get_field("queueing_metadata.enq_timestamp").get<ts_res::rep>();
       phv->get_field("queueing_metadata.deq_timedelta").set(
@@ -418,7 +461,7 @@ SimpleSwitch::egress_thread(size_t worker_id) {
         std::unique_ptr<Packet> packet_copy =
             packet->clone_with_phv_reset_metadata_ptr();
         PHV *phv_copy = packet_copy->get_phv();
-        FieldList *field_list = this->get_field_list(field_list_id);
+        FieldList *field_list = config->get_field_list(field_list_id);
         for (const auto &p : *field_list) {
           phv_copy->get_field(p.header, p.offset)
             .set(phv->get_field(p.header, p.offset));
@@ -445,7 +488,7 @@ SimpleSwitch::egress_thread(size_t worker_id) {
         BMLOG_DEBUG_PKT(*packet, "Recirculating packet");
         p4object_id_t field_list_id = f_recirc.get_int();
         f_recirc.set(0);
-        FieldList *field_list = this->get_field_list(field_list_id);
+        FieldList *field_list = config->get_field_list(field_list_id);
         // TODO(antonin): just like for resubmit, there is no need for a copy
         // here, but it is more convenient for this first prototype
         std::unique_ptr<Packet> packet_copy = packet->clone_no_phv_ptr();
@@ -26,6 +26,7 @@
 #include <thread>
 #include <vector>
 
+#include "bm_sim/clock.h"
 #include "bm_sim/queue.h"
 #include "bm_sim/queueing.h"
 #include "bm_sim/packet.h"
@@ -57,6 +58,7 @@ using bm::PHV;
 using bm::Parser;
 using bm::Deparser;
 using bm::Pipeline;
+using bm::P4Objects;
 using bm::McSimplePreLAG;
 using bm::Field;
 using bm::FieldList;
@@ -69,7 +71,7 @@ class SimpleSwitch : public Switch {
   typedef int mirror_id_t;
 
  private:
-  typedef std::chrono::high_resolution_clock clock;
+  typedef bm::Clock clock;
 
  public:
   // by default, swapping is off
@@ -132,6 +134,9 @@ class SimpleSwitch : public Switch {
 
  private:
   void ingress_thread();
+  // everything which happens to a packet after the ingress pipeline
+  void ingress_post_process(Parser *parser, std::unique_ptr<Packet> packet,
+                            const Packet::buffer_state_t &packet_in_state);
   void egress_thread(size_t worker_id);
   void transmit_thread();
 
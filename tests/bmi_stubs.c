@@ -42,6 +42,11 @@ int bmi_port_send(bmi_port_mgr_t *port_mgr) {
   return 0;
 }
 
+int bmi_port_send_batch(bmi_port_mgr_t *port_mgr) {
+  (void) port_mgr;
+  return 0;
+}
+
 int bmi_port_interface_add(bmi_port_mgr_t *port_mgr) {
   (void) port_mgr;
   return 0;
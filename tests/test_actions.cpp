@@ -129,6 +129,51 @@ class WritePacketRegister : public ActionPrimitive<const Data &> {
 
 REGISTER_PRIMITIVE(WritePacketRegister);
 
+// primitives with well-known semantics, which the action engine can execute
+// without calling them; they count the number of times they are called
+class SetSpecialized : public ActionPrimitive<Data &, const Data &> {
+ public:
+  void operator ()(Data &f, const Data &d) {
+    calls++;
+    f.set(d);
+  }
+
+  Semantics get_semantics() const override {
+    return Semantics::MODIFY_FIELD;
+  }
+
+  int calls{0};
+};
+
+class AddToFieldSpecialized : public ActionPrimitive<Field &, const Data &> {
+ public:
+  void operator ()(Field &f, const Data &d) {
+    calls++;
+    f.add(f, d);
+  }
+
+  Semantics get_semantics() const override {
+    return Semantics::ADD_TO_FIELD;
+  }
+
+  int calls{0};
+};
+
+class CountSpecialized
+    : public ActionPrimitive<CounterArray &, const Data &> {
+ public:
+  void operator ()(CounterArray &counter_array, const Data &idx) {
+    calls++;
+    counter_array.get_counter(idx.get_uint()).increment_counter(get_packet());
+  }
+
+  Semantics get_semantics() const override {
+    return Semantics::COUNT;
+  }
+
+  int calls{0};
+};
+
 // Google Test fixture for actions tests
 class ActionsTest : public ::testing::Test {
  protected:
@@ -557,6 +602,62 @@ TEST_F(ActionsTest, TwoPrimitives) {
   ASSERT_EQ((unsigned) 0xaba, dst2.get_uint());
 }
 
+TEST_F(ActionsTest, SpecializedPrimitives) {
+  SetSpecialized set;
+  AddToFieldSpecialized add;
+  CountSpecialized count;
+  RegisterArray register_array("register_test", 0, 16, 16);
+  CounterArray counter_array("counter_test", 0, 16);
+
+  // f16 = 0xab
+  testActionFn.push_back_primitive(&set);
+  testActionFn.parameter_push_back_field(testHeader1, 3);  // f16
+  testActionFn.parameter_push_back_const(Data(0xab));
+  // f32 = action data 0
+  testActionFn.push_back_primitive(&set);
+  testActionFn.parameter_push_back_field(testHeader1, 0);  // f32
+  testActionFn.parameter_push_back_action_data(0);
+  // f8 = f16
+  testActionFn.push_back_primitive(&set);
+  testActionFn.parameter_push_back_field(testHeader1, 2);  // f8
+  testActionFn.parameter_push_back_field(testHeader1, 3);  // f16
+  // f16 += 1, f32 += action data 1, f8 += f16
+  testActionFn.push_back_primitive(&add);
+  testActionFn.parameter_push_back_field(testHeader1, 3);  // f16
+  testActionFn.parameter_push_back_const(Data(1));
+  testActionFn.push_back_primitive(&add);
+  testActionFn.parameter_push_back_field(testHeader1, 0);  // f32
+  testActionFn.parameter_push_back_action_data(1);
+  testActionFn.push_back_primitive(&add);
+  testActionFn.parameter_push_back_field(testHeader1, 2);  // f8
+  testActionFn.parameter_push_back_field(testHeader1, 3);  // f16
+  // counter_test[3]
+  testActionFn.push_back_primitive(&count);
+  testActionFn.parameter_push_back_counter_array(&counter_array);
+  testActionFn.parameter_push_back_const(Data(3));
+  // the destination is a register, so this goes through the primitive
+  testActionFn.push_back_primitive(&set);
+  testActionFn.parameter_push_back_register_ref(&register_array, 2);
+  testActionFn.parameter_push_back_const(Data(0xcd));
+
+  testActionFnEntry.push_back_action_data(0x1000);
+  testActionFnEntry.push_back_action_data(0x10);
+
+  testActionFnEntry(pkt.get());
+
+  ASSERT_EQ(0xac, phv->get_field(testHeader1, 3).get_uint());
+  ASSERT_EQ(0x1010, phv->get_field(testHeader1, 0).get_uint());
+  ASSERT_EQ((0xab + 0xac) & 0xff, phv->get_field(testHeader1, 2).get_uint());
+  ASSERT_EQ(0xcd, register_array.at(2).get_uint());
+  Counter::counter_value_t bytes, packets;
+  counter_array.get_counter(3).query_counter(&bytes, &packets);
+  ASSERT_EQ(1u, packets);
+
+  ASSERT_EQ(1, set.calls);
+  ASSERT_EQ(0, add.calls);
+  ASSERT_EQ(0, count.calls);
+}
+
 extern bool WITH_VALGRIND; // defined in main.cpp
 
 // added this test after I found a race condition when the same action primitive
@@ -195,3 +195,71 @@ TEST_F(AgeingTest, NoDuplicate) {
   elapsed = duration_cast<milliseconds>(tp4 - tp3).count();
   ASSERT_GT(elapsed, (unsigned int) (sweep_int * 1.5));
 }
+
+TEST_F(AgeingTest, SweepEntries) {
+  std::string key_("\x0a\xba");
+  std::string key("0x0aba");
+  entry_handle_t handle_1;
+  entry_handle_t lookup_handle;
+  unsigned int ttl = 100u;
+  std::vector<entry_handle_t> entries;
+  ASSERT_EQ(MatchErrorCode::SUCCESS, add_entry(key_, &handle_1, ttl));
+
+  table->sweep_entries(&entries);
+  ASSERT_TRUE(entries.empty());
+
+  sleep_for(milliseconds(ttl + 50u));
+  table->sweep_entries(&entries);
+  ASSERT_EQ(1u, entries.size());
+  ASSERT_EQ(handle_1, entries[0]);
+
+  // still expired, so reported again by the next sweep
+  entries.clear();
+  table->sweep_entries(&entries);
+  ASSERT_EQ(1u, entries.size());
+
+  // a hit refreshes the entry
+  ASSERT_TRUE(send_pkt(key, &lookup_handle));
+  entries.clear();
+  table->sweep_entries(&entries);
+  ASSERT_TRUE(entries.empty());
+
+  sleep_for(milliseconds(ttl / 2));
+  ASSERT_TRUE(send_pkt(key, &lookup_handle));
+  sleep_for(milliseconds(ttl / 2 + 20u));
+  table->sweep_entries(&entries);
+  ASSERT_TRUE(entries.empty());
+
+  sleep_for(milliseconds(ttl));
+  table->sweep_entries(&entries);
+  ASSERT_EQ(1u, entries.size());
+
+  // deleted entries are never reported
+  ASSERT_EQ(MatchErrorCode::SUCCESS, delete_entry(handle_1));
+  entries.clear();
+  table->sweep_entries(&entries);
+  ASSERT_TRUE(entries.empty());
+}
+
+TEST_F(AgeingTest, ShorterTTL) {
+  std::string key_("\x0a\xba");
+  entry_handle_t handle_1;
+  std::vector<entry_handle_t> entries;
+  ASSERT_EQ(MatchErrorCode::SUCCESS, add_entry(key_, &handle_1, 10000u));
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->set_entry_ttl(handle_1, 50u));
+  sleep_for(milliseconds(100u));
+  table->sweep_entries(&entries);
+  ASSERT_EQ(1u, entries.size());
+  ASSERT_EQ(handle_1, entries[0]);
+}
+
+TEST(AtomicTimestamp, Coarse) {
+  MatchUnit::AtomicTimestamp ts(static_cast<uint64_t>(0));
+  const uint64_t epoch = MatchUnit::AtomicTimestamp::epoch_length_ms;
+  ts.set_coarse(10 * epoch + 1);
+  ASSERT_EQ(10 * epoch, ts.get_ms());
+  ts.set_coarse(11 * epoch - 1);
+  ASSERT_EQ(10 * epoch, ts.get_ms());
+  ts.set_coarse(11 * epoch);
+  ASSERT_EQ(11 * epoch, ts.get_ms());
+}
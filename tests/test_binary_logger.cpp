@@ -0,0 +1,204 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iterator>
+
+#include <cstring>
+#include <cstdio>
+
+#include "bm_sim/logger.h"
+#include "bm_sim/packet.h"
+
+using namespace bm;
+
+namespace {
+
+typedef BinaryLogger::ArgType ArgType;
+
+class TraceReader {
+ public:
+  explicit TraceReader(const std::string &path) {
+    std::ifstream fs(path, std::ios::binary);
+    data = std::string((std::istreambuf_iterator<char>(fs)),
+                       std::istreambuf_iterator<char>());
+  }
+
+  bool done() const { return offset >= data.size(); }
+
+  template <typename T>
+  T get() {
+    T v;
+    std::memcpy(&v, data.data() + offset, sizeof(v));
+    offset += sizeof(v);
+    return v;
+  }
+
+  std::string get_string() {
+    auto len = get<uint32_t>();
+    std::string s(data, offset, len);
+    offset += len;
+    return s;
+  }
+
+  std::string data;
+  size_t offset{0};
+};
+
+struct Record {
+  uint32_t fmt_id;
+  uint64_t packet_id;
+  uint64_t copy_id;
+  uint32_t cxt;
+  std::vector<std::string> args;
+};
+
+}  // namespace
+
+class BinaryLoggerTest : public ::testing::Test {
+ protected:
+  PHVFactory phv_factory;
+  std::unique_ptr<PHVSourceIface> phv_source{nullptr};
+  const std::string path{"binary_logger_trace.bin"};
+
+  std::map<uint32_t, std::string> formats;
+  std::vector<Record> records;
+
+  BinaryLoggerTest()
+      : phv_source(PHVSourceIface::make_phv_source()) { }
+
+  virtual void SetUp() {
+    phv_source->set_phv_factory(0, &phv_factory);
+  }
+
+  virtual void TearDown() {
+    BinaryLogger::disable();
+    std::remove(path.c_str());
+  }
+
+  Packet get_pkt(packet_id_t id) {
+    return Packet::make_new(0, 0, id, 0, 128, PacketBuffer(256),
+                            phv_source.get());
+  }
+
+  // decodes arguments to strings, as the decoder tool would
+  void read_trace() {
+    TraceReader reader(path);
+    ASSERT_EQ(0x424d424cu, reader.get<uint32_t>());
+    ASSERT_EQ(1u, reader.get<uint32_t>());
+    while (!reader.done()) {
+      auto type = reader.get<uint8_t>();
+      if (type == 0) {  // FORMAT
+        auto id = reader.get<uint32_t>();
+        reader.get<uint8_t>();
+        reader.get<uint32_t>();
+        reader.get_string();
+        formats[id] = reader.get_string();
+        continue;
+      }
+      ASSERT_EQ(1, type);  // RECORDS
+      reader.get<uint32_t>();
+      size_t end = reader.offset + reader.get<uint32_t>();
+      while (reader.offset < end) {
+        Record record;
+        reader.get<uint32_t>();
+        record.fmt_id = reader.get<uint32_t>();
+        reader.get<uint64_t>();
+        record.packet_id = reader.get<uint64_t>();
+        record.copy_id = reader.get<uint64_t>();
+        record.cxt = reader.get<uint32_t>();
+        auto nargs = reader.get<uint8_t>();
+        for (int i = 0; i < nargs; i++) {
+          switch (static_cast<ArgType>(reader.get<uint8_t>())) {
+            case ArgType::INT:
+              record.args.push_back(std::to_string(reader.get<int64_t>()));
+              break;
+            case ArgType::UINT:
+              record.args.push_back(std::to_string(reader.get<uint64_t>()));
+              break;
+            case ArgType::BOOL:
+              record.args.push_back(reader.get<uint8_t>() ? "true" : "false");
+              break;
+            case ArgType::STRING:
+              record.args.push_back(reader.get_string());
+              break;
+            case ArgType::BYTES:
+              {
+                const std::string bytes = reader.get_string();
+                record.args.push_back(
+                    ByteContainer(bytes.data(), bytes.size()).to_hex());
+              }
+              break;
+          }
+        }
+        records.push_back(record);
+      }
+    }
+  }
+};
+
+TEST_F(BinaryLoggerTest, Disabled) {
+  ASSERT_FALSE(BinaryLogger::is_enabled(Logger::LogLevel::TRACE));
+  ASSERT_FALSE(BinaryLogger::is_enabled(Logger::LogLevel::ERROR));
+}
+
+TEST_F(BinaryLoggerTest, Levels) {
+  ASSERT_TRUE(BinaryLogger::enable(path, Logger::LogLevel::DEBUG));
+  ASSERT_FALSE(BinaryLogger::is_enabled(Logger::LogLevel::TRACE));
+  ASSERT_TRUE(BinaryLogger::is_enabled(Logger::LogLevel::DEBUG));
+  ASSERT_TRUE(BinaryLogger::is_enabled(Logger::LogLevel::INFO));
+  BinaryLogger::disable();
+  ASSERT_FALSE(BinaryLogger::is_enabled(Logger::LogLevel::DEBUG));
+}
+
+TEST_F(BinaryLoggerTest, Record) {
+  ASSERT_TRUE(BinaryLogger::enable(path));
+  Packet pkt = get_pkt(99);
+  const std::string name("table_1");
+  const ByteContainer key("0x0a0b");
+  const int num_records = 100;
+  for (int i = 0; i < num_records; i++) {
+    BMLOG_BINARY_PKT(Logger::LogLevel::DEBUG, pkt,
+                     "Table '{}': {} {} {} {}", name, -i, 7u, true, key);
+  }
+  BMLOG_BINARY_PKT(Logger::LogLevel::TRACE, pkt, "No arguments");
+  BinaryLogger::disable();
+  ASSERT_EQ(0u, BinaryLogger::get_dropped_records());
+
+  read_trace();
+  ASSERT_EQ(static_cast<size_t>(num_records + 1), records.size());
+  for (int i = 0; i < num_records; i++) {
+    const auto &record = records.at(i);
+    ASSERT_EQ("Table '{}': {} {} {} {}", formats.at(record.fmt_id));
+    ASSERT_EQ(99u, record.packet_id);
+    ASSERT_EQ(0u, record.copy_id);
+    ASSERT_EQ(0u, record.cxt);
+    std::vector<std::string> expected =
+        {name, std::to_string(-i), "7", "true", "0a0b"};
+    ASSERT_EQ(expected, record.args);
+  }
+  ASSERT_EQ("No arguments", formats.at(records.back().fmt_id));
+  ASSERT_TRUE(records.back().args.empty());
+}
@@ -0,0 +1,122 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "bmi_interface.h"
+}
+
+// bmi_interface_send_batch needs a real interface, so we exercise the
+// underlying bmi_fd_send_batch on a datagram socket pair instead
+class BmiSendBatchTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+    // any datagram larger than the send buffer is rejected with EMSGSIZE
+    int sndbuf = 4096;
+    ASSERT_EQ(0, setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF,
+                            &sndbuf, sizeof(sndbuf)));
+  }
+
+  virtual void TearDown() {
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  int send(const std::vector<std::vector<std::string> > &pkts) {
+    std::vector<std::vector<struct iovec> > iov_storage;
+    for (const auto &segments : pkts) {
+      std::vector<struct iovec> iov;
+      for (const auto &s : segments)
+        iov.push_back({const_cast<char *>(s.data()), s.size()});
+      iov_storage.push_back(iov);
+    }
+    std::vector<const struct iovec *> iovs;
+    std::vector<int> iovcnts;
+    for (const auto &iov : iov_storage) {
+      iovs.push_back(iov.data());
+      iovcnts.push_back(static_cast<int>(iov.size()));
+    }
+    return bmi_fd_send_batch(fds[0], iovs.data(), iovcnts.data(),
+                             static_cast<int>(pkts.size()));
+  }
+
+  std::string receive() {
+    char buffer[4096];
+    ssize_t len = recv(fds[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (len < 0) return "";
+    return std::string(buffer, len);
+  }
+
+  int fds[2];
+};
+
+TEST_F(BmiSendBatchTest, Send) {
+  ASSERT_EQ(0, send({{"pkt1"}, {"pk", "t2"}, {"pkt", "3", ""}}));
+  ASSERT_EQ("pkt1", receive());
+  ASSERT_EQ("pkt2", receive());
+  ASSERT_EQ("pkt3", receive());
+  ASSERT_EQ("", receive());
+}
+
+TEST_F(BmiSendBatchTest, DropOne) {
+  const std::string too_large(65536, 'x');
+  // the middle packet is dropped, the following one is still sent
+  ASSERT_EQ(1, send({{"pkt1"}, {too_large}, {"pkt3"}}));
+  ASSERT_EQ("pkt1", receive());
+  ASSERT_EQ("pkt3", receive());
+  ASSERT_EQ("", receive());
+
+  ASSERT_EQ(2, send({{too_large}, {"pkt2"}, {too_large}}));
+  ASSERT_EQ("pkt2", receive());
+  ASSERT_EQ("", receive());
+}
+
+// the port sockets are non-blocking, a full socket must not drop packets
+TEST_F(BmiSendBatchTest, WaitWhenFull) {
+  ASSERT_EQ(0, fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK));
+  const size_t n = 64;
+  const std::string pkt(1000, 'x');
+  std::vector<std::string> received;
+  std::thread receiver([this, &received, n]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      char buffer[4096];
+      while (received.size() < n) {
+        ssize_t len = recv(fds[1], buffer, sizeof(buffer), 0);
+        if (len < 0) break;
+        received.emplace_back(buffer, len);
+      }
+  });
+  ASSERT_EQ(0, send(std::vector<std::vector<std::string> >(n, {pkt})));
+  receiver.join();
+  ASSERT_EQ(n, received.size());
+  for (const auto &p : received) ASSERT_EQ(pkt, p);
+}
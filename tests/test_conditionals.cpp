@@ -382,8 +382,8 @@ TEST_F(ConditionalsTest, RegisterGen) {
   ASSERT_FALSE(c.eval(*phv));
 }
 
-// This test was written to stress-test the Expression::assign_dest_registers(),
-// for which my first implementation was faulty...
+// This test was written to stress-test the allocation of registers for
+// expressions, for which my first implementation was faulty...
 TEST_F(ConditionalsTest, Add2) {
   Conditional c("ctest", 0);
   constexpr size_t nb_sub_adds = 16;
@@ -571,3 +571,118 @@ TEST_F(ConditionalsTest, Stress) {
     }
   }
 }
+
+// when the bitwidth of fields is provided, the expression is evaluated with
+// 64-bit integers as long as the intermediate values fit
+TEST_F(ConditionalsTest, FieldWidths) {
+  // (f16 * f48) - f32 == expected
+  Conditional c("ctest", 0);
+  c.push_back_load_field(testHeader1, 3, 16);  // f16
+  c.push_back_load_field(testHeader1, 1, 48);  // f48
+  c.push_back_op(ExprOpcode::MUL);
+  c.push_back_load_field(testHeader1, 0, 32);  // f32
+  c.push_back_op(ExprOpcode::SUB);
+  c.push_back_load_const(Data(0xfffdffff0002ull));
+  c.push_back_op(ExprOpcode::EQ_DATA);
+  c.build();
+
+  phv->get_field(testHeader1, 3).set(0xffff);
+  phv->get_field(testHeader1, 1).set(0xffffffffull);
+  phv->get_field(testHeader1, 0).set(0xffffffffull);
+  ASSERT_TRUE(c.eval(*phv));
+
+  // negative intermediate value
+  ArithExpression e;
+  e.push_back_load_field(testHeader1, 3, 16);  // f16
+  e.push_back_load_field(testHeader1, 0, 32);  // f32
+  e.push_back_op(ExprOpcode::SUB);
+  e.build();
+  Data res;
+  e.eval(*phv, &res);
+  ASSERT_EQ(Data(0xffff - 0xffffffffll), res);
+}
+
+// intermediate values which may not fit in 64 bits are computed with bignums
+TEST_F(ConditionalsTest, FieldWidthsOverflow) {
+  ArithExpression e;
+  // (f48 << 40) + f128
+  e.push_back_load_field(testHeader1, 1, 48);  // f48
+  e.push_back_load_const(Data(40));
+  e.push_back_op(ExprOpcode::SHIFT_LEFT);
+  e.push_back_load_field(testHeader1, 4, 128);  // f128
+  e.push_back_op(ExprOpcode::ADD);
+  e.build();
+
+  phv->get_field(testHeader1, 1).set("0xffffffffffff");
+  phv->get_field(testHeader1, 4).set(1);
+  Data res;
+  e.eval(*phv, &res);
+  ASSERT_EQ(Data("0xffffffffffff0000000001"), res);
+
+  // 48 bits * 48 bits does not fit either
+  ArithExpression e2;
+  e2.push_back_load_field(testHeader1, 1, 48);  // f48
+  e2.push_back_load_field(testHeader2, 1, 48);  // f48
+  e2.push_back_op(ExprOpcode::MUL);
+  e2.build();
+
+  phv->get_field(testHeader2, 1).set("0xffffffffffff");
+  e2.eval(*phv, &res);
+  ASSERT_EQ(Data("0xfffffffffffe000000000001"), res);
+}
+
+TEST_F(ConditionalsTest, ConstantFolding) {
+  // ((true or valid(testHeader1)) ? (3 * (1 + 2)) : f16) == 9
+  Conditional c("ctest", 0);
+  Expression ternary_e1;
+  ternary_e1.push_back_load_const(Data(3));
+  ternary_e1.push_back_load_const(Data(1));
+  ternary_e1.push_back_load_const(Data(2));
+  ternary_e1.push_back_op(ExprOpcode::ADD);
+  ternary_e1.push_back_op(ExprOpcode::MUL);
+  Expression ternary_e2;
+  ternary_e2.push_back_load_field(testHeader1, 3, 16);  // f16
+
+  c.push_back_load_bool(true);
+  c.push_back_load_header(testHeader1);
+  c.push_back_op(ExprOpcode::VALID_HEADER);
+  c.push_back_op(ExprOpcode::OR);
+  c.push_back_ternary_op(ternary_e1, ternary_e2);
+  c.push_back_load_const(Data(9));
+  c.push_back_op(ExprOpcode::EQ_DATA);
+  c.build();
+
+  phv->get_header(testHeader1).mark_invalid();
+  ASSERT_TRUE(c.eval(*phv));
+}
+
+// the right operand of "and" / "or" is only evaluated when needed, we check
+// this by using an out-of-range register index
+TEST_F(ConditionalsTest, ShortCircuit) {
+  constexpr size_t register_size = 16;
+  RegisterArray register_array("register_test", 0, register_size, 16);
+
+  for (const auto opcode : {ExprOpcode::AND, ExprOpcode::OR}) {
+    // (f16 == 1) op (register_test[f32] == 0)
+    Conditional c("ctest", 0);
+    c.push_back_load_field(testHeader1, 3, 16);  // f16
+    c.push_back_load_const(Data(1));
+    c.push_back_op(ExprOpcode::EQ_DATA);
+    c.push_back_load_field(testHeader1, 0, 32);  // f32
+    c.push_back_load_register_gen(&register_array);
+    c.push_back_load_const(Data(0));
+    c.push_back_op(ExprOpcode::EQ_DATA);
+    c.push_back_op(opcode);
+    c.build();
+
+    const bool is_and = (opcode == ExprOpcode::AND);
+    phv->get_field(testHeader1, 3).set(is_and ? 0 : 1);
+    phv->get_field(testHeader1, 0).set(register_size);
+    ASSERT_EQ(!is_and, c.eval(*phv));
+
+    phv->get_field(testHeader1, 3).set(is_and ? 1 : 0);
+    ASSERT_THROW(c.eval(*phv), std::out_of_range);
+    phv->get_field(testHeader1, 0).set(register_size - 1);
+    ASSERT_TRUE(c.eval(*phv));
+  }
+}
@@ -15,19 +15,33 @@
 
 #include "bm_sim/dev_mgr.h"
 #include "bm_sim/port_monitor.h"
+#include "bm_sim/shm_ring.h"
 #include "bm_apps/packet_pipe.h"
+#include "bm_apps/shm_packet_pipe.h"
+
+#include <boost/filesystem.hpp>
 
 #include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <fstream>
+#include <functional>
 #include <gtest/gtest.h>
 #include <iostream>
 #include <map>
 #include <unordered_map>
+#include <string>
 #include <thread>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include "utils.h"
 
 using namespace bm;
@@ -107,10 +121,16 @@ private:
     return ReturnCode::SUCCESS;
   }
 
-  void transmit_fn_(int port_num, const char *buffer, int len) override {}
+  void transmit_fn_(int port_num, const char *buffer, int len) override {
+    transmitted.emplace_back(port_num, std::string(buffer, len));
+  }
 
   void start_() override {}
 
+ public:
+  std::vector<std::pair<int, std::string> > transmitted{};
+
+ private:
   std::map<port_t, PortStatus> port_status{};
   mutable std::mutex status_mutex{};
 };
@@ -192,6 +212,24 @@ TEST_F(DevMgrTest, cb_test) {
       << "Number of port remove callbacks incorrect" << std::endl;
 }
 
+// the default implementation of transmit_batch_fn calls transmit_fn for each
+// packet, after linearizing it
+TEST_F(DevMgrTest, TransmitBatch) {
+  const std::string hdr("\x01\x02\x03", 3);
+  const std::string payload("\xaa\xbb", 2);
+  struct iovec iov_2[2] = {
+    {const_cast<char *>(hdr.data()), hdr.size()},
+    {const_cast<char *>(payload.data()), payload.size()}};
+  struct iovec iov_1[1] = {
+    {const_cast<char *>(payload.data()), payload.size()}};
+  DevMgrIface::TransmitDesc pkts[3] = {{1, iov_2, 2}, {2, iov_1, 1},
+                                       {1, iov_1, 1}};
+  g_mgr->transmit_batch_fn(pkts, 3);
+  const std::vector<std::pair<int, std::string> > expected = {
+    {1, hdr + payload}, {2, payload}, {1, payload}};
+  ASSERT_EQ(expected, g_mgr->transmitted);
+}
+
 class PacketInReceiver {
  public:
   enum class Status { CAN_READ, CAN_RECEIVE };
@@ -565,3 +603,304 @@ TYPED_TEST(PortMonitorTest, Basic) {
   ASSERT_EQ(port, statuses[0].port);
   ASSERT_EQ(0, statuses[0].status);
 }
+
+// is here because DevMgr has a protected destructor
+class AfPacketSwitch : public DevMgr {
+};
+
+// uses the loopback interface, every packet sent on the port is received back
+// on the same port; requires CAP_NET_RAW
+TEST(AfPacketDevMgrTest, Loopback) {
+  constexpr int port = 1;
+  constexpr int num_pkts = 64;
+  AfPacketSwitch sw;
+  sw.set_dev_mgr_af_packet(0);
+  if (sw.port_add("lo", port, nullptr, nullptr) !=
+      PacketDispatcherIface::ReturnCode::SUCCESS) {
+    std::cout << "Cannot use AF_PACKET on lo, skipping test\n";
+    return;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> received;
+  auto handler = [&mutex, &cv, &received](int port_num, const char *buffer,
+                                          int len, void *cookie) {
+    (void) cookie;
+    // ignore other traffic on lo, we use a local experimental ethertype
+    if (port_num != port || len < 14 || buffer[12] != '\x88' ||
+        buffer[13] != '\xb5')
+      return;
+    std::unique_lock<std::mutex> lock(mutex);
+    received.emplace_back(buffer, len);
+    cv.notify_one();
+  };
+  sw.set_packet_handler(handler, nullptr);
+  sw.start();
+
+  std::vector<std::string> sent;
+  for (int i = 0; i < num_pkts; i++) {
+    // some packets do not fit in 2KB frames, which is fine given the MTU of lo
+    std::string pkt((i % 8 == 7) ? 4000 : 64, static_cast<char>(i));
+    std::fill(pkt.begin(), pkt.begin() + 12, '\x00');
+    pkt[12] = '\x88';
+    pkt[13] = '\xb5';
+    sent.push_back(pkt);
+  }
+  // first half one by one, second half as a single batch, with the Ethernet
+  // header and the payload in different segments
+  for (int i = 0; i < num_pkts / 2; i++)
+    sw.transmit_fn(port, sent[i].data(), sent[i].size());
+  std::vector<struct iovec> iovs;
+  std::vector<DevMgr::TransmitDesc> pkts;
+  for (int i = num_pkts / 2; i < num_pkts; i++) {
+    char *data = const_cast<char *>(sent[i].data());
+    iovs.push_back({data, 14});
+    iovs.push_back({data + 14, sent[i].size() - 14});
+  }
+  for (size_t i = 0; i < iovs.size(); i += 2)
+    pkts.push_back({port, &iovs[i], 2});
+  sw.transmit_batch_fn(pkts.data(), pkts.size());
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait_for(lock, std::chrono::seconds(2),
+              [&received]() { return received.size() >= num_pkts; });
+  ASSERT_EQ(sent, received);
+}
+
+class ShmSwitch : public DevMgr {
+};
+
+TEST(ShmDevMgrTest, Batch) {
+  constexpr int num_pkts = 1000;
+  constexpr size_t batch_size = 100;
+  const std::string path = "/tmp/bm_shm_test_" + std::to_string(getpid());
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::pair<int, std::string> > recv_switch;
+  std::vector<std::pair<int, std::string> > recv_lib;
+  auto make_handler = [&mutex, &cv](
+      std::vector<std::pair<int, std::string> > *received) {
+    return [&mutex, &cv, received](int port_num, const char *buffer, int len,
+                                   void *cookie) {
+      (void) cookie;
+      std::unique_lock<std::mutex> lock(mutex);
+      received->emplace_back(port_num, std::string(buffer, len));
+      cv.notify_one();
+    };
+  };
+  ShmSwitch sw;
+  sw.set_dev_mgr_shm(0, path);
+  bm_apps::ShmPacketInject packet_inject(path);
+  sw.set_packet_handler(make_handler(&recv_switch), nullptr);
+  packet_inject.set_packet_receiver(make_handler(&recv_lib), nullptr);
+  sw.start();
+  packet_inject.start();
+
+  std::vector<std::pair<int, std::string> > sent;
+  for (int i = 0; i < num_pkts; i++)
+    sent.emplace_back(i % 4, std::string(64 + i % 100, static_cast<char>(i)));
+
+  // client to switch
+  for (size_t i = 0; i < sent.size(); i += batch_size) {
+    int ports[batch_size];
+    const char *buffers[batch_size];
+    int lens[batch_size];
+    for (size_t j = 0; j < batch_size; j++) {
+      ports[j] = sent[i + j].first;
+      buffers[j] = sent[i + j].second.data();
+      lens[j] = static_cast<int>(sent[i + j].second.size());
+    }
+    ASSERT_EQ(batch_size,
+              packet_inject.send_batch(ports, buffers, lens, batch_size));
+  }
+
+  // switch to client, with the packets split in 2 segments
+  std::vector<struct iovec> iovs;
+  for (auto &p : sent) {
+    char *data = const_cast<char *>(p.second.data());
+    iovs.push_back({data, 14});
+    iovs.push_back({data + 14, p.second.size() - 14});
+  }
+  for (size_t i = 0; i < sent.size(); i += batch_size) {
+    std::vector<DevMgr::TransmitDesc> pkts;
+    for (size_t j = i; j < i + batch_size; j++)
+      pkts.push_back({sent[j].first, &iovs[2 * j], 2});
+    sw.transmit_batch_fn(pkts.data(), pkts.size());
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait_for(lock, std::chrono::seconds(2),
+              [&recv_switch, &recv_lib]() {
+                return recv_switch.size() >= num_pkts &&
+                    recv_lib.size() >= num_pkts;
+              });
+  ASSERT_EQ(sent, recv_switch);
+  ASSERT_EQ(sent, recv_lib);
+}
+
+TEST(ShmDevMgrTest, OneClient) {
+  const std::string path = "/tmp/bm_shm_test_" + std::to_string(getpid());
+  ShmSwitch sw;
+  sw.set_dev_mgr_shm(0, path);
+  sw.start();
+
+  std::unique_ptr<bm_apps::ShmPacketInject> client(
+      new bm_apps::ShmPacketInject(path));
+  // the rings are single-producer / single-consumer
+  ASSERT_THROW(bm_apps::ShmPacketInject other(path), std::runtime_error);
+  // a new client can attach once the first one goes away
+  client.reset();
+  client.reset(new bm_apps::ShmPacketInject(path));
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::string received;
+  sw.set_packet_handler(
+      [&mutex, &cv, &received](int port_num, const char *buffer, int len,
+                               void *cookie) {
+        (void) port_num; (void) cookie;
+        std::unique_lock<std::mutex> lock(mutex);
+        received.assign(buffer, len);
+        cv.notify_one();
+      }, nullptr);
+  const std::string pkt(64, 'a');
+  ASSERT_TRUE(client->send(1, pkt.data(), static_cast<int>(pkt.size())));
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait_for(lock, std::chrono::seconds(2),
+              [&received]() { return !received.empty(); });
+  ASSERT_EQ(pkt, received);
+}
+
+// connects to the switch like ShmPacketInject, but writes records of its own
+// to the to_switch ring
+class RawShmClient {
+ public:
+  explicit RawShmClient(const std::string &path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(sock >= 0);
+    bool success = connect(sock, reinterpret_cast<struct sockaddr *>(&addr),
+                           sizeof(addr)) == 0 && shm::recv_fds(sock, fds);
+    assert(success);
+    (void) success;
+    region = static_cast<char *>(mmap(
+        nullptr, shm::Region::size(), PROT_READ | PROT_WRITE, MAP_SHARED,
+        fds[shm::FD_REGION], 0));
+    assert(region != MAP_FAILED);
+    to_switch = shm::Region::to_switch(region);
+    to_switch.attach();
+  }
+
+  ~RawShmClient() {
+    munmap(region, shm::Region::size());
+    for (const int fd : fds) close(fd);
+    close(sock);
+  }
+
+  // pushes a packet record, whose header is then modified by patch_fn
+  template <typename F>
+  void send(const std::string &pkt, F patch_fn) {
+    auto *ctl = reinterpret_cast<shm::RingCtl *>(
+        region + sizeof(shm::Region::Header));
+    char *record = region + sizeof(shm::Region::Header) +
+        sizeof(shm::RingCtl) + (ctl->tail & (shm::Region::ring_capacity - 1));
+    struct iovec iov = {const_cast<char *>(pkt.data()), pkt.size()};
+    bool success = to_switch.push(shm::MSG_TYPE_PACKET_IN, 1,
+                                  static_cast<int32_t>(pkt.size()), &iov, 1);
+    assert(success);
+    shm::MsgHdr hdr;
+    std::memcpy(&hdr, record, sizeof(hdr));
+    patch_fn(&hdr);
+    std::memcpy(record, &hdr, sizeof(hdr));
+    to_switch.flush();
+    uint64_t one = 1;
+    success = write(fds[shm::FD_TO_SWITCH_DOORBELL], &one, sizeof(one)) ==
+        sizeof(one);
+    assert(success);
+    (void) success;
+  }
+
+  // true if the switch closes the connection within 2 seconds
+  bool detached() const {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    char byte;
+    return poll(&pfd, 1, 2000) == 1 && recv(sock, &byte, 1, 0) == 0;
+  }
+
+ private:
+  int sock{-1};
+  int fds[shm::FD_COUNT] = {-1, -1, -1};
+  char *region{nullptr};
+  shm::Ring to_switch{};
+};
+
+// a client which writes invalid records is detached, the next one can use the
+// ring again
+TEST(ShmDevMgrTest, InvalidRecord) {
+  const std::string path = "/tmp/bm_shm_test_" + std::to_string(getpid());
+  ShmSwitch sw;
+  sw.set_dev_mgr_shm(0, path);
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> received;
+  sw.set_packet_handler(
+      [&mutex, &cv, &received](int port_num, const char *buffer, int len,
+                               void *cookie) {
+        (void) port_num; (void) cookie;
+        std::unique_lock<std::mutex> lock(mutex);
+        received.emplace_back(buffer, len);
+        cv.notify_one();
+      }, nullptr);
+  sw.start();
+
+  const std::string pkt(64, 'a');
+  std::vector<std::function<void(shm::MsgHdr *)> > patches = {
+    [](shm::MsgHdr *hdr) { hdr->size = 0; },
+    [](shm::MsgHdr *hdr) { hdr->size += 1; },
+    [](shm::MsgHdr *hdr) { hdr->size += shm::record_align; },
+    [](shm::MsgHdr *hdr) { hdr->size = shm::Region::ring_capacity; },
+    [](shm::MsgHdr *hdr) { hdr->more = hdr->size; },
+    [](shm::MsgHdr *hdr) { hdr->more = -1; }};
+  for (const auto &patch : patches) {
+    RawShmClient client(path);
+    client.send(pkt, patch);
+    ASSERT_TRUE(client.detached());
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    ASSERT_TRUE(received.empty());
+  }
+
+  bm_apps::ShmPacketInject client(path);
+  ASSERT_TRUE(client.send(1, pkt.data(), static_cast<int>(pkt.size())));
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait_for(lock, std::chrono::seconds(2),
+              [&received]() { return !received.empty(); });
+  ASSERT_EQ(std::vector<std::string>({pkt}), received);
+}
+
+TEST(ShmDevMgrTest, PathInUse) {
+  const std::string path = "/tmp/bm_shm_test_" + std::to_string(getpid());
+  auto count_fds = []() {
+    return std::distance(boost::filesystem::directory_iterator("/proc/self/fd"),
+                         boost::filesystem::directory_iterator());
+  };
+  // not a socket, so it must not be removed
+  { std::ofstream fs(path); fs << "data"; }
+  const auto nb_fds = count_fds();
+  ShmSwitch sw;
+  ASSERT_THROW(sw.set_dev_mgr_shm(0, path), std::runtime_error);
+  // nothing leaked
+  ASSERT_EQ(nb_fds, count_fds());
+  std::ifstream fs(path);
+  std::string content;
+  fs >> content;
+  ASSERT_EQ("data", content);
+  fs.close();
+  unlink(path.c_str());
+}
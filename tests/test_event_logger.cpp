@@ -0,0 +1,200 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <fstream>
+#include <chrono>
+#include <iterator>
+
+#include <cstring>
+#include <cstdio>
+
+#include "bm_sim/event_logger.h"
+
+using namespace bm;
+
+namespace {
+
+// offsets in the packed messages sent by the event logger
+constexpr size_t msg_hdr_size = 36;
+constexpr size_t msg_type_offset = 0;
+constexpr size_t msg_packet_id_offset = 20;
+
+class TransportCapture : public TransportIface {
+ public:
+  size_t size() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return msgs.size();
+  }
+
+  std::vector<std::string> get_msgs() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return msgs;
+  }
+
+ private:
+  int open_() override { return 0; }
+
+  int send_(const std::string &msg) const override {
+    std::unique_lock<std::mutex> lock(mutex);
+    msgs.push_back(msg);
+    return 0;
+  }
+
+  int send_(const char *msg, int len) const override {
+    return send_(std::string(msg, len));
+  }
+
+  int send_msgs_(const std::initializer_list<std::string> &msgs)
+      const override {
+    for (const auto &msg : msgs) send_(msg);
+    return 0;
+  }
+
+  int send_msgs_(const std::initializer_list<MsgBuf> &msgs) const override {
+    for (const auto &msg : msgs) send_(msg.buf, msg.len);
+    return 0;
+  }
+
+  mutable std::vector<std::string> msgs{};
+  mutable std::mutex mutex{};
+};
+
+template <typename T>
+T extract(const std::string &msg, size_t offset) {
+  T v;
+  std::memcpy(&v, msg.data() + offset, sizeof(v));
+  return v;
+}
+
+}  // namespace
+
+class EventLoggerTest : public ::testing::Test {
+ protected:
+  PHVFactory phv_factory;
+  std::unique_ptr<PHVSourceIface> phv_source{nullptr};
+
+  EventLoggerTest()
+      : phv_source(PHVSourceIface::make_phv_source()) { }
+
+  virtual void SetUp() {
+    phv_source->set_phv_factory(0, &phv_factory);
+  }
+
+  Packet get_pkt(packet_id_t id) {
+    return Packet::make_new(0, 0, id, 0, 128, PacketBuffer(256),
+                            phv_source.get());
+  }
+};
+
+TEST_F(EventLoggerTest, Sync) {
+  TransportCapture *transport = new TransportCapture();
+  EventLogger logger((std::unique_ptr<TransportIface>(transport)));
+  ASSERT_FALSE(logger.is_async());
+  Packet pkt = get_pkt(7);
+  logger.packet_in(pkt);
+  logger.parser_extract(pkt, 3);
+  auto msgs = transport->get_msgs();
+  ASSERT_EQ(2u, msgs.size());
+  ASSERT_EQ(0, extract<int>(msgs[0], msg_type_offset));  // PACKET_IN
+  ASSERT_EQ(7u, extract<uint64_t>(msgs[0], msg_packet_id_offset));
+  ASSERT_EQ(3, extract<int>(msgs[1], msg_hdr_size));
+}
+
+TEST_F(EventLoggerTest, AsyncOrdering) {
+  TransportCapture *transport = new TransportCapture();
+  EventLogger logger((std::unique_ptr<TransportIface>(transport)));
+  // small rings, so that some messages get dropped
+  logger.start_async(64);
+  ASSERT_TRUE(logger.is_async());
+
+  const int num_threads = 4;
+  const int num_events = 20000;
+  auto producer = [this, &logger, num_events](packet_id_t id) {
+    Packet pkt = get_pkt(id);
+    for (int i = 0; i < num_events; i++) logger.parser_extract(pkt, i);
+  };
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) threads.emplace_back(producer, t);
+  for (auto &t : threads) t.join();
+  logger.stop_async();
+  ASSERT_FALSE(logger.is_async());
+
+  auto msgs = transport->get_msgs();
+  ASSERT_EQ(logger.get_published_events(), msgs.size());
+  ASSERT_EQ(static_cast<uint64_t>(num_threads * num_events),
+            logger.get_published_events() + logger.get_dropped_events());
+
+  // messages from a given thread are published in order
+  std::vector<int> last(num_threads, -1);
+  for (const auto &msg : msgs) {
+    auto id = extract<uint64_t>(msg, msg_packet_id_offset);
+    ASSERT_LT(id, static_cast<uint64_t>(num_threads));
+    int header = extract<int>(msg, msg_hdr_size);
+    ASSERT_GT(header, last[id]);
+    last[id] = header;
+  }
+
+  // back to synchronous mode
+  size_t count = transport->size();
+  logger.packet_in(get_pkt(0));
+  ASSERT_EQ(count + 1, transport->size());
+}
+
+TEST_F(EventLoggerTest, FileTransport) {
+  const std::string path("event_logger_trace.bin");
+  const int num_events = 1000;
+  {
+    auto transport = TransportIface::make_file(path);
+    ASSERT_EQ(0, transport->open());
+    EventLogger logger(std::move(transport));
+    logger.start_async();
+    Packet pkt = get_pkt(1);
+    for (int i = 0; i < num_events; i++) {
+      logger.packet_in(pkt);
+      // let the background thread catch up, we do not want drops
+      if (i % 256 == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    logger.stop_async();
+    ASSERT_EQ(0u, logger.get_dropped_events());
+  }
+
+  std::ifstream fs(path, std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(fs)),
+                   std::istreambuf_iterator<char>());
+  std::remove(path.c_str());
+
+  const size_t msg_size = msg_hdr_size + sizeof(int);
+  ASSERT_EQ(8u + num_events * (sizeof(uint32_t) + msg_size), data.size());
+  size_t offset = 8;
+  for (int i = 0; i < num_events; i++) {
+    ASSERT_EQ(msg_size, extract<uint32_t>(data, offset));
+    offset += sizeof(uint32_t);
+    ASSERT_EQ(1u, extract<uint64_t>(data, offset + msg_packet_id_offset));
+    offset += msg_size;
+  }
+}
@@ -26,6 +26,8 @@
 #include <thread>
 #include <condition_variable>
 #include <chrono>
+#include <set>
+#include <vector>
 
 #include <cassert>
 
@@ -547,3 +549,50 @@ TEST_F(LearningTest, OneSampleCbMode) {
   ASSERT_EQ((char) 0xa, data[0]);
   ASSERT_EQ((char) 0xba, data[1]);
 }
+
+TEST_F(LearningTest, MultipleThreads) {
+  LearnEngine::list_id_t list_id = 1;
+  const size_t max_samples = 64; unsigned timeout_ms = 0;
+  const int num_threads = 4;
+  learn_on_test1_f16(list_id, max_samples, timeout_ms);
+
+  // every thread learns the same samples, each one should only be sent once
+  auto do_learn = [this, list_id, max_samples](Packet *pkt) {
+    Field &f = pkt->get_phv()->get_field(testHeader1, 0);
+    for (int i = 0; i < 10; i++) {
+      for (size_t c = 0; c < max_samples; c++) {
+        f.set(static_cast<unsigned int>(c));
+        learn_engine.learn(list_id, *pkt);
+      }
+    }
+  };
+
+  std::vector<Packet> pkts;
+  for (int i = 0; i < num_threads; i++) pkts.push_back(get_pkt());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++)
+    threads.emplace_back(do_learn, &pkts[i]);
+  for (auto &t : threads) t.join();
+
+  learn_writer->read(buffer, sizeof(buffer));
+  LearnEngine::msg_hdr_t *msg_hdr = (LearnEngine::msg_hdr_t *) buffer;
+  const char *data = buffer + sizeof(LearnEngine::msg_hdr_t);
+  ASSERT_EQ(0u, msg_hdr->buffer_id);
+  ASSERT_EQ(max_samples, msg_hdr->num_samples);
+  std::set<int> samples;
+  for (size_t i = 0; i < max_samples; i++) {
+    samples.insert((static_cast<unsigned char>(data[2 * i]) << 8) |
+                   static_cast<unsigned char>(data[2 * i + 1]));
+  }
+  ASSERT_EQ(max_samples, samples.size());
+
+  sleep_for(milliseconds(100));
+  ASSERT_NE(MemoryAccessor::Status::CAN_READ, learn_writer->check_status());
+
+  // after an ack, samples can be learned again
+  ASSERT_EQ(LearnEngine::SUCCESS, learn_engine.ack_buffer(list_id, 0));
+  do_learn(&pkts[0]);
+  learn_writer->read(buffer, sizeof(buffer));
+  ASSERT_EQ(1u, msg_hdr->buffer_id);
+  ASSERT_EQ(max_samples, msg_hdr->num_samples);
+}
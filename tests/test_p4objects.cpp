@@ -22,6 +22,8 @@
 
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "bm_sim/P4Objects.h"
 
@@ -117,6 +119,75 @@ TEST(P4Objects, Empty) {
   ASSERT_EQ(0, objects.init_objects(&is, &factory));
 }
 
+namespace {
+
+void check_stateful_arrays(P4Objects *objects) {
+  CounterArray *c = objects->get_counter_array("c1");
+  ASSERT_EQ(0, c->get_id());
+  ASSERT_EQ(16u, c->size());
+  // direct counters are created with the table
+  ASSERT_THROW(objects->get_counter_array("c_direct"), std::out_of_range);
+  MeterArray *m = objects->get_meter_array("m1");
+  ASSERT_EQ(0, m->get_id());
+  ASSERT_EQ(8u, m->size());
+  RegisterArray *r1 = objects->get_register_array("r1");
+  ASSERT_EQ(0, r1->get_id());
+  ASSERT_EQ(32u, r1->size());
+  ASSERT_EQ(16, r1->get_bitwidth());
+  RegisterArray *r2 = objects->get_register_array("r2");
+  ASSERT_EQ(1, r2->get_id());
+  ASSERT_EQ(4u, r2->size());
+  ASSERT_EQ(8, r2->get_bitwidth());
+}
+
+const char *JSON_STATEFUL_ARRAYS = "{\"counter_arrays\":[{\"name\":\"c1\",\"id\":0,\"size\":16},{\"name\":\"c_direct\",\"id\":1,\"size\":16,\"is_direct\":true}],\"meter_arrays\":[{\"name\":\"m1\",\"id\":0,\"type\":\"packets\",\"rate_count\":2,\"size\":8}],\"register_arrays\":[{\"name\":\"r1\",\"id\":0,\"size\":32,\"bitwidth\":16},{\"name\":\"r2\",\"id\":1,\"size\":4,\"bitwidth\":8}]}";
+
+}  // namespace
+
+TEST(P4Objects, StatefulArrays) {
+  std::istringstream is(JSON_STATEFUL_ARRAYS);
+  P4Objects objects;
+  LookupStructureFactory factory;
+  ASSERT_EQ(0, objects.init_objects(&is, &factory));
+  check_stateful_arrays(&objects);
+}
+
+TEST(P4Objects, SharedParsedConfig) {
+  Json::Value cfg_root;
+  {
+    std::istringstream is(JSON_TEST_STRING_2);
+    is >> cfg_root;
+  }
+  std::istringstream is(JSON_STATEFUL_ARRAYS);
+  Json::Value cfg_stateful;
+  is >> cfg_stateful;
+  for (const auto &member : cfg_stateful.getMemberNames())
+    cfg_root[member] = cfg_stateful[member];
+  const Json::Value &cfg_root_ = cfg_root;
+
+  // several instances built concurrently from the same parsed JSON
+  const size_t nb_objects = 4;
+  std::vector<std::unique_ptr<P4Objects> > objects;
+  std::vector<int> status(nb_objects, -1);
+  std::vector<std::thread> threads;
+  LookupStructureFactory factory;
+  for (size_t i = 0; i < nb_objects; i++)
+    objects.emplace_back(new P4Objects());
+  for (size_t i = 0; i < nb_objects; i++) {
+    threads.emplace_back([&objects, &status, &factory, &cfg_root_, i]() {
+      status[i] = objects[i]->init_objects(cfg_root_, &factory, 0, i);
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  for (size_t i = 0; i < nb_objects; i++) {
+    ASSERT_EQ(0, status[i]);
+    ASSERT_NE(nullptr, objects[i]->get_match_action_table("ExactOne"));
+    ASSERT_NE(nullptr, objects[i]->get_learn_engine());
+    check_stateful_arrays(objects[i].get());
+  }
+}
+
 TEST(P4Objects, UnknownPrimitive) {
   std::istringstream is("{\"actions\":[{\"name\":\"_drop\",\"id\":2,\"runtime_data\":[],\"primitives\":[{\"op\":\"bad_primitive\",\"parameters\":[]}]}]}");
   std::stringstream os;
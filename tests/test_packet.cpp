@@ -53,7 +53,9 @@ class PHVSourceTest : public PHVSourceIface {
   }
 
  private:
-  std::unique_ptr<PHV> get_(size_t cxt) override {
+  std::unique_ptr<PHV> get_(size_t cxt,
+                            std::shared_ptr<P4Objects> *config) override {
+    (void) config;
     assert(phv_factories[cxt]);
     ++count;
     ++created.at(cxt);
@@ -67,7 +69,9 @@ class PHVSourceTest : public PHVSourceIface {
     ++destroyed.at(cxt);
   }
 
-  void set_phv_factory_(size_t cxt, const PHVFactory *factory) override {
+  void set_phv_factory_(size_t cxt, const PHVFactory *factory,
+                        std::shared_ptr<P4Objects> config) override {
+    (void) config;
     phv_factories.at(cxt) = factory;
   }
 
@@ -20,6 +20,14 @@
 #include "bm_sim/pcap_file.h"
 #include <stdio.h>
 
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
 using namespace bm;
 
 namespace fs = boost::filesystem;
@@ -226,8 +234,279 @@ TEST_F(PcapTest, Write) {
 
   reader.start();
   setReceiver(nullptr);
+  writer.flush();
 
   PcapFileComparator comparator(false);
   Status comparison = comparator.compare(getFile1(), getTmpFile());
   ASSERT_EQ(Status::OK, comparison);
 }
+
+TEST_F(PcapTest, FastReplay) {
+  PcapFilesReader reader1(false, 0);
+  reader1.setFastReplay(1);
+  reader1.addFile(0, getFile1());
+  reader1.addFile(1, getFile2());
+  reader1.set_packet_handler(packet_handler, (void*)this);
+  reader1.start();
+  int onePass = received;
+  received = 0;
+  // 27 packets in en0.pcap and 16 in lo0.pcap
+  ASSERT_EQ(43, onePass);
+
+  PcapFilesReader reader3(false, 0);
+  reader3.setFastReplay(3);
+  reader3.addFile(0, getFile1());
+  reader3.addFile(1, getFile2());
+  reader3.set_packet_handler(packet_handler, (void*)this);
+  reader3.start();
+  ASSERT_EQ(3 * onePass, received);
+}
+
+// the packets must be the same, and in the same order, as with libpcap
+TEST_F(PcapTest, FastReplaySameOrder) {
+  std::vector<std::pair<int, std::string> > expected;
+  std::vector<std::pair<int, std::string> > actual;
+  auto record = [](int port_num, const char *buffer, int len, void *cookie) {
+    static_cast<std::vector<std::pair<int, std::string> > *>(cookie)
+        ->emplace_back(port_num, std::string(buffer, len));
+  };
+
+  PcapFilesReader reader(false, 0);
+  reader.addFile(0, getFile1());
+  reader.addFile(1, getFile2());
+  reader.set_packet_handler(record, &expected);
+  reader.start();
+
+  PcapFilesReader fastReader(false, 0);
+  fastReader.setFastReplay(1);
+  fastReader.addFile(0, getFile1());
+  fastReader.addFile(1, getFile2());
+  fastReader.set_packet_handler(record, &actual);
+  fastReader.start();
+
+  ASSERT_EQ(expected, actual);
+}
+
+TEST_F(PcapTest, FastReplayRate) {
+  // 43 packets * 10 loops at 4000 pps should take at least ~100ms
+  PcapFilesReader reader(false, 0);
+  reader.setFastReplay(10, 4000);
+  reader.addFile(0, getFile1());
+  reader.addFile(1, getFile2());
+  reader.set_packet_handler(packet_handler, (void*)this);
+  auto start = std::chrono::steady_clock::now();
+  reader.start();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_EQ(430, received);
+  ASSERT_GE(elapsed, std::chrono::milliseconds(90));
+}
+
+namespace {
+
+std::vector<std::string> readCapture(const std::string &filename) {
+  std::vector<std::string> packets;
+  PcapFileMmap file(0, filename);
+  for (const auto &record : file.getRecords())
+    packets.emplace_back(record.data, record.length);
+  return packets;
+}
+
+}  // namespace
+
+namespace {
+
+// minimal pcapng writer, for the tests of PcapFileMmap
+class PcapngBuilder {
+ public:
+  PcapngBuilder() {
+    // section header block, with an unspecified section length
+    block(0x0A0D0D0A, {0x1A2B3C4D, 0x00000001, 0xffffffff, 0xffffffff});
+  }
+
+  // tsresol is the raw value of the if_tsresol option
+  PcapngBuilder &interface(uint8_t tsresol) {
+    // linktype (Ethernet) and snaplen, then if_tsresol and opt_endofopt
+    block(0x00000001, {0x00000001, 0x00000000, 9u | (1u << 16), tsresol, 0});
+    return *this;
+  }
+
+  PcapngBuilder &packet(uint32_t if_id, uint64_t ts, const std::string &data,
+                        uint32_t caplen) {
+    std::vector<uint32_t> body = {if_id, static_cast<uint32_t>(ts >> 32),
+                                  static_cast<uint32_t>(ts), caplen,
+                                  static_cast<uint32_t>(data.size())};
+    std::string padded(data);
+    padded.resize((data.size() + 3) & ~3u, '\0');
+    for (size_t i = 0; i < padded.size(); i += 4) {
+      uint32_t w;
+      std::memcpy(&w, padded.data() + i, 4);
+      body.push_back(w);
+    }
+    block(0x00000006, body);
+    return *this;
+  }
+
+  PcapngBuilder &packet(uint32_t if_id, uint64_t ts, const std::string &data) {
+    return packet(if_id, ts, data, static_cast<uint32_t>(data.size()));
+  }
+
+  void write(const std::string &path) const {
+    std::ofstream fs(path, std::ios::out | std::ios::binary);
+    fs.write(reinterpret_cast<const char *>(words.data()), words.size() * 4);
+  }
+
+ private:
+  void block(uint32_t type, const std::vector<uint32_t> &body) {
+    const uint32_t len = 12 + body.size() * 4;
+    words.push_back(type);
+    words.push_back(len);
+    words.insert(words.end(), body.begin(), body.end());
+    words.push_back(len);
+  }
+
+  std::vector<uint32_t> words;
+};
+
+}  // namespace
+
+TEST_F(PcapTest, MmapPcapng) {
+  PcapngBuilder()
+      .interface(9)  // nanoseconds
+      .interface(0x80 | 40)  // 2^-40 seconds
+      .packet(0, 1234567890123ull, "abcde")
+      .packet(1, (5ull << 40) | (1ull << 39), "fghi")
+      .write(getTmpFile());
+
+  PcapFileMmap file(0, getTmpFile());
+  const auto &records = file.getRecords();
+  ASSERT_EQ(2u, records.size());
+  ASSERT_EQ(1234567890123ull, records[0].ts_ns);
+  ASSERT_EQ("abcde", std::string(records[0].data, records[0].length));
+  ASSERT_EQ(5500000000ull, records[1].ts_ns);
+  ASSERT_EQ("fghi", std::string(records[1].data, records[1].length));
+}
+
+TEST_F(PcapTest, MmapPcapngInvalid) {
+  // a huge caplen must not wrap around in the bounds check
+  PcapngBuilder().interface(9).packet(0, 0, "abcd", 0xfffffff0u)
+      .write(getTmpFile());
+  ASSERT_EXIT(PcapFileMmap(0, getTmpFile()), ::testing::ExitedWithCode(1),
+              "Invalid packet block");
+
+  // the timestamp units would not fit in 64 bits
+  for (uint8_t tsresol : {static_cast<uint8_t>(0x80 | 64),
+                          static_cast<uint8_t>(20)}) {
+    PcapngBuilder().interface(tsresol).packet(0, 0, "abcd")
+        .write(getTmpFile());
+    ASSERT_EXIT(PcapFileMmap(0, getTmpFile()), ::testing::ExitedWithCode(1),
+                "Unsupported timestamp resolution");
+  }
+}
+
+TEST_F(PcapTest, Capture) {
+  std::vector<std::string> expected;
+  {
+    PcapCaptureConfig config;
+    config.snaplen = 64;
+    PcapCapture capture(getTmpFile(), config);
+    for (int i = 0; i < 100; i++) {
+      std::string pkt(20 + i, static_cast<char>(i));
+      if (i % 2 == 0) {
+        ASSERT_TRUE(capture.capture(pkt.data(), pkt.size()));
+      } else {
+        // in 2 segments
+        struct iovec iov[2] = {{&pkt[0], 10}, {&pkt[10], pkt.size() - 10}};
+        ASSERT_TRUE(capture.capture(iov, 2));
+      }
+      expected.push_back(pkt.substr(0, 64));
+    }
+    capture.flush();
+    ASSERT_EQ(expected, readCapture(getTmpFile()));
+    auto stats = capture.get_stats();
+    ASSERT_EQ(100u, stats.captured);
+    ASSERT_EQ(0u, stats.dropped);
+    ASSERT_EQ(1u, stats.files);
+  }
+  // the destructor writes everything as well
+  ASSERT_EQ(expected, readCapture(getTmpFile()));
+}
+
+TEST_F(PcapTest, CaptureRotate) {
+  const std::string rotated1("tmp.1.pcap");
+  const std::string rotated2("tmp.2.pcap");
+  {
+    PcapCaptureConfig config;
+    // global header (24 bytes) + 10 packets of 100 bytes (+ 16 bytes headers)
+    config.rotate_bytes = 24 + 10 * 116;
+    PcapCapture capture(getTmpFile(), config);
+    const std::string pkt(100, 'a');
+    for (int i = 0; i < 25; i++)
+      capture.capture(pkt.data(), pkt.size());
+    capture.flush();
+    ASSERT_EQ(3u, capture.get_stats().files);
+  }
+  ASSERT_EQ(10u, readCapture(getTmpFile()).size());
+  ASSERT_EQ(10u, readCapture(rotated1).size());
+  ASSERT_EQ(5u, readCapture(rotated2).size());
+  remove(rotated1.c_str());
+  remove(rotated2.c_str());
+}
+
+// e.g. the receive and transmit directions of a port captured to the same
+// file
+TEST_F(PcapTest, CaptureConcurrent) {
+  const int num_threads = 4;
+  const int n = 2000;
+  {
+    PcapCaptureConfig config;
+    config.queue_bytes = 1 << 24;
+    PcapCapture capture(getTmpFile(), config);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&capture, t, n]() {
+        for (int i = 0; i < n; i++) {
+          const std::string pkt =
+              std::to_string(t) + ":" + std::to_string(i) +
+              std::string(64 + i % 64, static_cast<char>('a' + t));
+          capture.capture(pkt.data(), pkt.size());
+        }
+      });
+    }
+    for (auto &thread : threads) thread.join();
+    capture.flush();
+    const auto stats = capture.get_stats();
+    ASSERT_EQ(static_cast<uint64_t>(num_threads * n), stats.captured);
+    ASSERT_EQ(0u, stats.dropped);
+  }
+
+  // every packet is intact, and the packets of each thread are in order
+  std::vector<int> next(num_threads, 0);
+  const auto packets = readCapture(getTmpFile());
+  ASSERT_EQ(static_cast<size_t>(num_threads * n), packets.size());
+  for (const auto &pkt : packets) {
+    const int t = pkt[0] - '0';
+    ASSERT_LE(0, t);
+    ASSERT_GT(num_threads, t);
+    const int i = next[t]++;
+    ASSERT_EQ(std::to_string(t) + ":" + std::to_string(i) +
+              std::string(64 + i % 64, static_cast<char>('a' + t)), pkt);
+  }
+}
+
+// with a small queue, packets may be dropped from the capture, but all the
+// packets which were accepted end up in the file
+TEST_F(PcapTest, CaptureDrops) {
+  const int n = 5000;
+  PcapCapture::Stats stats;
+  {
+    PcapCaptureConfig config;
+    config.queue_bytes = 1 << 16;
+    PcapCapture capture(getTmpFile(), config);
+    const std::string pkt(1500, 'a');
+    for (int i = 0; i < n; i++)
+      capture.capture(pkt.data(), pkt.size());
+    stats = capture.get_stats();
+  }
+  ASSERT_EQ(static_cast<uint64_t>(n), stats.captured + stats.dropped);
+  ASSERT_EQ(stats.captured, readCapture(getTmpFile()).size());
+}
@@ -0,0 +1,474 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bm_sim/pipeline.h"
+#include "bm_sim/conditionals.h"
+#include "bm_sim/tables.h"
+#include "bm_sim/lookup_structures.h"
+#include "bm_sim/actions.h"
+
+using namespace bm;
+
+namespace {
+
+// a control flow node which is neither a table nor a condition
+class CountingNode : public ControlFlowNode {
+ public:
+  const ControlFlowNode *operator()(Packet *pkt) const override {
+    count++;
+    if (clock) visited_at = (*clock)++;
+    if (exit) pkt->mark_for_exit();
+    return next;
+  }
+
+  const ControlFlowNode *next{nullptr};
+  bool exit{false};
+  mutable int count{0};
+  // if not nullptr, used to record when the node was last visited
+  int *clock{nullptr};
+  mutable int visited_at{-1};
+};
+
+LookupStructureFactory lookup_factory;
+
+class PipelineSetField : public ActionPrimitive<Field &, const Data &> {
+  void operator ()(Field &f, const Data &d) {
+    f.set(d);
+  }
+};
+
+}  // namespace
+
+// table (exact match on test1.f16):
+//   hit -> node_hit
+//   miss -> condition (test1.f48 == 7)
+//     true -> node_true
+//     false -> end of pipeline
+class PipelineTest : public ::testing::Test {
+ protected:
+  PHVFactory phv_factory;
+  HeaderType testHeaderType;
+  header_id_t testHeader1{0};
+  ActionFn action_fn;
+  MatchKeyBuilder key_builder;
+  std::unique_ptr<MatchActionTable> table{nullptr};
+  Conditional condition;
+  CountingNode node_hit{};
+  CountingNode node_true{};
+  std::unique_ptr<PHVSourceIface> phv_source{nullptr};
+
+  PipelineTest()
+      : testHeaderType("test_t", 0), action_fn("actionA", 0),
+        condition("condition", 0),
+        phv_source(PHVSourceIface::make_phv_source()) {
+    testHeaderType.push_back_field("f16", 16);
+    testHeaderType.push_back_field("f48", 48);
+    phv_factory.push_back_header("test1", testHeader1, testHeaderType);
+
+    key_builder.push_back_field(testHeader1, 0, 16,
+                                MatchKeyParam::Type::EXACT);
+    std::unique_ptr<MatchUnitExact<MatchTable::ActionEntry> > match_unit(
+        new MatchUnitExact<MatchTable::ActionEntry>(16, key_builder,
+                                                    &lookup_factory));
+    std::unique_ptr<MatchTable> match_table(
+        new MatchTable("test_table", 0, std::move(match_unit)));
+    match_table->set_next_node(0, &node_hit);
+    match_table->set_next_node_miss_default(&condition);
+    table = std::unique_ptr<MatchActionTable>(
+        new MatchActionTable("test_table", 0, std::move(match_table)));
+
+    condition.push_back_load_field(testHeader1, 1, 48);
+    condition.push_back_load_const(Data(7));
+    condition.push_back_op(ExprOpcode::EQ_DATA);
+    condition.build();
+    condition.set_next_node_if_true(&node_true);
+  }
+
+  virtual void SetUp() {
+    phv_source->set_phv_factory(0, &phv_factory);
+    entry_handle_t handle;
+    auto match_table = static_cast<MatchTable *>(table->get_match_table());
+    ASSERT_EQ(MatchErrorCode::SUCCESS, match_table->add_entry(
+        {MatchKeyParam(MatchKeyParam::Type::EXACT, std::string("\x00\x01", 2))},
+        &action_fn, ActionData(), &handle));
+  }
+
+  std::unique_ptr<Packet> get_pkt(unsigned int f16, unsigned int f48) {
+    std::unique_ptr<Packet> pkt(new Packet(
+        Packet::make_new(phv_source.get())));
+    PHV *phv = pkt->get_phv();
+    phv->get_header(testHeader1).mark_valid();
+    phv->get_field(testHeader1, 0).set(f16);
+    phv->get_field(testHeader1, 1).set(f48);
+    return pkt;
+  }
+};
+
+TEST_F(PipelineTest, Branches) {
+  Pipeline pipeline("pipeline", 0, table.get());
+
+  auto pkt = get_pkt(1, 7);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(1, node_hit.count);
+  ASSERT_EQ(0, node_true.count);
+
+  pkt = get_pkt(2, 7);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(1, node_hit.count);
+  ASSERT_EQ(1, node_true.count);
+
+  pkt = get_pkt(2, 8);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(1, node_hit.count);
+  ASSERT_EQ(1, node_true.count);
+}
+
+TEST_F(PipelineTest, Exit) {
+  node_hit.next = &node_true;
+  node_hit.exit = true;
+  Pipeline pipeline("pipeline", 0, table.get());
+
+  auto pkt = get_pkt(1, 7);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(1, node_hit.count);
+  ASSERT_EQ(0, node_true.count);
+}
+
+// the successors of a generic node are not known when the pipeline is built,
+// which means they may not be in the flattened program
+TEST_F(PipelineTest, GenericSuccessor) {
+  Pipeline pipeline("pipeline", 0, table.get());
+  CountingNode node_other;
+  node_hit.next = &node_other;
+
+  auto pkt = get_pkt(1, 7);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(1, node_hit.count);
+  ASSERT_EQ(1, node_other.count);
+}
+
+TEST_F(PipelineTest, Batch) {
+  Pipeline pipeline("pipeline", 0, table.get());
+
+  // hit, miss + true, miss + false, hit
+  std::vector<std::unique_ptr<Packet> > pkts;
+  pkts.push_back(get_pkt(1, 7));
+  pkts.push_back(get_pkt(2, 7));
+  pkts.push_back(get_pkt(2, 8));
+  pkts.push_back(get_pkt(1, 8));
+  std::vector<Packet *> batch;
+  for (auto &pkt : pkts) batch.push_back(pkt.get());
+  pipeline.apply_batch(batch.data(), batch.size());
+  ASSERT_EQ(2, node_hit.count);
+  ASSERT_EQ(1, node_true.count);
+}
+
+// packets have to go through a stateful pipeline one by one, in order
+TEST_F(PipelineTest, BatchStateful) {
+  int clock = 0;
+  node_hit.clock = &clock;
+  node_true.clock = &clock;
+  // in a batch, the condition and node_true are visited before node_hit
+  table->get_match_table()->set_stateful_actions();
+  Pipeline pipeline("pipeline", 0, table.get());
+
+  auto pkt_1 = get_pkt(1, 8);
+  auto pkt_2 = get_pkt(2, 7);
+  Packet *batch[] = {pkt_1.get(), pkt_2.get()};
+  pipeline.apply_batch(batch, 2);
+  ASSERT_EQ(0, node_hit.visited_at);
+  ASSERT_EQ(1, node_true.visited_at);
+}
+
+TEST_F(PipelineTest, BatchExit) {
+  node_hit.next = &node_true;
+  node_hit.exit = true;
+  CountingNode node_other;
+  condition.set_next_node_if_true(&node_other);
+  Pipeline pipeline("pipeline", 0, table.get());
+
+  auto pkt_1 = get_pkt(1, 7);
+  auto pkt_2 = get_pkt(2, 7);
+  // a packet which is marked for exit before entering the pipeline
+  auto pkt_3 = get_pkt(2, 7);
+  pkt_3->mark_for_exit();
+  Packet *batch[] = {pkt_1.get(), pkt_2.get(), pkt_3.get()};
+  pipeline.apply_batch(batch, 3);
+  ASSERT_EQ(1, node_hit.count);
+  ASSERT_EQ(0, node_true.count);
+  ASSERT_EQ(1, node_other.count);
+}
+
+// table1 (exact match on test1.f16) -> condition (test1.f48 == 7)
+//   true -> table2 (exact match on test1.f8)
+//   false -> end of pipeline
+// table1 entry (f16 == 1): test1.f8 = test1.f32
+// table2 entry (f8 == 3): test1.f48 = 100
+class DecisionCacheTest : public ::testing::Test {
+ protected:
+  PHVFactory phv_factory;
+  HeaderType testHeaderType;
+  header_id_t testHeader1{0};
+  PipelineSetField primitive;
+  ActionFn action_fn_1, action_fn_2;
+  MatchKeyBuilder key_builder_1, key_builder_2;
+  std::unique_ptr<MatchActionTable> table_1{nullptr}, table_2{nullptr};
+  Conditional condition;
+  entry_handle_t handle_1{}, handle_2{};
+  std::unique_ptr<PHVSourceIface> phv_source{nullptr};
+
+  DecisionCacheTest()
+      : testHeaderType("test_t", 0), action_fn_1("actionA", 0),
+        action_fn_2("actionB", 1), condition("condition", 0),
+        phv_source(PHVSourceIface::make_phv_source()) {
+    testHeaderType.push_back_field("f16", 16);
+    testHeaderType.push_back_field("f48", 48);
+    testHeaderType.push_back_field("f32", 32);
+    testHeaderType.push_back_field("f8", 8);
+    phv_factory.push_back_header("test1", testHeader1, testHeaderType);
+
+    action_fn_1.push_back_primitive(&primitive);
+    action_fn_1.parameter_push_back_field(testHeader1, 3);
+    action_fn_1.parameter_push_back_field(testHeader1, 2);
+    action_fn_2.push_back_primitive(&primitive);
+    action_fn_2.parameter_push_back_field(testHeader1, 1);
+    action_fn_2.parameter_push_back_const(Data(100));
+
+    key_builder_1.push_back_field(testHeader1, 0, 16,
+                                  MatchKeyParam::Type::EXACT);
+    table_1 = make_table("table_1", 0, key_builder_1, 16);
+    key_builder_2.push_back_field(testHeader1, 3, 8,
+                                  MatchKeyParam::Type::EXACT);
+    table_2 = make_table("table_2", 1, key_builder_2, 8);
+
+    get_match_table(table_1.get())->set_next_node_miss_default(&condition);
+    get_match_table(table_1.get())->set_next_node(0, &condition);
+    get_match_table(table_2.get())->set_next_node(1, nullptr);
+
+    condition.push_back_load_field(testHeader1, 1, 48);
+    condition.push_back_load_const(Data(7));
+    condition.push_back_op(ExprOpcode::EQ_DATA);
+    condition.build();
+    condition.set_next_node_if_true(table_2.get());
+  }
+
+  static std::unique_ptr<MatchActionTable> make_table(
+      const std::string &name, p4object_id_t id,
+      const MatchKeyBuilder &key_builder, size_t size) {
+    std::unique_ptr<MatchUnitExact<MatchTable::ActionEntry> > match_unit(
+        new MatchUnitExact<MatchTable::ActionEntry>(size, key_builder,
+                                                    &lookup_factory));
+    std::unique_ptr<MatchTable> match_table(
+        new MatchTable(name, id, std::move(match_unit), true));
+    return std::unique_ptr<MatchActionTable>(
+        new MatchActionTable(name, id, std::move(match_table)));
+  }
+
+  static MatchTable *get_match_table(MatchActionTable *table) {
+    return static_cast<MatchTable *>(table->get_match_table());
+  }
+
+  virtual void SetUp() {
+    phv_source->set_phv_factory(0, &phv_factory);
+    ASSERT_EQ(MatchErrorCode::SUCCESS, get_match_table(table_1.get())->add_entry(
+        {MatchKeyParam(MatchKeyParam::Type::EXACT, std::string("\x00\x01", 2))},
+        &action_fn_1, ActionData(), &handle_1));
+    ASSERT_EQ(MatchErrorCode::SUCCESS, get_match_table(table_2.get())->add_entry(
+        {MatchKeyParam(MatchKeyParam::Type::EXACT, std::string("\x03", 1))},
+        &action_fn_2, ActionData(), &handle_2));
+  }
+
+  std::unique_ptr<Packet> get_pkt(unsigned int f16, unsigned int f48,
+                                  unsigned int f32) {
+    std::unique_ptr<Packet> pkt(new Packet(
+        Packet::make_new(phv_source.get())));
+    PHV *phv = pkt->get_phv();
+    phv->get_header(testHeader1).mark_valid();
+    phv->get_field(testHeader1, 0).set(f16);
+    phv->get_field(testHeader1, 1).set(f48);
+    phv->get_field(testHeader1, 2).set(f32);
+    phv->get_field(testHeader1, 3).set(0);
+    return pkt;
+  }
+
+  unsigned int get_f48(const Packet &pkt) const {
+    return pkt.get_phv()->get_field(testHeader1, 1).get<unsigned int>();
+  }
+
+  uint64_t get_packet_count(MatchActionTable *table,
+                            entry_handle_t handle) const {
+    MatchTableAbstract::counter_value_t bytes, packets;
+    EXPECT_EQ(MatchErrorCode::SUCCESS,
+              table->get_match_table()->query_counters(handle, &bytes,
+                                                       &packets));
+    return packets;
+  }
+};
+
+TEST_F(DecisionCacheTest, Disabled) {
+  Pipeline pipeline("pipeline", 0, table_1.get());
+  auto pkt = get_pkt(1, 7, 3);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(100u, get_f48(*pkt));
+  auto stats = pipeline.get_decision_cache_stats();
+  ASSERT_EQ(0u, stats.misses);
+  ASSERT_EQ(0u, stats.entries);
+}
+
+TEST_F(DecisionCacheTest, Hit) {
+  Pipeline pipeline("pipeline", 0, table_1.get());
+  pipeline.set_decision_cache_size(16);
+
+  for (int i = 0; i < 3; i++) {
+    auto pkt = get_pkt(1, 7, 3);
+    pipeline.apply(pkt.get());
+    ASSERT_EQ(100u, get_f48(*pkt));
+  }
+  auto stats = pipeline.get_decision_cache_stats();
+  ASSERT_EQ(1u, stats.misses);
+  ASSERT_EQ(2u, stats.hits);
+  ASSERT_EQ(1u, stats.entries);
+  // direct counters are updated when an entry is replayed
+  ASSERT_EQ(3u, get_packet_count(table_1.get(), handle_1));
+  ASSERT_EQ(3u, get_packet_count(table_2.get(), handle_2));
+
+  // the condition reads f48, which is part of the cache key
+  auto pkt = get_pkt(1, 8, 3);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(8u, get_f48(*pkt));
+  stats = pipeline.get_decision_cache_stats();
+  ASSERT_EQ(2u, stats.misses);
+  ASSERT_EQ(2u, stats.entries);
+}
+
+TEST_F(DecisionCacheTest, TableModified) {
+  Pipeline pipeline("pipeline", 0, table_1.get());
+  pipeline.set_decision_cache_size(16);
+
+  auto pkt = get_pkt(1, 7, 3);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(100u, get_f48(*pkt));
+
+  ASSERT_EQ(MatchErrorCode::SUCCESS,
+            get_match_table(table_2.get())->delete_entry(handle_2));
+  pkt = get_pkt(1, 7, 3);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(7u, get_f48(*pkt));
+  auto stats = pipeline.get_decision_cache_stats();
+  ASSERT_EQ(1u, stats.invalidations);
+  // the stale decisions were removed from the cache
+  ASSERT_EQ(0u, stats.entries);
+
+  pkt = get_pkt(1, 7, 3);
+  pipeline.apply(pkt.get());
+  pkt = get_pkt(1, 7, 3);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(7u, get_f48(*pkt));
+  stats = pipeline.get_decision_cache_stats();
+  ASSERT_EQ(2u, stats.misses);
+  ASSERT_EQ(1u, stats.hits);
+}
+
+// f32 is not read by any table or condition, so it is not part of the cache
+// key, but table_2 depends on it, through f8
+TEST_F(DecisionCacheTest, Diverge) {
+  Pipeline pipeline("pipeline", 0, table_1.get());
+  pipeline.set_decision_cache_size(16);
+
+  auto pkt = get_pkt(1, 7, 3);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(100u, get_f48(*pkt));
+
+  pkt = get_pkt(1, 7, 4);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(7u, get_f48(*pkt));
+  auto stats = pipeline.get_decision_cache_stats();
+  ASSERT_EQ(1u, stats.invalidations);
+  ASSERT_EQ(1u, stats.entries);
+
+  pkt = get_pkt(1, 7, 3);
+  pipeline.apply(pkt.get());
+  ASSERT_EQ(100u, get_f48(*pkt));
+  stats = pipeline.get_decision_cache_stats();
+  ASSERT_EQ(1u, stats.hits);
+}
+
+// table_a and table_b both match on test1.f16, so they share the same key
+// table_a entries: f16 == 1 -> f16 = 2, f16 == 2 -> no-op
+// table_b entry: f16 == 2 -> f48 = 100
+class KeyMemoTest : public DecisionCacheTest {
+ protected:
+  ActionFn action_fn_set, action_fn_noop;
+  std::unique_ptr<MatchActionTable> table_a{nullptr}, table_b{nullptr};
+
+  KeyMemoTest()
+      : action_fn_set("set", 2), action_fn_noop("noop", 3) {
+    action_fn_set.push_back_primitive(&primitive);
+    action_fn_set.parameter_push_back_field(testHeader1, 0);
+    action_fn_set.parameter_push_back_const(Data(2));
+
+    table_a = make_table("table_a", 2, key_builder_1, 16);
+    table_b = make_table("table_b", 3, key_builder_1, 16);
+    get_match_table(table_a.get())->set_next_node_miss_default(table_b.get());
+    get_match_table(table_a.get())->set_next_node(2, table_b.get());
+    get_match_table(table_a.get())->set_next_node(3, table_b.get());
+    get_match_table(table_b.get())->set_next_node(1, nullptr);
+  }
+
+  virtual void SetUp() {
+    DecisionCacheTest::SetUp();
+    entry_handle_t handle;
+    ASSERT_EQ(MatchErrorCode::SUCCESS, get_match_table(table_a.get())->add_entry(
+        {MatchKeyParam(MatchKeyParam::Type::EXACT, std::string("\x00\x01", 2))},
+        &action_fn_set, ActionData(), &handle));
+    ASSERT_EQ(MatchErrorCode::SUCCESS, get_match_table(table_a.get())->add_entry(
+        {MatchKeyParam(MatchKeyParam::Type::EXACT, std::string("\x00\x02", 2))},
+        &action_fn_noop, ActionData(), &handle));
+    ASSERT_EQ(MatchErrorCode::SUCCESS, get_match_table(table_b.get())->add_entry(
+        {MatchKeyParam(MatchKeyParam::Type::EXACT, std::string("\x00\x02", 2))},
+        &action_fn_2, ActionData(), &handle));
+  }
+};
+
+// the memoized key must not be reused once the action has modified the PHV
+TEST_F(KeyMemoTest, Invalidation) {
+  Pipeline pipeline("pipeline", 0, table_a.get());
+  for (unsigned int f16 : {1u, 2u}) {
+    auto pkt = get_pkt(f16, 7, 0);
+    pipeline.apply(pkt.get());
+    ASSERT_EQ(100u, get_f48(*pkt));
+    ASSERT_FALSE(pkt->get_key_memo()->enabled);
+  }
+
+  auto pkt_1 = get_pkt(1, 7, 0);
+  auto pkt_2 = get_pkt(2, 7, 0);
+  auto pkt_3 = get_pkt(3, 7, 0);
+  Packet *batch[] = {pkt_1.get(), pkt_2.get(), pkt_3.get()};
+  pipeline.apply_batch(batch, 3);
+  ASSERT_EQ(100u, get_f48(*pkt_1));
+  ASSERT_EQ(100u, get_f48(*pkt_2));
+  ASSERT_EQ(7u, get_f48(*pkt_3));
+}
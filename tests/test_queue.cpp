@@ -23,12 +23,14 @@
 #include <thread>
 
 #include "bm_sim/queue.h"
+#include "bm_sim/spsc_queue.h"
 
 using std::unique_ptr;
 
 using std::thread;
 
 using bm::Queue;
+using bm::SPSCQueue;
 
 using ::testing::TestWithParam;
 using ::testing::Values;
@@ -82,8 +84,59 @@ TEST_P(QueueTest, ProducerConsumer) {
   producer_thread.join();
 }
 
+TEST_P(QueueTest, ProducerConsumerBatch) {
+
+  thread producer_thread(producer, this);
+
+  int batch[32];
+  for(int i = 0; i < iterations;) {
+    size_t n = queue->pop_back_batch(batch, 32);
+    ASSERT_LT(0u, n);
+    ASSERT_GE(32u, n);
+    for(size_t j = 0; j < n; j++) {
+      ASSERT_EQ(values[i++], batch[j]);
+    }
+  }
+
+  producer_thread.join();
+}
+
 
 INSTANTIATE_TEST_CASE_P(TestParameters,
                         QueueTest,
                         Combine(Values(16, 1024, 20000),
 				Values(1000, 200000)));
+
+TEST(SPSCQueue, Capacity) {
+  SPSCQueue<int> queue(5);
+  ASSERT_EQ(8u, queue.capacity());
+  for (int i = 0; i < 8; i++) ASSERT_TRUE(queue.try_push(i));
+  ASSERT_FALSE(queue.try_push(8));
+  ASSERT_EQ(8u, queue.size());
+  int value;
+  for (int i = 0; i < 8; i++) {
+    ASSERT_TRUE(queue.try_pop(&value));
+    ASSERT_EQ(i, value);
+  }
+  ASSERT_FALSE(queue.try_pop(&value));
+  ASSERT_TRUE(queue.empty());
+}
+
+TEST(SPSCQueue, ProducerConsumer) {
+  const int iterations = 200000;
+  SPSCQueue<int> queue(64);
+
+  thread producer_thread([&queue]() {
+      for (int i = 0; i < iterations; i++) {
+        while (!queue.try_push(i)) std::this_thread::yield();
+      }
+    });
+
+  int value;
+  for (int i = 0; i < iterations; i++) {
+    while (!queue.try_pop(&value)) std::this_thread::yield();
+    ASSERT_EQ(i, value);
+  }
+
+  producer_thread.join();
+}
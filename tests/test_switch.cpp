@@ -49,6 +49,26 @@ char char2digit(char c) {
 }  // namespace
 
 class SwitchTest : public Switch {
+ public:
+  explicit SwitchTest(bool enable_swap = false)
+      : Switch(enable_swap) { }
+
+ private:
+  int receive(int port_num, const char *buffer, int len) override {
+    (void) port_num; (void) buffer; (void) len;
+    return 0;
+  }
+
+  void start_and_return() override {
+  }
+};
+
+class SwitchWContextsTest : public SwitchWContexts {
+ public:
+  SwitchWContextsTest(size_t nb_cxts, bool enable_swap)
+      : SwitchWContexts(nb_cxts, enable_swap) { }
+
+ private:
   int receive(int port_num, const char *buffer, int len) override {
     (void) port_num; (void) buffer; (void) len;
     return 0;
@@ -85,3 +105,84 @@ TEST(Switch, GetConfig) {
 
   ASSERT_EQ(std::string(md5.begin(), md5.end()), sw.get_config_md5());
 }
+
+TEST(Switch, HitlessSwap) {
+  fs::path config_path = fs::path(TESTDATADIR) / fs::path("empty_config.json");
+  const std::string new_config =
+      "{\"header_types\": [{\"name\": \"h_t\", \"id\": 0, "
+      "\"fields\": [[\"f\", 8]]}], "
+      "\"headers\": [{\"name\": \"h\", \"id\": 0, "
+      "\"header_type\": \"h_t\", \"metadata\": true}]}";
+  const auto success = RuntimeInterface::ErrorCode::SUCCESS;
+
+  SwitchTest sw(true);  // enable swapping
+  sw.init_objects(config_path.string(), 0, nullptr);
+
+  auto old_packet = sw.new_packet_ptr(0, 0, 0, PacketBuffer(128));
+  P4Objects *old_config = old_packet->get_p4objects();
+  ASSERT_NE(nullptr, old_config);
+  ASSERT_EQ(0u, old_packet->get_phv()->num_headers());
+
+  ASSERT_EQ(success, sw.load_new_config(new_config));
+  ASSERT_EQ(success, sw.swap_configs());
+  // does not wait for old_packet to be destroyed
+  ASSERT_EQ(0, sw.do_swap());
+
+  auto new_packet = sw.new_packet_ptr(0, 1, 0, PacketBuffer(128));
+  ASSERT_NE(old_config, new_packet->get_p4objects());
+  ASSERT_EQ(1u, new_packet->get_phv()->num_headers());
+
+  // the in-flight packet and its clones still use the old configuration
+  ASSERT_EQ(old_config, old_packet->get_p4objects());
+  auto old_clone = old_packet->clone_with_phv_ptr();
+  ASSERT_EQ(old_config, old_clone->get_p4objects());
+  ASSERT_EQ(0u, old_clone->get_phv()->num_headers());
+  old_clone = old_packet->clone_no_phv_ptr();
+  ASSERT_EQ(old_config, old_clone->get_p4objects());
+  ASSERT_EQ(0u, old_clone->get_phv()->num_headers());
+
+  // the PHVs of the old configuration are not recycled
+  old_clone.reset();
+  old_packet.reset();
+  new_packet.reset();
+  for (packet_id_t id = 2; id < 5; id++) {
+    auto packet = sw.new_packet_ptr(0, id, 0, PacketBuffer(128));
+    ASSERT_EQ(1u, packet->get_phv()->num_headers());
+  }
+}
+
+TEST(Switch, MultipleContexts) {
+  fs::path config_path = fs::path(TESTDATADIR) / fs::path("empty_config.json");
+  const std::string new_config =
+      "{\"header_types\": [{\"name\": \"h_t\", \"id\": 0, "
+      "\"fields\": [[\"f\", 8]]}], "
+      "\"headers\": [{\"name\": \"h\", \"id\": 0, "
+      "\"header_type\": \"h_t\", \"metadata\": true}], "
+      "\"register_arrays\": [{\"name\": \"r\", \"id\": 0, "
+      "\"size\": 1024, \"bitwidth\": 32}]}";
+  const size_t nb_cxts = 4;
+
+  // the JSON is parsed once, and the contexts are built from it concurrently
+  SwitchWContextsTest sw(nb_cxts, true);  // enable swapping
+  ASSERT_EQ(0, sw.init_objects(config_path.string(), 0, nullptr));
+
+  ASSERT_EQ(RuntimeInterface::ErrorCode::SUCCESS,
+            sw.load_new_config(new_config));
+  // all the contexts have an ongoing swap
+  ASSERT_EQ(RuntimeInterface::ErrorCode::ONGOING_SWAP,
+            sw.load_new_config(new_config));
+  ASSERT_EQ(RuntimeInterface::ErrorCode::SUCCESS, sw.swap_configs());
+  ASSERT_EQ(0, sw.do_swap());
+
+  std::vector<P4Objects *> configs;
+  for (size_t cxt_id = 0; cxt_id < nb_cxts; cxt_id++) {
+    auto packet = sw.new_packet_ptr(cxt_id, 0, cxt_id, 0, PacketBuffer(128));
+    ASSERT_EQ(1u, packet->get_phv()->num_headers());
+    P4Objects *config = packet->get_p4objects();
+    ASSERT_EQ(1024u, config->get_register_array("r")->size());
+    // each context has its own instance
+    for (auto other : configs) ASSERT_NE(other, config);
+    configs.push_back(config);
+  }
+  ASSERT_EQ(new_config, sw.get_config());
+}
@@ -23,6 +23,8 @@
 #include <memory>
 #include <thread>
 #include <future>
+#include <random>
+#include <vector>
 #include "bm_sim/tables.h"
 
 using namespace bm;
@@ -39,6 +41,7 @@ typedef MatchTableAbstract::ActionEntry ActionEntry;
 typedef MatchUnitExact<ActionEntry> MUExact;
 typedef MatchUnitLPM<ActionEntry> MULPM;
 typedef MatchUnitTernary<ActionEntry> MUTernary;
+typedef MatchUnitRange<ActionEntry> MURange;
 
 namespace {
 
@@ -339,6 +342,41 @@ TYPED_TEST(TableSizeTwo, LookupEntry) {
   ASSERT_FALSE(hit);
 }
 
+// more packets than the lookup structures process at once
+TYPED_TEST(TableSizeTwo, ApplyActionBatch) {
+  entry_handle_t handle_1, handle_2;
+  ASSERT_EQ(MatchErrorCode::SUCCESS, this->add_entry("\x0a\xba", &handle_1));
+  ASSERT_EQ(MatchErrorCode::SUCCESS, this->add_entry("\x0b\xcb", &handle_2));
+
+  const size_t n = 40;
+  const char *const values[] = {"0xaba", "0xbcb", "0xabb"};
+  std::vector<Packet> pkts;
+  for (size_t i = 0; i < n; i++) {
+    pkts.push_back(this->get_pkt(64));
+    pkts.back().get_phv()->get_field(this->testHeader1, 0).set(values[i % 3]);
+  }
+  std::vector<Packet *> batch;
+  for (auto &pkt : pkts) batch.push_back(&pkt);
+  std::vector<const ControlFlowNode *> next_nodes(n);
+  this->table->apply_action_batch(batch.data(), n, next_nodes.data());
+
+  for (size_t i = 0; i < n; i++) {
+    if (i % 3 == 2)
+      ASSERT_EQ(&this->node_miss_default, next_nodes[i]);
+    else
+      ASSERT_EQ(nullptr, next_nodes[i]);
+  }
+
+  MatchTableAbstract::counter_value_t counter_bytes, counter_packets;
+  ASSERT_EQ(MatchErrorCode::SUCCESS, this->table->query_counters(
+      handle_1, &counter_bytes, &counter_packets));
+  ASSERT_EQ(14u, counter_packets);
+  ASSERT_EQ(14u * 64u, counter_bytes);
+  ASSERT_EQ(MatchErrorCode::SUCCESS, this->table->query_counters(
+      handle_2, &counter_bytes, &counter_packets));
+  ASSERT_EQ(13u, counter_packets);
+}
+
 TYPED_TEST(TableSizeTwo, NextNodeHitMiss) {
   std::string key = "\x0a\xba";
   entry_handle_t handle;
@@ -1229,6 +1267,72 @@ TEST_F(TableIndirectWS, LookupEntryWS) {
   ASSERT_EQ(MatchErrorCode::SUCCESS, rc);
 }
 
+TEST_F(TableIndirectWS, ResilientHashing) {
+  grp_hdl_t grp;
+  std::vector<mbr_hdl_t> mbrs(5);
+  entry_handle_t handle;
+  entry_handle_t lookup_handle;
+  bool hit;
+
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->create_group(&grp));
+  for (unsigned int i = 0; i < mbrs.size(); i++)
+    ASSERT_EQ(MatchErrorCode::SUCCESS, add_member(i, &mbrs[i]));
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_EQ(MatchErrorCode::SUCCESS,
+              table->add_member_to_group(mbrs[i], grp));
+  }
+  ASSERT_EQ(MatchErrorCode::SUCCESS, add_entry_ws("\x0a\xba", grp, &handle));
+
+  Packet pkt = get_pkt(64);
+  pkt.get_phv()->get_field(testHeader1, 0).set("0xaba");
+
+  struct Flow {
+    unsigned int h1_f48;
+    unsigned int h2_f16;
+    unsigned int h2_f48;
+  };
+  std::vector<Flow> flows;
+  for (int i = 0; i < 512; i++) flows.push_back({dis(gen), dis(gen), dis(gen)});
+
+  auto choose = [this, &pkt, &hit, &lookup_handle](const Flow &flow) {
+    pkt.get_phv()->get_field(testHeader1, 1).set(flow.h1_f48);
+    pkt.get_phv()->get_field(testHeader2, 0).set(flow.h2_f16);
+    pkt.get_phv()->get_field(testHeader2, 1).set(flow.h2_f48);
+    const ActionEntry &entry = table->lookup(pkt, &hit, &lookup_handle);
+    return entry.action_fn.get_action_data_at(0).get_uint();
+  };
+
+  std::vector<unsigned int> chosen;
+  for (const auto &flow : flows) chosen.push_back(choose(flow));
+
+  // flows can only move to the new member
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->add_member_to_group(mbrs[4], grp));
+  size_t moved = 0;
+  for (size_t i = 0; i < flows.size(); i++) {
+    const unsigned int data = choose(flows[i]);
+    if (data == chosen[i]) continue;
+    ASSERT_EQ(4u, data);
+    chosen[i] = data;
+    moved++;
+  }
+  ASSERT_NEAR(flows.size() / 5, moved, 40);
+
+  // only the flows of the removed member move
+  ASSERT_EQ(MatchErrorCode::SUCCESS,
+            table->remove_member_from_group(mbrs[1], grp));
+  for (size_t i = 0; i < flows.size(); i++) {
+    const unsigned int data = choose(flows[i]);
+    if (chosen[i] == 1u)
+      ASSERT_NE(1u, data);
+    else
+      ASSERT_EQ(chosen[i], data);
+  }
+
+  table->set_nb_buckets(64);
+  ASSERT_EQ(64u, table->get_nb_buckets());
+  for (const auto &flow : flows) ASSERT_NE(1u, choose(flow));
+}
+
 template <typename MUType>
 class TableBigMask : public ::testing::Test {
  protected:
@@ -1489,6 +1593,57 @@ TEST_F(MatchKeyBuilderTest1, KeyToFields) {
   ASSERT_EQ(expected, v);
 }
 
+// the masks are folded in the key building, and the fields of invalid headers
+// are replaced with zeros
+TEST_F(MatchKeyBuilderTest, MaskAndInvalidHeader) {
+  key_builder.push_back_field(testHeader1, 0, 16, ByteContainer("0xff0f"),
+                              MatchKeyParam::Type::TERNARY);  // h1.f16
+  key_builder.push_back_field(testHeader2, 0, 16,
+                              MatchKeyParam::Type::EXACT);  // h2.f16
+  key_builder.push_back_valid_header(testHeader2);
+  key_builder.build();
+
+  Packet pkt = get_pkt();
+  PHV *phv = pkt.get_phv();
+  phv->get_field(testHeader1, 0).set("0xabcd");
+  phv->get_field(testHeader2, 0).set("0x7001");
+
+  ByteContainer key("0x99");
+  key_builder(*phv, &key);
+  ASSERT_EQ(ByteContainer("0x99017001ab0d"), key);
+
+  phv->get_header(testHeader2).mark_invalid();
+  key.clear();
+  key_builder(*phv, &key);
+  ASSERT_EQ(ByteContainer("0x000000ab0d"), key);
+
+  char buffer[5];
+  key_builder(*phv, buffer);
+  ASSERT_EQ(ByteContainer("0x000000ab0d"), ByteContainer(buffer, 5));
+}
+
+TEST_F(MatchKeyBuilderTest, KeyId) {
+  MatchKeyBuilder key_builder_2, key_builder_3;
+  for (auto builder : {&key_builder, &key_builder_2, &key_builder_3}) {
+    builder->push_back_field(testHeader1, 0, 16, MatchKeyParam::Type::EXACT);
+    builder->push_back_field(testHeader2, 0, 16, MatchKeyParam::Type::LPM);
+  }
+  // same fields, different mask
+  key_builder_3.push_back_field(testHeader3, 0, 16, ByteContainer("0xff00"),
+                                MatchKeyParam::Type::TERNARY);
+  key_builder.push_back_field(testHeader3, 0, 16, ByteContainer("0xffff"),
+                              MatchKeyParam::Type::TERNARY);
+  key_builder_2.push_back_field(testHeader3, 0, 16,
+                                MatchKeyParam::Type::TERNARY);
+  ASSERT_EQ(-1, key_builder.get_key_id());
+  key_builder.build();
+  key_builder_2.build();
+  key_builder_3.build();
+  ASSERT_LE(0, key_builder.get_key_id());
+  ASSERT_EQ(key_builder.get_key_id(), key_builder_2.get_key_id());
+  ASSERT_NE(key_builder.get_key_id(), key_builder_3.get_key_id());
+}
+
 
 // added after exposing some hidden nasty bugs
 class AdvancedTest : public ::testing::Test {
@@ -1680,6 +1835,340 @@ TEST_F(AdvancedTernaryTest, Lookup1) {
   ASSERT_TRUE(hit);
 }
 
+class AdaptiveLookupTest : public AdvancedTest {
+ protected:
+  std::unique_ptr<MatchTable> table_lpm;
+
+  AdaptiveLookupTest()
+      : AdvancedTest() {
+    key_builder.push_back_field(testHeader1, 0, 16,
+                                MatchKeyParam::Type::TERNARY);
+    table = std::unique_ptr<MatchTable>(new MatchTable(
+        "test_table", 0,
+        std::unique_ptr<MUTernary>(
+            new MUTernary(t_size, key_builder, &lookup_factory)),
+        false));
+    table->set_next_node(0, nullptr);
+
+    MatchKeyBuilder key_builder_lpm;
+    key_builder_lpm.push_back_field(testHeader1, 0, 16,
+                                    MatchKeyParam::Type::LPM);
+    key_builder_lpm.push_back_field(testHeader2, 0, 16,
+                                    MatchKeyParam::Type::EXACT);
+    table_lpm = std::unique_ptr<MatchTable>(new MatchTable(
+        "test_table_lpm", 1,
+        std::unique_ptr<MULPM>(
+            new MULPM(t_size, key_builder_lpm, &lookup_factory)),
+        false));
+    table_lpm->set_next_node(0, nullptr);
+  }
+
+  // key and mask are 2 bytes long
+  entry_handle_t add_ternary(const char *key, const char *mask, int priority) {
+    entry_handle_t handle;
+    std::vector<MatchKeyParam> match_key;
+    match_key.emplace_back(MatchKeyParam::Type::TERNARY,
+                           std::string(key, 2), std::string(mask, 2));
+    EXPECT_EQ(MatchErrorCode::SUCCESS, table->add_entry(
+        match_key, &action_fn, ActionData(), &handle, priority));
+    return handle;
+  }
+
+  entry_handle_t add_lpm(const std::string &key, int prefix_length) {
+    entry_handle_t handle;
+    std::vector<MatchKeyParam> match_key;
+    match_key.emplace_back(MatchKeyParam::Type::LPM, key, prefix_length);
+    match_key.emplace_back(MatchKeyParam::Type::EXACT,
+                           std::string("\xab\xcd", 2));
+    EXPECT_EQ(MatchErrorCode::SUCCESS, table_lpm->add_entry(
+        match_key, &action_fn, ActionData(), &handle));
+    return handle;
+  }
+
+  // returns the handle of the entry hit, or -1 in case of a miss
+  entry_handle_t lookup(MatchTable *t, const std::string &h1_f16_v) const {
+    Packet pkt = get_pkt();
+    pkt.get_phv()->get_field(testHeader1, 0).set(h1_f16_v);
+    pkt.get_phv()->get_field(testHeader2, 0).set("0xabcd");
+    bool hit;
+    entry_handle_t handle;
+    t->lookup(pkt, &hit, &handle);
+    return hit ? handle : static_cast<entry_handle_t>(-1);
+  }
+};
+
+TEST_F(AdaptiveLookupTest, Disabled) {
+  add_ternary("\x00\x01", "\xff\xff", 10);
+  add_ternary("\x00\x02", "\xff\xff", 10);
+  const auto stats = table->get_lookup_stats();
+  ASSERT_EQ("ternary_linear", stats.structure);
+  ASSERT_EQ(2u, stats.num_entries);
+  ASSERT_EQ(1u, stats.num_shapes);
+  ASSERT_EQ(0u, stats.migrations);
+  ASSERT_FALSE(stats.adaptive);
+}
+
+TEST_F(AdaptiveLookupTest, Ternary) {
+  const entry_handle_t miss = static_cast<entry_handle_t>(-1);
+  table->set_adaptive_lookup(true);
+  ASSERT_EQ("ternary_linear", table->get_lookup_stats().structure);
+
+  // a single mask
+  const auto h_1 = add_ternary("\x00\x01", "\xff\xff", 10);
+  auto stats = table->get_lookup_stats();
+  ASSERT_EQ("ternary_tuple_space", stats.structure);
+  ASSERT_EQ(1u, stats.migrations);
+  ASSERT_TRUE(stats.adaptive);
+  ASSERT_EQ(h_1, lookup(table.get(), "0x0001"));
+
+  // 2 masks for 2 entries, back to a linear search
+  const auto h_2 = add_ternary("\x00\x00", "\xff\x00", 5);
+  stats = table->get_lookup_stats();
+  ASSERT_EQ("ternary_linear", stats.structure);
+  ASSERT_EQ(2u, stats.num_shapes);
+  ASSERT_EQ(2u, stats.migrations);
+  ASSERT_EQ(h_2, lookup(table.get(), "0x0001"));
+
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->delete_entry(h_2));
+  ASSERT_EQ("ternary_tuple_space", table->get_lookup_stats().structure);
+  ASSERT_EQ(h_1, lookup(table.get(), "0x0001"));
+
+  // 2 masks for 4 entries, the tuple space is kept
+  const auto h_3 = add_ternary("\x00\x02", "\xff\xff", 1);
+  add_ternary("\x00\x03", "\xff\xff", 10);
+  const auto h_5 = add_ternary("\x00\x00", "\xff\x00", 5);
+  stats = table->get_lookup_stats();
+  ASSERT_EQ("ternary_tuple_space", stats.structure);
+  ASSERT_EQ(3u, stats.migrations);
+  ASSERT_EQ(h_5, lookup(table.get(), "0x0001"));
+  ASSERT_EQ(h_3, lookup(table.get(), "0x0002"));
+  ASSERT_EQ(h_5, lookup(table.get(), "0x00ff"));
+  ASSERT_EQ(miss, lookup(table.get(), "0x0100"));
+
+  table->set_adaptive_lookup(false);
+  stats = table->get_lookup_stats();
+  ASSERT_EQ("ternary_linear", stats.structure);
+  ASSERT_EQ(4u, stats.migrations);
+  ASSERT_EQ(h_5, lookup(table.get(), "0x0001"));
+  ASSERT_EQ(h_3, lookup(table.get(), "0x0002"));
+  ASSERT_EQ(miss, lookup(table.get(), "0x0100"));
+}
+
+TEST_F(AdaptiveLookupTest, LPM) {
+  const entry_handle_t miss = static_cast<entry_handle_t>(-1);
+  table_lpm->set_adaptive_lookup(true);
+  ASSERT_EQ("lpm_trie", table_lpm->get_lookup_stats().structure);
+
+  const auto h_1 = add_lpm(std::string("\x0a\x00", 2), 8);
+  const auto h_2 = add_lpm(std::string("\x0b\x00", 2), 8);
+  ASSERT_EQ("lpm_tuple_space", table_lpm->get_lookup_stats().structure);
+  ASSERT_EQ(h_1, lookup(table_lpm.get(), "0x0a12"));
+  ASSERT_EQ(h_2, lookup(table_lpm.get(), "0x0b34"));
+  ASSERT_EQ(miss, lookup(table_lpm.get(), "0x0c00"));
+
+  const auto h_3 = add_lpm(std::string("\x0a\x10", 2), 12);
+  ASSERT_EQ("lpm_tuple_space", table_lpm->get_lookup_stats().structure);
+  ASSERT_EQ(h_3, lookup(table_lpm.get(), "0x0a1f"));
+  ASSERT_EQ(h_1, lookup(table_lpm.get(), "0x0a20"));
+
+  // 3 prefix lengths
+  const auto h_4 = add_lpm(std::string("\x00\x00", 2), 0);
+  auto stats = table_lpm->get_lookup_stats();
+  ASSERT_EQ("lpm_trie", stats.structure);
+  ASSERT_EQ(3u, stats.num_shapes);
+  ASSERT_EQ(2u, stats.migrations);
+  ASSERT_EQ(h_3, lookup(table_lpm.get(), "0x0a1f"));
+  ASSERT_EQ(h_4, lookup(table_lpm.get(), "0x0c00"));
+}
+
+class RangeMatchTest : public AdvancedTest {
+ protected:
+  RangeMatchTest()
+      : AdvancedTest() {
+    key_builder.push_back_field(testHeader2, 0, 16,
+                                MatchKeyParam::Type::RANGE);  // h2.f16
+    key_builder.push_back_field(testHeader1, 0, 16,
+                                MatchKeyParam::Type::TERNARY);  // h1.f16
+    key_builder.push_back_field(testHeader3, 2, 17,
+                                MatchKeyParam::Type::RANGE);  // h3.f17
+    table = std::unique_ptr<MatchTable>(new MatchTable(
+        "test_table", 0,
+        std::unique_ptr<MURange>(
+            new MURange(t_size, key_builder, &lookup_factory)),
+        false));
+    table->set_next_node(0, nullptr);
+  }
+
+  std::vector<MatchKeyParam> make_key(const std::string &h2_start,
+                                      const std::string &h2_end,
+                                      const std::string &h1_key,
+                                      const std::string &h1_mask,
+                                      const std::string &h3_start,
+                                      const std::string &h3_end) const {
+    std::vector<MatchKeyParam> match_key;
+    match_key.emplace_back(MatchKeyParam::Type::RANGE, h2_start, h2_end);
+    match_key.emplace_back(MatchKeyParam::Type::TERNARY, h1_key, h1_mask);
+    match_key.emplace_back(MatchKeyParam::Type::RANGE, h3_start, h3_end);
+    return match_key;
+  }
+
+  // returns the handle of the entry hit, or -1 in case of a miss
+  entry_handle_t lookup(const std::string &h2_f16_v,
+                        const std::string &h1_f16_v,
+                        const std::string &h3_f17_v) const {
+    Packet pkt = get_pkt();
+    pkt.get_phv()->get_field(testHeader2, 0).set(h2_f16_v);
+    pkt.get_phv()->get_field(testHeader1, 0).set(h1_f16_v);
+    pkt.get_phv()->get_field(testHeader3, 2).set(h3_f17_v);
+    bool hit;
+    entry_handle_t handle;
+    table->lookup(pkt, &hit, &handle);
+    return hit ? handle : static_cast<entry_handle_t>(-1);
+  }
+};
+
+TEST_F(RangeMatchTest, Lookup) {
+  const entry_handle_t miss = static_cast<entry_handle_t>(-1);
+  entry_handle_t h_1, h_2, h_3;
+  const std::string zero_16("\x00\x00", 2);
+  const std::string zero_17("\x00\x00\x00", 3);
+
+  const auto key_1 = make_key(zero_16, std::string("\x03\xff", 2),
+                              std::string("\x0a\x00", 2),
+                              std::string("\xff\x00", 2),
+                              zero_17, std::string("\x01\xff\xff", 3));
+  ASSERT_EQ(MatchErrorCode::SUCCESS,
+            table->add_entry(key_1, &action_fn, ActionData(), &h_1, 10));
+  ASSERT_EQ(MatchErrorCode::DUPLICATE_ENTRY,
+            table->add_entry(key_1, &action_fn, ActionData(), &h_1, 10));
+
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->add_entry(
+      make_key(std::string("\x00\x50", 2), std::string("\x00\x50", 2),
+               zero_16, zero_16,
+               std::string("\x00\x01\x00", 3),
+               std::string("\x00\x01\xff", 3)),
+      &action_fn, ActionData(), &h_2, 1));
+
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->add_entry(
+      make_key(zero_16, std::string("\xff\xff", 2), zero_16, zero_16,
+               zero_17, std::string("\x01\xff\xff", 3)),
+      &action_fn, ActionData(), &h_3, 100));
+
+  // start > end
+  entry_handle_t h_bad;
+  ASSERT_EQ(MatchErrorCode::BAD_MATCH_KEY, table->add_entry(
+      make_key(std::string("\x00\x51", 2), std::string("\x00\x50", 2),
+               zero_16, zero_16, zero_17, zero_17),
+      &action_fn, ActionData(), &h_bad, 1));
+
+  ASSERT_EQ("range_segment_tree", table->get_lookup_stats().structure);
+
+  ASSERT_EQ(h_2, lookup("0x0050", "0x0a01", "0x00150"));
+  ASSERT_EQ(h_1, lookup("0x0050", "0x0a01", "0x00050"));
+  ASSERT_EQ(h_1, lookup("0x03ff", "0x0aff", "0x1ffff"));
+  ASSERT_EQ(h_3, lookup("0x0400", "0x0a01", "0x00000"));
+  ASSERT_EQ(h_3, lookup("0x0050", "0x0b00", "0x00050"));
+
+  std::vector<MatchKeyParam> match_key;
+  const ActionFn *action_fn_;
+  ActionData action_data;
+  int priority;
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->get_entry(
+      h_1, &match_key, &action_fn_, &action_data, &priority));
+  ASSERT_EQ(10, priority);
+  ASSERT_EQ(key_1.size(), match_key.size());
+  for (size_t i = 0; i < key_1.size(); i++) {
+    ASSERT_EQ(key_1[i].type, match_key[i].type);
+    ASSERT_EQ(key_1[i].key, match_key[i].key);
+    ASSERT_EQ(key_1[i].mask, match_key[i].mask);
+  }
+
+  std::stringstream os;
+  table->dump(&os);
+  ASSERT_NE(std::string::npos,
+            os.str().find("0000 -> 03ff 0a00 &&& ff00 000000 -> 01ffff"));
+
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->delete_entry(h_3));
+  ASSERT_EQ(miss, lookup("0x0400", "0x0a01", "0x00000"));
+  ASSERT_EQ(h_2, lookup("0x0050", "0x0a01", "0x00150"));
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table->delete_entry(h_2));
+  ASSERT_EQ(h_1, lookup("0x0050", "0x0a01", "0x00150"));
+}
+
+// compares the lookup results with a brute force search, for random ranges
+TEST_F(RangeMatchTest, Random) {
+  MatchKeyBuilder key_builder_range;
+  key_builder_range.push_back_field(testHeader1, 0, 16,
+                                    MatchKeyParam::Type::RANGE);
+  table = std::unique_ptr<MatchTable>(new MatchTable(
+      "test_table", 0,
+      std::unique_ptr<MURange>(
+          new MURange(t_size, key_builder_range, &lookup_factory)),
+      false));
+  table->set_next_node(0, nullptr);
+
+  struct Range {
+    int start;
+    int end;
+    int priority;
+    entry_handle_t handle;
+  };
+  std::vector<Range> ranges;
+
+  auto to_bytes = [](int v) {
+    const char bytes[2] = {static_cast<char>(v >> 8), static_cast<char>(v)};
+    return std::string(bytes, 2);
+  };
+
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> value_dis(0, 1023);
+  std::uniform_int_distribution<int> priority_dis(0, 63);
+  for (int iter = 0; iter < 256; iter++) {
+    if (ranges.size() == t_size || (ranges.size() > 0 && gen() % 4 == 0)) {
+      const size_t idx = gen() % ranges.size();
+      ASSERT_EQ(MatchErrorCode::SUCCESS,
+                table->delete_entry(ranges[idx].handle));
+      ranges.erase(ranges.begin() + idx);
+    } else {
+      Range r;
+      r.start = value_dis(gen);
+      r.end = std::min(1023, r.start + value_dis(gen) / 8);
+      r.priority = priority_dis(gen);
+      std::vector<MatchKeyParam> match_key;
+      match_key.emplace_back(MatchKeyParam::Type::RANGE, to_bytes(r.start),
+                             to_bytes(r.end));
+      const auto rc = table->add_entry(match_key, &action_fn, ActionData(),
+                                       &r.handle, r.priority);
+      if (rc == MatchErrorCode::DUPLICATE_ENTRY) continue;
+      ASSERT_EQ(MatchErrorCode::SUCCESS, rc);
+      ranges.push_back(r);
+    }
+
+    for (int v = 0; v < 1024; v += 7) {
+      const Range *best = nullptr;
+      for (const auto &r : ranges) {
+        if (v < r.start || v > r.end) continue;
+        if (!best || r.priority < best->priority) best = &r;
+      }
+      Packet pkt = get_pkt();
+      pkt.get_phv()->get_field(testHeader1, 0).set(v);
+      bool hit;
+      entry_handle_t handle;
+      table->lookup(pkt, &hit, &handle);
+      ASSERT_EQ(best != nullptr, hit);
+      if (!hit) continue;
+      const auto it = std::find_if(
+          ranges.begin(), ranges.end(),
+          [handle](const Range &r) { return r.handle == handle; });
+      ASSERT_NE(ranges.end(), it);
+      ASSERT_LE(it->start, v);
+      ASSERT_GE(it->end, v);
+      // with equal priorities, which entry is hit is not specified
+      ASSERT_EQ(best->priority, it->priority);
+    }
+  }
+}
+
 
 template <typename MUType>
 class TableEntryDebug : public ::testing::Test {
@@ -2220,3 +2709,65 @@ TYPED_TEST(TableBadInputKey, NonByteAligned) {
   this->table->lookup(pkt, &hit, &lookup_handle);
   ASSERT_TRUE(hit);
 }
+
+TEST(EntryMeta, OptionalColumns) {
+  typedef MatchTableAbstract::ActionEntry ActionEntry;
+  typedef MatchUnitExact<ActionEntry> MUExact;
+  typedef MatchUnit::MetaColumn<Counter> CounterColumn;
+  const size_t size = 16 * CounterColumn::chunk_size;
+  MatchKeyBuilder key_builder;
+  key_builder.push_back_field(0, 0, 16, MatchKeyParam::Type::EXACT);
+  LookupStructureFactory factory;
+  ActionFn action_fn("actionA", 0);
+
+  auto add_entries = [&action_fn](MatchTable *table, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      entry_handle_t handle;
+      char key[2] = {static_cast<char>(i >> 8), static_cast<char>(i & 0xff)};
+      std::vector<MatchKeyParam> match_key;
+      match_key.emplace_back(MatchKeyParam::Type::EXACT,
+                             std::string(key, sizeof(key)));
+      ASSERT_EQ(MatchErrorCode::SUCCESS,
+                table->add_entry(match_key, &action_fn, ActionData(), &handle));
+    }
+  };
+
+  // neither counters nor ageing: nothing is allocated for the entries
+  MUExact *mu_bare = new MUExact(size, key_builder, &factory);
+  MatchTable table_bare("bare", 0, std::unique_ptr<MUExact>(mu_bare));
+  table_bare.set_next_node(0, nullptr);
+  add_entries(&table_bare, 10);
+  EXPECT_EQ(0u, mu_bare->get_entry_meta_bytes());
+
+  // counters only, the column grows with the number of entries, not with the
+  // table size
+  MUExact *mu_counters = new MUExact(size, key_builder, &factory);
+  MatchTable table_counters("counters", 0,
+                            std::unique_ptr<MUExact>(mu_counters), true);
+  table_counters.set_next_node(0, nullptr);
+  const size_t empty_bytes = mu_counters->get_entry_meta_bytes();
+  EXPECT_LT(empty_bytes, size * sizeof(Counter));
+  add_entries(&table_counters, CounterColumn::chunk_size + 1);
+  const size_t bytes = mu_counters->get_entry_meta_bytes();
+  EXPECT_EQ(empty_bytes + 2 * CounterColumn::chunk_size * sizeof(Counter),
+            bytes);
+  MatchTableAbstract::counter_value_t counter_bytes, counter_packets;
+  ASSERT_EQ(MatchErrorCode::SUCCESS,
+            table_counters.write_counters(CounterColumn::chunk_size, 1, 2));
+  ASSERT_EQ(MatchErrorCode::SUCCESS,
+            table_counters.query_counters(CounterColumn::chunk_size,
+                                          &counter_bytes, &counter_packets));
+  EXPECT_EQ(1u, counter_bytes);
+  EXPECT_EQ(2u, counter_packets);
+  ASSERT_EQ(MatchErrorCode::SUCCESS, table_counters.reset_counters());
+  ASSERT_EQ(MatchErrorCode::SUCCESS,
+            table_counters.query_counters(CounterColumn::chunk_size,
+                                          &counter_bytes, &counter_packets));
+  EXPECT_EQ(0u, counter_packets);
+  ASSERT_EQ(MatchErrorCode::AGEING_DISABLED,
+            table_counters.set_entry_ttl(0, 100));
+
+  // the memory is released when the state is reset
+  table_counters.reset_state();
+  EXPECT_EQ(empty_bytes, mu_counters->get_entry_meta_bytes());
+}
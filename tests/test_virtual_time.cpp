@@ -0,0 +1,200 @@
+/* Copyright 2013-present Barefoot Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Antonin Bas (antonin@barefootnetworks.com)
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bm_sim/clock.h"
+#include "bm_sim/pcap_file.h"
+#include "bm_sim/queueing.h"
+
+using bm::Clock;
+using bm::VirtualTime;
+
+namespace fs = boost::filesystem;
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+#ifndef TESTDATADIR
+#define TESTDATADIR "testdata"
+#endif
+
+class VirtualTimeTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    VirtualTime::enable();
+    start = Clock::now();
+    real_start = std::chrono::steady_clock::now();
+  }
+
+  virtual void TearDown() {
+    VirtualTime::disable();
+  }
+
+  // the whole point of virtual time
+  void check_fast() const {
+    ASSERT_LT(std::chrono::steady_clock::now() - real_start, seconds(1));
+  }
+
+  Clock::time_point start{};
+  std::chrono::steady_clock::time_point real_start{};
+};
+
+TEST_F(VirtualTimeTest, Frozen) {
+  std::this_thread::sleep_for(milliseconds(10));
+  ASSERT_EQ(start, Clock::now());
+  VirtualTime::advance_to(start + seconds(3600));
+  ASSERT_EQ(start + seconds(3600), Clock::now());
+  // the clock never goes back
+  VirtualTime::advance_to(start);
+  ASSERT_EQ(start + seconds(3600), Clock::now());
+  check_fast();
+}
+
+TEST_F(VirtualTimeTest, Timer) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  Clock::time_point woken_up;
+  const Clock::time_point deadline = start + seconds(5);
+
+  // a unit of work waiting for the deadline, e.g. a rate-limited packet
+  VirtualTime::add_work();
+  std::thread waiter([&mutex, &cv, &woken_up, &deadline]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (Clock::now() < deadline)
+      VirtualTime::wait_until(&cv, &lock, deadline, 1);
+    woken_up = Clock::now();
+    VirtualTime::remove_work();
+  });
+
+  VirtualTime::advance_to(start + seconds(10));
+  waiter.join();
+  ASSERT_EQ(deadline, woken_up);
+  ASSERT_EQ(start + seconds(10), Clock::now());
+  check_fast();
+}
+
+namespace {
+
+struct WorkerMapper {
+  size_t operator()(size_t queue_id) const {
+    (void) queue_id;
+    return 0;
+  }
+};
+
+}  // namespace
+
+TEST_F(VirtualTimeTest, RateLimitedQueue) {
+  const int nb_elements = 20;
+  bm::QueueingLogicRL<int, WorkerMapper> queue(1, 1, 64, WorkerMapper());
+  queue.set_rate(0, 10);
+
+  std::vector<Clock::time_point> popped;
+  std::thread consumer([&queue, &popped, nb_elements]() {
+    for (int i = 0; i < nb_elements; i++) {
+      size_t queue_id;
+      int e;
+      queue.pop_back(0, &queue_id, &e);
+      popped.push_back(Clock::now());
+      VirtualTime::remove_work();
+    }
+  });
+
+  for (int i = 0; i < nb_elements; i++) {
+    VirtualTime::add_work();
+    ASSERT_EQ(1, queue.push_front(0, i));
+  }
+  VirtualTime::run_until_idle();
+  consumer.join();
+
+  ASSERT_EQ(static_cast<size_t>(nb_elements), popped.size());
+  for (int i = 0; i < nb_elements; i++)
+    ASSERT_EQ(start + milliseconds(100) * (i + 1), popped[i]);
+  check_fast();
+}
+
+TEST_F(VirtualTimeTest, PacedReplay) {
+  int received = 0;
+  auto handler = [](int port_num, const char *buffer, int len, void *cookie) {
+    (void) port_num; (void) buffer; (void) len;
+    (*static_cast<int *>(cookie))++;
+  };
+
+  bm::PcapFilesReader reader(false, 0);
+  reader.setFastReplay(10, 4000);
+  reader.addFile(0, (fs::path(TESTDATADIR) / fs::path("en0.pcap")).string());
+  reader.addFile(1, (fs::path(TESTDATADIR) / fs::path("lo0.pcap")).string());
+  reader.set_packet_handler(handler, &received);
+  reader.start();
+
+  ASSERT_EQ(430, received);
+  // each loop (43 packets) fits in one batch, the last one starts after 9
+  // loops
+  ASSERT_EQ(start + std::chrono::microseconds(9 * 43 * 1000000 / 4000),
+            Clock::now());
+  check_fast();
+}
+
+// the packets are sent when the clock reaches their timestamp (relative to the
+// first one), even though the reader does not respect timing
+TEST_F(VirtualTimeTest, TimedReplay) {
+  const std::vector<std::string> filenames = {
+    (fs::path(TESTDATADIR) / fs::path("en0.pcap")).string(),
+    (fs::path(TESTDATADIR) / fs::path("lo0.pcap")).string()};
+
+  std::vector<uint64_t> timestamps;
+  for (const auto &filename : filenames) {
+    bm::PcapFileMmap file(0, filename);
+    for (const auto &record : file.getRecords())
+      timestamps.push_back(record.ts_ns);
+  }
+  std::sort(timestamps.begin(), timestamps.end());
+
+  std::vector<Clock::time_point> sent_at;
+  auto handler = [](int port_num, const char *buffer, int len, void *cookie) {
+    (void) port_num; (void) buffer; (void) len;
+    static_cast<std::vector<Clock::time_point> *>(cookie)->push_back(
+        Clock::now());
+  };
+
+  bm::PcapFilesReader reader(false, 0);
+  for (size_t i = 0; i < filenames.size(); i++)
+    reader.addFile(i, filenames[i]);
+  reader.set_packet_handler(handler, &sent_at);
+  reader.start();
+
+  ASSERT_EQ(timestamps.size(), sent_at.size());
+  for (size_t i = 0; i < timestamps.size(); i++) {
+    ASSERT_EQ(start + std::chrono::nanoseconds(timestamps[i] - timestamps[0]),
+              sent_at[i]);
+  }
+  check_fast();
+}
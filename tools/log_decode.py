@@ -0,0 +1,169 @@
+#!/usr/bin/env python
+
+# Copyright 2013-present Barefoot Networks, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+#
+# Antonin Bas (antonin@barefootnetworks.com)
+#
+#
+
+# Decodes the binary log files produced by bmv2 when it is run with
+# --log-binary-file. See modules/bm_sim/src/binary_logger.cpp for a description
+# of the file format.
+
+import argparse
+import struct
+import sys
+import datetime
+
+FILE_MAGIC = 0x424d424c
+FILE_VERSION = 1
+
+class BLOCK_TYPES:
+    FORMAT, RECORDS = range(2)
+
+class ARG_TYPES:
+    INT, UINT, BOOL, STRING, BYTES = range(5)
+
+# same as bm::Logger::LogLevel
+LEVELS = ["T", "D", "I", "N", "W", "E", "C", "A", "M", "O"]
+
+class Format:
+    def __init__(self, level, file_, line, fmt):
+        self.level = level
+        self.file_ = file_
+        self.line = line
+        self.fmt = fmt
+
+class Record:
+    def __init__(self, thread, fmt_id, ts, packet_id, copy_id, cxt, args):
+        self.thread = thread
+        self.fmt_id = fmt_id
+        self.ts = ts
+        self.packet_id = packet_id
+        self.copy_id = copy_id
+        self.cxt = cxt
+        self.args = args
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    def done(self):
+        return self.offset >= len(self.data)
+
+    def unpack(self, fmt):
+        # = required to prevent alignment
+        s = struct.Struct("=" + fmt)
+        v = s.unpack_from(self.data, self.offset)
+        self.offset += s.size
+        return v
+
+    def bytes_(self, n):
+        v = self.data[self.offset:self.offset + n]
+        self.offset += n
+        return v
+
+    def string(self):
+        (n,) = self.unpack("I")
+        return self.bytes_(n)
+
+def decode_arg(reader):
+    (type_,) = reader.unpack("B")
+    if type_ == ARG_TYPES.INT:
+        return reader.unpack("q")[0]
+    if type_ == ARG_TYPES.UINT:
+        return reader.unpack("Q")[0]
+    if type_ == ARG_TYPES.BOOL:
+        return "true" if reader.unpack("B")[0] else "false"
+    if type_ == ARG_TYPES.STRING:
+        return reader.string()
+    if type_ == ARG_TYPES.BYTES:
+        return "".join("%02x" % ord(c) for c in reader.bytes_(
+            reader.unpack("I")[0]))
+    raise ValueError("unknown argument type %d" % type_)
+
+def decode_records(thread, data, records):
+    reader = Reader(data)
+    while not reader.done():
+        start = reader.offset
+        (len_, fmt_id, ts, packet_id, copy_id, cxt, nargs) = \
+            reader.unpack("IIQQQIB")
+        args = [decode_arg(reader) for _ in xrange(nargs)]
+        assert(reader.offset == start + len_)
+        records.append(
+            Record(thread, fmt_id, ts, packet_id, copy_id, cxt, args))
+
+def decode_file(path):
+    with open(path, 'rb') as f:
+        reader = Reader(f.read())
+    (magic, version) = reader.unpack("II")
+    if magic != FILE_MAGIC:
+        raise ValueError("%s is not a bmv2 binary log file" % path)
+    if version != FILE_VERSION:
+        raise ValueError("unsupported binary log version %d" % version)
+    formats = {}
+    records = []
+    while not reader.done():
+        (type_,) = reader.unpack("B")
+        if type_ == BLOCK_TYPES.FORMAT:
+            (id_, level, line) = reader.unpack("IBI")
+            file_ = reader.string()
+            fmt = reader.string()
+            formats[id_] = Format(level, file_, line, fmt)
+        elif type_ == BLOCK_TYPES.RECORDS:
+            (thread, len_) = reader.unpack("II")
+            decode_records(thread, reader.bytes_(len_), records)
+        else:
+            raise ValueError("unknown block type %d" % type_)
+    return formats, records
+
+def format_record(formats, record, show_site):
+    format_ = formats[record.fmt_id]
+    try:
+        msg = format_.fmt.format(*record.args)
+    except (IndexError, KeyError, ValueError):
+        msg = format_.fmt + " " + str(record.args)
+    ts = datetime.datetime.fromtimestamp(record.ts / 1e9)
+    s = "[%s.%03d] [bmv2] [%s] [thread %d] [%d.%d] [cxt %d] %s" % (
+        ts.strftime("%H:%M:%S"), ts.microsecond / 1000,
+        LEVELS[format_.level], record.thread,
+        record.packet_id, record.copy_id, record.cxt, msg)
+    if show_site:
+        s += " (%s:%d)" % (format_.file_, format_.line)
+    return s
+
+def main():
+    parser = argparse.ArgumentParser(description='BM binary log decoder')
+    parser.add_argument('file', help='Binary log file produced by bmv2',
+                        action="store")
+    parser.add_argument('--packet-id', help='Only show messages for this packet',
+                        type=int, action="store")
+    parser.add_argument('--show-site', help='Show the source location of each '
+                        'log message', action="store_true")
+    args = parser.parse_args()
+
+    formats, records = decode_file(args.file)
+    # records are grouped by thread in the file
+    records.sort(key=lambda r: r.ts)
+    for record in records:
+        if args.packet_id is not None and record.packet_id != args.packet_id:
+            continue
+        print format_record(formats, record, args.show_site)
+
+if __name__ == "__main__":
+    main()
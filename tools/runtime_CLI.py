@@ -113,14 +113,15 @@ class MatchType:
     LPM = 1
     TERNARY = 2
     VALID = 3 # not yet supported
+    RANGE = 4
 
     @staticmethod
     def to_str(x):
-        return {0: "exact", 1: "lpm", 2: "ternary", 3: "valid"}[x]
+        return {0: "exact", 1: "lpm", 2: "ternary", 3: "valid", 4: "range"}[x]
 
     @staticmethod
     def from_str(x):
-        return {"exact": 0, "lpm": 1, "ternary": 2, "valid": 3}[x]
+        return {"exact": 0, "lpm": 1, "ternary": 2, "valid": 3, "range": 4}[x]
 
 class Table:
     def __init__(self, name, id_):
@@ -433,6 +434,7 @@ _match_types_mapping = {
     MatchType.LPM : BmMatchParamType.LPM,
     MatchType.TERNARY : BmMatchParamType.TERNARY,
     MatchType.VALID : BmMatchParamType.VALID,
+    MatchType.RANGE : BmMatchParamType.RANGE,
 }
 
 def parse_match_key(table, key_fields):
@@ -474,6 +476,16 @@ def parse_match_key(table, key_fields):
             key = bool(int(field))
             param = BmMatchParam(type = param_type,
                                  valid = BmMatchParamValid(key))
+        elif param_type == BmMatchParamType.RANGE:
+            start, end = field.split("->")
+            start = bytes_to_string(parse_param_(start, bw))
+            end = bytes_to_string(parse_param_(end, bw))
+            if len(start) != len(end):
+                raise UIn_MatchKeyError(
+                    "start and end have different lengths in expression %s" % field
+                )
+            param = BmMatchParam(type = param_type,
+                                 range = BmMatchParamRange(start, end))
         else:
             assert(0)
         params.append(param)
@@ -487,7 +499,8 @@ def BmMatchParam_to_str(self):
         (self.exact.to_str() if self.exact else "") +\
         (self.lpm.to_str() if self.lpm else "") +\
         (self.ternary.to_str() if self.ternary else "") +\
-        (self.valid.to_str() if self.valid else "")
+        (self.valid.to_str() if self.valid else "") +\
+        (self.range.to_str() if self.range else "")
 
 def BmMatchParamExact_to_str(self):
     return printable_byte_str(self.key)
@@ -498,6 +511,9 @@ def BmMatchParamLPM_to_str(self):
 def BmMatchParamTernary_to_str(self):
     return printable_byte_str(self.key) + " &&& " + printable_byte_str(self.mask)
 
+def BmMatchParamRange_to_str(self):
+    return printable_byte_str(self.start) + " -> " + printable_byte_str(self.end_)
+
 def BmMatchParamValid_to_str(self):
     return ""
 
@@ -506,6 +522,7 @@ BmMatchParamExact.to_str = BmMatchParamExact_to_str
 BmMatchParamLPM.to_str = BmMatchParamLPM_to_str
 BmMatchParamTernary.to_str = BmMatchParamTernary_to_str
 BmMatchParamValid.to_str = BmMatchParamValid_to_str
+BmMatchParamRange.to_str = BmMatchParamRange_to_str
 
 # services is [(service_name, client_class), ...]
 def thrift_connect(thrift_ip, thrift_port, services):
@@ -756,7 +773,7 @@ class RuntimeAPI(cmd.Cmd):
                 "Table %s has no action %s" % (table_name, action_name)
             )
 
-        if table.match_type == MatchType.TERNARY:
+        if table.match_type in {MatchType.TERNARY, MatchType.RANGE}:
             try:
                 priority = int(args.pop(-1))
             except:
@@ -972,7 +989,7 @@ class RuntimeAPI(cmd.Cmd):
         else:
             self.check_indirect(table)
 
-        if table.match_type == MatchType.TERNARY:
+        if table.match_type in {MatchType.TERNARY, MatchType.RANGE}:
             try:
                 priority = int(args.pop(-1))
             except: